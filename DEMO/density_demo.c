@@ -0,0 +1,187 @@
+//Checks the exact noisy backend: noiseless circuits run with q_density_run are compared with q_circuit_run, noisy circuits run with q_density_run_noisy are compared with q_trajectory_probabilities and q_trajectory_sample on the same q_noisy_circuit, and q_density_partial_trace is compared with sums over the full matrix. The noise mixes the predefined single qubit channels with a two qubit channel, so both the superoperator layout and the Kraus sets are covered.
+//Build and run from DEMO/ with
+//  gcc -fopenmp ../*.c density_demo.c -o density_demo -lgsl -lgslcblas -lm
+//  ./density_demo
+//Prints ok and exits with 0 when every check passes.
+#include "../q_density.h"
+#include "../predefined_q.h"
+
+#define TOLERANCE 1e-9
+#define TRAJECTORIES 20000
+
+static int failures = 0;
+
+/**check
+  *Reports a failed comparison and counts it.
+*/
+static void check(int ok, const char* what, int trial){
+  if(!ok){
+    printf("FAIL trial %d: %s\n", trial, what);
+    failures++;
+  }
+}
+
+/**random_targets
+  *Picks k distinct qubits out of n with rand.
+*/
+static void random_targets(int n, int k, int* targets){
+  for(int a = 0; a < k; a++){
+    int repeated;
+    do{
+      targets[a] = rand() % n;
+      repeated = 0;
+      for(int b = 0; b < a; b++){
+        if(targets[b] == targets[a]) repeated = 1;
+      }
+    }while(repeated);
+  }
+}
+
+/**random_circuit
+  *Records a circuit of random single qubit rotations, q_cX and q_crot_z gates.
+*/
+static q_circuit* random_circuit(int n, int gates){
+  q_circuit* circuit = q_circuit_alloc(n);
+  for(int g = 0; g < gates; g++){
+    int k = n > 1 ? 1 + rand() % 2 : 1;
+    int targets[2];
+    random_targets(n, k, targets);
+    int kind = rand() % 2;
+    q_op* op;
+    if(k == 1) op = kind ? q_hadamard() : q_rot_z(rand_double());
+    else op = kind ? q_cX() : q_crot_z(rand_double());
+    q_circuit_add(circuit, op, targets, k);
+  }
+  return circuit;
+}
+
+/**channel_tensor
+  *Builds the two qubit channel that applies a on the first qubit and b on the second, with Kraus operators A_i (x) B_j.
+*/
+static q_channel* channel_tensor(q_channel* a, q_channel* b){
+  q_op* kraus[a->count * b->count];
+  for(int i = 0; i < a->count; i++){
+    for(int j = 0; j < b->count; j++){
+      kraus[i * b->count + j] = q_op_tensor(a->kraus[i], b->kraus[j]);
+    }
+  }
+  return q_channel_alloc(kraus, a->count * b->count);
+}
+
+/**traced_entry
+  *Sums the entries (i, j) of a density matrix whose kept qubits read a and b and whose other qubits agree, i.e. entry (a, b) of the partial trace computed from the definition.
+*/
+static gsl_complex traced_entry(q_density* rho, const int* keep, int k, size_t a, size_t b){
+  int n = rho->qubits;
+  size_t dim = (size_t)1 << n;
+  size_t kept = 0;
+  for(int x = 0; x < k; x++){
+    kept |= (size_t)1 << (n - 1 - keep[x]);
+  }
+  gsl_complex sum = GSL_COMPLEX_ZERO;
+  for(size_t i = 0; i < dim; i++){
+    for(size_t j = 0; j < dim; j++){
+      if((i & ~kept) != (j & ~kept)) continue;
+      size_t ia = 0;
+      size_t jb = 0;
+      for(int x = 0; x < k; x++){
+        ia = (ia << 1) | ((i >> (n - 1 - keep[x])) & 1);
+        jb = (jb << 1) | ((j >> (n - 1 - keep[x])) & 1);
+      }
+      if(ia == a && jb == b) sum = gsl_complex_add(sum, gsl_matrix_complex_get(rho->matrix, i, j));
+    }
+  }
+  return sum;
+}
+
+int main (void)
+{
+  srand(22);
+  q_channel* depolarizing = q_channel_depolarizing(0.1);
+  q_channel* amplitude = q_channel_amplitude_damping(0.2);
+  q_channel* phase = q_channel_phase_damping(0.15);
+  q_channel* pair = channel_tensor(amplitude, depolarizing);
+  q_channel* channels[4] = {depolarizing, amplitude, phase, pair};
+  for(int trial = 0; trial < 10; trial++){
+    int n = 2 + rand() % 4;
+    size_t dim = (size_t)1 << n;
+    q_circuit* circuit = random_circuit(n, 12);
+    q_rng rng;
+    q_rng_init(&rng, trial, 0);
+    q_state* initial = q_haar_random(n, &rng);
+
+    //Without noise the density matrix stays |psi><psi| for the state vector result.
+    q_density* rho = q_density_from_state(initial);
+    q_density_run(rho, circuit);
+    q_state* reference = q_state_alloc(n);
+    gsl_matrix_complex_memcpy(reference->vector, initial->vector);
+    q_circuit_run(circuit, reference);
+    check(fabs(q_density_fidelity(rho, reference) - 1.0) < TOLERANCE, "q_density_run fidelity", trial);
+    check(fabs(q_density_purity(rho) - 1.0) < TOLERANCE, "q_density_run purity", trial);
+    q_density_free(rho);
+    q_state_free(reference);
+
+    q_noisy_circuit* noisy = q_noisy_circuit_alloc(circuit);
+    for(int g = 0; g < circuit->gates; g++){
+      q_channel* channel = channels[rand() % 4];
+      int targets[2];
+      random_targets(n, channel->qubits, targets);
+      q_noisy_circuit_add_channel(noisy, g, channel, targets);
+    }
+    rho = q_density_from_state(initial);
+    q_density_run_noisy(rho, noisy);
+    double trace = 0.0;
+    for(size_t i = 0; i < dim; i++){
+      trace += GSL_REAL(gsl_matrix_complex_get(rho->matrix, i, i));
+    }
+    check(fabs(trace - 1.0) < TOLERANCE, "q_density_run_noisy trace", trial);
+
+    //Each trajectory contributes probabilities between 0 and 1, so their mean is within a few 0.5 / sqrt(TRAJECTORIES) of the diagonal.
+    gsl_vector* probabilities = q_trajectory_probabilities(noisy, initial, TRAJECTORIES, &rng);
+    for(size_t i = 0; i < dim; i++){
+      double p = GSL_REAL(gsl_matrix_complex_get(rho->matrix, i, i));
+      check(fabs(gsl_vector_get(probabilities, i) - p) < 3.0 / sqrt(TRAJECTORIES), "q_trajectory_probabilities", trial);
+    }
+    gsl_vector_free(probabilities);
+
+    //Without readout error each outcome count is binomial with the diagonal entry as probability.
+    unsigned char* out = malloc(TRAJECTORIES * n);
+    size_t* counts = calloc(dim, sizeof(size_t));
+    q_trajectory_sample(noisy, initial, TRAJECTORIES, &rng, out);
+    for(size_t t = 0; t < TRAJECTORIES; t++){
+      size_t i = 0;
+      for(int j = 0; j < n; j++){
+        i = (i << 1) | out[t * n + j];
+      }
+      counts[i]++;
+    }
+    for(size_t i = 0; i < dim; i++){
+      double p = GSL_REAL(gsl_matrix_complex_get(rho->matrix, i, i));
+      check(fabs((double)counts[i] - TRAJECTORIES * p) <= 6 * sqrt(TRAJECTORIES * p * (1 - p)) + 1, "q_trajectory_sample histogram", trial);
+    }
+    free(out);
+    free(counts);
+
+    int k = 1 + rand() % n;
+    int keep[k];
+    random_targets(n, k, keep);
+    q_density* reduced = q_density_partial_trace(rho, keep, k);
+    for(size_t a = 0; a < ((size_t)1 << k); a++){
+      for(size_t b = 0; b < ((size_t)1 << k); b++){
+        gsl_complex expected = traced_entry(rho, keep, k, a, b);
+        check(gsl_complex_abs(gsl_complex_sub(expected, gsl_matrix_complex_get(reduced->matrix, a, b))) < TOLERANCE, "q_density_partial_trace", trial);
+      }
+    }
+    q_density_free(reduced);
+
+    q_density_free(rho);
+    q_noisy_circuit_free(noisy);
+    q_state_free(initial);
+    q_circuit_free(circuit);
+  }
+  for(int c = 0; c < 4; c++){
+    q_channel_free(channels[c]);
+  }
+  printf("%s\n", failures == 0 ? "ok" : "FAIL");
+  return failures != 0;
+}
@@ -0,0 +1,138 @@
+//Checks checkpointing and chunked execution: states go through the q_state_save and q_state_load round trip, checkpoints are mapped with q_state_mmap, and random circuits run with q_circuit_run_chunked, on mapped and ordinary states and for every chunk size, are compared with q_circuit_run. Small chunks make passes both with and without top qubits, so the gather in run_pass is exercised.
+//Build and run from DEMO/ with
+//  gcc -fopenmp ../*.c disk_demo.c -o disk_demo -lgsl -lgslcblas -lm
+//  ./disk_demo
+//It writes and removes disk_demo.state in the working directory. Prints ok and exits with 0 when every check passes.
+#include "../q_disk.h"
+#include "../predefined_q.h"
+
+#define TOLERANCE 1e-9
+#define PATH "disk_demo.state"
+
+static int failures = 0;
+
+/**check
+  *Reports a failed comparison and counts it.
+*/
+static void check(int ok, const char* what, int trial){
+  if(!ok){
+    printf("FAIL trial %d: %s\n", trial, what);
+    failures++;
+  }
+}
+
+/**random_targets
+  *Picks k distinct qubits out of n with rand.
+*/
+static void random_targets(int n, int k, int* targets){
+  for(int a = 0; a < k; a++){
+    int repeated;
+    do{
+      targets[a] = rand() % n;
+      repeated = 0;
+      for(int b = 0; b < a; b++){
+        if(targets[b] == targets[a]) repeated = 1;
+      }
+    }while(repeated);
+  }
+}
+
+/**random_circuit
+  *Records a circuit of random 1 to 3 qubit gates, mixing permutations, diagonals and dense ops.
+*/
+static q_circuit* random_circuit(int n, int gates){
+  q_circuit* circuit = q_circuit_alloc(n);
+  for(int i = 0; i < gates; i++){
+    int k = 1 + rand() % 3;
+    int targets[3];
+    random_targets(n, k, targets);
+    int kind = rand() % 4;
+    q_op* op;
+    if(k == 1 && kind == 0) op = q_hadamard();
+    else if(k == 1 && kind == 1) op = q_rot_z(rand_double());
+    else if(k == 2 && kind == 0) op = q_cX();
+    else if(k == 2 && kind == 1) op = q_crot_z(rand_double());
+    else{
+      op = q_op_alloc(k);
+      for(size_t r = 0; r < ((size_t)1 << k); r++){
+        for(size_t c = 0; c < ((size_t)1 << k); c++){
+          gsl_matrix_complex_set(op->matrix, r, c, gsl_complex_rect(rand_double() - 0.5, rand_double() - 0.5));
+        }
+      }
+    }
+    q_circuit_add(circuit, op, targets, k);
+  }
+  return circuit;
+}
+
+/**max_difference
+  *Returns the largest distance between corresponding amplitudes of two states.
+*/
+static double max_difference(q_state* a, q_state* b){
+  double worst = 0.0;
+  for(size_t i = 0; i < ((size_t)1 << a->qubits); i++){
+    double d = gsl_complex_abs(gsl_complex_sub(gsl_matrix_complex_get(a->vector, i, 0), gsl_matrix_complex_get(b->vector, i, 0)));
+    if(d > worst) worst = d;
+  }
+  return worst;
+}
+
+/**copy_state
+  *Returns a new state with the amplitudes of a given one.
+*/
+static q_state* copy_state(q_state* state){
+  q_state* copy = q_state_alloc(state->qubits);
+  gsl_matrix_complex_memcpy(copy->vector, state->vector);
+  return copy;
+}
+
+int main (void)
+{
+  srand(24);
+  for(int trial = 0; trial < 6; trial++){
+    int n = 12;
+    q_circuit* circuit = random_circuit(n, 40);
+    q_rng rng;
+    q_rng_init(&rng, trial, 0);
+    q_state* initial = q_haar_random(n, &rng);
+    q_state* reference = copy_state(initial);
+    q_circuit_run(circuit, reference);
+
+    remove(PATH);
+    q_state* mapped = q_state_mmap(PATH, n);
+    q_state* zero = q_state_calloc(n);
+    check(max_difference(mapped, zero) == 0.0, "new mapping is zero", trial);
+    q_state_free(zero);
+    q_state_munmap(mapped);
+
+    q_state_save(initial, PATH);
+    q_state* loaded = q_state_load(PATH);
+    check(loaded->qubits == n && max_difference(loaded, initial) == 0.0, "q_state_save and q_state_load", trial);
+    q_state_free(loaded);
+
+    //Run on the mapped checkpoint with 5 qubit chunks, then write it back and read it again.
+    mapped = q_state_mmap(PATH, n);
+    check(max_difference(mapped, initial) == 0.0, "q_state_mmap of a checkpoint", trial);
+    q_circuit_run_chunked(circuit, mapped, 5);
+    check(max_difference(mapped, reference) < TOLERANCE, "q_circuit_run_chunked on a mapped state", trial);
+    q_state_sync(mapped);
+    q_state_munmap(mapped);
+    loaded = q_state_load(PATH);
+    check(max_difference(loaded, reference) < TOLERANCE, "reload after q_state_sync", trial);
+    q_state_free(loaded);
+
+    for(int chunk_qubits = 1; chunk_qubits <= n; chunk_qubits++){
+      q_state* state = copy_state(initial);
+      q_circuit_run_chunked(circuit, state, chunk_qubits);
+      check(max_difference(state, reference) < TOLERANCE, "q_circuit_run_chunked", trial);
+      q_state_free(state);
+    }
+
+    q_state_free(reference);
+    q_state_free(initial);
+    q_circuit_free(circuit);
+  }
+  remove(PATH);
+  printf("%s\n", failures == 0 ? "ok" : "FAIL");
+  return failures != 0;
+}
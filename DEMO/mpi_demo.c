@@ -0,0 +1,133 @@
+//Checks distributed states against the single node simulator: random circuits are run with q_mpi_circuit_run and with q_circuit_run, and the gathered states, probabilities, fidelities and measurement outcomes are compared.
+//Build and run from DEMO/ with
+//  mpicc -DQ_MPI -fopenmp ../*.c mpi_demo.c -o mpi_demo -lgsl -lgslcblas -lm
+//  mpirun -np 4 ./mpi_demo
+//The number of ranks must be a power of two, at most 8, so that the 3 qubit gates fit on the local qubits of the smallest registers. Prints ok and exits with 0 when every check passes.
+#include "../q_mpi.h"
+#include "../predefined_q.h"
+
+#define TOLERANCE 1e-9
+
+static int failures = 0;
+
+/**check
+  *Reports a failed comparison and counts it.
+*/
+static void check(int ok, const char* what, int trial){
+  if(!ok){
+    printf("FAIL trial %d: %s\n", trial, what);
+    failures++;
+  }
+}
+
+/**random_targets
+  *Picks k distinct qubits out of n with rand.
+*/
+static void random_targets(int n, int k, int* targets){
+  for(int a = 0; a < k; a++){
+    int repeated;
+    do{
+      targets[a] = rand() % n;
+      repeated = 0;
+      for(int b = 0; b < a; b++){
+        if(targets[b] == targets[a]) repeated = 1;
+      }
+    }while(repeated);
+  }
+}
+
+/**random_circuit
+  *Records a circuit of random 1 to 3 qubit gates, mixing permutations, diagonals, controlled gates and dense ops so that every kernel and every kind of global qubit gate is exercised.
+*/
+static q_circuit* random_circuit(int n, int gates){
+  q_circuit* circuit = q_circuit_alloc(n);
+  for(int i = 0; i < gates; i++){
+    int k = 1 + rand() % 3;
+    int targets[3];
+    random_targets(n, k, targets);
+    int kind = rand() % 4;
+    q_op* op;
+    if(k == 1 && kind == 0) op = q_hadamard();
+    else if(k == 1 && kind == 1) op = q_rot_z(rand_double());
+    else if(k == 2 && kind == 0) op = q_cX();
+    else if(k == 2 && kind == 1) op = q_crot_z(rand_double());
+    else{
+      op = q_op_alloc(k);
+      for(size_t r = 0; r < ((size_t)1 << k); r++){
+        for(size_t c = 0; c < ((size_t)1 << k); c++){
+          gsl_matrix_complex_set(op->matrix, r, c, gsl_complex_rect(rand_double() - 0.5, rand_double() - 0.5));
+        }
+      }
+    }
+    q_circuit_add(circuit, op, targets, k);
+  }
+  return circuit;
+}
+
+/**max_difference
+  *Returns the largest distance between corresponding amplitudes of two states.
+*/
+static double max_difference(q_state* a, q_state* b){
+  double worst = 0.0;
+  for(size_t i = 0; i < ((size_t)1 << a->qubits); i++){
+    double d = gsl_complex_abs(gsl_complex_sub(gsl_matrix_complex_get(a->vector, i, 0), gsl_matrix_complex_get(b->vector, i, 0)));
+    if(d > worst) worst = d;
+  }
+  return worst;
+}
+
+int main (int argc, char** argv)
+{
+  MPI_Init(&argc, &argv);
+  int rank;
+  int size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  for(int trial = 0; trial < 12; trial++){
+    //Every rank seeds alike, so they all build the same circuit and initial state.
+    srand(100 + trial);
+    int n = 6 + rand() % 8;
+    q_circuit* circuit = random_circuit(n, 60);
+    q_rng rng;
+    q_rng_init(&rng, 1 + trial, 0);
+    q_state* initial = q_haar_random(n, &rng);
+
+    q_state* reference = q_state_alloc(n);
+    gsl_matrix_complex_memcpy(reference->vector, initial->vector);
+    q_circuit_run(circuit, reference);
+    q_state_normalize(reference);
+    q_mpi_state* state = q_mpi_state_from_state(initial, MPI_COMM_WORLD);
+    q_mpi_circuit_run(circuit, state);
+    q_mpi_state_normalize(state);
+
+    for(int q = 0; q < n; q++){
+      check(fabs(q_mpi_state_probability(state, q, 1) - q_state_probability(reference, q, 1)) < TOLERANCE, "probability", trial);
+    }
+    q_mpi_state* expected = q_mpi_state_from_state(reference, MPI_COMM_WORLD);
+    check(fabs(q_mpi_fidelity(state, expected) - 1.0) < TOLERANCE, "fidelity", trial);
+
+    //Both sides draw from generators in the same state, so they must pick the same outcome and keep the same branch.
+    q_rng a;
+    q_rng b;
+    q_rng_init(&a, 7 + trial, 0);
+    q_rng_init(&b, 7 + trial, 0);
+    int qubit = rand() % n;
+    check(q_mpi_state_measure_random(state, qubit, &a) == q_state_measure_random(reference, qubit, &b), "measurement", trial);
+
+    q_state* full = q_mpi_state_gather(state, 0);
+    if(rank == 0){
+      check(max_difference(full, reference) < TOLERANCE, "gathered state", trial);
+      q_state_free(full);
+    }
+    q_mpi_state_free(expected);
+    q_mpi_state_free(state);
+    q_state_free(reference);
+    q_state_free(initial);
+    q_circuit_free(circuit);
+  }
+  int total;
+  MPI_Allreduce(&failures, &total, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+  if(rank == 0) printf("%s on %d ranks\n", total == 0 ? "ok" : "FAIL", size);
+  MPI_Finalize();
+  return total != 0;
+}
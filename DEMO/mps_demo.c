@@ -0,0 +1,146 @@
+//Checks matrix product states against the state vector simulator: random circuits of 1 and 2 qubit gates, on neighbouring and distant qubits, are run with q_mps_run at a bond dimension large enough to be exact, and q_mps_to_state, q_mps_amplitude, the q_mps_from_state round trip and q_mps_sample histograms are compared with the dense results.
+//Build and run from DEMO/ with
+//  gcc -fopenmp ../*.c mps_demo.c -o mps_demo -lgsl -lgslcblas -lm
+//  ./mps_demo
+//Prints ok and exits with 0 when every check passes.
+#include "../q_mps.h"
+#include "../predefined_q.h"
+
+#define TOLERANCE 1e-9
+#define SHOTS 100000
+
+static int failures = 0;
+
+/**check
+  *Reports a failed comparison and counts it.
+*/
+static void check(int ok, const char* what, int trial){
+  if(!ok){
+    printf("FAIL trial %d: %s\n", trial, what);
+    failures++;
+  }
+}
+
+/**random_unitary
+  *Builds a random 1 qubit unitary, or for k = 2 a random entangling one, from products of predefined gates.
+*/
+static q_op* random_unitary(int k){
+  q_op* h = q_hadamard();
+  q_op* a = q_rot_z(6 * rand_double());
+  q_op* b = q_rot_z(6 * rand_double());
+  q_op* ha = q_op_multiply(h, a);
+  q_op* hah = q_op_multiply(ha, h);
+  q_op* u = q_op_multiply(b, hah);
+  q_op_free(h);
+  q_op_free(a);
+  q_op_free(b);
+  q_op_free(ha);
+  q_op_free(hah);
+  if(k == 1) return u;
+  q_op* z = q_rot_z(6 * rand_double());
+  q_op* uz = q_op_tensor(u, z);
+  q_op* cx = q_cX();
+  q_op* result = q_op_multiply(cx, uz);
+  q_op_free(u);
+  q_op_free(z);
+  q_op_free(uz);
+  q_op_free(cx);
+  return result;
+}
+
+/**random_targets
+  *Picks k distinct qubits out of n with rand.
+*/
+static void random_targets(int n, int k, int* targets){
+  for(int a = 0; a < k; a++){
+    int repeated;
+    do{
+      targets[a] = rand() % n;
+      repeated = 0;
+      for(int b = 0; b < a; b++){
+        if(targets[b] == targets[a]) repeated = 1;
+      }
+    }while(repeated);
+  }
+}
+
+/**max_difference
+  *Returns the largest distance between corresponding amplitudes of two states.
+*/
+static double max_difference(q_state* a, q_state* b){
+  double worst = 0.0;
+  for(size_t i = 0; i < ((size_t)1 << a->qubits); i++){
+    double d = gsl_complex_abs(gsl_complex_sub(gsl_matrix_complex_get(a->vector, i, 0), gsl_matrix_complex_get(b->vector, i, 0)));
+    if(d > worst) worst = d;
+  }
+  return worst;
+}
+
+int main (void)
+{
+  srand(19);
+  for(int trial = 0; trial < 40; trial++){
+    int n = 2 + rand() % 9;
+    size_t dim = (size_t)1 << n;
+    //A bond dimension of 2^(n/2) holds any n qubit state, so nothing is truncated.
+    int bond = 1 << (n / 2);
+    q_circuit* circuit = q_circuit_alloc(n);
+    for(int g = 0; g < 40; g++){
+      int k = 1 + rand() % 2;
+      int targets[2];
+      random_targets(n, k, targets);
+      q_circuit_add(circuit, random_unitary(k), targets, k);
+    }
+    q_state* reference = q_state_calloc(n);
+    gsl_matrix_complex_set(reference->vector, 0, 0, GSL_COMPLEX_ONE);
+    q_circuit_run(circuit, reference);
+    q_mps* mps = q_mps_alloc(n, bond);
+    q_mps_run(mps, circuit);
+
+    q_state* state = q_mps_to_state(mps);
+    check(max_difference(state, reference) < TOLERANCE, "q_mps_to_state", trial);
+    check(mps->truncation_error < TOLERANCE, "truncation", trial);
+
+    unsigned char bits[n];
+    for(size_t i = 0; i < dim; i++){
+      for(int j = 0; j < n; j++){
+        bits[j] = (i >> (n - 1 - j)) & 1;
+      }
+      gsl_complex amplitude = q_mps_amplitude(mps, bits);
+      check(gsl_complex_abs(gsl_complex_sub(amplitude, gsl_matrix_complex_get(reference->vector, i, 0))) < TOLERANCE, "q_mps_amplitude", trial);
+    }
+
+    q_mps* copy = q_mps_from_state(reference, bond);
+    q_state* round_trip = q_mps_to_state(copy);
+    check(max_difference(round_trip, reference) < TOLERANCE, "q_mps_from_state round trip", trial);
+
+    //Each outcome count is binomial, so it must lie within a few standard deviations of SHOTS |psi_i|^2.
+    q_rng rng;
+    q_rng_init(&rng, trial, 0);
+    unsigned char* out = malloc(SHOTS * n);
+    size_t* counts = calloc(dim, sizeof(size_t));
+    q_mps_sample(mps, SHOTS, &rng, out);
+    for(size_t s = 0; s < SHOTS; s++){
+      size_t i = 0;
+      for(int j = 0; j < n; j++){
+        i = (i << 1) | out[s * n + j];
+      }
+      counts[i]++;
+    }
+    for(size_t i = 0; i < dim; i++){
+      double p = gsl_complex_abs2(gsl_matrix_complex_get(reference->vector, i, 0));
+      double deviation = fabs((double)counts[i] - SHOTS * p);
+      check(deviation <= 6 * sqrt(SHOTS * p * (1 - p)) + 1, "q_mps_sample histogram", trial);
+    }
+    free(out);
+    free(counts);
+    q_state_free(round_trip);
+    q_mps_free(copy);
+    q_state_free(state);
+    q_mps_free(mps);
+    q_state_free(reference);
+    q_circuit_free(circuit);
+  }
+  printf("%s\n", failures == 0 ? "ok" : "FAIL");
+  return failures != 0;
+}
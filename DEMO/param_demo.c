@@ -0,0 +1,121 @@
+//Checks adjoint gradients against central finite differences: random circuits use every q_param_type, with parameters shared between several gates and fixed gates in between, and the observable is a sum of mixed Pauli strings.
+//Build and run from DEMO/ with
+//  gcc -fopenmp ../*.c param_demo.c -o param_demo -lgsl -lgslcblas -lm
+//  ./param_demo
+//Prints the largest gradient error of each circuit, then ok, and exits with 0 when every check passes.
+#include "../q_param.h"
+#include "../predefined_q.h"
+
+#define STEP 1e-5
+#define TOLERANCE 1e-6
+
+static int failures = 0;
+
+/**check
+  *Reports a failed comparison and counts it.
+*/
+static void check(int ok, const char* what, int trial){
+  if(!ok){
+    printf("FAIL trial %d: %s\n", trial, what);
+    failures++;
+  }
+}
+
+/**random_targets
+  *Picks k distinct qubits out of n with rand.
+*/
+static void random_targets(int n, int k, int* targets){
+  for(int a = 0; a < k; a++){
+    int repeated;
+    do{
+      targets[a] = rand() % n;
+      repeated = 0;
+      for(int b = 0; b < a; b++){
+        if(targets[b] == targets[a]) repeated = 1;
+      }
+    }while(repeated);
+  }
+}
+
+/**energy
+  *Returns <psi|obs|psi> for the output psi of the circuit at its current parameters, run on a copy of the initial state.
+*/
+static double energy(q_param_circuit* param, q_observable* obs, q_state* initial){
+  q_state* state = q_state_alloc(initial->qubits);
+  gsl_matrix_complex_memcpy(state->vector, initial->vector);
+  q_circuit_run(param->circuit, state);
+  double e = q_observable_expectation(obs, state);
+  q_state_free(state);
+  return e;
+}
+
+int main (void)
+{
+  srand(23);
+  for(int trial = 0; trial < 8; trial++){
+    int n = 2 + rand() % 7;
+    int gates = 5 * (2 + rand() % 4);
+    //Fewer parameters than gates, so most parameters drive several gates and their gradients are sums.
+    int parameters = 1 + gates / 3;
+    q_circuit* circuit = q_circuit_alloc(n);
+    q_param_circuit* param = q_param_circuit_alloc(circuit);
+    for(int g = 0; g < gates; g++){
+      int targets[2];
+      random_targets(n, 2, targets);
+      q_param_circuit_add(param, (q_param_type)(g % 5), rand() % parameters, targets);
+      if(rand() % 2) q_circuit_add(circuit, q_hadamard(), targets, 1);
+      if(rand() % 3 == 0) q_circuit_add(circuit, q_cX(), targets, 2);
+    }
+    double values[param->parameters];
+    for(int j = 0; j < param->parameters; j++){
+      values[j] = 4 * (rand_double() - 0.5);
+    }
+    q_param_circuit_set(param, values);
+
+    //One term holds X, Y and Z at once; the others are random strings.
+    q_observable* obs = q_observable_alloc(n);
+    char paulis[n + 1];
+    paulis[n] = '\0';
+    for(int q = 0; q < n; q++){
+      paulis[q] = "XYZ"[q % 3];
+    }
+    q_observable_add(obs, rand_double() - 0.5, paulis);
+    for(int t = 0; t < 4; t++){
+      for(int q = 0; q < n; q++){
+        paulis[q] = "IXYZ"[rand() % 4];
+      }
+      q_observable_add(obs, rand_double() - 0.5, paulis);
+    }
+
+    q_rng rng;
+    q_rng_init(&rng, trial, 0);
+    q_state* initial = q_haar_random(n, &rng);
+    double gradient[param->parameters];
+    double e = q_param_gradient(param, obs, initial, gradient);
+    check(fabs(e - energy(param, obs, initial)) < 1e-10, "expectation value", trial);
+
+    double worst = 0.0;
+    for(int j = 0; j < param->parameters; j++){
+      double shifted[param->parameters];
+      memcpy(shifted, values, sizeof(shifted));
+      shifted[j] = values[j] + STEP;
+      q_param_circuit_set(param, shifted);
+      double plus = energy(param, obs, initial);
+      shifted[j] = values[j] - STEP;
+      q_param_circuit_set(param, shifted);
+      double minus = energy(param, obs, initial);
+      double error = fabs((plus - minus) / (2 * STEP) - gradient[j]);
+      if(error > worst) worst = error;
+    }
+    q_param_circuit_set(param, values);
+    printf("%d qubits, %d parameterised gates, %d parameters: largest error %.2e\n", n, gates, param->parameters, worst);
+    check(worst < TOLERANCE, "gradient", trial);
+
+    q_state_free(initial);
+    q_observable_free(obs);
+    q_param_circuit_free(param);
+    q_circuit_free(circuit);
+  }
+  printf("%s\n", failures == 0 ? "ok" : "FAIL");
+  return failures != 0;
+}
@@ -0,0 +1,126 @@
+//Checks stabilizer states against the state vector simulator: random circuits of H, S, CX, CZ and Pauli gates are run with q_stabilizer_run and q_circuit_run, and q_stabilizer_to_state, q_stabilizer_probability, q_stabilizer_measure and q_stabilizer_sample histograms are compared with the dense results.
+//Build and run from DEMO/ with
+//  gcc -fopenmp ../*.c stabilizer_demo.c -o stabilizer_demo -lgsl -lgslcblas -lm
+//  ./stabilizer_demo
+//Prints ok and exits with 0 when every check passes.
+#include "../q_stabilizer.h"
+#include "../predefined_q.h"
+
+#define TOLERANCE 1e-9
+#define SHOTS 20000
+
+static int failures = 0;
+
+/**check
+  *Reports a failed comparison and counts it.
+*/
+static void check(int ok, const char* what, int trial){
+  if(!ok){
+    printf("FAIL trial %d: %s\n", trial, what);
+    failures++;
+  }
+}
+
+/**random_targets
+  *Picks k distinct qubits out of n with rand.
+*/
+static void random_targets(int n, int k, int* targets){
+  for(int a = 0; a < k; a++){
+    int repeated;
+    do{
+      targets[a] = rand() % n;
+      repeated = 0;
+      for(int b = 0; b < a; b++){
+        if(targets[b] == targets[a]) repeated = 1;
+      }
+    }while(repeated);
+  }
+}
+
+/**random_clifford
+  *Records a circuit of random H, S, CX, CZ and Pauli gates.
+*/
+static q_circuit* random_clifford(int n, int gates){
+  q_circuit* circuit = q_circuit_alloc(n);
+  for(int g = 0; g < gates; g++){
+    int kind = rand() % (n > 1 ? 7 : 5);
+    int k = kind < 5 ? 1 : 2;
+    int targets[2];
+    random_targets(n, k, targets);
+    q_op* op;
+    switch(kind){
+      case 0: op = q_hadamard(); break;
+      case 1: op = q_s(); break;
+      case 2: op = q_pauli_X(); break;
+      case 3: op = q_pauli_Y(); break;
+      case 4: op = q_pauli_Z(); break;
+      case 5: op = q_cX(); break;
+      default: op = q_cZ(); break;
+    }
+    q_circuit_add(circuit, op, targets, k);
+  }
+  return circuit;
+}
+
+int main (void)
+{
+  srand(18);
+  for(int trial = 0; trial < 60; trial++){
+    int n = 1 + rand() % 8;
+    size_t dim = (size_t)1 << n;
+    q_circuit* circuit = random_clifford(n, 40);
+    check(q_circuit_is_clifford(circuit), "q_circuit_is_clifford", trial);
+    q_stabilizer* s = q_stabilizer_alloc(n);
+    q_stabilizer_run(s, circuit);
+    q_state* reference = q_state_calloc(n);
+    gsl_matrix_complex_set(reference->vector, 0, 0, GSL_COMPLEX_ONE);
+    q_circuit_run(circuit, reference);
+
+    //The conversion drops the global phase, so the states are compared by fidelity.
+    q_state* state = q_stabilizer_to_state(s);
+    check(fabs(fidelity(state, reference) - 1.0) < TOLERANCE, "q_stabilizer_to_state", trial);
+    q_state_free(state);
+
+    for(int q = 0; q < n; q++){
+      for(int outcome = 0; outcome < 2; outcome++){
+        check(fabs(q_stabilizer_probability(s, q, outcome) - q_state_probability(reference, q, outcome)) < TOLERANCE, "q_stabilizer_probability", trial);
+      }
+    }
+
+    //Each outcome count is binomial, so it must lie within a few standard deviations of SHOTS |psi_i|^2.
+    q_rng rng;
+    q_rng_init(&rng, trial, 0);
+    unsigned char* out = malloc(SHOTS * n);
+    size_t* counts = calloc(dim, sizeof(size_t));
+    q_stabilizer_sample(s, SHOTS, &rng, out);
+    for(size_t shot = 0; shot < SHOTS; shot++){
+      size_t i = 0;
+      for(int j = 0; j < n; j++){
+        i = (i << 1) | out[shot * n + j];
+      }
+      counts[i]++;
+    }
+    for(size_t i = 0; i < dim; i++){
+      double p = gsl_complex_abs2(gsl_matrix_complex_get(reference->vector, i, 0));
+      check(fabs((double)counts[i] - SHOTS * p) <= 6 * sqrt(SHOTS * p * (1 - p)) + 1, "q_stabilizer_sample histogram", trial);
+    }
+    free(out);
+    free(counts);
+
+    //A measured outcome must have been possible, and measuring again must repeat it with certainty.
+    int qubit = rand() % n;
+    int outcome = q_stabilizer_measure(s, qubit, &rng);
+    check(q_state_probability(reference, qubit, outcome) > TOLERANCE, "q_stabilizer_measure outcome", trial);
+    check(fabs(q_stabilizer_probability(s, qubit, outcome) - 1.0) < TOLERANCE, "q_stabilizer_measure collapse", trial);
+    q_state_collapse(reference, qubit, outcome);
+    state = q_stabilizer_to_state(s);
+    check(fabs(fidelity(state, reference) - 1.0) < TOLERANCE, "q_stabilizer_measure state", trial);
+    q_state_free(state);
+
+    q_state_free(reference);
+    q_stabilizer_free(s);
+    q_circuit_free(circuit);
+  }
+  printf("%s\n", failures == 0 ? "ok" : "FAIL");
+  return failures != 0;
+}
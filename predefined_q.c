@@ -8,38 +8,23 @@ double rand_double(){
   return (double)rand() / (double)RAND_MAX;
 }
 
+static q_rng q_default_rng;
+static int q_default_seeded = 0;
+
+/**q_seed - SEED
+  *Seeds the generator used by q_rand. Unless this is called, the generator is seeded from rand() on first use, so srand still varies q_rand between runs.
+*/
+void q_seed(unsigned long long seed){
+  q_rng_init(&q_default_rng, seed, 0);
+  q_default_seeded = 1;
+}
+
 gsl_complex e_i_pi(double p){
   gsl_complex ret;
   GSL_SET_COMPLEX(&ret, cos(p), sin(p));
   return ret;
 }
 
-void int_to_bin_digit(unsigned int in, int count, int* out);
-//Lazy Source: https://stackoverflow.com/questions/31577866/c-programming-convert-integer-to-binary-array
-void int_to_bin_digit(unsigned int in, int count, int* out)
-{
-    /* assert: count <= sizeof(int)*CHAR_BIT */
-    unsigned int mask = 1U << (count-1);
-    int i;
-    for (i = 0; i < count; i++) {
-        out[i] = (in & mask) ? 1 : 0;
-        in <<= 1;
-    }
-}
-
-int bin_to_int_digit(int count, int* in);
-int bin_to_int_digit(int count, int* in){
-  int val = 0;
-
-  for(int i = 0; i < count; i++){
-    if(in[i] == 1){
-      val += pow(2, count - (1 + i));
-    }
-  }
-
-  return val;
-}
-
 q_state* q_zero(){
   q_state* q = q_state_calloc(1);
   gsl_matrix_complex_set(q->vector, 0, 0, GSL_COMPLEX_ONE);
@@ -53,9 +38,16 @@ q_state* q_one(){
 }
 
 q_state* q_rand(){
+  if(!q_default_seeded){
+    q_seed(((unsigned long long)rand() << 32) ^ (unsigned long long)rand());
+  }
+  return q_rand_r(&q_default_rng);
+}
+
+q_state* q_rand_r(q_rng* rng){
   q_state* q = q_state_calloc(1);
-  double r1 = rand_double() * 2 * M_PI;
-  double r2 = rand_double() * 2 * M_PI;
+  double r1 = q_rng_uniform(rng) * 2 * M_PI;
+  double r2 = q_rng_uniform(rng) * 2 * M_PI;
   gsl_complex z;
   gsl_complex o;
   GSL_SET_COMPLEX(&z, cos(r1) * cos(r2), sin(r1) * cos(r2));
@@ -65,7 +57,33 @@ q_state* q_rand(){
   return q;
 }
 
+q_state* q_haar_random(int qubits, q_rng* rng){
+  q_state* q = q_state_alloc(qubits);
+  size_t dim = (size_t)1 << qubits;
+  unsigned long long first = rng->counter;
+  double* amp = q->vector->data;
+  //Amplitude i is a complex Gaussian drawn from counter first + i, so the state does not depend on the number of threads.
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < dim; i++){
+    q_rng_normal_at(rng, first + i, amp + 2 * i);
+  }
+  rng->counter += dim;
+  q_state_normalize(q);
+  return q;
+}
+
 q_op* q_identity(int qubits){
+  if(qubits >= Q_SPARSE_QUBITS){
+    size_t rows = (size_t)1 << qubits;
+    q_op* op = q_op_sparse_alloc(qubits, rows);
+    for(size_t i = 0; i < rows; i++){
+      op->sparse->row_start[i + 1] = i + 1;
+      op->sparse->columns[i] = i;
+      op->sparse->values[2 * i] = 1.0;
+      op->sparse->values[2 * i + 1] = 0.0;
+    }
+    return op;
+  }
   q_op* op = q_op_calloc(qubits);
   for(int i = 0; i < op->matrix->size1; i++){
     gsl_matrix_complex_set(op->matrix, i, i, GSL_COMPLEX_ONE);
@@ -163,16 +181,22 @@ q_op* q_crot_z(double p){
 }
 
 q_op* q_swap(int qubits, int* map){
-  q_op* op = q_op_calloc(qubits);
-  for(int i = 0; i < (int)pow(2, qubits); i++){
-    int bits[qubits];
-    int_to_bin_digit(i, qubits, bits);
-    int new_bits[qubits];
+  int sparse = qubits >= Q_SPARSE_QUBITS;
+  q_op* op = sparse ? q_op_sparse_alloc(qubits, (size_t)1 << qubits) : q_op_calloc(qubits);
+  for(size_t i = 0; i < ((size_t)1 << qubits); i++){
+    size_t index = 0;
     for(int j = 0; j < qubits; j++){
-      new_bits[j] = bits[map[j]];
+      index |= ((i >> (qubits - 1 - map[j])) & 1) << (qubits - 1 - j);
+    }
+    if(sparse){
+      op->sparse->row_start[i + 1] = i + 1;
+      op->sparse->columns[i] = index;
+      op->sparse->values[2 * i] = 1.0;
+      op->sparse->values[2 * i + 1] = 0.0;
+    }
+    else{
+      gsl_matrix_complex_set(op->matrix, i, index, GSL_COMPLEX_ONE);
     }
-    int index = bin_to_int_digit(qubits, new_bits);
-    gsl_matrix_complex_set(op->matrix, i, index, GSL_COMPLEX_ONE);
   }
   return op;
 }
@@ -6,6 +6,8 @@
 q_state* q_zero();
 q_state* q_one();
 q_state* q_rand();
+q_state* q_rand_r(q_rng* rng);
+q_state* q_haar_random(int qubits, q_rng* rng);
 q_op* q_identity(int qubits);
 q_op* q_hadamard();
 q_op* q_pauli_X();
@@ -22,6 +24,11 @@ q_op* q_swap(int qubits, int* map);
   *Computes a random double between 0 and 1 using C's inbuilt RNG
 */
 double rand_double();
+
+/**q_seed - SEED
+  *Seeds the generator used by q_rand. Unless this is called, the generator is seeded from rand() on first use, so srand still varies q_rand between runs.
+*/
+void q_seed(unsigned long long seed);
 gsl_complex e_i_pi(double p);
 
 q_op* q_s();
@@ -1,15 +1,122 @@
 #include "q_circuit.h"
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+static int q_thread_count = 0;
+
+/**q_set_threads
+  *Sets the number of threads used by the state vector kernels. Has no effect unless the library is compiled with OpenMP (-fopenmp).
+    *threads. The number of threads, or 0 to use the OpenMP default.
+*/
+void q_set_threads(int threads){
+  q_thread_count = threads;
+}
+
+/**q_get_threads
+  *Returns the number of threads used by the state vector kernels, which is 1 when the library is compiled without OpenMP.
+*/
+int q_get_threads(){
+#ifdef _OPENMP
+  if(q_thread_count > 0){
+    return q_thread_count;
+  }
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+/**reduce_norm
+  *Computes the squared norm of a strided amplitude array. The sum is split into fixed size chunks whose sums are added in order, at most Q_REDUCE_PARTS runs of them at a time into a stack buffer, so the result does not depend on the number of threads and nothing is allocated.
+*/
+static double reduce_norm(const double* amp, size_t stride, size_t dim){
+  size_t chunks = (dim + Q_REDUCE_CHUNK - 1) / Q_REDUCE_CHUNK;
+  size_t per = (chunks + Q_REDUCE_PARTS - 1) / Q_REDUCE_PARTS;
+  size_t parts = (chunks + per - 1) / per;
+  double partial[Q_REDUCE_PARTS];
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t s = 0; s < parts; s++){
+    double part = 0.0;
+    for(size_t c = s * per; c < (s + 1) * per && c < chunks; c++){
+      size_t end = (c + 1) * Q_REDUCE_CHUNK < dim ? (c + 1) * Q_REDUCE_CHUNK : dim;
+      double sum = 0.0;
+      if(stride == 1){
+        sum = q_simd_norm(amp + 2 * c * Q_REDUCE_CHUNK, end - c * Q_REDUCE_CHUNK);
+      }
+      else{
+        for(size_t i = c * Q_REDUCE_CHUNK; i < end; i++){
+          const double* x = amp + 2 * i * stride;
+          sum += x[0] * x[0] + x[1] * x[1];
+        }
+      }
+      part += sum;
+    }
+    partial[s] = part;
+  }
+  double total = 0.0;
+  for(size_t s = 0; s < parts; s++){
+    total += partial[s];
+  }
+  return total;
+}
+
+/**reduce_inner
+  *Computes sum_i a_i * conj(b_i) over two strided amplitude arrays, chunked like reduce_norm so that the result does not depend on the number of threads.
+*/
+static gsl_complex reduce_inner(const double* a, size_t a_stride, const double* b, size_t b_stride, size_t dim){
+  size_t chunks = (dim + Q_REDUCE_CHUNK - 1) / Q_REDUCE_CHUNK;
+  size_t per = (chunks + Q_REDUCE_PARTS - 1) / Q_REDUCE_PARTS;
+  size_t parts = (chunks + per - 1) / per;
+  double partial[2 * Q_REDUCE_PARTS];
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t s = 0; s < parts; s++){
+    double part[2] = {0.0, 0.0};
+    for(size_t c = s * per; c < (s + 1) * per && c < chunks; c++){
+      size_t end = (c + 1) * Q_REDUCE_CHUNK < dim ? (c + 1) * Q_REDUCE_CHUNK : dim;
+      double sum[2] = {0.0, 0.0};
+      if(a_stride == 1 && b_stride == 1){
+        q_simd_inner(a + 2 * c * Q_REDUCE_CHUNK, b + 2 * c * Q_REDUCE_CHUNK, end - c * Q_REDUCE_CHUNK, sum);
+      }
+      else{
+        for(size_t i = c * Q_REDUCE_CHUNK; i < end; i++){
+          const double* x = a + 2 * i * a_stride;
+          const double* y = b + 2 * i * b_stride;
+          sum[0] += x[0] * y[0] + x[1] * y[1];
+          sum[1] += x[1] * y[0] - x[0] * y[1];
+        }
+      }
+      part[0] += sum[0];
+      part[1] += sum[1];
+    }
+    partial[2 * s] = part[0];
+    partial[2 * s + 1] = part[1];
+  }
+  gsl_complex total = GSL_COMPLEX_ZERO;
+  for(size_t s = 0; s < parts; s++){
+    GSL_SET_COMPLEX(&total, GSL_REAL(total) + partial[2 * s], GSL_IMAG(total) + partial[2 * s + 1]);
+  }
+  return total;
+}
 
 /**g_state_alloc
-  *Allocates a q_state struct.
+  *Allocates a q_state struct. The amplitudes are stored contiguously (interleaved real and imaginary parts) in a buffer aligned to Q_ALIGNMENT bytes, so the vectorised kernels of q_simd can work on them directly.
     *qubits. The number of qubits of the q_state.
   Returns the empty state "state".
 */
 q_state* q_state_alloc(int qubits){
-  int rows = pow(2, qubits);
+  size_t rows = (size_t)1 << qubits;
+  size_t bytes = 2 * rows * sizeof(double);
   q_state* state = malloc(sizeof(q_state));
   state->qubits = qubits;
-  state->vector = gsl_matrix_complex_alloc(rows, 1);
+  //The amplitudes live in one contiguous Q_ALIGNMENT aligned buffer, owned by the matrix so that gsl_matrix_complex_free releases it.
+  gsl_block_complex* block = malloc(sizeof(gsl_block_complex));
+  block->size = rows;
+  block->data = aligned_alloc(Q_ALIGNMENT, (bytes + Q_ALIGNMENT - 1) / Q_ALIGNMENT * Q_ALIGNMENT);
+  state->vector = gsl_matrix_complex_alloc_from_block(block, 0, rows, 1, 1);
+  state->vector->owner = 1;
   return state;
 }
 
@@ -39,14 +146,15 @@ void q_state_free(q_state* state){
     *state. The state to normalize.
 */
 void q_state_normalize(q_state* state){
-  int num = pow(2, state->qubits);
-  double dsum = 0.0;
-  for(int i = 0; i < num; i++){
-    dsum += (gsl_complex_abs(gsl_matrix_complex_get(state->vector, i, 0)) * gsl_complex_abs(gsl_matrix_complex_get(state->vector, i, 0)));
+  size_t dim = (size_t)1 << state->qubits;
+  size_t stride = state->vector->tda;
+  double* amp = state->vector->data;
+  double scale = 1.0 / sqrt(reduce_norm(amp, stride, dim));
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < dim; i++){
+    amp[2 * i * stride] *= scale;
+    amp[2 * i * stride + 1] *= scale;
   }
-  gsl_complex sum;
-  GSL_SET_COMPLEX(&sum, 1.0/dsum, 0);
-  gsl_matrix_complex_scale(state->vector, sum);
 }
 
 /*q_complex_conjugate
@@ -55,15 +163,33 @@ void q_state_normalize(q_state* state){
   *Returns new, the complex conjugate of q.
 */
 q_state* q_complex_conjugate(q_state* q){
-  q_state* new = q_state_calloc(q->qubits);
-  for(int i = 0; i < (int)pow(2, q->qubits); i++){
-    gsl_complex o;
-    GSL_SET_COMPLEX(&o, GSL_REAL(gsl_matrix_complex_get(q->vector, i, 0)), -GSL_IMAG(gsl_matrix_complex_get(q->vector, i, 0)));
-    gsl_matrix_complex_set(new->vector, i, 0, o);
-  }
+  q_state* new = q_state_alloc(q->qubits);
+  q_complex_conjugate_into(q, new);
   return new;
 }
 
+/**q_complex_conjugate_into
+  *Computes the complex conjugate of a q state into an existing state, without allocating.
+    *q. The state to compute the complex conjugate of.
+    *out. The destination, on the same number of qubits. It may be q itself, which is then conjugated in place.
+*/
+void q_complex_conjugate_into(q_state* q, q_state* out){
+  if(q->qubits != out->qubits){
+    printf("Error: size mismatch in complex conjugate. Terminating.\n");
+    exit(0);
+  }
+  size_t dim = (size_t)1 << q->qubits;
+  const double* src = q->vector->data;
+  double* dst = out->vector->data;
+  size_t src_stride = q->vector->tda;
+  size_t dst_stride = out->vector->tda;
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < dim; i++){
+    dst[2 * i * dst_stride] = src[2 * i * src_stride];
+    dst[2 * i * dst_stride + 1] = -src[2 * i * src_stride + 1];
+  }
+}
+
 /**q_state_print
   *Prints a q_state.
     *state. The state to print.
@@ -94,6 +220,8 @@ q_op* q_op_alloc(int qubits){
   q_op* op = malloc(sizeof(q_op));
   op->qubits = qubits;
   op->matrix = gsl_matrix_complex_alloc(rows, rows);
+  op->sparse = NULL;
+  op->lazy = NULL;
   return op;
 }
 
@@ -109,25 +237,335 @@ q_op* q_op_calloc(int qubits){
   return op;
 }
 
+/**sparse_alloc
+  *Allocates CSR storage for a square matrix with the given number of rows and non-zeros. row_start is zeroed.
+*/
+static q_sparse* sparse_alloc(size_t rows, size_t nonzeros){
+  q_sparse* sparse = malloc(sizeof(q_sparse));
+  sparse->nonzeros = nonzeros;
+  sparse->row_start = calloc(rows + 1, sizeof(size_t));
+  sparse->columns = malloc((nonzeros > 0 ? nonzeros : 1) * sizeof(size_t));
+  sparse->values = malloc(2 * (nonzeros > 0 ? nonzeros : 1) * sizeof(double));
+  return sparse;
+}
+
+/**sparse_free
+  *Frees CSR storage.
+*/
+static void sparse_free(q_sparse* sparse){
+  free(sparse->row_start);
+  free(sparse->columns);
+  free(sparse->values);
+  free(sparse);
+}
+
+/**sparse_from_dense
+  *Builds the CSR storage of a dense matrix, keeping its exactly non-zero entries.
+*/
+static q_sparse* sparse_from_dense(gsl_matrix_complex* m){
+  size_t nonzeros = 0;
+  for(size_t i = 0; i < m->size1; i++){
+    for(size_t j = 0; j < m->size2; j++){
+      const double* x = m->data + 2 * (i * m->tda + j);
+      nonzeros += x[0] != 0.0 || x[1] != 0.0;
+    }
+  }
+  q_sparse* sparse = sparse_alloc(m->size1, nonzeros);
+  size_t nz = 0;
+  for(size_t i = 0; i < m->size1; i++){
+    for(size_t j = 0; j < m->size2; j++){
+      const double* x = m->data + 2 * (i * m->tda + j);
+      if(x[0] != 0.0 || x[1] != 0.0){
+        sparse->columns[nz] = j;
+        sparse->values[2 * nz] = x[0];
+        sparse->values[2 * nz + 1] = x[1];
+        nz++;
+      }
+    }
+    sparse->row_start[i + 1] = nz;
+  }
+  return sparse;
+}
+
+/**dense_from_sparse
+  *Expands CSR storage into a dense square matrix with the given number of rows.
+*/
+static gsl_matrix_complex* dense_from_sparse(q_sparse* sparse, size_t rows){
+  gsl_matrix_complex* m = gsl_matrix_complex_alloc(rows, rows);
+  gsl_matrix_complex_set_all(m, GSL_COMPLEX_ZERO);
+  for(size_t i = 0; i < rows; i++){
+    for(size_t nz = sparse->row_start[i]; nz < sparse->row_start[i + 1]; nz++){
+      double* x = m->data + 2 * (i * m->tda + sparse->columns[nz]);
+      x[0] = sparse->values[2 * nz];
+      x[1] = sparse->values[2 * nz + 1];
+    }
+  }
+  return m;
+}
+
+/**lazy_alloc
+  *Allocates a lazy q_op with room for the given number of factors. The caller fills in the factors and count.
+*/
+static q_op* lazy_alloc(int qubits, q_lazy_type type, int capacity){
+  q_op* op = malloc(sizeof(q_op));
+  op->qubits = qubits;
+  op->matrix = NULL;
+  op->sparse = NULL;
+  op->lazy = malloc(sizeof(q_lazy));
+  op->lazy->type = type;
+  op->lazy->count = 0;
+  op->lazy->factors = malloc(capacity * sizeof(q_op*));
+  return op;
+}
+
+/**lazy_free
+  *Frees the factors of a lazy q_op.
+*/
+static void lazy_free(q_lazy* lazy){
+  for(int f = 0; f < lazy->count; f++){
+    q_op_free(lazy->factors[f]);
+  }
+  free(lazy->factors);
+  free(lazy);
+}
+
+/**lazy_get
+  *Gets an entry of a lazy q_op. Tensor entries are products of factor entries; product entries propagate row i through every factor.
+*/
+static gsl_complex lazy_get(q_op* op, size_t i, size_t j){
+  q_lazy* lazy = op->lazy;
+  if(lazy->type == Q_LAZY_TENSOR){
+    gsl_complex q = GSL_COMPLEX_ONE;
+    int shift = op->qubits;
+    for(int f = 0; f < lazy->count; f++){
+      int qubits = lazy->factors[f]->qubits;
+      size_t mask = ((size_t)1 << qubits) - 1;
+      shift -= qubits;
+      q = gsl_complex_mul(q, q_op_get(lazy->factors[f], (i >> shift) & mask, (j >> shift) & mask));
+    }
+    return q;
+  }
+  size_t rows = (size_t)1 << op->qubits;
+  gsl_complex* row = malloc(rows * sizeof(gsl_complex));
+  gsl_complex* next = malloc(rows * sizeof(gsl_complex));
+  for(size_t l = 0; l < rows; l++){
+    row[l] = q_op_get(lazy->factors[0], i, l);
+  }
+  for(int f = 1; f < lazy->count; f++){
+    for(size_t c = 0; c < rows; c++){
+      next[c] = GSL_COMPLEX_ZERO;
+      for(size_t l = 0; l < rows; l++){
+        if(GSL_REAL(row[l]) != 0.0 || GSL_IMAG(row[l]) != 0.0){
+          next[c] = gsl_complex_add(next[c], gsl_complex_mul(row[l], q_op_get(lazy->factors[f], l, c)));
+        }
+      }
+    }
+    gsl_complex* swap = row;
+    row = next;
+    next = swap;
+  }
+  gsl_complex q = row[j];
+  free(row);
+  free(next);
+  return q;
+}
+
+/**lazy_materialize
+  *Replaces a lazy q_op by its evaluated matrix, stored as chosen by q_op_tensor and q_op_multiply.
+*/
+static void lazy_materialize(q_op* op){
+  q_lazy* lazy = op->lazy;
+  q_op* acc = q_op_copy(lazy->factors[0]);
+  q_op_densify(acc);
+  for(int f = 1; f < lazy->count; f++){
+    q_op* factor = q_op_copy(lazy->factors[f]);
+    q_op_densify(factor);
+    q_op* next = lazy->type == Q_LAZY_TENSOR ? q_op_tensor(acc, factor) : q_op_multiply(acc, factor);
+    q_op_free(acc);
+    q_op_free(factor);
+    acc = next;
+  }
+  lazy_free(lazy);
+  op->lazy = NULL;
+  op->matrix = acc->matrix;
+  op->sparse = acc->sparse;
+  free(acc);
+}
+
+/**q_op_sparse_alloc
+  *Allocates a q_op struct with CSR storage for the given number of non-zeros. row_start is zeroed; the caller fills in row_start, columns (increasing within each row) and values.
+    *qubits. The number of qubits that the q_op operates on.
+    *nonzeros. The number of non-zero entries.
+  Returns the generated operator "op"
+*/
+q_op* q_op_sparse_alloc(int qubits, size_t nonzeros){
+  q_op* op = malloc(sizeof(q_op));
+  op->qubits = qubits;
+  op->matrix = NULL;
+  op->sparse = sparse_alloc((size_t)1 << qubits, nonzeros);
+  op->lazy = NULL;
+  return op;
+}
+
+/**q_op_is_sparse
+  *Checks whether a q_op uses sparse (CSR) storage.
+    *op. The q_op to check.
+  *Returns 1 if it is sparse and 0 otherwise.
+*/
+int q_op_is_sparse(q_op* op){
+  return op->sparse != NULL;
+}
+
+/**q_op_sparsify
+  *Converts a q_op to sparse (CSR) storage in place. Does nothing if it is already sparse. Lazy operators are evaluated first.
+    *op. The op to convert.
+*/
+void q_op_sparsify(q_op* op){
+  if(op->lazy != NULL) q_op_densify(op);
+  if(op->sparse != NULL) return;
+  op->sparse = sparse_from_dense(op->matrix);
+  gsl_matrix_complex_free(op->matrix);
+  op->matrix = NULL;
+}
+
+/**q_op_densify
+  *Converts a q_op to dense storage in place. Does nothing if it is already dense. Lazy operators are evaluated, which allocates the full matrix.
+    *op. The op to convert.
+*/
+void q_op_densify(q_op* op){
+  if(op->lazy != NULL){
+    lazy_materialize(op);
+  }
+  if(op->sparse == NULL) return;
+  op->matrix = dense_from_sparse(op->sparse, (size_t)1 << op->qubits);
+  sparse_free(op->sparse);
+  op->sparse = NULL;
+}
+
+/**q_op_select
+  *Picks the storage of a q_op from its size and density: operators on at least Q_SPARSE_QUBITS qubits with at most a Q_SPARSE_DENSITY fraction of non-zeros are stored sparse, everything else dense. Lazy operators are left lazy.
+    *op. The op to convert.
+*/
+void q_op_select(q_op* op){
+  if(op->lazy != NULL) return;
+  size_t rows = (size_t)1 << op->qubits;
+  size_t nonzeros;
+  if(op->sparse != NULL){
+    nonzeros = op->sparse->nonzeros;
+  }
+  else{
+    if(op->qubits < Q_SPARSE_QUBITS) return;
+    nonzeros = 0;
+    for(size_t i = 0; i < rows; i++){
+      for(size_t j = 0; j < rows; j++){
+        const double* x = op->matrix->data + 2 * (i * op->matrix->tda + j);
+        nonzeros += x[0] != 0.0 || x[1] != 0.0;
+      }
+    }
+  }
+  if(op->qubits >= Q_SPARSE_QUBITS && nonzeros <= Q_SPARSE_DENSITY * rows * rows){
+    q_op_sparsify(op);
+  }
+  else{
+    q_op_densify(op);
+  }
+}
+
+/**q_op_get
+  *Gets an entry of a q_op, whichever storage it uses. Entries of lazy products cost a vector-matrix product per factor.
+    *op. The op.
+    *i. The row.
+    *j. The column.
+  *Returns the entry "q".
+*/
+gsl_complex q_op_get(q_op* op, size_t i, size_t j){
+  if(op->lazy != NULL){
+    return lazy_get(op, i, j);
+  }
+  if(op->sparse == NULL){
+    return gsl_matrix_complex_get(op->matrix, i, j);
+  }
+  size_t lo = op->sparse->row_start[i];
+  size_t hi = op->sparse->row_start[i + 1];
+  while(lo < hi){
+    size_t mid = (lo + hi) / 2;
+    if(op->sparse->columns[mid] < j){
+      lo = mid + 1;
+    }
+    else{
+      hi = mid;
+    }
+  }
+  gsl_complex q = GSL_COMPLEX_ZERO;
+  if(lo < op->sparse->row_start[i + 1] && op->sparse->columns[lo] == j){
+    GSL_SET_COMPLEX(&q, op->sparse->values[2 * lo], op->sparse->values[2 * lo + 1]);
+  }
+  return q;
+}
+
 /**q_op_free
   *Frees a given q_op.
     *op. The state to op.
 */
 void q_op_free(q_op* op){
-  gsl_matrix_complex_free(op->matrix);
+  if(op->lazy != NULL){
+    lazy_free(op->lazy);
+  }
+  else if(op->sparse != NULL){
+    sparse_free(op->sparse);
+  }
+  else{
+    gsl_matrix_complex_free(op->matrix);
+  }
   free(op);
 }
 
+/**q_op_copy
+  *Copies a q_op, keeping its storage (dense, sparse or lazy).
+    *op. The op to copy.
+  Returns the copy "new_op"
+*/
+q_op* q_op_copy(q_op* op){
+  if(op->lazy != NULL){
+    q_op* new_op = lazy_alloc(op->qubits, op->lazy->type, op->lazy->count);
+    for(int f = 0; f < op->lazy->count; f++){
+      new_op->lazy->factors[f] = q_op_copy(op->lazy->factors[f]);
+    }
+    new_op->lazy->count = op->lazy->count;
+    return new_op;
+  }
+  if(op->sparse != NULL){
+    q_op* new_op = q_op_sparse_alloc(op->qubits, op->sparse->nonzeros);
+    memcpy(new_op->sparse->row_start, op->sparse->row_start, (((size_t)1 << op->qubits) + 1) * sizeof(size_t));
+    memcpy(new_op->sparse->columns, op->sparse->columns, op->sparse->nonzeros * sizeof(size_t));
+    memcpy(new_op->sparse->values, op->sparse->values, 2 * op->sparse->nonzeros * sizeof(double));
+    return new_op;
+  }
+  q_op* new_op = q_op_alloc(op->qubits);
+  gsl_matrix_complex_memcpy(new_op->matrix, op->matrix);
+  return new_op;
+}
+
+/**q_op_is_lazy
+  *Checks whether a q_op is a lazy tensor or matrix product of factors.
+    *op. The q_op to check.
+  *Returns 1 if it is lazy and 0 otherwise.
+*/
+int q_op_is_lazy(q_op* op){
+  return op->lazy != NULL;
+}
+
 /**q_op_print
   *Prints a q_op.
     *op. The op to print.
 */
 void q_op_print(q_op* op){
 
+  size_t rows = (size_t)1 << op->qubits;
   printf("%d qubits:\n", op->qubits);
-  for (int i = 0; i < op->matrix->size1; i++) {
-    for (int j = 0; j < op->matrix->size2; j++) {
-      gsl_complex q = gsl_matrix_complex_get(op->matrix, i, j);
+  for (size_t i = 0; i < rows; i++) {
+    for (size_t j = 0; j < rows; j++) {
+      gsl_complex q = q_op_get(op, i, j);
       double re = GSL_REAL(q);
       double im = GSL_IMAG(q);
       printf("(%lf, %lfj)\t", re, im);
@@ -138,10 +576,10 @@ void q_op_print(q_op* op){
 }
 
 /**apply_qop
-  *Applies a q_op operator to a state. The old state is not destroyed and must be freed by the user. This operation is effectively op * state using matrix multiplication.
+  *Applies a q_op operator to a state. The old state is not destroyed and must be freed by the user. This operation is effectively op * state using matrix multiplication; sparse operators use a sparse matrix-vector product that costs time proportional to their non-zeros, and lazy operators are applied factor by factor with q_state_apply_gate.
     *op. The q_op to apply.
     *state. The state to apply the q_op to.
-  Returns the produced state "new_state"
+  Returns new_state
 */
 q_state* apply_qop(q_op* op, q_state* state){
   if(op->qubits != state->qubits){
@@ -149,158 +587,1895 @@ q_state* apply_qop(q_op* op, q_state* state){
     exit(0);
   }
   q_state* new_state = q_state_alloc(state->qubits);
-
-  gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, GSL_COMPLEX_ONE, op->matrix, state->vector, GSL_COMPLEX_ZERO, new_state->vector);
-
+  apply_qop_into(op, state, new_state);
   return new_state;
 }
 
-/**q_state_tensor
-  *Performs the matrix tensor operation on quantum states a and b. Neither a nor b is destroyed and both must be freed by the user.
-    *a. The first q_state.
-    *b. The second q_state.
-  *Returns the tensor of a and b "new_state".
+/**apply_qop_into
+  *Applies a q_op operator to a state like apply_qop, but writes op * state into an existing state instead of allocating one, so loops can reuse their buffers.
+    *op. The q_op to apply.
+    *state. The state to apply the q_op to. It is not changed.
+    *out. The destination, on the same number of qubits and distinct from state. It is overwritten.
 */
-q_state* q_state_tensor(q_state* a, q_state* b){
-  q_state* new_state = q_state_calloc(a->qubits + b->qubits);
-  for(int i = 0; i < a->vector->size1; i++){
-    for(int j = 0; j < a->vector->size2; j++){
-      gsl_complex q1 = gsl_matrix_complex_get(a->vector, i, j);
-      if(GSL_REAL(q1) != 0.0 || GSL_IMAG(q1) != 0.0){
-        for(int k = 0; k < b->vector->size1; k++){
-          for(int l = 0; l < b->vector->size2; l++){
-            gsl_complex q2 = gsl_matrix_complex_get(b->vector, k, l);
-            if(GSL_REAL(q1) != 0.0 || GSL_IMAG(q1) != 0.0){
-              gsl_matrix_complex_set(new_state->vector, (i * b->vector->size1) + k, (j * b->vector->size2) + l, gsl_complex_mul(q1, q2));
-            }
-          }
-        }
+void apply_qop_into(q_op* op, q_state* state, q_state* out){
+  if(op->qubits != state->qubits || out->qubits != state->qubits){
+    printf("Error: size mismatch in operator application. Terminating.\n");
+    exit(0);
+  }
+  if(out == state){
+    printf("Error: the destination of an operator application must differ from its source. Terminating.\n");
+    exit(0);
+  }
+
+  if(op->lazy != NULL){
+    int targets[op->qubits];
+    for(int i = 0; i < op->qubits; i++){
+      targets[i] = i;
+    }
+    gsl_matrix_complex_memcpy(out->vector, state->vector);
+    q_state_apply_gate(out, op, targets, op->qubits);
+    return;
+  }
+
+  if(op->sparse != NULL){
+    size_t rows = (size_t)1 << op->qubits;
+    q_sparse* sp = op->sparse;
+    const double* x = state->vector->data;
+    double* y = out->vector->data;
+    size_t x_stride = state->vector->tda;
+    size_t y_stride = out->vector->tda;
+    #pragma omp parallel for if(sp->nonzeros >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t i = 0; i < rows; i++){
+      double re = 0.0, im = 0.0;
+      for(size_t nz = sp->row_start[i]; nz < sp->row_start[i + 1]; nz++){
+        const double* v = sp->values + 2 * nz;
+        const double* a = x + 2 * sp->columns[nz] * x_stride;
+        re += v[0] * a[0] - v[1] * a[1];
+        im += v[0] * a[1] + v[1] * a[0];
       }
+      y[2 * i * y_stride] = re;
+      y[2 * i * y_stride + 1] = im;
     }
+    return;
   }
-  return new_state;
+
+  gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, GSL_COMPLEX_ONE, op->matrix, state->vector, GSL_COMPLEX_ZERO, out->vector);
 }
 
-/**q_op_tensor
-  *Performs the matrix tensor operation on quantum operators a and b. Neither a nor b is destroyed and both must be freed by the user.
-    *a. The first q_op.
-    *b. The second q_op.
-  *Returns the tensor of a and b "new_op".
+/**q_gate_masks
+  *Validates a list of target qubits against a state and converts them to bit masks on the amplitude index. Qubit 0 is the most significant bit of the index, matching q_state_tensor. Together with q_gate_offsets and q_insert_zero_bits this lets other modules walk the blocks of a gate like the kernels here do.
+    *qubits. The number of qubits of the state.
+    *targets. The target qubits.
+    *k. The number of target qubits.
+    *masks. Output, the mask of each target qubit in gate order.
+    *sorted. Output, the same masks in ascending order.
 */
-q_op* q_op_tensor(q_op* a, q_op* b){
-  q_op* new_op = q_op_calloc(a->qubits + b->qubits);
-  for(int i = 0; i < a->matrix->size1; i++){
-    for(int j = 0; j < a->matrix->size2; j++){
-      gsl_complex q1 = gsl_matrix_complex_get(a->matrix, i, j);
-      if(GSL_REAL(q1) != 0.0 || GSL_IMAG(q1) != 0.0){
-        for(int k = 0; k < b->matrix->size1; k++){
-          for(int l = 0; l < b->matrix->size2; l++){
-            gsl_complex q2 = gsl_matrix_complex_get(b->matrix, k, l);
-            if(GSL_REAL(q1) != 0.0 || GSL_IMAG(q1) != 0.0){
-              gsl_matrix_complex_set(new_op->matrix, (i * b->matrix->size1) + k, (j * b->matrix->size2) + l, gsl_complex_mul(q1, q2));
-            }
-          }
-        }
+void q_gate_masks(int qubits, const int* targets, int k, size_t* masks, size_t* sorted){
+  for(int i = 0; i < k; i++){
+    if(targets[i] < 0 || targets[i] >= qubits){
+      printf("Error: target qubit %d out of range in gate application. Terminating.\n", targets[i]);
+      exit(0);
+    }
+    masks[i] = (size_t)1 << (qubits - 1 - targets[i]);
+    for(int j = 0; j < i; j++){
+      if(masks[j] == masks[i]){
+        printf("Error: repeated target qubit %d in gate application. Terminating.\n", targets[i]);
+        exit(0);
       }
     }
+    int j = i;
+    while(j > 0 && sorted[j - 1] > masks[i]){
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = masks[i];
   }
-  return new_op;
 }
 
-/**q_op_multiply
-  *Performs the matrix multiplication operation on quantum operators a and b. Neither a nor b is destroyed and both must be freed by the user.
-    *a. The first q_op.
-    *b. The second q_op.
-  *Returns a.b "new_op".
+/**q_gate_offsets
+  *Computes, for each local index l of a k-qubit gate, the offset of its amplitude from the base index of a block: the OR of the masks of the targets whose bit is set in l, with targets[0] as the most significant bit of l.
+    *masks. The mask of each target qubit in gate order, from q_gate_masks.
+    *k. The number of target qubits.
+    *offsets. Output, the 2^k offsets.
 */
-q_op* q_op_multiply(q_op* a, q_op* b){
-  if(a->qubits != b->qubits){
-    printf("Error: size mismatch in operator application. Terminating.\n");
-    exit(0);
+void q_gate_offsets(const size_t* masks, int k, size_t* offsets){
+  for(size_t l = 0; l < ((size_t)1 << k); l++){
+    offsets[l] = 0;
+    for(int j = 0; j < k; j++){
+      if(l & ((size_t)1 << (k - 1 - j))) offsets[l] |= masks[j];
+    }
   }
-  q_op* new_op = q_op_alloc(b->qubits);
+}
 
-  gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, GSL_COMPLEX_ONE, a->matrix, b->matrix, GSL_COMPLEX_ZERO, new_op->matrix);
+/**apply_controlled_1
+  *Applies the single qubit gate v (8 interleaved doubles) to a contiguous amplitude array through the vectorised kernel, split into chunks across threads. A control mask of 0 means the gate is uncontrolled.
+*/
+static void apply_controlled_1(double* amp, size_t dim, const double* v, size_t control, size_t mask){
+  size_t pairs = control == 0 ? dim / 2 : dim / 4;
+  size_t chunks = (pairs + Q_REDUCE_CHUNK - 1) / Q_REDUCE_CHUNK;
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t c = 0; c < chunks; c++){
+    size_t end = (c + 1) * Q_REDUCE_CHUNK < pairs ? (c + 1) * Q_REDUCE_CHUNK : pairs;
+    q_simd_gate_1(amp, v, control, mask, c * Q_REDUCE_CHUNK, end);
+  }
+}
 
-  return new_op;
+/**apply_gate_1
+  *Pair update for a single qubit gate u (row major, interleaved complex) acting on the qubit with the given mask.
+*/
+static void apply_gate_1(double* amp, size_t stride, size_t dim, const double* u, size_t tda, size_t mask){
+  double u00r = u[0], u00i = u[1], u01r = u[2], u01i = u[3];
+  double u10r = u[2 * tda], u10i = u[2 * tda + 1], u11r = u[2 * tda + 2], u11i = u[2 * tda + 3];
+  if(stride == 1){
+    double v[8] = {u00r, u00i, u01r, u01i, u10r, u10i, u11r, u11i};
+    apply_controlled_1(amp, dim, v, 0, mask);
+    return;
+  }
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t r = 0; r < dim / 2; r++){
+    size_t lo = ((r & ~(mask - 1)) << 1) | (r & (mask - 1));
+    double* a = amp + 2 * lo * stride;
+    double* b = amp + 2 * (lo + mask) * stride;
+    double ar = a[0], ai = a[1], br = b[0], bi = b[1];
+    a[0] = u00r * ar - u00i * ai + u01r * br - u01i * bi;
+    a[1] = u00r * ai + u00i * ar + u01r * bi + u01i * br;
+    b[0] = u10r * ar - u10i * ai + u11r * br - u11i * bi;
+    b[1] = u10r * ai + u10i * ar + u11r * bi + u11i * br;
+  }
 }
 
-/**g_state_distribution_alloc
-  *Allocates a q_state distribution struct.
-    *s. The number of states of the q_state_distribution.
-  Returns the empty state distribution "dist".
+/**apply_gate_k
+  *General block update for a k-qubit gate u (row major, interleaved complex). Each block of 2^k amplitudes is gathered, multiplied by u and scattered back.
 */
-q_state_distribution* q_state_distribution_alloc(int s){
-  q_state_distribution* dist = malloc(sizeof(q_state_distribution));
-  dist->s = s;
-  dist->states = malloc(s * sizeof(q_state));
-  dist->probabilities = malloc(s * sizeof(double));
-  return dist;
+static void apply_gate_k(double* amp, size_t stride, size_t dim, const double* u, size_t tda, const size_t* masks, const size_t* sorted, int k){
+  size_t d = (size_t)1 << k;
+  size_t offsets[d];
+  q_gate_offsets(masks, k, offsets);
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t r = 0; r < (dim >> k); r++){
+    double in[2 * d];
+    size_t base = q_insert_zero_bits(r, sorted, k);
+    for(size_t l = 0; l < d; l++){
+      in[2 * l] = amp[2 * (base + offsets[l]) * stride];
+      in[2 * l + 1] = amp[2 * (base + offsets[l]) * stride + 1];
+    }
+    for(size_t row = 0; row < d; row++){
+      const double* ur = u + 2 * row * tda;
+      double re = 0.0, im = 0.0;
+      for(size_t l = 0; l < d; l++){
+        re += ur[2 * l] * in[2 * l] - ur[2 * l + 1] * in[2 * l + 1];
+        im += ur[2 * l] * in[2 * l + 1] + ur[2 * l + 1] * in[2 * l];
+      }
+      amp[2 * (base + offsets[row]) * stride] = re;
+      amp[2 * (base + offsets[row]) * stride + 1] = im;
+    }
+  }
 }
 
-/**q_state_distribution_free
-  *Frees a given q_state_distribution.
-    *dist. The distribution to free.
+/**apply_sparse_k
+  *Block update for a k-qubit gate in CSR form. Each block of 2^k amplitudes is gathered into a per-thread buffer and multiplied by the non-zeros of each row, so the cost per block is the number of non-zeros rather than 4^k.
 */
-void q_state_distribution_free(q_state_distribution* dist){
-  for(int i = 0; i < dist->s; i++){
-    q_state_free(dist->states[i]);
+static void apply_sparse_k(double* amp, size_t stride, size_t dim, const q_sparse* sp, const size_t* masks, const size_t* sorted, int k){
+  size_t d = (size_t)1 << k;
+  size_t* offsets = malloc(d * sizeof(size_t));
+  q_gate_offsets(masks, k, offsets);
+  #pragma omp parallel if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads())
+  {
+    double* in = malloc(2 * d * sizeof(double));
+    #pragma omp for schedule(static)
+    for(size_t r = 0; r < (dim >> k); r++){
+      size_t base = q_insert_zero_bits(r, sorted, k);
+      for(size_t l = 0; l < d; l++){
+        in[2 * l] = amp[2 * (base + offsets[l]) * stride];
+        in[2 * l + 1] = amp[2 * (base + offsets[l]) * stride + 1];
+      }
+      for(size_t row = 0; row < d; row++){
+        double re = 0.0, im = 0.0;
+        for(size_t nz = sp->row_start[row]; nz < sp->row_start[row + 1]; nz++){
+          const double* v = sp->values + 2 * nz;
+          const double* x = in + 2 * sp->columns[nz];
+          re += v[0] * x[0] - v[1] * x[1];
+          im += v[0] * x[1] + v[1] * x[0];
+        }
+        amp[2 * (base + offsets[row]) * stride] = re;
+        amp[2 * (base + offsets[row]) * stride + 1] = im;
+      }
+    }
+    free(in);
   }
-  free(dist->states);
-  free(dist->probabilities);
-  free(dist);
+  free(offsets);
 }
 
-/**q_state_distribution_lazy_free
-  *Frees a given q_state_distribution, does not free individual q_states.
-    *dist. The distribution to free.
+/**apply_gate_masks
+  *Applies a k-qubit gate whose targets have already been converted to masks by q_gate_masks.
 */
-void q_state_distribution_lazy_free(q_state_distribution* dist){
-  free(dist->states);
-  free(dist->probabilities);
-  free(dist);
+static void apply_gate_masks(q_state* state, q_op* gate, const size_t* masks, const size_t* sorted, int k){
+  size_t dim = (size_t)1 << state->qubits;
+  if(k == 1){
+    apply_gate_1(state->vector->data, state->vector->tda, dim, gate->matrix->data, gate->matrix->tda, masks[0]);
+  }
+  else if(k > 1){
+    apply_gate_k(state->vector->data, state->vector->tda, dim, gate->matrix->data, gate->matrix->tda, masks, sorted, k);
+  }
 }
 
-/**q_state_measure
-  *Performs a measurement of a given qubit of a q state.
-    *q. The q_state to perform a measurement on.
-    *qubit. The qubit to measure.
-  *A probability distribution over outcomes.
+/**apply_controlled_masks
+  *Applies the single qubit gate u (row major with row stride tda) to the qubit masks[1], controlled by the qubit masks[0].
 */
-q_state_distribution** q_state_measure(q_state* q, int qubit){
-  int flips_at = (int)pow(2, qubit-1);
-  int zero = 1;
-  double z_prob = 0.0;
-  double o_prob = 0.0;
-  return NULL;
+static void apply_controlled_masks(q_state* state, const double* u, size_t tda, const size_t* masks){
+  size_t dim = (size_t)1 << state->qubits;
+  double v[8] = {u[0], u[1], u[2], u[3], u[2 * tda], u[2 * tda + 1], u[2 * tda + 2], u[2 * tda + 3]};
+  if(state->vector->tda == 1){
+    apply_controlled_1(state->vector->data, dim, v, masks[0], masks[1]);
+    return;
+  }
+  //Strided states are rare enough to go through the general kernel with the full 4x4 matrix.
+  double full[32] = {0.0};
+  full[0] = 1.0;
+  full[10] = 1.0;
+  for(int i = 0; i < 2; i++){
+    for(int j = 0; j < 2; j++){
+      full[2 * ((i + 2) * 4 + j + 2)] = v[2 * (2 * i + j)];
+      full[2 * ((i + 2) * 4 + j + 2) + 1] = v[2 * (2 * i + j) + 1];
+    }
+  }
+  size_t sorted[2] = {masks[0] < masks[1] ? masks[0] : masks[1], masks[0] < masks[1] ? masks[1] : masks[0]};
+  apply_gate_k(state->vector->data, state->vector->tda, dim, full, 4, masks, sorted, 2);
 }
 
-/**q_state_measure
-  *Performs a measurement of a given qubit of a q distribution.
-    *q. The q_state_distribution to perform a measurement on.
-    *qubit. The qubit to measure.
-  *A probability distribution over outcomes.
+/**apply_gate_columns
+  *Applies a k-qubit gate to every column of a matrix whose rows are indexed by the amplitude index, i.e. computes G.m in place for the gate G embedded on the masked qubits. Work is split into batches of Q_COLUMN_BATCH columns per block of rows, so each update streams along contiguous row segments and batches run in parallel.
 */
-q_state_distribution** q_distribution_measure(q_state_distribution* q, int qubit){
-  return NULL;
+static void apply_gate_columns(gsl_matrix_complex* m, q_op* gate, const size_t* masks, const size_t* sorted, int k){
+  size_t d = (size_t)1 << k;
+  size_t rows = m->size1;
+  size_t cols = m->size2;
+  size_t tda = m->tda;
+  size_t offsets[d];
+  q_gate_offsets(masks, k, offsets);
+  const double* u = gate->matrix->data;
+  size_t u_tda = gate->matrix->tda;
+  size_t batches = (cols + Q_COLUMN_BATCH - 1) / Q_COLUMN_BATCH;
+  size_t blocks = rows >> k;
+  #pragma omp parallel if(rows * cols >= Q_PARALLEL_MIN) num_threads(q_get_threads())
+  {
+    double* in = malloc(2 * d * Q_COLUMN_BATCH * sizeof(double));
+    #pragma omp for collapse(2) schedule(static)
+    for(size_t b = 0; b < batches; b++){
+      for(size_t r = 0; r < blocks; r++){
+        size_t c0 = b * Q_COLUMN_BATCH;
+        size_t w = cols - c0 < Q_COLUMN_BATCH ? cols - c0 : Q_COLUMN_BATCH;
+        size_t base = q_insert_zero_bits(r, sorted, k);
+        for(size_t l = 0; l < d; l++){
+          memcpy(in + 2 * l * Q_COLUMN_BATCH, m->data + 2 * ((base + offsets[l]) * tda + c0), 2 * w * sizeof(double));
+        }
+        for(size_t row = 0; row < d; row++){
+          double* out = m->data + 2 * ((base + offsets[row]) * tda + c0);
+          for(size_t c = 0; c < 2 * w; c++){
+            out[c] = 0.0;
+          }
+          for(size_t l = 0; l < d; l++){
+            double ur = u[2 * (row * u_tda + l)];
+            double ui = u[2 * (row * u_tda + l) + 1];
+            if(ur == 0.0 && ui == 0.0) continue;
+            const double* x = in + 2 * l * Q_COLUMN_BATCH;
+            for(size_t c = 0; c < w; c++){
+              out[2 * c] += ur * x[2 * c] - ui * x[2 * c + 1];
+              out[2 * c + 1] += ur * x[2 * c + 1] + ui * x[2 * c];
+            }
+          }
+        }
+      }
+    }
+    free(in);
+  }
 }
 
-/**fidelity
-  *Computes the fidelity between 2 states.
-    *a. The first q_state.
-    *b. The second q_state.
-  *Returns fid, the fidelity
+/**q_state_apply_gate
+  *Applies a k-qubit q_op to the given target qubits of a state in place, without building the full operator on all qubits. Qubit 0 is the leftmost qubit of the state (as in q_state_tensor) and targets[0] is the leftmost qubit of the gate, so q_cX applied to {2, 0} is a CNOT controlled by qubit 2 targeting qubit 0.
+    *state. The state to apply the gate to. It is overwritten.
+    *gate. The k-qubit q_op to apply. Sparse gates are applied block by block in CSR form and lazy gates factor by factor.
+    *targets. The k distinct target qubits of the state.
+    *k. The number of target qubits.
 */
-double fidelity(q_state* a, q_state* b){
-  q_state* bt = q_complex_conjugate(b);
-  gsl_complex sum;
-  GSL_SET_COMPLEX(&sum, 0.0, 0.0);
-  for(int i = 0; i < (int)pow(2, a->qubits); i++){
-    gsl_complex ac = gsl_matrix_complex_get(a->vector, i, 0);
-    gsl_complex bc = gsl_matrix_complex_get(bt->vector, i, 0);
-    sum = gsl_complex_add(sum, gsl_complex_mul(ac, bc));
-  }
-  double fid = gsl_complex_abs(sum);
-  q_state_free(bt);
-  return fid;
+void q_state_apply_gate(q_state* state, q_op* gate, const int* targets, int k){
+  if(gate->qubits != k || k > state->qubits){
+    printf("Error: size mismatch in gate application. Terminating.\n");
+    exit(0);
+  }
+  if(gate->lazy != NULL){
+    if(gate->lazy->type == Q_LAZY_TENSOR){
+      for(int f = 0; f < gate->lazy->count; f++){
+        q_state_apply_gate(state, gate->lazy->factors[f], targets, gate->lazy->factors[f]->qubits);
+        targets += gate->lazy->factors[f]->qubits;
+      }
+    }
+    else{
+      for(int f = gate->lazy->count - 1; f >= 0; f--){
+        q_state_apply_gate(state, gate->lazy->factors[f], targets, k);
+      }
+    }
+    return;
+  }
+  size_t masks[k];
+  size_t sorted[k];
+  q_gate_masks(state->qubits, targets, k, masks, sorted);
+  if(gate->sparse != NULL){
+    apply_sparse_k(state->vector->data, state->vector->tda, (size_t)1 << state->qubits, gate->sparse, masks, sorted, k);
+  }
+  else{
+    apply_gate_masks(state, gate, masks, sorted, k);
+  }
+}
+
+/**q_op_embed
+  *Builds the n-qubit operator that applies a k-qubit gate to the given target qubits and the identity elsewhere, in a single pass over the output rows without intermediate tensor products or swaps. The targets may be in any order and need not be adjacent; they have the same meaning as in q_state_apply_gate. The result is stored sparse when q_op_select would choose that, and dense otherwise.
+    *gate. The k-qubit q_op to embed. It is not destroyed.
+    *targets. The k distinct target qubits.
+    *k. The number of target qubits.
+    *qubits. The number of qubits n of the result.
+  Returns the embedded operator "op"
+*/
+q_op* q_op_embed(q_op* gate, const int* targets, int k, int qubits){
+  if(gate->qubits != k || k > qubits){
+    printf("Error: size mismatch in operator embedding. Terminating.\n");
+    exit(0);
+  }
+  size_t masks[k];
+  size_t sorted[k];
+  q_gate_masks(qubits, targets, k, masks, sorted);
+  size_t rows = (size_t)1 << qubits;
+  size_t d = (size_t)1 << k;
+  size_t mask = 0;
+  for(int j = 0; j < k; j++){
+    mask |= masks[j];
+  }
+  //Local columns in order of increasing offset, so each output row is written left to right.
+  size_t* offsets = malloc(d * sizeof(size_t));
+  size_t* order = malloc(d * sizeof(size_t));
+  q_gate_offsets(masks, k, offsets);
+  for(size_t l = 0; l < d; l++){
+    size_t pos = l;
+    while(pos > 0 && offsets[order[pos - 1]] > offsets[l]){
+      order[pos] = order[pos - 1];
+      pos--;
+    }
+    order[pos] = l;
+  }
+  double* u = malloc(2 * d * d * sizeof(double));
+  size_t* row_nonzeros = calloc(d, sizeof(size_t));
+  for(size_t a = 0; a < d; a++){
+    for(size_t b = 0; b < d; b++){
+      gsl_complex q = q_op_get(gate, a, b);
+      u[2 * (a * d + b)] = GSL_REAL(q);
+      u[2 * (a * d + b) + 1] = GSL_IMAG(q);
+      row_nonzeros[a] += GSL_REAL(q) != 0.0 || GSL_IMAG(q) != 0.0;
+    }
+  }
+  size_t total = 0;
+  for(size_t a = 0; a < d; a++){
+    total += row_nonzeros[a];
+  }
+  total <<= qubits - k;
+  q_op* op;
+  if(qubits >= Q_SPARSE_QUBITS && total <= Q_SPARSE_DENSITY * rows * rows){
+    op = q_op_sparse_alloc(qubits, total);
+    q_sparse* sp = op->sparse;
+    for(size_t i = 0; i < rows; i++){
+      size_t local = 0;
+      for(int j = 0; j < k; j++){
+        local = (local << 1) | ((i & masks[j]) != 0);
+      }
+      sp->row_start[i + 1] = sp->row_start[i] + row_nonzeros[local];
+    }
+    #pragma omp parallel for if(total >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t i = 0; i < rows; i++){
+      size_t local = 0;
+      for(int j = 0; j < k; j++){
+        local = (local << 1) | ((i & masks[j]) != 0);
+      }
+      size_t nz = sp->row_start[i];
+      for(size_t c = 0; c < d; c++){
+        const double* v = u + 2 * (local * d + order[c]);
+        if(v[0] != 0.0 || v[1] != 0.0){
+          sp->columns[nz] = (i & ~mask) | offsets[order[c]];
+          sp->values[2 * nz] = v[0];
+          sp->values[2 * nz + 1] = v[1];
+          nz++;
+        }
+      }
+    }
+  }
+  else{
+    op = q_op_alloc(qubits);
+    gsl_matrix_complex* m = op->matrix;
+    #pragma omp parallel for if(rows * rows >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t i = 0; i < rows; i++){
+      double* row = m->data + 2 * i * m->tda;
+      memset(row, 0, 2 * rows * sizeof(double));
+      size_t local = 0;
+      for(int j = 0; j < k; j++){
+        local = (local << 1) | ((i & masks[j]) != 0);
+      }
+      for(size_t l = 0; l < d; l++){
+        double* x = row + 2 * ((i & ~mask) | offsets[l]);
+        x[0] = u[2 * (local * d + l)];
+        x[1] = u[2 * (local * d + l) + 1];
+      }
+    }
+  }
+  free(offsets);
+  free(order);
+  free(u);
+  free(row_nonzeros);
+  return op;
+}
+
+/**q_op_is_controlled
+  *Checks whether a 2-qubit q_op is a controlled single qubit gate, i.e. acts as the identity when its first qubit is zero, as q_cY does.
+    *op. The q_op to check.
+  *Returns 1 if op is a controlled gate and 0 otherwise.
+*/
+int q_op_is_controlled(q_op* op){
+  if(op->qubits != 2){
+    return 0;
+  }
+  for(int i = 0; i < 4; i++){
+    for(int j = 0; j < 4; j++){
+      if(i >= 2 && j >= 2) continue;
+      gsl_complex q = q_op_get(op, i, j);
+      if(GSL_REAL(q) != (i == j ? 1.0 : 0.0) || GSL_IMAG(q) != 0.0){
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/**q_state_apply_controlled
+  *Applies a single qubit gate to the target qubit of a state in place, for the amplitudes whose control qubit is one.
+    *state. The state to apply the gate to. It is overwritten.
+    *gate. The single qubit q_op to apply. A sparse gate is converted to dense storage in place.
+    *control. The control qubit.
+    *target. The target qubit.
+*/
+void q_state_apply_controlled(q_state* state, q_op* gate, int control, int target){
+  if(gate->qubits != 1 || state->qubits < 2){
+    printf("Error: size mismatch in gate application. Terminating.\n");
+    exit(0);
+  }
+  q_op_densify(gate);
+  int targets[2] = {control, target};
+  size_t masks[2];
+  size_t sorted[2];
+  q_gate_masks(state->qubits, targets, 2, masks, sorted);
+  apply_controlled_masks(state, gate->matrix->data, gate->matrix->tda, masks);
+}
+
+/**q_op_is_diagonal
+  *Checks whether every off-diagonal entry of a q_op is exactly zero, as it is for the phase gates of predefined_q.
+    *op. The q_op to check.
+  *Returns 1 if op is diagonal and 0 otherwise.
+*/
+int q_op_is_diagonal(q_op* op){
+  int rows = 1 << op->qubits;
+  for(int i = 0; i < rows; i++){
+    for(int j = 0; j < rows; j++){
+      gsl_complex q = q_op_get(op, i, j);
+      if(i != j && (GSL_REAL(q) != 0.0 || GSL_IMAG(q) != 0.0)){
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/**apply_diagonal_masks
+  *Multiplies every amplitude by the phase selected by its target bits. Phases that are exactly one are skipped, so e.g. q_cZ only touches a quarter of the state.
+*/
+static void apply_diagonal_masks(q_state* state, gsl_vector_complex* phases, const size_t* masks, const size_t* sorted, int k){
+  size_t d = (size_t)1 << k;
+  size_t dim = (size_t)1 << state->qubits;
+  size_t stride = state->vector->tda;
+  double* amp = state->vector->data;
+  size_t offsets[d];
+  double p[2 * d];
+  size_t active[d];
+  size_t a = 0;
+  q_gate_offsets(masks, k, offsets);
+  for(size_t l = 0; l < d; l++){
+    gsl_complex z = gsl_vector_complex_get(phases, l);
+    if(GSL_REAL(z) != 1.0 || GSL_IMAG(z) != 0.0){
+      p[2 * a] = GSL_REAL(z);
+      p[2 * a + 1] = GSL_IMAG(z);
+      active[a++] = offsets[l];
+    }
+  }
+  if(a == 0) return;
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t r = 0; r < (dim >> k); r++){
+    size_t base = q_insert_zero_bits(r, sorted, k);
+    for(size_t l = 0; l < a; l++){
+      double* x = amp + 2 * (base + active[l]) * stride;
+      double re = x[0];
+      x[0] = p[2 * l] * re - p[2 * l + 1] * x[1];
+      x[1] = p[2 * l] * x[1] + p[2 * l + 1] * re;
+    }
+  }
+}
+
+/**q_state_apply_diagonal
+  *Applies a k-qubit diagonal gate, given by its diagonal, to the target qubits of a state in place. Each amplitude is multiplied by the phase indexed by its target bits, so the whole state is updated in one streaming pass.
+    *state. The state to apply the gate to. It is overwritten.
+    *phases. The 2^k diagonal entries of the gate.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_state_apply_diagonal(q_state* state, gsl_vector_complex* phases, const int* targets, int k){
+  if(phases->size != ((size_t)1 << k) || k > state->qubits){
+    printf("Error: size mismatch in gate application. Terminating.\n");
+    exit(0);
+  }
+  size_t masks[k];
+  size_t sorted[k];
+  q_gate_masks(state->qubits, targets, k, masks, sorted);
+  apply_diagonal_masks(state, phases, masks, sorted, k);
+}
+
+/**q_op_is_permutation
+  *Checks whether a q_op is a permutation matrix, i.e. every row and column holds a single entry of exactly one and zeros elsewhere, as for q_pauli_X, q_cX and q_swap.
+    *op. The q_op to check.
+  *Returns 1 if op is a permutation and 0 otherwise.
+*/
+int q_op_is_permutation(q_op* op){
+  int rows = 1 << op->qubits;
+  int hits[rows];
+  for(int i = 0; i < rows; i++){
+    hits[i] = 0;
+  }
+  for(int j = 0; j < rows; j++){
+    int ones = 0;
+    for(int i = 0; i < rows; i++){
+      gsl_complex q = q_op_get(op, i, j);
+      if(GSL_REAL(q) == 1.0 && GSL_IMAG(q) == 0.0){
+        ones++;
+        hits[i]++;
+      }
+      else if(GSL_REAL(q) != 0.0 || GSL_IMAG(q) != 0.0){
+        return 0;
+      }
+    }
+    if(ones != 1){
+      return 0;
+    }
+  }
+  for(int i = 0; i < rows; i++){
+    if(hits[i] != 1){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**apply_permutation_masks
+  *Moves the amplitude with local index l to local index permutation[l] within every block, without any floating point arithmetic. Fixed points are not touched.
+*/
+static void apply_permutation_masks(q_state* state, const int* permutation, const size_t* masks, const size_t* sorted, int k){
+  size_t d = (size_t)1 << k;
+  size_t dim = (size_t)1 << state->qubits;
+  size_t stride = state->vector->tda;
+  double* amp = state->vector->data;
+  if(k == 1){
+    if(permutation[0] == 0) return;
+    size_t mask = masks[0];
+    #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t r = 0; r < dim / 2; r++){
+      size_t lo = ((r & ~(mask - 1)) << 1) | (r & (mask - 1));
+      double* a = amp + 2 * lo * stride;
+      double* b = amp + 2 * (lo + mask) * stride;
+      double re = a[0], im = a[1];
+      a[0] = b[0];
+      a[1] = b[1];
+      b[0] = re;
+      b[1] = im;
+    }
+    return;
+  }
+  size_t offsets[d];
+  size_t from[d];
+  size_t to[d];
+  size_t a = 0;
+  q_gate_offsets(masks, k, offsets);
+  for(size_t l = 0; l < d; l++){
+    if((size_t)permutation[l] != l){
+      from[a] = offsets[l];
+      to[a++] = offsets[permutation[l]];
+    }
+  }
+  if(a == 0) return;
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t r = 0; r < (dim >> k); r++){
+    double moved[2 * a];
+    size_t base = q_insert_zero_bits(r, sorted, k);
+    for(size_t l = 0; l < a; l++){
+      moved[2 * l] = amp[2 * (base + from[l]) * stride];
+      moved[2 * l + 1] = amp[2 * (base + from[l]) * stride + 1];
+    }
+    for(size_t l = 0; l < a; l++){
+      amp[2 * (base + to[l]) * stride] = moved[2 * l];
+      amp[2 * (base + to[l]) * stride + 1] = moved[2 * l + 1];
+    }
+  }
+}
+
+/**q_state_apply_permutation
+  *Applies a k-qubit permutation gate to the target qubits of a state in place by moving amplitudes, without any floating point arithmetic.
+    *state. The state to apply the gate to. It is overwritten.
+    *permutation. The 2^k entries of the permutation; the amplitude with local index l moves to local index permutation[l]. For a q_op this is the row holding the one in column l.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_state_apply_permutation(q_state* state, const int* permutation, const int* targets, int k){
+  if(k > state->qubits){
+    printf("Error: size mismatch in gate application. Terminating.\n");
+    exit(0);
+  }
+  size_t masks[k];
+  size_t sorted[k];
+  q_gate_masks(state->qubits, targets, k, masks, sorted);
+  apply_permutation_masks(state, permutation, masks, sorted, k);
+}
+
+/**q_state_swap_qubits
+  *Swaps two qubits of a state in place by exchanging the amplitudes whose bits for a and b differ.
+    *state. The state to swap the qubits of. It is overwritten.
+    *a. The first qubit.
+    *b. The second qubit.
+*/
+void q_state_swap_qubits(q_state* state, int a, int b){
+  if(a == b) return;
+  int targets[2] = {a, b};
+  int permutation[4] = {0, 2, 1, 3};
+  q_state_apply_permutation(state, permutation, targets, 2);
+}
+
+/**q_state_permute_qubits
+  *Relabels the qubits of a state in place, so that qubit j of the old state becomes qubit map[j] of the new one. This has the same effect as applying q_swap(qubits, map), but costs at most qubits - 1 passes of amplitude swaps.
+    *state. The state to permute. It is overwritten.
+    *map. The new position of each qubit.
+*/
+void q_state_permute_qubits(q_state* state, const int* map){
+  int n = state->qubits;
+  int current[n];
+  int wanted[n];
+  for(int j = 0; j < n; j++){
+    current[j] = j;
+    wanted[j] = -1;
+  }
+  for(int j = 0; j < n; j++){
+    if(map[j] < 0 || map[j] >= n || wanted[map[j]] != -1){
+      printf("Error: invalid qubit map in permutation. Terminating.\n");
+      exit(0);
+    }
+    wanted[map[j]] = j;
+  }
+  for(int p = 0; p < n; p++){
+    if(current[p] != wanted[p]){
+      int q = p + 1;
+      while(current[q] != wanted[p]) q++;
+      q_state_swap_qubits(state, p, q);
+      current[q] = current[p];
+      current[p] = wanted[p];
+    }
+  }
+}
+
+/**q_state_tensor
+  *Performs the matrix tensor operation on quantum states a and b. Neither a nor b is destroyed and both must be freed by the user.
+    *a. The first q_state.
+    *b. The second q_state.
+  *Returns the tensor of a and b "new_state".
+*/
+q_state* q_state_tensor(q_state* a, q_state* b){
+  q_state* new_state = q_state_alloc(a->qubits + b->qubits);
+  q_state_tensor_into(a, b, new_state);
+  return new_state;
+}
+
+/**q_state_tensor_into
+  *Performs the matrix tensor operation on quantum states a and b like q_state_tensor, but writes the result into an existing state instead of allocating one.
+    *a. The first q_state.
+    *b. The second q_state.
+    *out. The destination, on a->qubits + b->qubits qubits and distinct from a and b. It is overwritten.
+*/
+void q_state_tensor_into(q_state* a, q_state* b, q_state* out){
+  if(out == a || out == b){
+    printf("Error: the destination of a state tensor must differ from its operands. Terminating.\n");
+    exit(0);
+  }
+  if(out->qubits != a->qubits + b->qubits){
+    printf("Error: size mismatch in state tensor. Terminating.\n");
+    exit(0);
+  }
+  size_t a_dim = a->vector->size1;
+  size_t b_dim = b->vector->size1;
+  const double* x = a->vector->data;
+  const double* y = b->vector->data;
+  double* z = out->vector->data;
+  size_t x_stride = a->vector->tda;
+  size_t y_stride = b->vector->tda;
+  size_t z_stride = out->vector->tda;
+  #pragma omp parallel for if(a_dim * b_dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < a_dim; i++){
+    double xr = x[2 * i * x_stride], xi = x[2 * i * x_stride + 1];
+    for(size_t k = 0; k < b_dim; k++){
+      double yr = y[2 * k * y_stride], yi = y[2 * k * y_stride + 1];
+      double* out = z + 2 * (i * b_dim + k) * z_stride;
+      out[0] = xr * yr - xi * yi;
+      out[1] = xr * yi + xi * yr;
+    }
+  }
+}
+
+/**sparse_tensor
+  *Builds the Kronecker product of two operators directly in CSR form, converting dense factors on the fly, then picks the storage of the result with q_op_select.
+*/
+static q_op* sparse_tensor(q_op* a, q_op* b){
+  q_sparse* x = a->sparse != NULL ? a->sparse : sparse_from_dense(a->matrix);
+  q_sparse* y = b->sparse != NULL ? b->sparse : sparse_from_dense(b->matrix);
+  size_t a_rows = (size_t)1 << a->qubits;
+  size_t b_rows = (size_t)1 << b->qubits;
+  q_op* new_op = q_op_sparse_alloc(a->qubits + b->qubits, x->nonzeros * y->nonzeros);
+  q_sparse* z = new_op->sparse;
+  size_t nz = 0;
+  for(size_t i = 0; i < a_rows; i++){
+    for(size_t k = 0; k < b_rows; k++){
+      for(size_t p = x->row_start[i]; p < x->row_start[i + 1]; p++){
+        double ar = x->values[2 * p], ai = x->values[2 * p + 1];
+        for(size_t q = y->row_start[k]; q < y->row_start[k + 1]; q++){
+          double br = y->values[2 * q], bi = y->values[2 * q + 1];
+          z->columns[nz] = x->columns[p] * b_rows + y->columns[q];
+          z->values[2 * nz] = ar * br - ai * bi;
+          z->values[2 * nz + 1] = ar * bi + ai * br;
+          nz++;
+        }
+      }
+      z->row_start[i * b_rows + k + 1] = nz;
+    }
+  }
+  if(x != a->sparse) sparse_free(x);
+  if(y != b->sparse) sparse_free(y);
+  q_op_select(new_op);
+  return new_op;
+}
+
+/**q_op_tensor
+  *Performs the matrix tensor operation on quantum operators a and b. Neither a nor b is destroyed and both must be freed by the user. Products on at least Q_SPARSE_QUBITS qubits, or with a sparse factor, are built sparsely and stored as chosen by q_op_select. If either operator is lazy the result is lazy, as from q_op_tensor_lazy.
+    *a. The first q_op.
+    *b. The second q_op.
+  *Returns the tensor of a and b "new_op".
+*/
+q_op* q_op_tensor(q_op* a, q_op* b){
+  if(a->lazy != NULL || b->lazy != NULL){
+    return q_op_tensor_lazy(a, b);
+  }
+  if(a->sparse != NULL || b->sparse != NULL || a->qubits + b->qubits >= Q_SPARSE_QUBITS){
+    return sparse_tensor(a, b);
+  }
+  q_op* new_op = q_op_calloc(a->qubits + b->qubits);
+  for(int i = 0; i < a->matrix->size1; i++){
+    for(int j = 0; j < a->matrix->size2; j++){
+      gsl_complex q1 = gsl_matrix_complex_get(a->matrix, i, j);
+      if(GSL_REAL(q1) != 0.0 || GSL_IMAG(q1) != 0.0){
+        for(int k = 0; k < b->matrix->size1; k++){
+          for(int l = 0; l < b->matrix->size2; l++){
+            gsl_complex q2 = gsl_matrix_complex_get(b->matrix, k, l);
+            if(GSL_REAL(q1) != 0.0 || GSL_IMAG(q1) != 0.0){
+              gsl_matrix_complex_set(new_op->matrix, (i * b->matrix->size1) + k, (j * b->matrix->size2) + l, gsl_complex_mul(q1, q2));
+            }
+          }
+        }
+      }
+    }
+  }
+  return new_op;
+}
+
+/**sparse_multiply
+  *Multiplies two operators, at least one of them sparse, row by row with a dense accumulator, and picks the storage of the product with q_op_select.
+*/
+static q_op* sparse_multiply(q_op* a, q_op* b){
+  size_t rows = (size_t)1 << a->qubits;
+  q_sparse* x = a->sparse != NULL ? a->sparse : sparse_from_dense(a->matrix);
+  q_sparse* y = b->sparse != NULL ? b->sparse : sparse_from_dense(b->matrix);
+  double* acc = calloc(2 * rows, sizeof(double));
+  size_t* last = malloc(rows * sizeof(size_t));
+  size_t* touched = malloc(rows * sizeof(size_t));
+  for(size_t j = 0; j < rows; j++){
+    last[j] = rows;
+  }
+  size_t capacity = x->nonzeros + y->nonzeros + rows;
+  q_sparse* z = sparse_alloc(rows, capacity);
+  size_t nz = 0;
+  for(size_t i = 0; i < rows; i++){
+    size_t count = 0;
+    for(size_t p = x->row_start[i]; p < x->row_start[i + 1]; p++){
+      size_t k = x->columns[p];
+      double ar = x->values[2 * p], ai = x->values[2 * p + 1];
+      for(size_t q = y->row_start[k]; q < y->row_start[k + 1]; q++){
+        size_t j = y->columns[q];
+        if(last[j] != i){
+          last[j] = i;
+          acc[2 * j] = 0.0;
+          acc[2 * j + 1] = 0.0;
+          //Keep the touched columns sorted by insertion, which is cheap as rows have few non-zeros.
+          size_t pos = count++;
+          while(pos > 0 && touched[pos - 1] > j){
+            touched[pos] = touched[pos - 1];
+            pos--;
+          }
+          touched[pos] = j;
+        }
+        double br = y->values[2 * q], bi = y->values[2 * q + 1];
+        acc[2 * j] += ar * br - ai * bi;
+        acc[2 * j + 1] += ar * bi + ai * br;
+      }
+    }
+    if(nz + count > capacity){
+      capacity = 2 * (nz + count);
+      z->columns = realloc(z->columns, capacity * sizeof(size_t));
+      z->values = realloc(z->values, 2 * capacity * sizeof(double));
+    }
+    for(size_t c = 0; c < count; c++){
+      size_t j = touched[c];
+      if(acc[2 * j] != 0.0 || acc[2 * j + 1] != 0.0){
+        z->columns[nz] = j;
+        z->values[2 * nz] = acc[2 * j];
+        z->values[2 * nz + 1] = acc[2 * j + 1];
+        nz++;
+      }
+    }
+    z->row_start[i + 1] = nz;
+  }
+  z->nonzeros = nz;
+  free(acc);
+  free(last);
+  free(touched);
+  if(x != a->sparse) sparse_free(x);
+  if(y != b->sparse) sparse_free(y);
+  q_op* new_op = malloc(sizeof(q_op));
+  new_op->qubits = a->qubits;
+  new_op->matrix = NULL;
+  new_op->sparse = z;
+  new_op->lazy = NULL;
+  q_op_select(new_op);
+  return new_op;
+}
+
+/**q_op_multiply
+  *Performs the matrix multiplication operation on quantum operators a and b. Neither a nor b is destroyed and both must be freed by the user. If either operator is sparse the product is computed sparsely and stored as chosen by q_op_select. If either operator is lazy the result is lazy, as from q_op_multiply_lazy.
+    *a. The first q_op.
+    *b. The second q_op.
+  *Returns a.b "new_op".
+*/
+q_op* q_op_multiply(q_op* a, q_op* b){
+  if(a->qubits != b->qubits){
+    printf("Error: size mismatch in operator application. Terminating.\n");
+    exit(0);
+  }
+  if(a->lazy != NULL || b->lazy != NULL){
+    return q_op_multiply_lazy(a, b);
+  }
+  if(a->sparse != NULL || b->sparse != NULL){
+    return sparse_multiply(a, b);
+  }
+  q_op* new_op = q_op_alloc(b->qubits);
+  q_op_multiply_into(a, b, new_op);
+  return new_op;
+}
+
+/**q_op_multiply_into
+  *Performs the matrix multiplication a.b like q_op_multiply, but writes the product into an existing dense operator instead of allocating one. Dense operands use zgemm; sparse operands are expanded row by row into the destination without temporaries.
+    *a. The first q_op. It must not be lazy.
+    *b. The second q_op. It must not be lazy.
+    *out. The destination, a dense q_op on the same number of qubits and distinct from a and b. It is overwritten.
+*/
+void q_op_multiply_into(q_op* a, q_op* b, q_op* out){
+  if(a->qubits != b->qubits || out->qubits != a->qubits){
+    printf("Error: size mismatch in operator application. Terminating.\n");
+    exit(0);
+  }
+  if(a->lazy != NULL || b->lazy != NULL || out->matrix == NULL){
+    printf("Error: q_op_multiply_into needs non-lazy operands and a dense destination. Terminating.\n");
+    exit(0);
+  }
+  if(out == a || out == b){
+    printf("Error: the destination of an operator product must differ from its operands. Terminating.\n");
+    exit(0);
+  }
+  if(a->sparse == NULL && b->sparse == NULL){
+    gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, GSL_COMPLEX_ONE, a->matrix, b->matrix, GSL_COMPLEX_ZERO, out->matrix);
+    return;
+  }
+  //Row i of a.b is the sum over the non-zeros a_ik of a_ik times row k of b.
+  size_t rows = (size_t)1 << a->qubits;
+  gsl_matrix_complex* m = out->matrix;
+  #pragma omp parallel for if(rows * rows >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < rows; i++){
+    double* z = m->data + 2 * i * m->tda;
+    memset(z, 0, 2 * rows * sizeof(double));
+    size_t p_end = a->sparse != NULL ? a->sparse->row_start[i + 1] : rows;
+    for(size_t p = a->sparse != NULL ? a->sparse->row_start[i] : 0; p < p_end; p++){
+      size_t k = a->sparse != NULL ? a->sparse->columns[p] : p;
+      const double* x = a->sparse != NULL ? a->sparse->values + 2 * p : a->matrix->data + 2 * (i * a->matrix->tda + k);
+      double ar = x[0], ai = x[1];
+      if(ar == 0.0 && ai == 0.0) continue;
+      if(b->sparse != NULL){
+        for(size_t q = b->sparse->row_start[k]; q < b->sparse->row_start[k + 1]; q++){
+          const double* y = b->sparse->values + 2 * q;
+          double* t = z + 2 * b->sparse->columns[q];
+          t[0] += ar * y[0] - ai * y[1];
+          t[1] += ar * y[1] + ai * y[0];
+        }
+      }
+      else{
+        const double* y = b->matrix->data + 2 * k * b->matrix->tda;
+        for(size_t j = 0; j < rows; j++){
+          z[2 * j] += ar * y[2 * j] - ai * y[2 * j + 1];
+          z[2 * j + 1] += ar * y[2 * j + 1] + ai * y[2 * j];
+        }
+      }
+    }
+  }
+}
+
+/**lazy_combine
+  *Builds a lazy q_op of the given type from copies of a and b. Operands that are already lazy of the same type contribute their factors, so chains stay flat.
+*/
+static q_op* lazy_combine(q_op* a, q_op* b, int qubits, q_lazy_type type){
+  int count_a = a->lazy != NULL && a->lazy->type == type ? a->lazy->count : 1;
+  int count_b = b->lazy != NULL && b->lazy->type == type ? b->lazy->count : 1;
+  q_op* new_op = lazy_alloc(qubits, type, count_a + count_b);
+  q_op* operands[2] = {a, b};
+  for(int o = 0; o < 2; o++){
+    q_op* x = operands[o];
+    if(x->lazy != NULL && x->lazy->type == type){
+      for(int f = 0; f < x->lazy->count; f++){
+        new_op->lazy->factors[new_op->lazy->count++] = q_op_copy(x->lazy->factors[f]);
+      }
+    }
+    else{
+      new_op->lazy->factors[new_op->lazy->count++] = q_op_copy(x);
+    }
+  }
+  return new_op;
+}
+
+/**q_op_tensor_lazy
+  *Builds the tensor product of quantum operators a and b without evaluating it. The result keeps copies of its factors and is applied to a state factor by factor, each on its own qubits, so H (x) H (x) ... (x) H on 25 qubits costs 25 single qubit passes and no 2^25 x 2^25 matrix is ever allocated. Neither a nor b is destroyed and both must be freed by the user.
+    *a. The first q_op.
+    *b. The second q_op.
+  *Returns the lazy tensor of a and b "new_op".
+*/
+q_op* q_op_tensor_lazy(q_op* a, q_op* b){
+  return lazy_combine(a, b, a->qubits + b->qubits, Q_LAZY_TENSOR);
+}
+
+/**q_op_multiply_lazy
+  *Builds the matrix product a.b of quantum operators a and b without evaluating it. The result is applied to a state by applying b and then a. Neither a nor b is destroyed and both must be freed by the user.
+    *a. The first q_op.
+    *b. The second q_op.
+  *Returns the lazy product a.b "new_op".
+*/
+q_op* q_op_multiply_lazy(q_op* a, q_op* b){
+  if(a->qubits != b->qubits){
+    printf("Error: size mismatch in operator application. Terminating.\n");
+    exit(0);
+  }
+  return lazy_combine(a, b, a->qubits, Q_LAZY_PRODUCT);
+}
+
+/**g_state_distribution_alloc
+  *Allocates a q_state distribution struct.
+    *s. The number of states of the q_state_distribution.
+  Returns the empty state distribution "dist".
+*/
+q_state_distribution* q_state_distribution_alloc(int s){
+  q_state_distribution* dist = malloc(sizeof(q_state_distribution));
+  dist->s = s;
+  dist->states = malloc(s * sizeof(q_state));
+  dist->probabilities = malloc(s * sizeof(double));
+  return dist;
+}
+
+/**q_state_distribution_free
+  *Frees a given q_state_distribution.
+    *dist. The distribution to free.
+*/
+void q_state_distribution_free(q_state_distribution* dist){
+  for(int i = 0; i < dist->s; i++){
+    q_state_free(dist->states[i]);
+  }
+  free(dist->states);
+  free(dist->probabilities);
+  free(dist);
+}
+
+/**q_state_distribution_lazy_free
+  *Frees a given q_state_distribution, does not free individual q_states.
+    *dist. The distribution to free.
+*/
+void q_state_distribution_lazy_free(q_state_distribution* dist){
+  free(dist->states);
+  free(dist->probabilities);
+  free(dist);
+}
+
+/**measure_probabilities
+  *Computes, in one pass over the state, the total weight of the amplitudes whose masked bit is zero (p[0]) and one (p[1]). Chunked like reduce_norm so the result does not depend on the number of threads.
+*/
+static void measure_probabilities(q_state* q, size_t mask, double* p){
+  size_t dim = (size_t)1 << q->qubits;
+  size_t stride = q->vector->tda;
+  const double* amp = q->vector->data;
+  size_t chunks = (dim + Q_REDUCE_CHUNK - 1) / Q_REDUCE_CHUNK;
+  size_t per = (chunks + Q_REDUCE_PARTS - 1) / Q_REDUCE_PARTS;
+  size_t parts = (chunks + per - 1) / per;
+  double partial[2 * Q_REDUCE_PARTS];
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t s = 0; s < parts; s++){
+    double part[2] = {0.0, 0.0};
+    for(size_t c = s * per; c < (s + 1) * per && c < chunks; c++){
+      size_t end = (c + 1) * Q_REDUCE_CHUNK < dim ? (c + 1) * Q_REDUCE_CHUNK : dim;
+      double sum[2] = {0.0, 0.0};
+      for(size_t i = c * Q_REDUCE_CHUNK; i < end; i++){
+        const double* x = amp + 2 * i * stride;
+        sum[(i & mask) != 0] += x[0] * x[0] + x[1] * x[1];
+      }
+      part[0] += sum[0];
+      part[1] += sum[1];
+    }
+    partial[2 * s] = part[0];
+    partial[2 * s + 1] = part[1];
+  }
+  p[0] = 0.0;
+  p[1] = 0.0;
+  for(size_t s = 0; s < parts; s++){
+    p[0] += partial[2 * s];
+    p[1] += partial[2 * s + 1];
+  }
+}
+
+/**collapse_into
+  *Writes the branch of q in which the masked bit equals outcome into dest, scaled by scale, with every other amplitude set to zero. dest may be q itself.
+*/
+static void collapse_into(q_state* q, q_state* dest, size_t mask, int outcome, double scale){
+  size_t dim = (size_t)1 << q->qubits;
+  size_t stride = q->vector->tda;
+  size_t dest_stride = dest->vector->tda;
+  const double* amp = q->vector->data;
+  double* out = dest->vector->data;
+  size_t keep = outcome ? mask : 0;
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < dim; i++){
+    double s = (i & mask) == keep ? scale : 0.0;
+    out[2 * i * dest_stride] = amp[2 * i * stride] * s;
+    out[2 * i * dest_stride + 1] = amp[2 * i * stride + 1] * s;
+  }
+}
+
+/**qubit_mask
+  *Checks a qubit index against a state and returns its mask on the amplitude index.
+*/
+static size_t qubit_mask(q_state* q, int qubit){
+  if(qubit < 0 || qubit >= q->qubits){
+    printf("Error: qubit %d out of range in measurement. Terminating.\n", qubit);
+    exit(0);
+  }
+  return (size_t)1 << (q->qubits - 1 - qubit);
+}
+
+/**q_state_probability
+  *Computes the probability of measuring a given outcome on a qubit of a q state, relative to the state's norm.
+    *q. The q_state to measure.
+    *qubit. The qubit to measure, with qubit 0 the leftmost qubit as in q_state_apply_gate.
+    *outcome. The outcome, 0 or 1.
+  *Returns the probability p of the outcome.
+*/
+double q_state_probability(q_state* q, int qubit, int outcome){
+  double p[2];
+  measure_probabilities(q, qubit_mask(q, qubit), p);
+  return p[outcome != 0] / (p[0] + p[1]);
+}
+
+/**q_state_collapse
+  *Measures a qubit of a q state in place, keeping only the branch with the given outcome and renormalising it.
+    *q. The q_state to collapse. It is overwritten.
+    *qubit. The qubit to measure.
+    *outcome. The outcome to keep, 0 or 1.
+  *Returns the probability p of the outcome. If p is zero the state is left unchanged.
+*/
+double q_state_collapse(q_state* q, int qubit, int outcome){
+  size_t mask = qubit_mask(q, qubit);
+  double p[2];
+  measure_probabilities(q, mask, p);
+  double branch = p[outcome != 0];
+  if(branch > 0.0){
+    collapse_into(q, q, mask, outcome != 0, 1.0 / sqrt(branch));
+  }
+  return branch / (p[0] + p[1]);
+}
+
+/**q_state_measure_random
+  *Measures a qubit of a q state in place, choosing the outcome at random with its Born probability and keeping only that branch, renormalised.
+    *q. The q_state to measure. It is overwritten.
+    *qubit. The qubit to measure.
+    *rng. The random number generator to draw the outcome from.
+  *Returns the outcome, 0 or 1.
+*/
+int q_state_measure_random(q_state* q, int qubit, q_rng* rng){
+  size_t mask = qubit_mask(q, qubit);
+  double p[2];
+  measure_probabilities(q, mask, p);
+  int outcome = q_rng_uniform(rng) * (p[0] + p[1]) >= p[0];
+  collapse_into(q, q, mask, outcome, 1.0 / sqrt(p[outcome]));
+  return outcome;
+}
+
+/**measure_into
+  *Appends the non-zero probability branches of measuring q to dist, each with probability weight * p(outcome).
+*/
+static void measure_into(q_state* q, size_t mask, double weight, q_state_distribution* dist){
+  double p[2];
+  measure_probabilities(q, mask, p);
+  for(int outcome = 0; outcome < 2; outcome++){
+    if(p[outcome] > 0.0){
+      q_state* branch = q_state_alloc(q->qubits);
+      collapse_into(q, branch, mask, outcome, 1.0 / sqrt(p[outcome]));
+      dist->states[dist->s] = branch;
+      dist->probabilities[dist->s] = weight * p[outcome] / (p[0] + p[1]);
+      dist->s++;
+    }
+  }
+}
+
+/**q_state_measure
+  *Performs a measurement of a given qubit of a q state. Both outcome probabilities are computed in a single pass and each branch is produced as one renormalised copy. The measured state is not destroyed.
+    *q. The q_state to perform a measurement on.
+    *qubit. The qubit to measure, with qubit 0 the leftmost qubit as in q_state_apply_gate.
+  *Returns a probability distribution over the (at most two) post-measurement states with non-zero probability.
+*/
+q_state_distribution* q_state_measure(q_state* q, int qubit){
+  size_t mask = qubit_mask(q, qubit);
+  q_state_distribution* dist = q_state_distribution_alloc(2);
+  dist->s = 0;
+  measure_into(q, mask, 1.0, dist);
+  return dist;
+}
+
+/**q_distribution_measure
+  *Performs a measurement of a given qubit of a q distribution. Every state is measured as in q_state_measure and the branches are collected into one flat distribution, allocated once for the worst case. The measured distribution is not destroyed.
+    *q. The q_state_distribution to perform a measurement on.
+    *qubit. The qubit to measure.
+  *Returns a probability distribution over outcomes, with each branch weighted by the probability of the state it came from.
+*/
+q_state_distribution* q_distribution_measure(q_state_distribution* q, int qubit){
+  q_state_distribution* dist = q_state_distribution_alloc(2 * q->s);
+  dist->s = 0;
+  for(int i = 0; i < q->s; i++){
+    measure_into(q->states[i], qubit_mask(q->states[i], qubit), q->probabilities[i], dist);
+  }
+  return dist;
+}
+
+/**fidelity
+  *Computes the fidelity between 2 states.
+    *a. The first q_state.
+    *b. The second q_state.
+  *Returns fid, the fidelity
+*/
+double fidelity(q_state* a, q_state* b){
+  return gsl_complex_abs(q_state_inner(a, b));
+}
+
+/**q_state_inner
+  *Computes the inner product <a|b> = sum_i conj(a_i) b_i, like BLAS zdotc, reading both states in place without forming a conjugated copy.
+    *a. The first q_state.
+    *b. The second q_state.
+  *Returns the inner product "sum".
+*/
+gsl_complex q_state_inner(q_state* a, q_state* b){
+  if(a->qubits != b->qubits){
+    printf("Error: size mismatch in inner product. Terminating.\n");
+    exit(0);
+  }
+  size_t dim = (size_t)1 << a->qubits;
+  gsl_complex sum = reduce_inner(b->vector->data, b->vector->tda, a->vector->data, a->vector->tda, dim);
+  return sum;
+}
+
+/**q_state_gram
+  *Computes the Gram matrix G_ij = <s_i|s_j> of a list of states. The states are packed panel by panel into a block of Q_GRAM_PANEL rows by m columns and each panel is accumulated with a single BLAS-3 zherk call, so only Q_GRAM_PANEL * m amplitudes are ever copied at once.
+    *states. The m states, all on the same number of qubits.
+    *m. The number of states.
+  *Returns the m x m Hermitian matrix "gram".
+*/
+gsl_matrix_complex* q_state_gram(q_state** states, int m){
+  int qubits = states[0]->qubits;
+  for(int j = 1; j < m; j++){
+    if(states[j]->qubits != qubits){
+      printf("Error: size mismatch in Gram matrix. Terminating.\n");
+      exit(0);
+    }
+  }
+  size_t dim = (size_t)1 << qubits;
+  size_t rows = dim < Q_GRAM_PANEL ? dim : Q_GRAM_PANEL;
+  gsl_matrix_complex* gram = gsl_matrix_complex_calloc(m, m);
+  gsl_matrix_complex* panel = gsl_matrix_complex_alloc(rows, m);
+  for(size_t start = 0; start < dim; start += rows){
+    #pragma omp parallel for if(rows * m >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t i = 0; i < rows; i++){
+      for(int j = 0; j < m; j++){
+        const double* x = states[j]->vector->data + 2 * (start + i) * states[j]->vector->tda;
+        double* y = panel->data + 2 * (i * panel->tda + j);
+        y[0] = x[0];
+        y[1] = x[1];
+      }
+    }
+    gsl_blas_zherk(CblasUpper, CblasConjTrans, 1.0, panel, 1.0, gram);
+  }
+  gsl_matrix_complex_free(panel);
+  for(int i = 0; i < m; i++){
+    for(int j = 0; j < i; j++){
+      gsl_matrix_complex_set(gram, i, j, gsl_complex_conjugate(gsl_matrix_complex_get(gram, j, i)));
+    }
+  }
+  return gram;
+}
+
+/**q_state_fidelity_matrix
+  *Computes the fidelity between every pair of a list of states, i.e. the absolute values of their Gram matrix (see q_state_gram).
+    *states. The m states, all on the same number of qubits.
+    *m. The number of states.
+  *Returns the m x m symmetric matrix "fid" with fid_ij = fidelity(states[i], states[j]).
+*/
+gsl_matrix* q_state_fidelity_matrix(q_state** states, int m){
+  gsl_matrix_complex* gram = q_state_gram(states, m);
+  gsl_matrix* fid = gsl_matrix_alloc(m, m);
+  for(int i = 0; i < m; i++){
+    for(int j = 0; j < m; j++){
+      gsl_matrix_set(fid, i, j, gsl_complex_abs(gsl_matrix_complex_get(gram, i, j)));
+    }
+  }
+  gsl_matrix_complex_free(gram);
+  return fid;
+}
+
+/**gate_clear
+  *Frees everything a recorded q_gate owns except its op.
+*/
+static void gate_clear(q_gate* gate){
+  free(gate->targets);
+  free(gate->masks);
+  if(gate->diagonal != NULL){
+    gsl_vector_complex_free(gate->diagonal);
+  }
+  free(gate->permutation);
+}
+
+/**gate_classify
+  *Sets the type of a recorded q_gate from its op, precomputing the permutation or diagonal its fast kernel needs. Sparse ops are not scanned, which would cost 4^k, and run with the CSR kernel.
+*/
+static void gate_classify(q_gate* gate){
+  q_op* op = gate->op;
+  gate->type = Q_GATE_DENSE;
+  gate->diagonal = NULL;
+  gate->permutation = NULL;
+  if(op->sparse != NULL){
+    gate->type = Q_GATE_SPARSE;
+  }
+  else if(q_op_is_permutation(op)){
+    gate->type = Q_GATE_PERMUTATION;
+    gate->permutation = malloc(op->matrix->size2 * sizeof(int));
+    for(int j = 0; j < op->matrix->size2; j++){
+      for(int i = 0; i < op->matrix->size1; i++){
+        if(GSL_REAL(gsl_matrix_complex_get(op->matrix, i, j)) == 1.0) gate->permutation[j] = i;
+      }
+    }
+  }
+  else if(q_op_is_diagonal(op)){
+    gate->type = Q_GATE_DIAGONAL;
+    gate->diagonal = gsl_vector_complex_alloc(op->matrix->size1);
+    for(int i = 0; i < op->matrix->size1; i++){
+      gsl_vector_complex_set(gate->diagonal, i, gsl_matrix_complex_get(op->matrix, i, i));
+    }
+  }
+  else if(q_op_is_controlled(op)){
+    gate->type = Q_GATE_CONTROLLED;
+  }
+}
+
+/**q_circuit_alloc
+  *Allocates an empty q_circuit.
+    *qubits. The number of qubits the circuit acts on.
+  Returns the empty circuit "circuit".
+*/
+q_circuit* q_circuit_alloc(int qubits){
+  q_circuit* circuit = malloc(sizeof(q_circuit));
+  circuit->qubits = qubits;
+  circuit->gates = 0;
+  circuit->capacity = 16;
+  circuit->gate_list = malloc(circuit->capacity * sizeof(q_gate));
+  return circuit;
+}
+
+/**q_circuit_free
+  *Frees a given q_circuit and every q_op recorded in it.
+    *circuit. The circuit to free.
+*/
+void q_circuit_free(q_circuit* circuit){
+  for(int i = 0; i < circuit->gates; i++){
+    q_op_free(circuit->gate_list[i].op);
+    gate_clear(&circuit->gate_list[i]);
+  }
+  free(circuit->gate_list);
+  free(circuit);
+}
+
+/**q_circuit_add
+  *Records a gate at the end of a circuit. The circuit takes ownership of the op, which is freed by q_circuit_free, so gates can be added straight from their constructors, e.g. q_circuit_add(c, q_hadamard(), (int[]){0}, 1).
+    *circuit. The circuit to add the gate to.
+    *op. The k-qubit q_op to record. A sparse op on at least Q_SPARSE_QUBITS qubits is kept sparse and runs in CSR form; smaller sparse ops are converted to dense storage. A lazy op is recorded as one gate per factor.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_circuit_add(q_circuit* circuit, q_op* op, const int* targets, int k){
+  if(op->qubits != k || k > circuit->qubits){
+    printf("Error: size mismatch in circuit construction. Terminating.\n");
+    exit(0);
+  }
+  if(op->lazy != NULL){
+    q_lazy* lazy = op->lazy;
+    if(lazy->type == Q_LAZY_TENSOR){
+      for(int f = 0; f < lazy->count; f++){
+        q_circuit_add(circuit, lazy->factors[f], targets, lazy->factors[f]->qubits);
+        targets += lazy->factors[f]->qubits;
+      }
+    }
+    else{
+      for(int f = lazy->count - 1; f >= 0; f--){
+        q_circuit_add(circuit, lazy->factors[f], targets, k);
+      }
+    }
+    free(lazy->factors);
+    free(lazy);
+    free(op);
+    return;
+  }
+  if(op->qubits < Q_SPARSE_QUBITS) q_op_densify(op);
+  if(circuit->gates == circuit->capacity){
+    circuit->capacity *= 2;
+    circuit->gate_list = realloc(circuit->gate_list, circuit->capacity * sizeof(q_gate));
+  }
+  q_gate* gate = &circuit->gate_list[circuit->gates];
+  gate->op = op;
+  gate->k = k;
+  gate->targets = malloc(k * sizeof(int));
+  gate->masks = malloc(2 * k * sizeof(size_t));
+  for(int i = 0; i < k; i++){
+    gate->targets[i] = targets[i];
+  }
+  q_gate_masks(circuit->qubits, targets, k, gate->masks, gate->masks + k);
+  gate_classify(gate);
+  circuit->gates++;
+}
+
+/**q_circuit_set_gate
+  *Replaces the q_op of a recorded gate, keeping its targets and position, e.g. to change the angle of a rotation without rebuilding the circuit. The gate is classified again, so the new op runs with the fastest kernel that fits it.
+    *circuit. The circuit.
+    *index. The index of the gate, from 0 to gates - 1.
+    *op. The new k-qubit q_op, on as many qubits as the old one. The circuit takes ownership of it and frees the old one. Sparse ops are stored as in q_circuit_add; lazy ops are not accepted.
+*/
+void q_circuit_set_gate(q_circuit* circuit, int index, q_op* op){
+  if(index < 0 || index >= circuit->gates){
+    printf("Error: gate %d out of range. Terminating.\n", index);
+    exit(0);
+  }
+  q_gate* gate = &circuit->gate_list[index];
+  if(op->qubits != gate->k || op->lazy != NULL){
+    printf("Error: size mismatch in gate replacement. Terminating.\n");
+    exit(0);
+  }
+  if(op->qubits < Q_SPARSE_QUBITS) q_op_densify(op);
+  q_op_free(gate->op);
+  if(gate->diagonal != NULL){
+    gsl_vector_complex_free(gate->diagonal);
+  }
+  free(gate->permutation);
+  gate->op = op;
+  gate_classify(gate);
+}
+
+/**q_circuit_run
+  *Executes every recorded gate of a circuit, in order, against a state in place. No memory is allocated while the circuit runs, apart from one block buffer per thread for sparse gates.
+    *circuit. The circuit to execute.
+    *state. The state to apply the circuit to. It is overwritten.
+*/
+void q_circuit_run(q_circuit* circuit, q_state* state){
+  q_circuit_run_range(circuit, state, 0, circuit->gates);
+}
+
+/**q_circuit_run_range
+  *Executes the recorded gates first to last - 1 of a circuit, in order, against a state in place, so callers can interleave their own operations between gates. No memory is allocated, apart from one block buffer per thread for sparse gates.
+    *circuit. The circuit to execute.
+    *state. The state to apply the gates to. It is overwritten.
+    *first. The index of the first gate to run.
+    *last. One past the index of the last gate to run.
+*/
+void q_circuit_run_range(q_circuit* circuit, q_state* state, int first, int last){
+  if(circuit->qubits != state->qubits){
+    printf("Error: size mismatch in circuit execution. Terminating.\n");
+    exit(0);
+  }
+  if(first < 0 || last > circuit->gates || first > last){
+    printf("Error: invalid gate range in circuit execution. Terminating.\n");
+    exit(0);
+  }
+  for(int i = first; i < last; i++){
+    q_gate* gate = &circuit->gate_list[i];
+    if(gate->type == Q_GATE_DIAGONAL){
+      apply_diagonal_masks(state, gate->diagonal, gate->masks, gate->masks + gate->k, gate->k);
+    }
+    else if(gate->type == Q_GATE_PERMUTATION){
+      apply_permutation_masks(state, gate->permutation, gate->masks, gate->masks + gate->k, gate->k);
+    }
+    else if(gate->type == Q_GATE_CONTROLLED){
+      q_op* op = gate->op;
+      apply_controlled_masks(state, op->matrix->data + 2 * (2 * op->matrix->tda + 2), op->matrix->tda, gate->masks);
+    }
+    else if(gate->type == Q_GATE_SPARSE){
+      apply_sparse_k(state->vector->data, state->vector->tda, (size_t)1 << state->qubits, gate->op->sparse, gate->masks, gate->masks + gate->k, gate->k);
+    }
+    else{
+      apply_gate_masks(state, gate->op, gate->masks, gate->masks + gate->k, gate->k);
+    }
+  }
+}
+
+/**run_columns
+  *Runs every recorded gate of a circuit over all columns of a matrix whose rows are indexed by the amplitude index. Diagonal gates scale whole rows; all other gates go through apply_gate_columns, sparse ones as a dense copy.
+*/
+static void run_columns(q_circuit* circuit, gsl_matrix_complex* m){
+  size_t rows = m->size1;
+  size_t cols = m->size2;
+  for(int g = 0; g < circuit->gates; g++){
+    q_gate* gate = &circuit->gate_list[g];
+    if(gate->type == Q_GATE_DIAGONAL){
+      const size_t* masks = gate->masks;
+      int k = gate->k;
+      #pragma omp parallel for if(rows * cols >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+      for(size_t i = 0; i < rows; i++){
+        size_t local = 0;
+        for(int j = 0; j < k; j++){
+          local = (local << 1) | ((i & masks[j]) != 0);
+        }
+        const double* p = gate->diagonal->data + 2 * local * gate->diagonal->stride;
+        if(p[0] == 1.0 && p[1] == 0.0) continue;
+        double* x = m->data + 2 * i * m->tda;
+        for(size_t c = 0; c < cols; c++){
+          double re = x[2 * c], im = x[2 * c + 1];
+          x[2 * c] = p[0] * re - p[1] * im;
+          x[2 * c + 1] = p[0] * im + p[1] * re;
+        }
+      }
+    }
+    else if(gate->type == Q_GATE_SPARSE){
+      //The columns already hold 4^n entries, so a dense copy of the gate costs nothing extra.
+      q_op* dense = q_op_copy(gate->op);
+      q_op_densify(dense);
+      apply_gate_columns(m, dense, gate->masks, gate->masks + gate->k, gate->k);
+      q_op_free(dense);
+    }
+    else{
+      apply_gate_columns(m, gate->op, gate->masks, gate->masks + gate->k, gate->k);
+    }
+  }
+}
+
+/**q_circuit_unitary
+  *Computes the unitary of a circuit by running every basis column through the recorded gates with the in-place kernels. The cost is about gates * 4^n operations with a single 2^n x 2^n allocation, instead of a dense product per gate. Useful for checking that two circuits are equivalent.
+    *circuit. The circuit.
+  Returns the circuit's unitary "op", where the first gate added is applied first.
+*/
+q_op* q_circuit_unitary(q_circuit* circuit){
+  q_op* op = q_op_alloc(circuit->qubits);
+  gsl_matrix_complex_set_identity(op->matrix);
+  run_columns(circuit, op->matrix);
+  return op;
+}
+
+/**q_circuit_fuse
+  *Greedily merges runs of consecutive gates into single dense gates on at most max_qubits qubits, so that executing the circuit makes fewer passes over the state vector. Gates keep their relative order, so the circuit's action is unchanged. Values of 4 or 5 work well; larger blocks cost 2^max_qubits operations per amplitude. Runs of diagonal gates may grow up to Q_FUSE_DIAGONAL_QUBITS qubits, since they still run as a single phase pass. Sparse gates are kept as they are and end the run before them.
+    *circuit. The circuit to fuse. Its gate list is replaced by the fused one.
+    *max_qubits. The largest number of qubits a fused gate may act on.
+*/
+void q_circuit_fuse(q_circuit* circuit, int max_qubits){
+  q_circuit* fused = q_circuit_alloc(circuit->qubits);
+  q_op* block = NULL;
+  int block_qubits[circuit->qubits];
+  int m = 0;
+  int block_diagonal = 0;
+  for(int i = 0; i < circuit->gates; i++){
+    q_gate* gate = &circuit->gate_list[i];
+    if(gate->type == Q_GATE_SPARSE){
+      //Sparse gates are too wide to merge with anything; close the current block and keep the gate as it is.
+      if(block != NULL){
+        q_circuit_add(fused, block, block_qubits, m);
+        block = NULL;
+        m = 0;
+      }
+      q_circuit_add(fused, gate->op, gate->targets, gate->k);
+      gate_clear(gate);
+      continue;
+    }
+    int qubits[circuit->qubits];
+    int u = m;
+    for(int j = 0; j < m; j++){
+      qubits[j] = block_qubits[j];
+    }
+    for(int j = 0; j < gate->k; j++){
+      int found = 0;
+      for(int l = 0; l < m; l++){
+        if(block_qubits[l] == gate->targets[j]) found = 1;
+      }
+      if(!found){
+        qubits[u++] = gate->targets[j];
+      }
+    }
+    int diagonal = block_diagonal && gate->type == Q_GATE_DIAGONAL;
+    if(block != NULL && (u <= max_qubits || (diagonal && u <= Q_FUSE_DIAGONAL_QUBITS))){
+      //Widen the block onto any new qubits, which are appended as its rightmost qubits, then left-multiply by the gate.
+      if(u > m){
+        q_op* id = q_op_alloc(u - m);
+        gsl_matrix_complex_set_identity(id->matrix);
+        q_op* wide = q_op_tensor(block, id);
+        q_op_densify(wide);
+        q_op_free(id);
+        q_op_free(block);
+        block = wide;
+      }
+      int local[gate->k];
+      for(int j = 0; j < gate->k; j++){
+        for(int l = 0; l < u; l++){
+          if(qubits[l] == gate->targets[j]) local[j] = l;
+        }
+      }
+      size_t masks[gate->k];
+      size_t sorted[gate->k];
+      q_gate_masks(u, local, gate->k, masks, sorted);
+      apply_gate_columns(block->matrix, gate->op, masks, sorted, gate->k);
+      q_op_free(gate->op);
+      for(int j = 0; j < u; j++){
+        block_qubits[j] = qubits[j];
+      }
+      m = u;
+      block_diagonal = diagonal;
+    }
+    else{
+      if(block != NULL){
+        q_circuit_add(fused, block, block_qubits, m);
+      }
+      block = gate->op;
+      m = gate->k;
+      for(int j = 0; j < m; j++){
+        block_qubits[j] = gate->targets[j];
+      }
+      block_diagonal = gate->type == Q_GATE_DIAGONAL;
+    }
+    gate_clear(gate);
+  }
+  if(block != NULL){
+    q_circuit_add(fused, block, block_qubits, m);
+  }
+  free(circuit->gate_list);
+  circuit->gate_list = fused->gate_list;
+  circuit->gates = fused->gates;
+  circuit->capacity = fused->capacity;
+  free(fused);
+}
+
+/**q_state_batch_alloc
+  *Allocates a batch of states on the same qubits, stored as the columns of one 2^n x count block so that operators and gates update every state in the same pass.
+    *qubits. The number of qubits of each state.
+    *count. The number of states.
+  Returns the generated batch "batch"
+*/
+q_state_batch* q_state_batch_alloc(int qubits, int count){
+  q_state_batch* batch = malloc(sizeof(q_state_batch));
+  batch->qubits = qubits;
+  batch->count = count;
+  batch->block = gsl_matrix_complex_alloc((size_t)1 << qubits, count);
+  return batch;
+}
+
+/**q_state_batch_free
+  *Frees a given batch.
+    *batch. The batch to free.
+*/
+void q_state_batch_free(q_state_batch* batch){
+  gsl_matrix_complex_free(batch->block);
+  free(batch);
+}
+
+/**batch_index
+  *Checks that a state index is in range for a batch.
+*/
+static void batch_index(q_state_batch* batch, int b){
+  if(b < 0 || b >= batch->count){
+    printf("Error: state %d out of range in batch. Terminating.\n", b);
+    exit(0);
+  }
+}
+
+/**q_state_batch_set
+  *Copies a state into one column of a batch.
+    *batch. The batch.
+    *b. The index of the state in the batch.
+    *state. The state to copy. It is not destroyed.
+*/
+void q_state_batch_set(q_state_batch* batch, int b, q_state* state){
+  batch_index(batch, b);
+  if(state->qubits != batch->qubits){
+    printf("Error: size mismatch in batch. Terminating.\n");
+    exit(0);
+  }
+  gsl_vector_complex_const_view column = gsl_matrix_complex_const_column(state->vector, 0);
+  gsl_matrix_complex_set_col(batch->block, b, &column.vector);
+}
+
+/**q_state_batch_get
+  *Copies one state out of a batch.
+    *batch. The batch.
+    *b. The index of the state in the batch.
+  Returns the copied state "state", which must be freed by the user.
+*/
+q_state* q_state_batch_get(q_state_batch* batch, int b){
+  batch_index(batch, b);
+  q_state* state = q_state_alloc(batch->qubits);
+  gsl_vector_complex_view column = gsl_matrix_complex_column(state->vector, 0);
+  gsl_matrix_complex_get_col(&column.vector, batch->block, b);
+  return state;
+}
+
+/**q_state_batch_apply_gate
+  *Applies a k-qubit q_op to the given target qubits of every state of a batch in place, as q_state_apply_gate does for one state.
+    *batch. The batch to apply the gate to. It is overwritten.
+    *gate. The k-qubit q_op to apply. Lazy gates are applied factor by factor; a sparse gate is expanded to a dense copy.
+    *targets. The k distinct target qubits.
+    *k. The number of target qubits.
+*/
+void q_state_batch_apply_gate(q_state_batch* batch, q_op* gate, const int* targets, int k){
+  if(gate->qubits != k || k > batch->qubits){
+    printf("Error: size mismatch in gate application. Terminating.\n");
+    exit(0);
+  }
+  if(gate->lazy != NULL){
+    if(gate->lazy->type == Q_LAZY_TENSOR){
+      for(int f = 0; f < gate->lazy->count; f++){
+        q_state_batch_apply_gate(batch, gate->lazy->factors[f], targets, gate->lazy->factors[f]->qubits);
+        targets += gate->lazy->factors[f]->qubits;
+      }
+    }
+    else{
+      for(int f = gate->lazy->count - 1; f >= 0; f--){
+        q_state_batch_apply_gate(batch, gate->lazy->factors[f], targets, k);
+      }
+    }
+    return;
+  }
+  size_t masks[k];
+  size_t sorted[k];
+  q_gate_masks(batch->qubits, targets, k, masks, sorted);
+  if(gate->sparse != NULL){
+    q_op* dense = q_op_copy(gate);
+    q_op_densify(dense);
+    apply_gate_columns(batch->block, dense, masks, sorted, k);
+    q_op_free(dense);
+  }
+  else{
+    apply_gate_columns(batch->block, gate, masks, sorted, k);
+  }
+}
+
+/**apply_qop_batch
+  *Applies a q_op operator to every state of a batch. The old batch is not destroyed and must be freed by the user. Dense operators use a single matrix-matrix product over the whole batch, sparse operators a sparse product over the rows and lazy operators q_state_batch_apply_gate.
+    *op. The q_op to apply.
+    *batch. The batch to apply the q_op to.
+  Returns new_batch
+*/
+q_state_batch* apply_qop_batch(q_op* op, q_state_batch* batch){
+  if(op->qubits != batch->qubits){
+    printf("Error: size mismatch in operator application. Terminating.\n");
+    exit(0);
+  }
+  q_state_batch* new_batch = q_state_batch_alloc(batch->qubits, batch->count);
+  if(op->lazy != NULL){
+    int targets[op->qubits];
+    for(int i = 0; i < op->qubits; i++){
+      targets[i] = i;
+    }
+    gsl_matrix_complex_memcpy(new_batch->block, batch->block);
+    q_state_batch_apply_gate(new_batch, op, targets, op->qubits);
+  }
+  else if(op->sparse != NULL){
+    size_t rows = (size_t)1 << op->qubits;
+    size_t cols = batch->count;
+    q_sparse* sp = op->sparse;
+    const gsl_matrix_complex* x = batch->block;
+    gsl_matrix_complex* y = new_batch->block;
+    #pragma omp parallel for if(sp->nonzeros * cols >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t i = 0; i < rows; i++){
+      double* out = y->data + 2 * i * y->tda;
+      for(size_t c = 0; c < 2 * cols; c++){
+        out[c] = 0.0;
+      }
+      for(size_t nz = sp->row_start[i]; nz < sp->row_start[i + 1]; nz++){
+        double vr = sp->values[2 * nz], vi = sp->values[2 * nz + 1];
+        const double* in = x->data + 2 * sp->columns[nz] * x->tda;
+        for(size_t c = 0; c < cols; c++){
+          out[2 * c] += vr * in[2 * c] - vi * in[2 * c + 1];
+          out[2 * c + 1] += vr * in[2 * c + 1] + vi * in[2 * c];
+        }
+      }
+    }
+  }
+  else{
+    gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, GSL_COMPLEX_ONE, op->matrix, batch->block, GSL_COMPLEX_ZERO, new_batch->block);
+  }
+  return new_batch;
+}
+
+/**q_circuit_run_batch
+  *Executes every recorded gate of a circuit, in order, against every state of a batch in place.
+    *circuit. The circuit to execute.
+    *batch. The batch to apply the circuit to. It is overwritten.
+*/
+void q_circuit_run_batch(q_circuit* circuit, q_state_batch* batch){
+  if(circuit->qubits != batch->qubits){
+    printf("Error: size mismatch in circuit execution. Terminating.\n");
+    exit(0);
+  }
+  run_columns(circuit, batch->block);
+}
+
+/**q_state_batch_fidelity
+  *Computes the fidelity |<a|b>| between a state and every state of a batch, with a single matrix-vector product.
+    *batch. The batch.
+    *state. The state to compare against.
+  *Returns the vector of fidelities "f", where f_b is the fidelity of state b. It must be freed by the user.
+*/
+gsl_vector* q_state_batch_fidelity(q_state_batch* batch, q_state* state){
+  if(state->qubits != batch->qubits){
+    printf("Error: size mismatch in fidelity. Terminating.\n");
+    exit(0);
+  }
+  gsl_vector_complex* inner = gsl_vector_complex_alloc(batch->count);
+  gsl_vector_complex_const_view column = gsl_matrix_complex_const_column(state->vector, 0);
+  gsl_blas_zgemv(CblasConjTrans, GSL_COMPLEX_ONE, batch->block, &column.vector, GSL_COMPLEX_ZERO, inner);
+  gsl_vector* f = gsl_vector_alloc(batch->count);
+  for(int b = 0; b < batch->count; b++){
+    gsl_vector_set(f, b, gsl_complex_abs(gsl_vector_complex_get(inner, b)));
+  }
+  gsl_vector_complex_free(inner);
+  return f;
+}
+
+/**batch_probabilities
+  *Computes the unnormalised weights of both outcomes of the masked qubit for every state of a batch. p[2 * b + outcome] receives the weight of state b. Groups of Q_REDUCE_COLUMNS states make one pass over the rows each, chunked like reduce_norm with at most Q_REDUCE_PARTS runs of chunks per state in a stack buffer, so the result does not depend on the number of threads and nothing is allocated.
+*/
+static void batch_probabilities(q_state_batch* batch, size_t mask, double* p){
+  size_t rows = (size_t)1 << batch->qubits;
+  size_t cols = batch->count;
+  const gsl_matrix_complex* m = batch->block;
+  size_t chunks = (rows + Q_REDUCE_CHUNK - 1) / Q_REDUCE_CHUNK;
+  size_t per = (chunks + Q_REDUCE_PARTS - 1) / Q_REDUCE_PARTS;
+  size_t parts = (chunks + per - 1) / per;
+  double partial[2 * Q_REDUCE_PARTS * Q_REDUCE_COLUMNS];
+  for(size_t first = 0; first < cols; first += Q_REDUCE_COLUMNS){
+    size_t group = cols - first < Q_REDUCE_COLUMNS ? cols - first : Q_REDUCE_COLUMNS;
+    #pragma omp parallel for if(rows * group >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t s = 0; s < parts; s++){
+      double* part = partial + 2 * s * Q_REDUCE_COLUMNS;
+      for(size_t b = 0; b < 2 * group; b++){
+        part[b] = 0.0;
+      }
+      for(size_t c = s * per; c < (s + 1) * per && c < chunks; c++){
+        size_t end = (c + 1) * Q_REDUCE_CHUNK < rows ? (c + 1) * Q_REDUCE_CHUNK : rows;
+        double sum[2 * Q_REDUCE_COLUMNS] = {0.0};
+        for(size_t i = c * Q_REDUCE_CHUNK; i < end; i++){
+          const double* x = m->data + 2 * (i * m->tda + first);
+          int bit = (i & mask) != 0;
+          for(size_t b = 0; b < group; b++){
+            sum[2 * b + bit] += x[2 * b] * x[2 * b] + x[2 * b + 1] * x[2 * b + 1];
+          }
+        }
+        for(size_t b = 0; b < 2 * group; b++){
+          part[b] += sum[b];
+        }
+      }
+    }
+    for(size_t b = 0; b < 2 * group; b++){
+      p[2 * first + b] = 0.0;
+    }
+    for(size_t s = 0; s < parts; s++){
+      for(size_t b = 0; b < 2 * group; b++){
+        p[2 * first + b] += partial[2 * s * Q_REDUCE_COLUMNS + b];
+      }
+    }
+  }
+}
+
+/**batch_mask
+  *Converts a qubit of a batch to its amplitude index mask.
+*/
+static size_t batch_mask(q_state_batch* batch, int qubit){
+  if(qubit < 0 || qubit >= batch->qubits){
+    printf("Error: qubit %d out of range in measurement. Terminating.\n", qubit);
+    exit(0);
+  }
+  return (size_t)1 << (batch->qubits - 1 - qubit);
+}
+
+/**q_state_batch_probability
+  *Computes, for every state of a batch, the probability that measuring a qubit gives a given outcome, in a single pass over the batch.
+    *batch. The batch. It is not changed.
+    *qubit. The qubit to measure.
+    *outcome. The outcome, 0 or 1.
+  *Returns the vector of probabilities "p", where p_b belongs to state b. It must be freed by the user.
+*/
+gsl_vector* q_state_batch_probability(q_state_batch* batch, int qubit, int outcome){
+  double* w = malloc(2 * batch->count * sizeof(double));
+  batch_probabilities(batch, batch_mask(batch, qubit), w);
+  gsl_vector* p = gsl_vector_alloc(batch->count);
+  for(int b = 0; b < batch->count; b++){
+    gsl_vector_set(p, b, w[2 * b + (outcome != 0)] / (w[2 * b] + w[2 * b + 1]));
+  }
+  free(w);
+  return p;
+}
+
+/**q_state_batch_measure_random
+  *Measures a qubit of every state of a batch, draws each outcome from its probability and collapses every state onto its outcome in place. State b uses its own counter of the generator, so the outcomes do not depend on the number of threads.
+    *batch. The batch to measure. It is overwritten.
+    *qubit. The qubit to measure.
+    *rng. The random number generator. It is advanced past the counters used.
+    *outcomes. Output, the outcome of every state.
+*/
+void q_state_batch_measure_random(q_state_batch* batch, int qubit, q_rng* rng, int* outcomes){
+  size_t mask = batch_mask(batch, qubit);
+  size_t rows = (size_t)1 << batch->qubits;
+  size_t cols = batch->count;
+  double* w = malloc(2 * cols * sizeof(double));
+  double* scale = malloc(cols * sizeof(double));
+  batch_probabilities(batch, mask, w);
+  for(size_t b = 0; b < cols; b++){
+    double u[2];
+    q_rng_uniform_at(rng, rng->counter + b, u);
+    outcomes[b] = u[0] * (w[2 * b] + w[2 * b + 1]) >= w[2 * b];
+    scale[b] = 1.0 / sqrt(w[2 * b + outcomes[b]]);
+  }
+  rng->counter += cols;
+  gsl_matrix_complex* m = batch->block;
+  #pragma omp parallel for if(rows * cols >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < rows; i++){
+    double* x = m->data + 2 * i * m->tda;
+    int bit = (i & mask) != 0;
+    for(size_t b = 0; b < cols; b++){
+      double s = outcomes[b] == bit ? scale[b] : 0.0;
+      x[2 * b] *= s;
+      x[2 * b + 1] *= s;
+    }
+  }
+  free(w);
+  free(scale);
 }
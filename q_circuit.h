@@ -4,10 +4,57 @@
 #include <gsl/gsl_complex_math.h>
 #include <gsl/gsl_blas.h>
 #include <math.h>
+#include "q_simd.h"
+#include "q_rng.h"
 
+//States with fewer qubits than this are processed on a single thread.
+#define Q_PARALLEL_QUBITS 14
+#define Q_PARALLEL_MIN ((size_t)1 << Q_PARALLEL_QUBITS)
+
+//Number of amplitudes summed per chunk by reductions. Chunk sums are added in order, so results do not depend on the number of threads.
+#define Q_REDUCE_CHUNK ((size_t)1 << 12)
+
+//Largest number of partial sums a reduction keeps, in a buffer on the stack so that reductions never allocate. Larger states add runs of consecutive chunks into each partial sum, still in a fixed order.
+#define Q_REDUCE_PARTS 256
+
+//Number of states of a batch reduced together by the batch measurements, so their partial sums fit in the same stack buffer.
+#define Q_REDUCE_COLUMNS 16
+
+//Number of amplitudes per state packed at a time by q_state_gram.
+#define Q_GRAM_PANEL 4096
+
+//Operators on at least this many qubits with at most this fraction of non-zero entries are stored sparse by q_op_tensor, q_op_multiply, q_identity and q_swap.
+#define Q_SPARSE_QUBITS 8
+#define Q_SPARSE_DENSITY 0.1
+
+//Compressed sparse row storage: the non-zeros of row i are entries row_start[i] to row_start[i + 1] - 1 of columns and values, in increasing column order. values holds interleaved real and imaginary parts.
+typedef struct q_sparse{
+  size_t* row_start;
+  size_t* columns;
+  double* values;
+  size_t nonzeros;
+} q_sparse;
+
+typedef enum q_lazy_type{
+  Q_LAZY_TENSOR,
+  Q_LAZY_PRODUCT
+} q_lazy_type;
+
+struct q_op;
+
+//Unevaluated operator: the tensor product factors[0] (x) factors[1] (x) ... or the matrix product factors[0] . factors[1] . ... of owned factors.
+typedef struct q_lazy{
+  struct q_op** factors;
+  int count;
+  q_lazy_type type;
+} q_lazy;
+
+//Exactly one of matrix, sparse and lazy is set.
 typedef struct q_op{
   gsl_matrix_complex* matrix;
   int qubits;
+  q_sparse* sparse;
+  q_lazy* lazy;
 } q_op;
 
 typedef struct q_state{
@@ -15,14 +62,63 @@ typedef struct q_state{
   int qubits;
 } q_state;
 
+//count states on the same qubits, stored as the columns of block (2^qubits x count).
+typedef struct q_state_batch{
+  gsl_matrix_complex* block;
+  int qubits;
+  int count;
+} q_state_batch;
+
+//Number of columns updated together by q_circuit_unitary and q_circuit_fuse.
+#define Q_COLUMN_BATCH 64
+
+//Largest number of qubits a run of diagonal gates is merged onto by q_circuit_fuse.
+#define Q_FUSE_DIAGONAL_QUBITS 8
+
+typedef enum q_gate_type{
+  Q_GATE_DENSE,
+  Q_GATE_DIAGONAL,
+  Q_GATE_PERMUTATION,
+  Q_GATE_CONTROLLED,
+  Q_GATE_SPARSE
+} q_gate_type;
+
+typedef struct q_gate{
+  q_op* op;
+  int* targets;
+  size_t* masks;
+  int k;
+  q_gate_type type;
+  gsl_vector_complex* diagonal;
+  int* permutation;
+} q_gate;
+
+typedef struct q_circuit{
+  q_gate* gate_list;
+  int gates;
+  int capacity;
+  int qubits;
+} q_circuit;
+
 typedef struct q_state_distribution{
   int s;
   q_state** states;
   double* probabilities;
 } q_state_distribution;
 
+/**q_set_threads
+  *Sets the number of threads used by the state vector kernels. Has no effect unless the library is compiled with OpenMP (-fopenmp).
+    *threads. The number of threads, or 0 to use the OpenMP default.
+*/
+void q_set_threads(int threads);
+
+/**q_get_threads
+  *Returns the number of threads used by the state vector kernels, which is 1 when the library is compiled without OpenMP.
+*/
+int q_get_threads();
+
 /**g_state_alloc
-  *Allocates a q_state struct.
+  *Allocates a q_state struct. The amplitudes are stored contiguously (interleaved real and imaginary parts) in a buffer aligned to Q_ALIGNMENT bytes, so the vectorised kernels of q_simd can work on them directly.
     *qubits. The number of qubits of the q_state.
   Returns the empty state "state".
 */
@@ -41,7 +137,6 @@ q_state* q_state_calloc(int qubits);
 */
 void q_state_free(q_state* state);
 
-
 /**q_state_normalize
   *Normalizes a given q_state
     *state. The state to normalize.
@@ -55,6 +150,13 @@ void q_state_normalize(q_state* state);
 */
 q_state* q_complex_conjugate(q_state* q);
 
+/**q_complex_conjugate_into
+  *Computes the complex conjugate of a q state into an existing state, without allocating.
+    *q. The state to compute the complex conjugate of.
+    *out. The destination, on the same number of qubits. It may be q itself, which is then conjugated in place.
+*/
+void q_complex_conjugate_into(q_state* q, q_state* out);
+
 /**q_state_print
   *Prints a q_state.
     *state. The state to print.
@@ -75,12 +177,68 @@ q_op* q_op_alloc(int qubits);
 */
 q_op* q_op_calloc(int qubits);
 
+/**q_op_sparse_alloc
+  *Allocates a q_op struct with CSR storage for the given number of non-zeros. row_start is zeroed; the caller fills in row_start, columns (increasing within each row) and values.
+    *qubits. The number of qubits that the q_op operates on.
+    *nonzeros. The number of non-zero entries.
+  Returns the generated operator "op"
+*/
+q_op* q_op_sparse_alloc(int qubits, size_t nonzeros);
+
+/**q_op_is_sparse
+  *Checks whether a q_op uses sparse (CSR) storage.
+    *op. The q_op to check.
+  *Returns 1 if it is sparse and 0 otherwise.
+*/
+int q_op_is_sparse(q_op* op);
+
+/**q_op_sparsify
+  *Converts a q_op to sparse (CSR) storage in place. Does nothing if it is already sparse. Lazy operators are evaluated first.
+    *op. The op to convert.
+*/
+void q_op_sparsify(q_op* op);
+
+/**q_op_densify
+  *Converts a q_op to dense storage in place. Does nothing if it is already dense. Lazy operators are evaluated, which allocates the full matrix.
+    *op. The op to convert.
+*/
+void q_op_densify(q_op* op);
+
+/**q_op_select
+  *Picks the storage of a q_op from its size and density: operators on at least Q_SPARSE_QUBITS qubits with at most a Q_SPARSE_DENSITY fraction of non-zeros are stored sparse, everything else dense. Lazy operators are left lazy.
+    *op. The op to convert.
+*/
+void q_op_select(q_op* op);
+
+/**q_op_get
+  *Gets an entry of a q_op, whichever storage it uses. Entries of lazy products cost a vector-matrix product per factor.
+    *op. The op.
+    *i. The row.
+    *j. The column.
+  *Returns the entry "q".
+*/
+gsl_complex q_op_get(q_op* op, size_t i, size_t j);
+
 /**q_op_free
   *Frees a given q_op.
     *op. The state to op.
 */
 void q_op_free(q_op* op);
 
+/**q_op_copy
+  *Copies a q_op, keeping its storage (dense, sparse or lazy).
+    *op. The op to copy.
+  Returns the copy "new_op"
+*/
+q_op* q_op_copy(q_op* op);
+
+/**q_op_is_lazy
+  *Checks whether a q_op is a lazy tensor or matrix product of factors.
+    *op. The q_op to check.
+  *Returns 1 if it is lazy and 0 otherwise.
+*/
+int q_op_is_lazy(q_op* op);
+
 /**q_op_print
   *Prints a q_op.
     *op. The op to print.
@@ -88,13 +246,136 @@ void q_op_free(q_op* op);
 void q_op_print(q_op* op);
 
 /**apply_qop
-  *Applies a q_op operator to a state. The old state is not destroyed and must be freed by the user.
+  *Applies a q_op operator to a state. The old state is not destroyed and must be freed by the user. This operation is effectively op * state using matrix multiplication; sparse operators use a sparse matrix-vector product that costs time proportional to their non-zeros, and lazy operators are applied factor by factor with q_state_apply_gate.
     *op. The q_op to apply.
     *state. The state to apply the q_op to.
   Returns new_state
 */
 q_state* apply_qop(q_op* op, q_state* state);
 
+/**apply_qop_into
+  *Applies a q_op operator to a state like apply_qop, but writes op * state into an existing state instead of allocating one, so loops can reuse their buffers.
+    *op. The q_op to apply.
+    *state. The state to apply the q_op to. It is not changed.
+    *out. The destination, on the same number of qubits and distinct from state. It is overwritten.
+*/
+void apply_qop_into(q_op* op, q_state* state, q_state* out);
+
+/**q_state_apply_gate
+  *Applies a k-qubit q_op to the given target qubits of a state in place, without building the full operator on all qubits. Qubit 0 is the leftmost qubit of the state (as in q_state_tensor) and targets[0] is the leftmost qubit of the gate, so q_cX applied to {2, 0} is a CNOT controlled by qubit 2 targeting qubit 0.
+    *state. The state to apply the gate to. It is overwritten.
+    *gate. The k-qubit q_op to apply. Sparse gates are applied block by block in CSR form and lazy gates factor by factor.
+    *targets. The k distinct target qubits of the state.
+    *k. The number of target qubits.
+*/
+void q_state_apply_gate(q_state* state, q_op* gate, const int* targets, int k);
+
+/**q_gate_masks
+  *Validates a list of target qubits against a state and converts them to bit masks on the amplitude index. Qubit 0 is the most significant bit of the index, matching q_state_tensor. Together with q_gate_offsets and q_insert_zero_bits this lets other modules walk the blocks of a gate like the kernels here do.
+    *qubits. The number of qubits of the state.
+    *targets. The target qubits.
+    *k. The number of target qubits.
+    *masks. Output, the mask of each target qubit in gate order.
+    *sorted. Output, the same masks in ascending order.
+*/
+void q_gate_masks(int qubits, const int* targets, int k, size_t* masks, size_t* sorted);
+
+/**q_gate_offsets
+  *Computes, for each local index l of a k-qubit gate, the offset of its amplitude from the base index of a block: the OR of the masks of the targets whose bit is set in l, with targets[0] as the most significant bit of l.
+    *masks. The mask of each target qubit in gate order, from q_gate_masks.
+    *k. The number of target qubits.
+    *offsets. Output, the 2^k offsets.
+*/
+void q_gate_offsets(const size_t* masks, int k, size_t* offsets);
+
+/**q_insert_zero_bits
+  *Spreads the bits of r so that every (ascending) masked bit position is zero. Enumerating r over 0..2^(n-k) visits every block base of a k-qubit gate exactly once. Defined here so that every kernel can inline it.
+    *r. The block number.
+    *sorted. The ascending masks, from q_gate_masks.
+    *k. The number of masks.
+  Returns the base index of block r.
+*/
+static inline size_t q_insert_zero_bits(size_t r, const size_t* sorted, int k){
+  for(int j = 0; j < k; j++){
+    size_t low = r & (sorted[j] - 1);
+    r = ((r ^ low) << 1) | low;
+  }
+  return r;
+}
+
+/**q_op_embed
+  *Builds the n-qubit operator that applies a k-qubit gate to the given target qubits and the identity elsewhere, in a single pass over the output rows without intermediate tensor products or swaps. The targets may be in any order and need not be adjacent; they have the same meaning as in q_state_apply_gate. The result is stored sparse when q_op_select would choose that, and dense otherwise.
+    *gate. The k-qubit q_op to embed. It is not destroyed.
+    *targets. The k distinct target qubits.
+    *k. The number of target qubits.
+    *qubits. The number of qubits n of the result.
+  Returns the embedded operator "op"
+*/
+q_op* q_op_embed(q_op* gate, const int* targets, int k, int qubits);
+
+/**q_op_is_controlled
+  *Checks whether a 2-qubit q_op is a controlled single qubit gate, i.e. acts as the identity when its first qubit is zero, as q_cY does.
+    *op. The q_op to check.
+  *Returns 1 if op is a controlled gate and 0 otherwise.
+*/
+int q_op_is_controlled(q_op* op);
+
+/**q_state_apply_controlled
+  *Applies a single qubit gate to the target qubit of a state in place, for the amplitudes whose control qubit is one.
+    *state. The state to apply the gate to. It is overwritten.
+    *gate. The single qubit q_op to apply. A sparse gate is converted to dense storage in place.
+    *control. The control qubit.
+    *target. The target qubit.
+*/
+void q_state_apply_controlled(q_state* state, q_op* gate, int control, int target);
+
+/**q_op_is_diagonal
+  *Checks whether every off-diagonal entry of a q_op is exactly zero, as it is for the phase gates of predefined_q.
+    *op. The q_op to check.
+  *Returns 1 if op is diagonal and 0 otherwise.
+*/
+int q_op_is_diagonal(q_op* op);
+
+/**q_state_apply_diagonal
+  *Applies a k-qubit diagonal gate, given by its diagonal, to the target qubits of a state in place. Each amplitude is multiplied by the phase indexed by its target bits, so the whole state is updated in one streaming pass.
+    *state. The state to apply the gate to. It is overwritten.
+    *phases. The 2^k diagonal entries of the gate.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_state_apply_diagonal(q_state* state, gsl_vector_complex* phases, const int* targets, int k);
+
+/**q_op_is_permutation
+  *Checks whether a q_op is a permutation matrix, i.e. every row and column holds a single entry of exactly one and zeros elsewhere, as for q_pauli_X, q_cX and q_swap.
+    *op. The q_op to check.
+  *Returns 1 if op is a permutation and 0 otherwise.
+*/
+int q_op_is_permutation(q_op* op);
+
+/**q_state_apply_permutation
+  *Applies a k-qubit permutation gate to the target qubits of a state in place by moving amplitudes, without any floating point arithmetic.
+    *state. The state to apply the gate to. It is overwritten.
+    *permutation. The 2^k entries of the permutation; the amplitude with local index l moves to local index permutation[l]. For a q_op this is the row holding the one in column l.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_state_apply_permutation(q_state* state, const int* permutation, const int* targets, int k);
+
+/**q_state_swap_qubits
+  *Swaps two qubits of a state in place by exchanging the amplitudes whose bits for a and b differ.
+    *state. The state to swap the qubits of. It is overwritten.
+    *a. The first qubit.
+    *b. The second qubit.
+*/
+void q_state_swap_qubits(q_state* state, int a, int b);
+
+/**q_state_permute_qubits
+  *Relabels the qubits of a state in place, so that qubit j of the old state becomes qubit map[j] of the new one. This has the same effect as applying q_swap(qubits, map), but costs at most qubits - 1 passes of amplitude swaps.
+    *state. The state to permute. It is overwritten.
+    *map. The new position of each qubit.
+*/
+void q_state_permute_qubits(q_state* state, const int* map);
+
 /**q_state_tensor
   *Performs the matrix tensor operation on quantum states a and b. Neither a nor b is destroyed and both must be freed by the user.
     *a. The first q_state.
@@ -103,8 +384,16 @@ q_state* apply_qop(q_op* op, q_state* state);
 */
 q_state* q_state_tensor(q_state* a, q_state* b);
 
+/**q_state_tensor_into
+  *Performs the matrix tensor operation on quantum states a and b like q_state_tensor, but writes the result into an existing state instead of allocating one.
+    *a. The first q_state.
+    *b. The second q_state.
+    *out. The destination, on a->qubits + b->qubits qubits and distinct from a and b. It is overwritten.
+*/
+void q_state_tensor_into(q_state* a, q_state* b, q_state* out);
+
 /**q_op_tensor
-  *Performs the matrix tensor operation on quantum operators a and b. Neither a nor b is destroyed and both must be freed by the user.
+  *Performs the matrix tensor operation on quantum operators a and b. Neither a nor b is destroyed and both must be freed by the user. Products on at least Q_SPARSE_QUBITS qubits, or with a sparse factor, are built sparsely and stored as chosen by q_op_select. If either operator is lazy the result is lazy, as from q_op_tensor_lazy.
     *a. The first q_op.
     *b. The second q_op.
   *Returns the tensor of a and b "new_op".
@@ -112,13 +401,37 @@ q_state* q_state_tensor(q_state* a, q_state* b);
 q_op* q_op_tensor(q_op* a, q_op* b);
 
 /**q_op_multiply
-  *Performs the matrix multiplication operation on quantum operators a and b. Neither a nor b is destroyed and both must be freed by the user.
+  *Performs the matrix multiplication operation on quantum operators a and b. Neither a nor b is destroyed and both must be freed by the user. If either operator is sparse the product is computed sparsely and stored as chosen by q_op_select. If either operator is lazy the result is lazy, as from q_op_multiply_lazy.
     *a. The first q_op.
     *b. The second q_op.
   *Returns a.b "new_op".
 */
 q_op* q_op_multiply(q_op* a, q_op* b);
 
+/**q_op_multiply_into
+  *Performs the matrix multiplication a.b like q_op_multiply, but writes the product into an existing dense operator instead of allocating one. Dense operands use zgemm; sparse operands are expanded row by row into the destination without temporaries.
+    *a. The first q_op. It must not be lazy.
+    *b. The second q_op. It must not be lazy.
+    *out. The destination, a dense q_op on the same number of qubits and distinct from a and b. It is overwritten.
+*/
+void q_op_multiply_into(q_op* a, q_op* b, q_op* out);
+
+/**q_op_tensor_lazy
+  *Builds the tensor product of quantum operators a and b without evaluating it. The result keeps copies of its factors and is applied to a state factor by factor, each on its own qubits, so H (x) H (x) ... (x) H on 25 qubits costs 25 single qubit passes and no 2^25 x 2^25 matrix is ever allocated. Neither a nor b is destroyed and both must be freed by the user.
+    *a. The first q_op.
+    *b. The second q_op.
+  *Returns the lazy tensor of a and b "new_op".
+*/
+q_op* q_op_tensor_lazy(q_op* a, q_op* b);
+
+/**q_op_multiply_lazy
+  *Builds the matrix product a.b of quantum operators a and b without evaluating it. The result is applied to a state by applying b and then a. Neither a nor b is destroyed and both must be freed by the user.
+    *a. The first q_op.
+    *b. The second q_op.
+  *Returns the lazy product a.b "new_op".
+*/
+q_op* q_op_multiply_lazy(q_op* a, q_op* b);
+
 /**g_state_distribution_alloc
   *Allocates a q_state distribution struct.
     *s. The number of states of the q_state_distribution.
@@ -126,7 +439,6 @@ q_op* q_op_multiply(q_op* a, q_op* b);
 */
 q_state_distribution* q_state_distribution_alloc(int qubits);
 
-
 /**q_state_distribution_free
   *Frees a given q_state_distribution.
     *dist. The distribution to free.
@@ -139,21 +451,48 @@ void q_state_distribution_free(q_state_distribution* dist);
 */
 void q_state_distribution_lazy_free(q_state_distribution* dist);
 
-/**q_state_measure
-  *Performs a measurement of a given qubit of a q state.
-    *q. The q_state to perform a measurement on.
+/**q_state_probability
+  *Computes the probability of measuring a given outcome on a qubit of a q state, relative to the state's norm.
+    *q. The q_state to measure.
+    *qubit. The qubit to measure, with qubit 0 the leftmost qubit as in q_state_apply_gate.
+    *outcome. The outcome, 0 or 1.
+  *Returns the probability p of the outcome.
+*/
+double q_state_probability(q_state* q, int qubit, int outcome);
+
+/**q_state_collapse
+  *Measures a qubit of a q state in place, keeping only the branch with the given outcome and renormalising it.
+    *q. The q_state to collapse. It is overwritten.
     *qubit. The qubit to measure.
-  *Returns a probability distribution over outcomes.
+    *outcome. The outcome to keep, 0 or 1.
+  *Returns the probability p of the outcome. If p is zero the state is left unchanged.
 */
-q_state_distribution** q_state_measure(q_state* q, int qubit);
+double q_state_collapse(q_state* q, int qubit, int outcome);
+
+/**q_state_measure_random
+  *Measures a qubit of a q state in place, choosing the outcome at random with its Born probability and keeping only that branch, renormalised.
+    *q. The q_state to measure. It is overwritten.
+    *qubit. The qubit to measure.
+    *rng. The random number generator to draw the outcome from.
+  *Returns the outcome, 0 or 1.
+*/
+int q_state_measure_random(q_state* q, int qubit, q_rng* rng);
 
 /**q_state_measure
-  *Performs a measurement of a given qubit of a q distribution.
+  *Performs a measurement of a given qubit of a q state. Both outcome probabilities are computed in a single pass and each branch is produced as one renormalised copy. The measured state is not destroyed.
+    *q. The q_state to perform a measurement on.
+    *qubit. The qubit to measure, with qubit 0 the leftmost qubit as in q_state_apply_gate.
+  *Returns a probability distribution over the (at most two) post-measurement states with non-zero probability.
+*/
+q_state_distribution* q_state_measure(q_state* q, int qubit);
+
+/**q_distribution_measure
+  *Performs a measurement of a given qubit of a q distribution. Every state is measured as in q_state_measure and the branches are collected into one flat distribution, allocated once for the worst case. The measured distribution is not destroyed.
     *q. The q_state_distribution to perform a measurement on.
     *qubit. The qubit to measure.
-  *Returns a probability distribution over outcomes.
+  *Returns a probability distribution over outcomes, with each branch weighted by the probability of the state it came from.
 */
-q_state_distribution** q_distribution_measure(q_state_distribution* q, int qubit);
+q_state_distribution* q_distribution_measure(q_state_distribution* q, int qubit);
 
 /**fidelity
   *Computes the fidelity between 2 states.
@@ -162,4 +501,168 @@ q_state_distribution** q_distribution_measure(q_state_distribution* q, int qubit
   *Returns fid, the fidelity
 */
 double fidelity(q_state* a, q_state* b);
+
+/**q_state_inner
+  *Computes the inner product <a|b> = sum_i conj(a_i) b_i, like BLAS zdotc, reading both states in place without forming a conjugated copy.
+    *a. The first q_state.
+    *b. The second q_state.
+  *Returns the inner product "sum".
+*/
+gsl_complex q_state_inner(q_state* a, q_state* b);
+
+/**q_state_gram
+  *Computes the Gram matrix G_ij = <s_i|s_j> of a list of states. The states are packed panel by panel into a block of Q_GRAM_PANEL rows by m columns and each panel is accumulated with a single BLAS-3 zherk call, so only Q_GRAM_PANEL * m amplitudes are ever copied at once.
+    *states. The m states, all on the same number of qubits.
+    *m. The number of states.
+  *Returns the m x m Hermitian matrix "gram".
+*/
+gsl_matrix_complex* q_state_gram(q_state** states, int m);
+
+/**q_state_fidelity_matrix
+  *Computes the fidelity between every pair of a list of states, i.e. the absolute values of their Gram matrix (see q_state_gram).
+    *states. The m states, all on the same number of qubits.
+    *m. The number of states.
+  *Returns the m x m symmetric matrix "fid" with fid_ij = fidelity(states[i], states[j]).
+*/
+gsl_matrix* q_state_fidelity_matrix(q_state** states, int m);
+
+/**q_circuit_alloc
+  *Allocates an empty q_circuit.
+    *qubits. The number of qubits the circuit acts on.
+  Returns the empty circuit "circuit".
+*/
+q_circuit* q_circuit_alloc(int qubits);
+
+/**q_circuit_free
+  *Frees a given q_circuit and every q_op recorded in it.
+    *circuit. The circuit to free.
+*/
+void q_circuit_free(q_circuit* circuit);
+
+/**q_circuit_add
+  *Records a gate at the end of a circuit. The circuit takes ownership of the op, which is freed by q_circuit_free, so gates can be added straight from their constructors, e.g. q_circuit_add(c, q_hadamard(), (int[]){0}, 1).
+    *circuit. The circuit to add the gate to.
+    *op. The k-qubit q_op to record. A sparse op on at least Q_SPARSE_QUBITS qubits is kept sparse and runs in CSR form; smaller sparse ops are converted to dense storage. A lazy op is recorded as one gate per factor.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_circuit_add(q_circuit* circuit, q_op* op, const int* targets, int k);
+
+/**q_circuit_set_gate
+  *Replaces the q_op of a recorded gate, keeping its targets and position, e.g. to change the angle of a rotation without rebuilding the circuit. The gate is classified again, so the new op runs with the fastest kernel that fits it.
+    *circuit. The circuit.
+    *index. The index of the gate, from 0 to gates - 1.
+    *op. The new k-qubit q_op, on as many qubits as the old one. The circuit takes ownership of it and frees the old one. Sparse ops are stored as in q_circuit_add; lazy ops are not accepted.
+*/
+void q_circuit_set_gate(q_circuit* circuit, int index, q_op* op);
+
+/**q_circuit_run
+  *Executes every recorded gate of a circuit, in order, against a state in place. No memory is allocated while the circuit runs, apart from one block buffer per thread for sparse gates.
+    *circuit. The circuit to execute.
+    *state. The state to apply the circuit to. It is overwritten.
+*/
+void q_circuit_run(q_circuit* circuit, q_state* state);
+
+/**q_circuit_run_range
+  *Executes the recorded gates first to last - 1 of a circuit, in order, against a state in place, so callers can interleave their own operations between gates. No memory is allocated, apart from one block buffer per thread for sparse gates.
+    *circuit. The circuit to execute.
+    *state. The state to apply the gates to. It is overwritten.
+    *first. The index of the first gate to run.
+    *last. One past the index of the last gate to run.
+*/
+void q_circuit_run_range(q_circuit* circuit, q_state* state, int first, int last);
+
+/**q_circuit_unitary
+  *Computes the unitary of a circuit by running every basis column through the recorded gates with the in-place kernels. The cost is about gates * 4^n operations with a single 2^n x 2^n allocation, instead of a dense product per gate. Useful for checking that two circuits are equivalent.
+    *circuit. The circuit.
+  Returns the circuit's unitary "op", where the first gate added is applied first.
+*/
+q_op* q_circuit_unitary(q_circuit* circuit);
+
+/**q_circuit_fuse
+  *Greedily merges runs of consecutive gates into single dense gates on at most max_qubits qubits, so that executing the circuit makes fewer passes over the state vector. Gates keep their relative order, so the circuit's action is unchanged. Values of 4 or 5 work well; larger blocks cost 2^max_qubits operations per amplitude. Runs of diagonal gates may grow up to Q_FUSE_DIAGONAL_QUBITS qubits, since they still run as a single phase pass. Sparse gates are kept as they are and end the run before them.
+    *circuit. The circuit to fuse. Its gate list is replaced by the fused one.
+    *max_qubits. The largest number of qubits a fused gate may act on.
+*/
+void q_circuit_fuse(q_circuit* circuit, int max_qubits);
+
+/**q_state_batch_alloc
+  *Allocates a batch of states on the same qubits, stored as the columns of one 2^n x count block so that operators and gates update every state in the same pass.
+    *qubits. The number of qubits of each state.
+    *count. The number of states.
+  Returns the generated batch "batch"
+*/
+q_state_batch* q_state_batch_alloc(int qubits, int count);
+
+/**q_state_batch_free
+  *Frees a given batch.
+    *batch. The batch to free.
+*/
+void q_state_batch_free(q_state_batch* batch);
+
+/**q_state_batch_set
+  *Copies a state into one column of a batch.
+    *batch. The batch.
+    *b. The index of the state in the batch.
+    *state. The state to copy. It is not destroyed.
+*/
+void q_state_batch_set(q_state_batch* batch, int b, q_state* state);
+
+/**q_state_batch_get
+  *Copies one state out of a batch.
+    *batch. The batch.
+    *b. The index of the state in the batch.
+  Returns the copied state "state", which must be freed by the user.
+*/
+q_state* q_state_batch_get(q_state_batch* batch, int b);
+
+/**q_state_batch_apply_gate
+  *Applies a k-qubit q_op to the given target qubits of every state of a batch in place, as q_state_apply_gate does for one state.
+    *batch. The batch to apply the gate to. It is overwritten.
+    *gate. The k-qubit q_op to apply. Lazy gates are applied factor by factor; a sparse gate is expanded to a dense copy.
+    *targets. The k distinct target qubits.
+    *k. The number of target qubits.
+*/
+void q_state_batch_apply_gate(q_state_batch* batch, q_op* gate, const int* targets, int k);
+
+/**apply_qop_batch
+  *Applies a q_op operator to every state of a batch. The old batch is not destroyed and must be freed by the user. Dense operators use a single matrix-matrix product over the whole batch, sparse operators a sparse product over the rows and lazy operators q_state_batch_apply_gate.
+    *op. The q_op to apply.
+    *batch. The batch to apply the q_op to.
+  Returns new_batch
+*/
+q_state_batch* apply_qop_batch(q_op* op, q_state_batch* batch);
+
+/**q_circuit_run_batch
+  *Executes every recorded gate of a circuit, in order, against every state of a batch in place.
+    *circuit. The circuit to execute.
+    *batch. The batch to apply the circuit to. It is overwritten.
+*/
+void q_circuit_run_batch(q_circuit* circuit, q_state_batch* batch);
+
+/**q_state_batch_fidelity
+  *Computes the fidelity |<a|b>| between a state and every state of a batch, with a single matrix-vector product.
+    *batch. The batch.
+    *state. The state to compare against.
+  *Returns the vector of fidelities "f", where f_b is the fidelity of state b. It must be freed by the user.
+*/
+gsl_vector* q_state_batch_fidelity(q_state_batch* batch, q_state* state);
+
+/**q_state_batch_probability
+  *Computes, for every state of a batch, the probability that measuring a qubit gives a given outcome, in a single pass over the batch.
+    *batch. The batch. It is not changed.
+    *qubit. The qubit to measure.
+    *outcome. The outcome, 0 or 1.
+  *Returns the vector of probabilities "p", where p_b belongs to state b. It must be freed by the user.
+*/
+gsl_vector* q_state_batch_probability(q_state_batch* batch, int qubit, int outcome);
+
+/**q_state_batch_measure_random
+  *Measures a qubit of every state of a batch, draws each outcome from its probability and collapses every state onto its outcome in place. State b uses its own counter of the generator, so the outcomes do not depend on the number of threads.
+    *batch. The batch to measure. It is overwritten.
+    *qubit. The qubit to measure.
+    *rng. The random number generator. It is advanced past the counters used.
+    *outcomes. Output, the outcome of every state.
+*/
+void q_state_batch_measure_random(q_state_batch* batch, int qubit, q_rng* rng, int* outcomes);
 #endif
@@ -0,0 +1,420 @@
+#include "q_density.h"
+#include <string.h>
+
+/**density_alloc
+  *Allocates the storage of a density matrix: a 2n-qubit state, aligned for the vectorised kernels, and a 2^n x 2^n matrix view of the same entries. The entries are not initialised.
+*/
+static q_density* density_alloc(int qubits){
+  size_t dim = (size_t)1 << qubits;
+  q_density* rho = malloc(sizeof(q_density));
+  rho->qubits = qubits;
+  rho->vector = q_state_alloc(2 * qubits);
+  rho->matrix = gsl_matrix_complex_alloc_from_block(rho->vector->vector->block, 0, dim, dim, dim);
+  return rho;
+}
+
+/**q_density_alloc
+  *Allocates a density matrix initialised to |0...0><0...0|. It holds 4^n complex entries, so 12 to 14 qubits is the practical range.
+    *qubits. The number of qubits.
+  Returns the generated density matrix "rho"
+*/
+q_density* q_density_alloc(int qubits){
+  q_density* rho = density_alloc(qubits);
+  gsl_matrix_complex_set_all(rho->vector->vector, GSL_COMPLEX_ZERO);
+  gsl_matrix_complex_set(rho->matrix, 0, 0, GSL_COMPLEX_ONE);
+  return rho;
+}
+
+/**q_density_free
+  *Frees a given density matrix.
+    *rho. The density matrix to free.
+*/
+void q_density_free(q_density* rho){
+  gsl_matrix_complex_free(rho->matrix);
+  q_state_free(rho->vector);
+  free(rho);
+}
+
+/**q_density_from_state
+  *Builds the density matrix |psi><psi| of a pure state.
+    *state. The state. It is not destroyed.
+  Returns the generated density matrix "rho"
+*/
+q_density* q_density_from_state(q_state* state){
+  size_t dim = (size_t)1 << state->qubits;
+  q_density* rho = density_alloc(state->qubits);
+  const double* x = state->vector->data;
+  size_t stride = state->vector->tda;
+  gsl_matrix_complex* m = rho->matrix;
+  #pragma omp parallel for if(dim * dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < dim; i++){
+    double ar = x[2 * i * stride], ai = x[2 * i * stride + 1];
+    double* row = m->data + 2 * i * m->tda;
+    for(size_t j = 0; j < dim; j++){
+      double br = x[2 * j * stride], bi = -x[2 * j * stride + 1];
+      row[2 * j] = ar * br - ai * bi;
+      row[2 * j + 1] = ar * bi + ai * br;
+    }
+  }
+  return rho;
+}
+
+/**check_targets
+  *Checks that target qubits lie on the register. Repeats are caught by the state vector kernels.
+*/
+static void check_targets(q_density* rho, const int* targets, int k){
+  for(int i = 0; i < k; i++){
+    if(targets[i] < 0 || targets[i] >= rho->qubits){
+      printf("Error: target qubit %d out of range in density matrix operation. Terminating.\n", targets[i]);
+      exit(0);
+    }
+  }
+}
+
+/**conjugate_op
+  *Complex conjugates every entry of a q_op in place, factor by factor for lazy operators.
+*/
+static void conjugate_op(q_op* op){
+  if(op->lazy != NULL){
+    for(int f = 0; f < op->lazy->count; f++){
+      conjugate_op(op->lazy->factors[f]);
+    }
+  }
+  else if(op->sparse != NULL){
+    for(size_t nz = 0; nz < op->sparse->nonzeros; nz++){
+      op->sparse->values[2 * nz + 1] = -op->sparse->values[2 * nz + 1];
+    }
+  }
+  else{
+    gsl_matrix_complex* m = op->matrix;
+    for(size_t i = 0; i < m->size1; i++){
+      for(size_t j = 0; j < m->size2; j++){
+        m->data[2 * (i * m->tda + j) + 1] = -m->data[2 * (i * m->tda + j) + 1];
+      }
+    }
+  }
+}
+
+/**apply_diagonal_both
+  *Applies a diagonal gate with diagonal d as the single 2k-qubit diagonal d_a conj(d_b) on the row and column qubits, one pass over rho.
+*/
+static void apply_diagonal_both(q_density* rho, gsl_vector_complex* diagonal, const int* targets, int k){
+  size_t d = (size_t)1 << k;
+  int both[2 * k];
+  for(int i = 0; i < k; i++){
+    both[i] = targets[i];
+    both[k + i] = targets[i] + rho->qubits;
+  }
+  gsl_vector_complex* phases = gsl_vector_complex_alloc(d * d);
+  for(size_t a = 0; a < d; a++){
+    gsl_complex x = gsl_vector_complex_get(diagonal, a);
+    for(size_t b = 0; b < d; b++){
+      gsl_vector_complex_set(phases, a * d + b, gsl_complex_mul(x, gsl_complex_conjugate(gsl_vector_complex_get(diagonal, b))));
+    }
+  }
+  q_state_apply_diagonal(rho->vector, phases, both, 2 * k);
+  gsl_vector_complex_free(phases);
+}
+
+/**apply_permutation_both
+  *Applies a permutation gate p, which is real, as the single 2k-qubit permutation (a, b) -> (p_a, p_b) on the row and column qubits, one pass over rho without arithmetic.
+*/
+static void apply_permutation_both(q_density* rho, const int* permutation, const int* targets, int k){
+  size_t d = (size_t)1 << k;
+  int both[2 * k];
+  for(int i = 0; i < k; i++){
+    both[i] = targets[i];
+    both[k + i] = targets[i] + rho->qubits;
+  }
+  int* pairs = malloc(d * d * sizeof(int));
+  for(size_t a = 0; a < d; a++){
+    for(size_t b = 0; b < d; b++){
+      pairs[a * d + b] = permutation[a] * d + permutation[b];
+    }
+  }
+  q_state_apply_permutation(rho->vector, pairs, both, 2 * k);
+  free(pairs);
+}
+
+/**q_density_apply_gate
+  *Applies a k-qubit q_op as rho -> U rho U^H to the given target qubits in place. As vec(U rho U^H) = (U (x) conj(U)) vec(rho), this is U on the row qubits and conj(U) on the column qubits of the 2n-qubit vector, two in-place passes of the multithreaded state vector kernels; no operator on all n qubits is built. Any q_op accepted by q_state_apply_gate works, so the gates of predefined_q.c and recorded circuits can be shared with the state vector backend.
+    *rho. The density matrix. It is overwritten.
+    *gate. The k-qubit q_op to apply.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_density_apply_gate(q_density* rho, q_op* gate, const int* targets, int k){
+  if(gate->qubits != k || k > rho->qubits){
+    printf("Error: size mismatch in gate application. Terminating.\n");
+    exit(0);
+  }
+  check_targets(rho, targets, k);
+  if(gate->lazy == NULL && k <= Q_FUSE_DIAGONAL_QUBITS && q_op_is_diagonal(gate)){
+    size_t d = (size_t)1 << k;
+    gsl_vector_complex* diagonal = gsl_vector_complex_alloc(d);
+    for(size_t a = 0; a < d; a++){
+      gsl_vector_complex_set(diagonal, a, q_op_get(gate, a, a));
+    }
+    apply_diagonal_both(rho, diagonal, targets, k);
+    gsl_vector_complex_free(diagonal);
+    return;
+  }
+  if(gate->lazy == NULL && k <= Q_FUSE_DIAGONAL_QUBITS && q_op_is_permutation(gate)){
+    size_t d = (size_t)1 << k;
+    int permutation[d];
+    for(size_t b = 0; b < d; b++){
+      for(size_t a = 0; a < d; a++){
+        gsl_complex x = q_op_get(gate, a, b);
+        if(GSL_REAL(x) != 0.0) permutation[b] = a;
+      }
+    }
+    apply_permutation_both(rho, permutation, targets, k);
+    return;
+  }
+  int columns[k];
+  for(int i = 0; i < k; i++){
+    columns[i] = targets[i] + rho->qubits;
+  }
+  q_state_apply_gate(rho->vector, gate, targets, k);
+  q_op* conjugate = q_op_copy(gate);
+  conjugate_op(conjugate);
+  q_state_apply_gate(rho->vector, conjugate, columns, k);
+  q_op_free(conjugate);
+}
+
+/**q_density_apply_channel
+  *Applies a channel as rho -> sum_i K_i rho K_i^H to the given target qubits in place, so the exact noisy result is obtained without sampling. The channel is turned into its 4^k x 4^k superoperator sum_i K_i (x) conj(K_i), which is applied as a single 2k-qubit gate to the row and column qubits of the 2n-qubit vector.
+    *rho. The density matrix. It is overwritten.
+    *channel. The channel.
+    *targets. The channel's distinct target qubits.
+*/
+void q_density_apply_channel(q_density* rho, q_channel* channel, const int* targets){
+  int k = channel->qubits;
+  if(k > rho->qubits){
+    printf("Error: size mismatch in channel application. Terminating.\n");
+    exit(0);
+  }
+  check_targets(rho, targets, k);
+  int both[2 * k];
+  for(int i = 0; i < k; i++){
+    both[i] = targets[i];
+    both[k + i] = targets[i] + rho->qubits;
+  }
+  size_t d = (size_t)1 << k;
+  q_op* super = q_op_calloc(2 * k);
+  gsl_matrix_complex* s = super->matrix;
+  for(int i = 0; i < channel->count; i++){
+    gsl_matrix_complex* m = channel->kraus[i]->matrix;
+    for(size_t a = 0; a < d; a++){
+      for(size_t b = 0; b < d; b++){
+        gsl_complex x = gsl_matrix_complex_get(m, a, b);
+        if(GSL_REAL(x) == 0.0 && GSL_IMAG(x) == 0.0) continue;
+        for(size_t c = 0; c < d; c++){
+          for(size_t e = 0; e < d; e++){
+            gsl_complex y = gsl_complex_conjugate(gsl_matrix_complex_get(m, c, e));
+            size_t row = a * d + c, col = b * d + e;
+            gsl_matrix_complex_set(s, row, col, gsl_complex_add(gsl_matrix_complex_get(s, row, col), gsl_complex_mul(x, y)));
+          }
+        }
+      }
+    }
+  }
+  //Superoperators of common channels are mostly zero: phase damping is diagonal, and depolarising and amplitude damping only couple the populations.
+  size_t nonzeros = 0;
+  for(size_t i = 0; i < d * d; i++){
+    for(size_t j = 0; j < d * d; j++){
+      gsl_complex x = gsl_matrix_complex_get(s, i, j);
+      nonzeros += GSL_REAL(x) != 0.0 || GSL_IMAG(x) != 0.0;
+    }
+  }
+  if(q_op_is_diagonal(super)){
+    gsl_vector_complex* phases = gsl_vector_complex_alloc(d * d);
+    for(size_t i = 0; i < d * d; i++){
+      gsl_vector_complex_set(phases, i, gsl_matrix_complex_get(s, i, i));
+    }
+    q_state_apply_diagonal(rho->vector, phases, both, 2 * k);
+    gsl_vector_complex_free(phases);
+  }
+  else{
+    if(2 * nonzeros <= d * d * d * d) q_op_sparsify(super);
+    q_state_apply_gate(rho->vector, super, both, 2 * k);
+  }
+  q_op_free(super);
+}
+
+/**run_gate
+  *Applies a recorded gate of a circuit to a density matrix, reusing the diagonal or permutation found when the gate was recorded.
+*/
+static void run_gate(q_density* rho, q_gate* gate){
+  if(gate->type == Q_GATE_DIAGONAL){
+    apply_diagonal_both(rho, gate->diagonal, gate->targets, gate->k);
+  }
+  else if(gate->type == Q_GATE_PERMUTATION){
+    apply_permutation_both(rho, gate->permutation, gate->targets, gate->k);
+  }
+  else{
+    q_density_apply_gate(rho, gate->op, gate->targets, gate->k);
+  }
+}
+
+/**q_density_run
+  *Executes every recorded gate of a circuit, in order, against a density matrix in place.
+    *rho. The density matrix. It is overwritten.
+    *circuit. The circuit to execute.
+*/
+void q_density_run(q_density* rho, q_circuit* circuit){
+  if(circuit->qubits != rho->qubits){
+    printf("Error: size mismatch in circuit execution. Terminating.\n");
+    exit(0);
+  }
+  for(int g = 0; g < circuit->gates; g++){
+    run_gate(rho, &circuit->gate_list[g]);
+  }
+}
+
+/**q_density_run_noisy
+  *Executes a noisy circuit exactly: every gate is followed by the channels attached to it, as in q_trajectory_run but averaged over all outcomes. Readout errors are not applied, since they only affect measurement records.
+    *rho. The density matrix. It is overwritten.
+    *noisy. The noisy circuit.
+*/
+void q_density_run_noisy(q_density* rho, q_noisy_circuit* noisy){
+  q_circuit* circuit = noisy->circuit;
+  if(circuit->qubits != rho->qubits){
+    printf("Error: size mismatch in circuit execution. Terminating.\n");
+    exit(0);
+  }
+  int e = 0;
+  for(int g = 0; g < circuit->gates; g++){
+    run_gate(rho, &circuit->gate_list[g]);
+    for(; e < noisy->count && noisy->events[e].gate == g; e++){
+      q_density_apply_channel(rho, noisy->events[e].channel, noisy->events[e].targets);
+    }
+  }
+}
+
+/**q_density_partial_trace
+  *Traces out every qubit except the given ones.
+    *rho. The density matrix. It is not changed.
+    *keep. The k distinct qubits to keep. They become qubits 0 to k - 1 of the result, in the given order.
+    *k. The number of qubits to keep.
+  Returns the reduced density matrix "reduced"
+*/
+q_density* q_density_partial_trace(q_density* rho, const int* keep, int k){
+  int n = rho->qubits;
+  if(k < 0 || k > n){
+    printf("Error: size mismatch in partial trace. Terminating.\n");
+    exit(0);
+  }
+  size_t d = (size_t)1 << k;
+  size_t masks[k];
+  size_t sorted[k];
+  size_t* offsets = malloc(d * sizeof(size_t));
+  q_gate_masks(n, keep, k, masks, sorted);
+  q_gate_offsets(masks, k, offsets);
+  size_t traced = ((size_t)1 << n) >> k;
+  q_density* reduced = density_alloc(k);
+  gsl_matrix_complex* m = rho->matrix;
+  gsl_matrix_complex* out = reduced->matrix;
+  #pragma omp parallel for collapse(2) if(d * d * traced >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t a = 0; a < d; a++){
+    for(size_t b = 0; b < d; b++){
+      double re = 0.0, im = 0.0;
+      for(size_t t = 0; t < traced; t++){
+        size_t base = q_insert_zero_bits(t, sorted, k);
+        const double* x = m->data + 2 * ((base + offsets[a]) * m->tda + base + offsets[b]);
+        re += x[0];
+        im += x[1];
+      }
+      out->data[2 * (a * out->tda + b)] = re;
+      out->data[2 * (a * out->tda + b) + 1] = im;
+    }
+  }
+  free(offsets);
+  return reduced;
+}
+
+/**q_density_purity
+  *Computes the purity Tr(rho^2), which is 1 for pure states and 1 / 2^n for the maximally mixed state.
+    *rho. The density matrix.
+  *Returns the purity.
+*/
+double q_density_purity(q_density* rho){
+  //rho is Hermitian, so Tr(rho^2) = sum_ij |rho_ij|^2. Rows are summed separately and then in order, so the result does not depend on the number of threads.
+  size_t dim = (size_t)1 << rho->qubits;
+  gsl_matrix_complex* m = rho->matrix;
+  double* rows = malloc(dim * sizeof(double));
+  #pragma omp parallel for if(dim * dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < dim; i++){
+    const double* row = m->data + 2 * i * m->tda;
+    double sum = 0.0;
+    for(size_t j = 0; j < 2 * dim; j++){
+      sum += row[j] * row[j];
+    }
+    rows[i] = sum;
+  }
+  double purity = 0.0;
+  for(size_t i = 0; i < dim; i++){
+    purity += rows[i];
+  }
+  free(rows);
+  return purity;
+}
+
+/**q_density_fidelity
+  *Computes the fidelity between a density matrix and a pure state, sqrt(<psi|rho|psi>). For rho = |phi><phi| this equals fidelity(phi, psi).
+    *rho. The density matrix.
+    *state. The pure state.
+  *Returns the fidelity.
+*/
+double q_density_fidelity(q_density* rho, q_state* state){
+  if(rho->qubits != state->qubits){
+    printf("Error: size mismatch in fidelity. Terminating.\n");
+    exit(0);
+  }
+  size_t dim = (size_t)1 << rho->qubits;
+  gsl_matrix_complex* m = rho->matrix;
+  const double* x = state->vector->data;
+  size_t stride = state->vector->tda;
+  double* rows = malloc(dim * sizeof(double));
+  #pragma omp parallel for if(dim * dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < dim; i++){
+    const double* row = m->data + 2 * i * m->tda;
+    double re = 0.0, im = 0.0;
+    for(size_t j = 0; j < dim; j++){
+      re += row[2 * j] * x[2 * j * stride] - row[2 * j + 1] * x[2 * j * stride + 1];
+      im += row[2 * j] * x[2 * j * stride + 1] + row[2 * j + 1] * x[2 * j * stride];
+    }
+    //Real part of conj(psi_i) (rho psi)_i.
+    rows[i] = x[2 * i * stride] * re + x[2 * i * stride + 1] * im;
+  }
+  double overlap = 0.0;
+  for(size_t i = 0; i < dim; i++){
+    overlap += rows[i];
+  }
+  free(rows);
+  return sqrt(overlap > 0.0 ? overlap : 0.0);
+}
+
+/**q_density_probability
+  *Computes the probability that measuring a qubit gives a given outcome.
+    *rho. The density matrix.
+    *qubit. The qubit.
+    *outcome. The outcome, 0 or 1.
+  *Returns the probability.
+*/
+double q_density_probability(q_density* rho, int qubit, int outcome){
+  if(qubit < 0 || qubit >= rho->qubits){
+    printf("Error: qubit %d out of range in probability. Terminating.\n", qubit);
+    exit(0);
+  }
+  size_t dim = (size_t)1 << rho->qubits;
+  size_t mask = (size_t)1 << (rho->qubits - 1 - qubit);
+  gsl_matrix_complex* m = rho->matrix;
+  double p = 0.0;
+  for(size_t i = 0; i < dim; i++){
+    if(((i & mask) != 0) == (outcome != 0)){
+      p += m->data[2 * i * (m->tda + 1)];
+    }
+  }
+  return p;
+}
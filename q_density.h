@@ -0,0 +1,97 @@
+#ifndef Q_DENSITY_H
+#define Q_DENSITY_H
+
+#include "q_circuit.h"
+#include "q_noise.h"
+
+//Density matrix of an n-qubit register, a 2^n x 2^n matrix indexed like the amplitudes of a q_state on both sides. vector views the same entries, row by row, as a 2n-qubit state, with the row index on qubits 0 to n - 1 and the column index on qubits n to 2n - 1, so that superoperators run through the state vector kernels.
+typedef struct q_density{
+  gsl_matrix_complex* matrix;
+  q_state* vector;
+  int qubits;
+} q_density;
+
+/**q_density_alloc
+  *Allocates a density matrix initialised to |0...0><0...0|. It holds 4^n complex entries, so 12 to 14 qubits is the practical range.
+    *qubits. The number of qubits.
+  Returns the generated density matrix "rho"
+*/
+q_density* q_density_alloc(int qubits);
+
+/**q_density_free
+  *Frees a given density matrix.
+    *rho. The density matrix to free.
+*/
+void q_density_free(q_density* rho);
+
+/**q_density_from_state
+  *Builds the density matrix |psi><psi| of a pure state.
+    *state. The state. It is not destroyed.
+  Returns the generated density matrix "rho"
+*/
+q_density* q_density_from_state(q_state* state);
+
+/**q_density_apply_gate
+  *Applies a k-qubit q_op as rho -> U rho U^H to the given target qubits in place. As vec(U rho U^H) = (U (x) conj(U)) vec(rho), this is U on the row qubits and conj(U) on the column qubits of the 2n-qubit vector, two in-place passes of the multithreaded state vector kernels; no operator on all n qubits is built. Any q_op accepted by q_state_apply_gate works, so the gates of predefined_q.c and recorded circuits can be shared with the state vector backend.
+    *rho. The density matrix. It is overwritten.
+    *gate. The k-qubit q_op to apply.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_density_apply_gate(q_density* rho, q_op* gate, const int* targets, int k);
+
+/**q_density_apply_channel
+  *Applies a channel as rho -> sum_i K_i rho K_i^H to the given target qubits in place, so the exact noisy result is obtained without sampling. The channel is turned into its 4^k x 4^k superoperator sum_i K_i (x) conj(K_i), which is applied as a single 2k-qubit gate to the row and column qubits of the 2n-qubit vector.
+    *rho. The density matrix. It is overwritten.
+    *channel. The channel.
+    *targets. The channel's distinct target qubits.
+*/
+void q_density_apply_channel(q_density* rho, q_channel* channel, const int* targets);
+
+/**q_density_run
+  *Executes every recorded gate of a circuit, in order, against a density matrix in place.
+    *rho. The density matrix. It is overwritten.
+    *circuit. The circuit to execute.
+*/
+void q_density_run(q_density* rho, q_circuit* circuit);
+
+/**q_density_run_noisy
+  *Executes a noisy circuit exactly: every gate is followed by the channels attached to it, as in q_trajectory_run but averaged over all outcomes. Readout errors are not applied, since they only affect measurement records.
+    *rho. The density matrix. It is overwritten.
+    *noisy. The noisy circuit.
+*/
+void q_density_run_noisy(q_density* rho, q_noisy_circuit* noisy);
+
+/**q_density_partial_trace
+  *Traces out every qubit except the given ones.
+    *rho. The density matrix. It is not changed.
+    *keep. The k distinct qubits to keep. They become qubits 0 to k - 1 of the result, in the given order.
+    *k. The number of qubits to keep.
+  Returns the reduced density matrix "reduced"
+*/
+q_density* q_density_partial_trace(q_density* rho, const int* keep, int k);
+
+/**q_density_purity
+  *Computes the purity Tr(rho^2), which is 1 for pure states and 1 / 2^n for the maximally mixed state.
+    *rho. The density matrix.
+  *Returns the purity.
+*/
+double q_density_purity(q_density* rho);
+
+/**q_density_fidelity
+  *Computes the fidelity between a density matrix and a pure state, sqrt(<psi|rho|psi>). For rho = |phi><phi| this equals fidelity(phi, psi).
+    *rho. The density matrix.
+    *state. The pure state.
+  *Returns the fidelity.
+*/
+double q_density_fidelity(q_density* rho, q_state* state);
+
+/**q_density_probability
+  *Computes the probability that measuring a qubit gives a given outcome.
+    *rho. The density matrix.
+    *qubit. The qubit.
+    *outcome. The outcome, 0 or 1.
+  *Returns the probability.
+*/
+double q_density_probability(q_density* rho, int qubit, int outcome);
+#endif
@@ -0,0 +1,262 @@
+#include "q_disk.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**state_bytes
+  *Returns the size of the amplitudes of an n-qubit state in bytes.
+*/
+static size_t state_bytes(int qubits){
+  return 2 * sizeof(double) * ((size_t)1 << qubits);
+}
+
+/**write_header
+  *Fills a Q_STATE_HEADER byte header for an n-qubit state.
+*/
+static void write_header(char* header, int qubits){
+  memset(header, 0, Q_STATE_HEADER);
+  memcpy(header, Q_STATE_MAGIC, 8);
+  memcpy(header + 8, &qubits, sizeof(int));
+}
+
+/**read_header
+  *Checks a state file header and returns its number of qubits.
+*/
+static int read_header(const char* header, const char* path){
+  int qubits;
+  memcpy(&qubits, header + 8, sizeof(int));
+  if(memcmp(header, Q_STATE_MAGIC, 8) != 0 || qubits < 0 || qubits > 8 * (int)sizeof(size_t) - 5){
+    printf("Error: %s is not a state file. Terminating.\n", path);
+    exit(0);
+  }
+  return qubits;
+}
+
+/**q_state_mmap
+  *Maps a state file into memory, so that registers larger than RAM can be simulated from fast storage, with the operating system paging amplitudes in and out. The result is an ordinary q_state and works with every function of q_circuit.c, but a chunked execution with q_circuit_run_chunked keeps the accesses page friendly. Its matrix does not own the mapping (owner is 0), so it must be released with q_state_munmap rather than q_state_free.
+    *path. The file. If it exists it must be a state file of the given number of qubits, e.g. a checkpoint from q_state_save, and its amplitudes are used as they are; otherwise it is created with every amplitude zero, as with q_state_calloc.
+    *qubits. The number of qubits.
+  Returns the mapped state "state". Changes are written back to the file.
+*/
+q_state* q_state_mmap(const char* path, int qubits){
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  struct stat info;
+  if(fd < 0 || fstat(fd, &info) != 0){
+    printf("Error: cannot open %s. Terminating.\n", path);
+    exit(0);
+  }
+  size_t length = Q_STATE_HEADER + state_bytes(qubits);
+  int created = info.st_size == 0;
+  if(created && ftruncate(fd, length) != 0){
+    printf("Error: cannot allocate %zu bytes for %s. Terminating.\n", length, path);
+    exit(0);
+  }
+  if(!created && (size_t)info.st_size != length){
+    printf("Error: %s does not hold a %d qubit state. Terminating.\n", path, qubits);
+    exit(0);
+  }
+  char* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED){
+    printf("Error: cannot map %s. Terminating.\n", path);
+    exit(0);
+  }
+  if(created){
+    write_header(base, qubits);
+  }
+  else if(read_header(base, path) != qubits){
+    printf("Error: %s does not hold a %d qubit state. Terminating.\n", path, qubits);
+    exit(0);
+  }
+  q_state* state = malloc(sizeof(q_state));
+  state->qubits = qubits;
+  //The block points into the mapping, which the matrix does not own, so gsl never frees it.
+  gsl_block_complex* block = malloc(sizeof(gsl_block_complex));
+  block->size = (size_t)1 << qubits;
+  block->data = (double*)(base + Q_STATE_HEADER);
+  state->vector = gsl_matrix_complex_alloc_from_block(block, 0, block->size, 1, 1);
+  state->vector->owner = 0;
+  return state;
+}
+
+/**q_state_munmap
+  *Unmaps a state from q_state_mmap, leaving its amplitudes in the file, and frees the struct.
+    *state. The mapped state.
+*/
+void q_state_munmap(q_state* state){
+  char* base = (char*)state->vector->block->data - Q_STATE_HEADER;
+  munmap(base, Q_STATE_HEADER + state_bytes(state->qubits));
+  free(state->vector->block);
+  gsl_matrix_complex_free(state->vector);
+  free(state);
+}
+
+/**q_state_sync
+  *Waits until every change to a mapped state has reached its file, so that the file is a valid checkpoint if the run is interrupted afterwards.
+    *state. The mapped state.
+*/
+void q_state_sync(q_state* state){
+  char* base = (char*)state->vector->block->data - Q_STATE_HEADER;
+  if(msync(base, Q_STATE_HEADER + state_bytes(state->qubits), MS_SYNC) != 0){
+    printf("Error: cannot write back mapped state. Terminating.\n");
+    exit(0);
+  }
+}
+
+/**q_state_save
+  *Writes a state to a state file as one sequential write. The data goes to path.tmp, which is flushed to storage and then renamed over path, so an interrupted save never destroys the previous checkpoint.
+    *state. The state. It is not changed.
+    *path. The file to write.
+*/
+void q_state_save(q_state* state, const char* path){
+  char* tmp = malloc(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+  FILE* file = fopen(tmp, "wb");
+  if(file == NULL){
+    printf("Error: cannot create %s. Terminating.\n", tmp);
+    exit(0);
+  }
+  char header[Q_STATE_HEADER];
+  write_header(header, state->qubits);
+  size_t dim = (size_t)1 << state->qubits;
+  int ok = fwrite(header, Q_STATE_HEADER, 1, file) == 1;
+  if(state->vector->tda == 1){
+    ok = ok && fwrite(state->vector->data, state_bytes(state->qubits), 1, file) == 1;
+  }
+  else{
+    for(size_t i = 0; i < dim && ok; i++){
+      ok = fwrite(state->vector->data + 2 * i * state->vector->tda, 2 * sizeof(double), 1, file) == 1;
+    }
+  }
+  ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+  if(!ok || rename(tmp, path) != 0){
+    printf("Error: cannot write %s. Terminating.\n", path);
+    exit(0);
+  }
+  free(tmp);
+}
+
+/**q_state_load
+  *Reads a state file written by q_state_save, or a mapped state, into memory as one sequential read.
+    *path. The file to read.
+  Returns the loaded state "state"
+*/
+q_state* q_state_load(const char* path){
+  FILE* file = fopen(path, "rb");
+  char header[Q_STATE_HEADER];
+  if(file == NULL || fread(header, Q_STATE_HEADER, 1, file) != 1){
+    printf("Error: cannot read %s. Terminating.\n", path);
+    exit(0);
+  }
+  q_state* state = q_state_alloc(read_header(header, path));
+  if(fread(state->vector->data, state_bytes(state->qubits), 1, file) != 1){
+    printf("Error: %s is truncated. Terminating.\n", path);
+    exit(0);
+  }
+  fclose(file);
+  return state;
+}
+
+/**run_pass
+  *Runs gates first to last - 1 of a circuit in one pass over the chunks of a state. The gates only touch the h top qubits listed in high, in increasing order, besides the chunk qubits. They are recorded again on h + chunk_qubits qubits, with high[j] as qubit j and the chunk qubits after them, and run on each group of 2^h chunks that differ only in the high qubits: in place when h is 0, and otherwise gathered into one buffer.
+*/
+static void run_pass(q_circuit* circuit, q_state* state, int first, int last, const int* high, int h, int chunk_qubits){
+  int top = circuit->qubits - chunk_qubits;
+  size_t chunk = (size_t)1 << chunk_qubits;
+  q_circuit* pass = q_circuit_alloc(h + chunk_qubits);
+  for(int i = first; i < last; i++){
+    q_gate* gate = &circuit->gate_list[i];
+    int targets[gate->k];
+    for(int j = 0; j < gate->k; j++){
+      targets[j] = h + gate->targets[j] - top;
+      for(int l = 0; l < h; l++){
+        if(high[l] == gate->targets[j]) targets[j] = l;
+      }
+    }
+    q_circuit_add(pass, q_op_copy(gate->op), targets, gate->k);
+  }
+  double* amp = state->vector->data;
+  if(h == 0){
+    for(size_t r = 0; r < ((size_t)1 << top); r++){
+      gsl_matrix_complex_view view = gsl_matrix_complex_submatrix(state->vector, r * chunk, 0, chunk, 1);
+      q_state part = {&view.matrix, chunk_qubits};
+      q_circuit_run(pass, &part);
+    }
+  }
+  else{
+    q_state* buffer = q_state_alloc(h + chunk_qubits);
+    size_t count = (size_t)1 << h;
+    size_t masks[h];
+    size_t sorted[h];
+    size_t offsets[count];
+    q_gate_masks(top, high, h, masks, sorted);
+    q_gate_offsets(masks, h, offsets);
+    for(size_t g = 0; g < ((size_t)1 << (top - h)); g++){
+      size_t base = q_insert_zero_bits(g, sorted, h);
+      for(size_t l = 0; l < count; l++){
+        memcpy(buffer->vector->data + 2 * l * chunk, amp + 2 * (base + offsets[l]) * chunk, 2 * chunk * sizeof(double));
+      }
+      q_circuit_run(pass, buffer);
+      for(size_t l = 0; l < count; l++){
+        memcpy(amp + 2 * (base + offsets[l]) * chunk, buffer->vector->data + 2 * l * chunk, 2 * chunk * sizeof(double));
+      }
+    }
+    q_state_free(buffer);
+  }
+  q_circuit_free(pass);
+}
+
+/**q_circuit_run_chunked
+  *Executes every recorded gate of a circuit against a state in place, in passes over contiguous chunks of 2^chunk_qubits amplitudes, for mapped states and other states much larger than the caches. Gates on qubits inside a chunk run chunk by chunk with the ordinary kernels. A gate on the top n - chunk_qubits qubits needs the chunks that differ in those qubits together, so consecutive gates are grouped greedily into passes that each touch at most Q_CHUNK_HIGH_QUBITS of them; a pass gathers those 2^h chunks into a buffer, runs all its gates there and writes them back. The state is then read and written once per pass rather than once per gate, each time in whole chunks.
+    *circuit. The circuit to execute.
+    *state. The state to apply the circuit to. It is overwritten.
+    *chunk_qubits. The number of qubits per chunk. Chunks of 2^20 to 2^24 amplitudes (16 MB to 256 MB) suit storage backed states.
+*/
+void q_circuit_run_chunked(q_circuit* circuit, q_state* state, int chunk_qubits){
+  if(circuit->qubits != state->qubits){
+    printf("Error: size mismatch in circuit execution. Terminating.\n");
+    exit(0);
+  }
+  if(chunk_qubits < 1){
+    printf("Error: chunks must hold at least one qubit. Terminating.\n");
+    exit(0);
+  }
+  if(chunk_qubits >= circuit->qubits || state->vector->tda != 1){
+    q_circuit_run(circuit, state);
+    return;
+  }
+  int top = circuit->qubits - chunk_qubits;
+  int first = 0;
+  while(first < circuit->gates){
+    //Grow the pass while the top qubits its gates touch fit in Q_CHUNK_HIGH_QUBITS; a first gate that needs more gets a pass of its own.
+    unsigned char used[top];
+    memset(used, 0, top);
+    int h = 0;
+    int last = first;
+    while(last < circuit->gates){
+      q_gate* gate = &circuit->gate_list[last];
+      int extra = 0;
+      for(int j = 0; j < gate->k; j++){
+        if(gate->targets[j] < top && !used[gate->targets[j]]) extra++;
+      }
+      if(last > first && h + extra > Q_CHUNK_HIGH_QUBITS) break;
+      for(int j = 0; j < gate->k; j++){
+        if(gate->targets[j] < top && !used[gate->targets[j]]){
+          used[gate->targets[j]] = 1;
+          h++;
+        }
+      }
+      last++;
+    }
+    int high[h > 0 ? h : 1];
+    h = 0;
+    for(int q = 0; q < top; q++){
+      if(used[q]) high[h++] = q;
+    }
+    run_pass(circuit, state, first, last, high, h, chunk_qubits);
+    first = last;
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef Q_DISK_H
+#define Q_DISK_H
+
+#include "q_circuit.h"
+
+//State files, written by q_state_save and mapped by q_state_mmap, start with a header of Q_STATE_HEADER bytes holding Q_STATE_MAGIC and the number of qubits as an int, followed by the 2^n amplitudes as interleaved doubles in native byte order. The header fills a page so that mapped amplitudes stay aligned for the vectorised kernels.
+#define Q_STATE_HEADER 4096
+#define Q_STATE_MAGIC "QSTATE01"
+
+//Largest number of qubits above the chunk that one pass of q_circuit_run_chunked gathers, unless a single gate needs more. Each pass holds 2^(chunk_qubits + Q_CHUNK_HIGH_QUBITS) amplitudes in memory.
+#define Q_CHUNK_HIGH_QUBITS 3
+
+/**q_state_mmap
+  *Maps a state file into memory, so that registers larger than RAM can be simulated from fast storage, with the operating system paging amplitudes in and out. The result is an ordinary q_state and works with every function of q_circuit.c, but a chunked execution with q_circuit_run_chunked keeps the accesses page friendly. Its matrix does not own the mapping (owner is 0), so it must be released with q_state_munmap rather than q_state_free.
+    *path. The file. If it exists it must be a state file of the given number of qubits, e.g. a checkpoint from q_state_save, and its amplitudes are used as they are; otherwise it is created with every amplitude zero, as with q_state_calloc.
+    *qubits. The number of qubits.
+  Returns the mapped state "state". Changes are written back to the file.
+*/
+q_state* q_state_mmap(const char* path, int qubits);
+
+/**q_state_munmap
+  *Unmaps a state from q_state_mmap, leaving its amplitudes in the file, and frees the struct.
+    *state. The mapped state.
+*/
+void q_state_munmap(q_state* state);
+
+/**q_state_sync
+  *Waits until every change to a mapped state has reached its file, so that the file is a valid checkpoint if the run is interrupted afterwards.
+    *state. The mapped state.
+*/
+void q_state_sync(q_state* state);
+
+/**q_state_save
+  *Writes a state to a state file as one sequential write. The data goes to path.tmp, which is flushed to storage and then renamed over path, so an interrupted save never destroys the previous checkpoint.
+    *state. The state. It is not changed.
+    *path. The file to write.
+*/
+void q_state_save(q_state* state, const char* path);
+
+/**q_state_load
+  *Reads a state file written by q_state_save, or a mapped state, into memory as one sequential read.
+    *path. The file to read.
+  Returns the loaded state "state"
+*/
+q_state* q_state_load(const char* path);
+
+/**q_circuit_run_chunked
+  *Executes every recorded gate of a circuit against a state in place, in passes over contiguous chunks of 2^chunk_qubits amplitudes, for mapped states and other states much larger than the caches. Gates on qubits inside a chunk run chunk by chunk with the ordinary kernels. A gate on the top n - chunk_qubits qubits needs the chunks that differ in those qubits together, so consecutive gates are grouped greedily into passes that each touch at most Q_CHUNK_HIGH_QUBITS of them; a pass gathers those 2^h chunks into a buffer, runs all its gates there and writes them back. The state is then read and written once per pass rather than once per gate, each time in whole chunks.
+    *circuit. The circuit to execute.
+    *state. The state to apply the circuit to. It is overwritten.
+    *chunk_qubits. The number of qubits per chunk. Chunks of 2^20 to 2^24 amplitudes (16 MB to 256 MB) suit storage backed states.
+*/
+void q_circuit_run_chunked(q_circuit* circuit, q_state* state, int chunk_qubits);
+#endif
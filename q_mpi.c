@@ -0,0 +1,429 @@
+#include "q_mpi.h"
+
+#ifdef Q_MPI
+#include <string.h>
+
+/**rank_bit
+  *Returns this rank's value of a global physical qubit.
+*/
+static int rank_bit(q_mpi_state* state, int physical){
+  return (state->rank >> (state->global - 1 - physical)) & 1;
+}
+
+/**local_mask
+  *Returns the mask of a local physical qubit on the index of the local amplitudes.
+*/
+static size_t local_mask(q_mpi_state* state, int physical){
+  return (size_t)1 << (state->qubits - 1 - physical);
+}
+
+/**exchange
+  *Swaps count doubles with a partner rank in place, in messages of at most Q_MPI_MESSAGE doubles.
+*/
+static void exchange(q_mpi_state* state, double* data, size_t count, int partner){
+  for(size_t done = 0; done < count; done += Q_MPI_MESSAGE){
+    int part = count - done < Q_MPI_MESSAGE ? count - done : Q_MPI_MESSAGE;
+    MPI_Sendrecv_replace(data + done, part, MPI_DOUBLE, partner, 0, partner, 0, state->comm, MPI_STATUS_IGNORE);
+  }
+}
+
+/**swap_physical
+  *Swaps the amplitudes of two physical qubits and the logical qubits sitting on them. Two local qubits are swapped in place. A global and a local qubit exchange the half of the local amplitudes whose local bit differs from the rank's global bit with the partner rank differing in that bit; the half is contiguous for the top local qubit and packed otherwise. Two global qubits exchange whole local vectors between the ranks whose bits for them differ.
+*/
+static void swap_physical(q_mpi_state* state, int a, int b){
+  int g = state->global;
+  if(a > b){
+    int t = a;
+    a = b;
+    b = t;
+  }
+  if(a == b) return;
+  size_t dim = (size_t)1 << state->local->qubits;
+  double* amp = state->local->vector->data;
+  if(a >= g){
+    q_state_swap_qubits(state->local, a - g, b - g);
+  }
+  else if(b >= g){
+    int bit = rank_bit(state, a);
+    int partner = state->rank ^ (1 << (g - 1 - a));
+    size_t half = dim / 2;
+    if(b == g){
+      exchange(state, amp + (bit ? 0 : 2 * half), 2 * half, partner);
+    }
+    else{
+      size_t mask = local_mask(state, b);
+      size_t set = bit ? 0 : mask;
+      double* packed = malloc(2 * half * sizeof(double));
+      #pragma omp parallel for if(half >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+      for(size_t i = 0; i < half; i++){
+        size_t index = ((i & ~(mask - 1)) << 1) | (i & (mask - 1)) | set;
+        packed[2 * i] = amp[2 * index];
+        packed[2 * i + 1] = amp[2 * index + 1];
+      }
+      exchange(state, packed, 2 * half, partner);
+      #pragma omp parallel for if(half >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+      for(size_t i = 0; i < half; i++){
+        size_t index = ((i & ~(mask - 1)) << 1) | (i & (mask - 1)) | set;
+        amp[2 * index] = packed[2 * i];
+        amp[2 * index + 1] = packed[2 * i + 1];
+      }
+      free(packed);
+    }
+  }
+  else if(rank_bit(state, a) != rank_bit(state, b)){
+    int partner = state->rank ^ (1 << (g - 1 - a)) ^ (1 << (g - 1 - b));
+    exchange(state, amp, 2 * dim, partner);
+  }
+  for(int q = 0; q < state->qubits; q++){
+    if(state->map[q] == a) state->map[q] = b;
+    else if(state->map[q] == b) state->map[q] = a;
+  }
+}
+
+/**restore_layout
+  *Swaps physical qubits until every logical qubit sits on the physical qubit of the same number.
+*/
+static void restore_layout(q_mpi_state* state){
+  for(int q = 0; q < state->qubits; q++){
+    if(state->map[q] != q){
+      swap_physical(state, q, state->map[q]);
+    }
+  }
+}
+
+/**mpi_state_alloc
+  *Allocates a distributed state with the identity layout and uninitialised amplitudes.
+*/
+static q_mpi_state* mpi_state_alloc(int qubits, MPI_Comm comm){
+  int size;
+  MPI_Comm_size(comm, &size);
+  int global = 0;
+  while((1 << global) < size){
+    global++;
+  }
+  if((1 << global) != size || global >= qubits){
+    printf("Error: %d ranks cannot hold a %d qubit state; use a power of two below 2^%d. Terminating.\n", size, qubits, qubits);
+    exit(0);
+  }
+  q_mpi_state* state = malloc(sizeof(q_mpi_state));
+  MPI_Comm_dup(comm, &state->comm);
+  MPI_Comm_rank(state->comm, &state->rank);
+  state->qubits = qubits;
+  state->global = global;
+  state->local = q_state_alloc(qubits - global);
+  state->map = malloc(qubits * sizeof(int));
+  for(int q = 0; q < qubits; q++){
+    state->map[q] = q;
+  }
+  return state;
+}
+
+/**q_mpi_state_alloc
+  *Allocates a distributed state initialised to |0...0>. Collective over the communicator.
+    *qubits. The number of qubits.
+    *comm. The communicator. Its size must be a power of two, at most 2^(qubits - 1). It is duplicated, so messages never mix with the caller's.
+  Returns this rank's part of the state "state"
+*/
+q_mpi_state* q_mpi_state_alloc(int qubits, MPI_Comm comm){
+  q_mpi_state* state = mpi_state_alloc(qubits, comm);
+  gsl_matrix_complex_set_zero(state->local->vector);
+  if(state->rank == 0){
+    gsl_matrix_complex_set(state->local->vector, 0, 0, GSL_COMPLEX_ONE);
+  }
+  return state;
+}
+
+/**q_mpi_state_free
+  *Frees a distributed state. Collective over its communicator.
+    *state. The state to free.
+*/
+void q_mpi_state_free(q_mpi_state* state){
+  MPI_Comm_free(&state->comm);
+  q_state_free(state->local);
+  free(state->map);
+  free(state);
+}
+
+/**q_mpi_state_from_state
+  *Distributes a state held in full by every rank, each rank keeping only its own slice. Meant for tests and for registers small enough to build on one node. Collective.
+    *full. The state. It is not changed.
+    *comm. The communicator, as in q_mpi_state_alloc.
+  Returns this rank's part of the state "state"
+*/
+q_mpi_state* q_mpi_state_from_state(q_state* full, MPI_Comm comm){
+  q_mpi_state* state = mpi_state_alloc(full->qubits, comm);
+  size_t dim = (size_t)1 << state->local->qubits;
+  gsl_matrix_complex_view slice = gsl_matrix_complex_submatrix(full->vector, state->rank * dim, 0, dim, 1);
+  gsl_matrix_complex_memcpy(state->local->vector, &slice.matrix);
+  return state;
+}
+
+/**q_mpi_state_gather
+  *Collects a distributed state on one rank, restoring the identity qubit layout first. Collective.
+    *state. The distributed state. Its amplitudes may be moved between ranks, but it represents the same state.
+    *root. The rank that receives the state.
+  Returns the full state "full" on root, and NULL on every other rank.
+*/
+q_state* q_mpi_state_gather(q_mpi_state* state, int root){
+  restore_layout(state);
+  size_t count = 2 * ((size_t)1 << state->local->qubits);
+  if(state->rank != root){
+    for(size_t done = 0; done < count; done += Q_MPI_MESSAGE){
+      int part = count - done < Q_MPI_MESSAGE ? count - done : Q_MPI_MESSAGE;
+      MPI_Send(state->local->vector->data + done, part, MPI_DOUBLE, root, 0, state->comm);
+    }
+    return NULL;
+  }
+  q_state* full = q_state_alloc(state->qubits);
+  for(int r = 0; r < (1 << state->global); r++){
+    double* slice = full->vector->data + r * count;
+    if(r == root){
+      memcpy(slice, state->local->vector->data, count * sizeof(double));
+      continue;
+    }
+    for(size_t done = 0; done < count; done += Q_MPI_MESSAGE){
+      int part = count - done < Q_MPI_MESSAGE ? count - done : Q_MPI_MESSAGE;
+      MPI_Recv(slice + done, part, MPI_DOUBLE, r, 0, state->comm, MPI_STATUS_IGNORE);
+    }
+  }
+  return full;
+}
+
+/**apply_gate
+  *Applies a gate whose diagonal, if it has one, is given, so recorded circuits do not classify their gates again.
+*/
+static void apply_gate(q_mpi_state* state, q_op* gate, const int* targets, int k, gsl_vector_complex* diagonal){
+  int g = state->global;
+  int n = state->qubits;
+  if(gate->qubits != k || k > n - g){
+    printf("Error: a %d qubit gate does not fit on %d local qubits. Terminating.\n", k, n - g);
+    exit(0);
+  }
+  int physical[k];
+  int globals = 0;
+  for(int i = 0; i < k; i++){
+    if(targets[i] < 0 || targets[i] >= n){
+      printf("Error: qubit %d out of range. Terminating.\n", targets[i]);
+      exit(0);
+    }
+    for(int j = 0; j < i; j++){
+      if(targets[j] == targets[i]){
+        printf("Error: repeated target qubit %d. Terminating.\n", targets[i]);
+        exit(0);
+      }
+    }
+    physical[i] = state->map[targets[i]];
+    globals += physical[i] < g;
+  }
+  if(globals > 0 && diagonal != NULL){
+    //Fix the global bits to this rank's values and keep the diagonal entries of the local ones.
+    int local[k];
+    int m = 0;
+    size_t fixed = 0;
+    for(int i = 0; i < k; i++){
+      if(physical[i] >= g) local[m++] = physical[i] - g;
+      else if(rank_bit(state, physical[i])) fixed |= (size_t)1 << (k - 1 - i);
+    }
+    gsl_vector_complex* phases = gsl_vector_complex_alloc((size_t)1 << m);
+    for(size_t l = 0; l < ((size_t)1 << m); l++){
+      size_t index = fixed;
+      int j = 0;
+      for(int i = 0; i < k; i++){
+        if(physical[i] >= g && (l & ((size_t)1 << (m - 1 - j++)))) index |= (size_t)1 << (k - 1 - i);
+      }
+      gsl_vector_complex_set(phases, l, gsl_vector_complex_get(diagonal, index));
+    }
+    if(m > 0){
+      q_state_apply_diagonal(state->local, phases, local, m);
+    }
+    else{
+      gsl_matrix_complex_scale(state->local->vector, gsl_vector_complex_get(phases, 0));
+    }
+    gsl_vector_complex_free(phases);
+    return;
+  }
+  for(int i = 0; i < k; i++){
+    if(physical[i] >= g) continue;
+    //Bring the global target onto the highest local qubit the gate leaves free, whose half of the local amplitudes is contiguous.
+    int free_qubit = g;
+    for(int used = 1; used; ){
+      used = 0;
+      for(int j = 0; j < k; j++){
+        if(physical[j] == free_qubit){
+          used = 1;
+          free_qubit++;
+        }
+      }
+    }
+    swap_physical(state, physical[i], free_qubit);
+    physical[i] = free_qubit;
+  }
+  int local[k];
+  for(int i = 0; i < k; i++){
+    local[i] = physical[i] - g;
+  }
+  q_state_apply_gate(state->local, gate, local, k);
+}
+
+/**q_mpi_state_apply_gate
+  *Applies a k-qubit q_op to the given target qubits in place. Collective. If every target is local the gate runs with the kernels of q_state_apply_gate and no communication. A diagonal gate on global qubits needs none either: each rank applies the diagonal restricted to its own values of those qubits. Otherwise every global target is first swapped with a local qubit the gate does not touch, which exchanges half of the local amplitudes with one partner rank per swap; the swap is kept in the qubit map, so later gates on the same qubits are local.
+    *state. The distributed state. It is overwritten.
+    *gate. The k-qubit q_op, with k at most the number of local qubits.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_mpi_state_apply_gate(q_mpi_state* state, q_op* gate, const int* targets, int k){
+  gsl_vector_complex* diagonal = NULL;
+  int globals = 0;
+  for(int i = 0; i < k; i++){
+    globals += targets[i] >= 0 && targets[i] < state->qubits && state->map[targets[i]] < state->global;
+  }
+  if(globals > 0 && gate->lazy == NULL && q_op_is_diagonal(gate)){
+    diagonal = gsl_vector_complex_alloc((size_t)1 << k);
+    for(size_t i = 0; i < ((size_t)1 << k); i++){
+      gsl_vector_complex_set(diagonal, i, q_op_get(gate, i, i));
+    }
+  }
+  apply_gate(state, gate, targets, k, diagonal);
+  if(diagonal != NULL){
+    gsl_vector_complex_free(diagonal);
+  }
+}
+
+/**q_mpi_circuit_run
+  *Executes every recorded gate of a circuit, in order, against a distributed state in place, reusing the diagonals found when the gates were recorded. Collective.
+    *circuit. The circuit to execute.
+    *state. The distributed state. It is overwritten.
+*/
+void q_mpi_circuit_run(q_circuit* circuit, q_mpi_state* state){
+  if(circuit->qubits != state->qubits){
+    printf("Error: size mismatch in circuit execution. Terminating.\n");
+    exit(0);
+  }
+  for(int i = 0; i < circuit->gates; i++){
+    q_gate* gate = &circuit->gate_list[i];
+    apply_gate(state, gate->op, gate->targets, gate->k, gate->type == Q_GATE_DIAGONAL ? gate->diagonal : NULL);
+  }
+}
+
+/**branch_weights
+  *Computes the squared norms of the two branches of a qubit over the whole distributed state. Local sums are taken in fixed chunks, with at most Q_REDUCE_PARTS runs of them in a stack buffer as in reduce_norm, and then added over ranks by MPI_Allreduce.
+*/
+static void branch_weights(q_mpi_state* state, int qubit, double* p){
+  if(qubit < 0 || qubit >= state->qubits){
+    printf("Error: qubit %d out of range in measurement. Terminating.\n", qubit);
+    exit(0);
+  }
+  int physical = state->map[qubit];
+  size_t dim = (size_t)1 << state->local->qubits;
+  const double* amp = state->local->vector->data;
+  size_t mask = physical >= state->global ? local_mask(state, physical) : 0;
+  size_t chunks = (dim + Q_REDUCE_CHUNK - 1) / Q_REDUCE_CHUNK;
+  size_t per = (chunks + Q_REDUCE_PARTS - 1) / Q_REDUCE_PARTS;
+  size_t parts = (chunks + per - 1) / per;
+  double partial[2 * Q_REDUCE_PARTS];
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t s = 0; s < parts; s++){
+    double part[2] = {0.0, 0.0};
+    for(size_t c = s * per; c < (s + 1) * per && c < chunks; c++){
+      size_t end = (c + 1) * Q_REDUCE_CHUNK < dim ? (c + 1) * Q_REDUCE_CHUNK : dim;
+      double sum[2] = {0.0, 0.0};
+      for(size_t i = c * Q_REDUCE_CHUNK; i < end; i++){
+        sum[(i & mask) != 0] += amp[2 * i] * amp[2 * i] + amp[2 * i + 1] * amp[2 * i + 1];
+      }
+      part[0] += sum[0];
+      part[1] += sum[1];
+    }
+    partial[2 * s] = part[0];
+    partial[2 * s + 1] = part[1];
+  }
+  double local[2] = {0.0, 0.0};
+  for(size_t s = 0; s < parts; s++){
+    local[0] += partial[2 * s];
+    local[1] += partial[2 * s + 1];
+  }
+  if(physical < state->global && rank_bit(state, physical)){
+    local[1] = local[0];
+    local[0] = 0.0;
+  }
+  MPI_Allreduce(local, p, 2, MPI_DOUBLE, MPI_SUM, state->comm);
+}
+
+/**q_mpi_state_normalize
+  *Normalizes a distributed state, with the norm summed over ranks by MPI_Allreduce. Collective.
+    *state. The state to normalize.
+*/
+void q_mpi_state_normalize(q_mpi_state* state){
+  double p[2];
+  branch_weights(state, 0, p);
+  gsl_complex scale;
+  GSL_SET_COMPLEX(&scale, 1.0 / sqrt(p[0] + p[1]), 0.0);
+  gsl_matrix_complex_scale(state->local->vector, scale);
+}
+
+/**q_mpi_state_probability
+  *Computes the probability of measuring a given outcome on a qubit, relative to the state's norm. Collective; every rank gets the result.
+    *state. The distributed state.
+    *qubit. The qubit.
+    *outcome. The outcome, 0 or 1.
+  *Returns the probability p of the outcome.
+*/
+double q_mpi_state_probability(q_mpi_state* state, int qubit, int outcome){
+  double p[2];
+  branch_weights(state, qubit, p);
+  return p[outcome != 0] / (p[0] + p[1]);
+}
+
+/**q_mpi_state_measure_random
+  *Measures a qubit in place, choosing the outcome with its Born probability and keeping only that branch, renormalised. Collective.
+    *state. The distributed state. It is overwritten.
+    *qubit. The qubit.
+    *rng. The random number generator. Every rank must pass a generator in the same state, so that they all draw the same outcome.
+  *Returns the outcome, 0 or 1.
+*/
+int q_mpi_state_measure_random(q_mpi_state* state, int qubit, q_rng* rng){
+  double p[2];
+  branch_weights(state, qubit, p);
+  int outcome = q_rng_uniform(rng) * (p[0] + p[1]) >= p[0];
+  double scale = 1.0 / sqrt(p[outcome]);
+  int physical = state->map[qubit];
+  size_t dim = (size_t)1 << state->local->qubits;
+  double* amp = state->local->vector->data;
+  if(physical < state->global){
+    //The whole local vector is in one branch.
+    gsl_complex factor;
+    GSL_SET_COMPLEX(&factor, rank_bit(state, physical) == outcome ? scale : 0.0, 0.0);
+    gsl_matrix_complex_scale(state->local->vector, factor);
+    return outcome;
+  }
+  size_t mask = local_mask(state, physical);
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < dim; i++){
+    double f = ((i & mask) != 0) == outcome ? scale : 0.0;
+    amp[2 * i] *= f;
+    amp[2 * i + 1] *= f;
+  }
+  return outcome;
+}
+
+/**q_mpi_fidelity
+  *Computes the fidelity |<a|b>| between two distributed states on the same communicator, as fidelity does for q_states, with the local inner products summed by MPI_Allreduce. Collective. If the states have different qubit layouts, both are first restored to the identity layout.
+    *a. The first distributed state.
+    *b. The second distributed state.
+  *Returns the fidelity.
+*/
+double q_mpi_fidelity(q_mpi_state* a, q_mpi_state* b){
+  if(a->qubits != b->qubits || a->global != b->global){
+    printf("Error: size mismatch in fidelity. Terminating.\n");
+    exit(0);
+  }
+  if(memcmp(a->map, b->map, a->qubits * sizeof(int)) != 0){
+    restore_layout(a);
+    restore_layout(b);
+  }
+  gsl_complex local = q_state_inner(a->local, b->local);
+  double sum[2];
+  MPI_Allreduce(local.dat, sum, 2, MPI_DOUBLE, MPI_SUM, a->comm);
+  return hypot(sum[0], sum[1]);
+}
+#endif
@@ -0,0 +1,101 @@
+#ifndef Q_MPI_H
+#define Q_MPI_H
+
+//Distributed states are only built when the library is compiled with MPI and -DQ_MPI, e.g. mpicc -DQ_MPI, and run with mpirun; without Q_MPI this module is empty.
+#ifdef Q_MPI
+
+#include <mpi.h>
+#include "q_circuit.h"
+
+//Largest number of doubles sent in one MPI message, so that counts fit in an int and the library's exchange buffers stay small.
+#define Q_MPI_MESSAGE ((size_t)1 << 24)
+
+//An n-qubit state split across the 2^g ranks of a communicator. Amplitudes are laid out on n physical qubits: the top g select the rank, which holds the 2^(n - g) amplitudes of the remaining, local ones in local. Logical qubit q, as used by gates, currently sits on physical qubit map[q]; gates on global qubits swap them into local positions instead of communicating every time.
+typedef struct q_mpi_state{
+  q_state* local;
+  int* map;
+  int qubits;
+  int global;
+  int rank;
+  MPI_Comm comm;
+} q_mpi_state;
+
+/**q_mpi_state_alloc
+  *Allocates a distributed state initialised to |0...0>. Collective over the communicator.
+    *qubits. The number of qubits.
+    *comm. The communicator. Its size must be a power of two, at most 2^(qubits - 1). It is duplicated, so messages never mix with the caller's.
+  Returns this rank's part of the state "state"
+*/
+q_mpi_state* q_mpi_state_alloc(int qubits, MPI_Comm comm);
+
+/**q_mpi_state_free
+  *Frees a distributed state. Collective over its communicator.
+    *state. The state to free.
+*/
+void q_mpi_state_free(q_mpi_state* state);
+
+/**q_mpi_state_from_state
+  *Distributes a state held in full by every rank, each rank keeping only its own slice. Meant for tests and for registers small enough to build on one node. Collective.
+    *full. The state. It is not changed.
+    *comm. The communicator, as in q_mpi_state_alloc.
+  Returns this rank's part of the state "state"
+*/
+q_mpi_state* q_mpi_state_from_state(q_state* full, MPI_Comm comm);
+
+/**q_mpi_state_gather
+  *Collects a distributed state on one rank, restoring the identity qubit layout first. Collective.
+    *state. The distributed state. Its amplitudes may be moved between ranks, but it represents the same state.
+    *root. The rank that receives the state.
+  Returns the full state "full" on root, and NULL on every other rank.
+*/
+q_state* q_mpi_state_gather(q_mpi_state* state, int root);
+
+/**q_mpi_state_apply_gate
+  *Applies a k-qubit q_op to the given target qubits in place. Collective. If every target is local the gate runs with the kernels of q_state_apply_gate and no communication. A diagonal gate on global qubits needs none either: each rank applies the diagonal restricted to its own values of those qubits. Otherwise every global target is first swapped with a local qubit the gate does not touch, which exchanges half of the local amplitudes with one partner rank per swap; the swap is kept in the qubit map, so later gates on the same qubits are local.
+    *state. The distributed state. It is overwritten.
+    *gate. The k-qubit q_op, with k at most the number of local qubits.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits.
+*/
+void q_mpi_state_apply_gate(q_mpi_state* state, q_op* gate, const int* targets, int k);
+
+/**q_mpi_circuit_run
+  *Executes every recorded gate of a circuit, in order, against a distributed state in place, reusing the diagonals found when the gates were recorded. Collective.
+    *circuit. The circuit to execute.
+    *state. The distributed state. It is overwritten.
+*/
+void q_mpi_circuit_run(q_circuit* circuit, q_mpi_state* state);
+
+/**q_mpi_state_normalize
+  *Normalizes a distributed state, with the norm summed over ranks by MPI_Allreduce. Collective.
+    *state. The state to normalize.
+*/
+void q_mpi_state_normalize(q_mpi_state* state);
+
+/**q_mpi_state_probability
+  *Computes the probability of measuring a given outcome on a qubit, relative to the state's norm. Collective; every rank gets the result.
+    *state. The distributed state.
+    *qubit. The qubit.
+    *outcome. The outcome, 0 or 1.
+  *Returns the probability p of the outcome.
+*/
+double q_mpi_state_probability(q_mpi_state* state, int qubit, int outcome);
+
+/**q_mpi_state_measure_random
+  *Measures a qubit in place, choosing the outcome with its Born probability and keeping only that branch, renormalised. Collective.
+    *state. The distributed state. It is overwritten.
+    *qubit. The qubit.
+    *rng. The random number generator. Every rank must pass a generator in the same state, so that they all draw the same outcome.
+  *Returns the outcome, 0 or 1.
+*/
+int q_mpi_state_measure_random(q_mpi_state* state, int qubit, q_rng* rng);
+
+/**q_mpi_fidelity
+  *Computes the fidelity |<a|b>| between two distributed states on the same communicator, as fidelity does for q_states, with the local inner products summed by MPI_Allreduce. Collective. If the states have different qubit layouts, both are first restored to the identity layout.
+    *a. The first distributed state.
+    *b. The second distributed state.
+  *Returns the fidelity.
+*/
+double q_mpi_fidelity(q_mpi_state* a, q_mpi_state* b);
+#endif
+#endif
@@ -0,0 +1,657 @@
+#include "q_mps.h"
+#include <string.h>
+
+/**q_mps_alloc
+  *Allocates a matrix product state initialised to |0...0>. Memory grows as n * max_bond^2 rather than 2^n.
+    *qubits. The number of qubits.
+    *max_bond. The largest bond dimension kept when gates are applied. Larger values are more accurate for more entangled states.
+  Returns the generated state "mps"
+*/
+q_mps* q_mps_alloc(int qubits, int max_bond){
+  q_mps* mps = malloc(sizeof(q_mps));
+  mps->qubits = qubits;
+  mps->max_bond = max_bond;
+  mps->center = 0;
+  mps->truncation_error = 0.0;
+  mps->bonds = malloc((qubits + 1) * sizeof(int));
+  mps->sites = malloc(qubits * sizeof(double*));
+  for(int i = 0; i <= qubits; i++){
+    mps->bonds[i] = 1;
+  }
+  for(int i = 0; i < qubits; i++){
+    mps->sites[i] = calloc(4, sizeof(double));
+    mps->sites[i][0] = 1.0;
+  }
+  return mps;
+}
+
+/**q_mps_free
+  *Frees a given matrix product state.
+    *mps. The state to free.
+*/
+void q_mps_free(q_mps* mps){
+  for(int i = 0; i < mps->qubits; i++){
+    free(mps->sites[i]);
+  }
+  free(mps->sites);
+  free(mps->bonds);
+  free(mps);
+}
+
+/**jacobi_svd
+  *One-sided (Hestenes) Jacobi SVD of an m x n complex matrix with m >= n, row major and interleaved. Pairs of columns are rotated until they are all orthogonal; the column norms are then the singular values. u receives the m x n left vectors, s the n singular values in decreasing order and v the n x n right vectors, so that a = u diag(s) v^H.
+*/
+static void jacobi_svd(const double* a, int m, int n, double* u, double* s, double* v){
+  //Work on columns, which are contiguous in w and vc.
+  double* w = malloc(2 * (size_t)m * n * sizeof(double));
+  double* vc = calloc(2 * (size_t)n * n, sizeof(double));
+  for(int i = 0; i < m; i++){
+    for(int j = 0; j < n; j++){
+      w[2 * ((size_t)j * m + i)] = a[2 * ((size_t)i * n + j)];
+      w[2 * ((size_t)j * m + i) + 1] = a[2 * ((size_t)i * n + j) + 1];
+    }
+  }
+  double total = 0.0;
+  for(size_t i = 0; i < 2 * (size_t)m * n; i++){
+    total += w[i] * w[i];
+  }
+  for(int j = 0; j < n; j++){
+    vc[2 * ((size_t)j * n + j)] = 1.0;
+  }
+  for(int sweep = 0; sweep < 100; sweep++){
+    int rotated = 0;
+    for(int i = 0; i < n - 1; i++){
+      for(int j = i + 1; j < n; j++){
+        double* wi = w + 2 * (size_t)i * m;
+        double* wj = w + 2 * (size_t)j * m;
+        double alpha = 0.0, beta = 0.0, gr = 0.0, gi = 0.0;
+        for(int r = 0; r < m; r++){
+          alpha += wi[2 * r] * wi[2 * r] + wi[2 * r + 1] * wi[2 * r + 1];
+          beta += wj[2 * r] * wj[2 * r] + wj[2 * r + 1] * wj[2 * r + 1];
+          gr += wi[2 * r] * wj[2 * r] + wi[2 * r + 1] * wj[2 * r + 1];
+          gi += wi[2 * r] * wj[2 * r + 1] - wi[2 * r + 1] * wj[2 * r];
+        }
+        //Columns far below the largest singular value are left alone, as their rotations would lose precision in denormals and they are truncated anyway.
+        double g = hypot(gr, gi);
+        if(g <= 1e-15 * sqrt(alpha) * sqrt(beta) || alpha <= 1e-40 * total || beta <= 1e-40 * total) continue;
+        rotated = 1;
+        //Rotate column i against e^(-i phi) column j, where <i|j> = g e^(i phi) so the pair becomes real.
+        double pr = gr / g, pi = -gi / g;
+        double zeta = (beta - alpha) / (2.0 * g);
+        double t = (zeta >= 0.0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+        double c = 1.0 / sqrt(1.0 + t * t);
+        double sn = c * t;
+        double* cols[2][2] = {{wi, wj}, {vc + 2 * (size_t)i * n, vc + 2 * (size_t)j * n}};
+        int lengths[2] = {m, n};
+        for(int x = 0; x < 2; x++){
+          double* ci = cols[x][0];
+          double* cj = cols[x][1];
+          for(int r = 0; r < lengths[x]; r++){
+            double ar = ci[2 * r], ai = ci[2 * r + 1];
+            double br = pr * cj[2 * r] - pi * cj[2 * r + 1];
+            double bi = pr * cj[2 * r + 1] + pi * cj[2 * r];
+            ci[2 * r] = c * ar - sn * br;
+            ci[2 * r + 1] = c * ai - sn * bi;
+            cj[2 * r] = sn * ar + c * br;
+            cj[2 * r + 1] = sn * ai + c * bi;
+          }
+        }
+      }
+    }
+    if(!rotated) break;
+  }
+  double* norms = malloc(n * sizeof(double));
+  int* order = malloc(n * sizeof(int));
+  for(int j = 0; j < n; j++){
+    double sum = 0.0;
+    for(int r = 0; r < m; r++){
+      sum += w[2 * ((size_t)j * m + r)] * w[2 * ((size_t)j * m + r)] + w[2 * ((size_t)j * m + r) + 1] * w[2 * ((size_t)j * m + r) + 1];
+    }
+    norms[j] = sqrt(sum);
+    int pos = j;
+    while(pos > 0 && norms[order[pos - 1]] < norms[j]){
+      order[pos] = order[pos - 1];
+      pos--;
+    }
+    order[pos] = j;
+  }
+  for(int k = 0; k < n; k++){
+    int j = order[k];
+    s[k] = norms[j];
+    double scale = norms[j] > 0.0 ? 1.0 / norms[j] : 0.0;
+    for(int r = 0; r < m; r++){
+      u[2 * ((size_t)r * n + k)] = w[2 * ((size_t)j * m + r)] * scale;
+      u[2 * ((size_t)r * n + k) + 1] = w[2 * ((size_t)j * m + r) + 1] * scale;
+    }
+    for(int r = 0; r < n; r++){
+      v[2 * ((size_t)r * n + k)] = vc[2 * ((size_t)j * n + r)];
+      v[2 * ((size_t)r * n + k) + 1] = vc[2 * ((size_t)j * n + r) + 1];
+    }
+  }
+  free(w);
+  free(vc);
+  free(norms);
+  free(order);
+}
+
+/**svd
+  *SVD of any m x n complex matrix, a = u diag(s) v^H with k = min(m, n) singular values in decreasing order, u m x k and v n x k. Wide matrices are handled through their adjoint.
+  *Returns k.
+*/
+static int svd(const double* a, int m, int n, double* u, double* s, double* v){
+  if(m >= n){
+    jacobi_svd(a, m, n, u, s, v);
+    return n;
+  }
+  double* h = malloc(2 * (size_t)m * n * sizeof(double));
+  for(int i = 0; i < m; i++){
+    for(int j = 0; j < n; j++){
+      h[2 * ((size_t)j * m + i)] = a[2 * ((size_t)i * n + j)];
+      h[2 * ((size_t)j * m + i) + 1] = -a[2 * ((size_t)i * n + j) + 1];
+    }
+  }
+  jacobi_svd(h, n, m, v, s, u);
+  free(h);
+  return m;
+}
+
+/**truncate
+  *Chooses how many singular values to keep: at most max_bond, and only those above Q_MPS_CUTOFF times the largest. The kept values are rescaled to the original norm.
+  *Returns the number kept and adds the discarded fraction of the weight to *error.
+*/
+static int truncate(double* s, int k, int max_bond, double* error){
+  double total = 0.0;
+  for(int j = 0; j < k; j++){
+    total += s[j] * s[j];
+  }
+  int keep = 1;
+  while(keep < k && keep < max_bond && s[keep] > Q_MPS_CUTOFF * s[0]){
+    keep++;
+  }
+  double kept = 0.0;
+  for(int j = 0; j < keep; j++){
+    kept += s[j] * s[j];
+  }
+  if(total > 0.0 && kept > 0.0){
+    *error += 1.0 - kept / total;
+    double scale = sqrt(total / kept);
+    for(int j = 0; j < keep; j++){
+      s[j] *= scale;
+    }
+  }
+  return keep;
+}
+
+/**move_right
+  *Moves the orthogonality center from site c to site c + 1: site c is split with an SVD into a left-orthonormal tensor and S V^H, which is absorbed into site c + 1.
+*/
+static void move_right(q_mps* mps, int c){
+  int dl = mps->bonds[c], dr = mps->bonds[c + 1], dn = mps->bonds[c + 2];
+  int m = 2 * dl;
+  int k0 = m < dr ? m : dr;
+  double* u = malloc(2 * (size_t)m * k0 * sizeof(double));
+  double* s = malloc(k0 * sizeof(double));
+  double* v = malloc(2 * (size_t)dr * k0 * sizeof(double));
+  int k = svd(mps->sites[c], m, dr, u, s, v);
+  double discarded = 0.0;
+  int keep = truncate(s, k, dr, &discarded);
+  double* left = malloc(2 * (size_t)m * keep * sizeof(double));
+  for(int i = 0; i < m; i++){
+    memcpy(left + 2 * (size_t)i * keep, u + 2 * (size_t)i * k, 2 * keep * sizeof(double));
+  }
+  double* next = calloc(2 * (size_t)keep * 2 * dn, sizeof(double));
+  const double* b = mps->sites[c + 1];
+  for(int j = 0; j < keep; j++){
+    for(int mid = 0; mid < dr; mid++){
+      //(S V^H)[j][mid] = s_j conj(v[mid][j]).
+      double vr = s[j] * v[2 * ((size_t)mid * k + j)];
+      double vi = -s[j] * v[2 * ((size_t)mid * k + j) + 1];
+      for(int q = 0; q < 2 * dn; q++){
+        const double* x = b + 2 * ((size_t)mid * 2 * dn + q);
+        double* y = next + 2 * ((size_t)j * 2 * dn + q);
+        y[0] += vr * x[0] - vi * x[1];
+        y[1] += vr * x[1] + vi * x[0];
+      }
+    }
+  }
+  free(mps->sites[c]);
+  free(mps->sites[c + 1]);
+  mps->sites[c] = left;
+  mps->sites[c + 1] = next;
+  mps->bonds[c + 1] = keep;
+  mps->center = c + 1;
+  free(u);
+  free(s);
+  free(v);
+}
+
+/**move_left
+  *Moves the orthogonality center from site c to site c - 1: site c is split with an SVD into U S and a right-orthonormal V^H, and U S is absorbed into site c - 1.
+*/
+static void move_left(q_mps* mps, int c){
+  int dp = mps->bonds[c - 1], dl = mps->bonds[c], dr = mps->bonds[c + 1];
+  int n = 2 * dr;
+  int k0 = dl < n ? dl : n;
+  double* u = malloc(2 * (size_t)dl * k0 * sizeof(double));
+  double* s = malloc(k0 * sizeof(double));
+  double* v = malloc(2 * (size_t)n * k0 * sizeof(double));
+  int k = svd(mps->sites[c], dl, n, u, s, v);
+  double discarded = 0.0;
+  int keep = truncate(s, k, dl, &discarded);
+  double* right = malloc(2 * (size_t)keep * n * sizeof(double));
+  for(int j = 0; j < keep; j++){
+    for(int q = 0; q < n; q++){
+      right[2 * ((size_t)j * n + q)] = v[2 * ((size_t)q * k + j)];
+      right[2 * ((size_t)j * n + q) + 1] = -v[2 * ((size_t)q * k + j) + 1];
+    }
+  }
+  double* prev = calloc(2 * (size_t)dp * 2 * keep, sizeof(double));
+  const double* a = mps->sites[c - 1];
+  for(int lp = 0; lp < 2 * dp; lp++){
+    for(int mid = 0; mid < dl; mid++){
+      const double* x = a + 2 * ((size_t)lp * dl + mid);
+      for(int j = 0; j < keep; j++){
+        double ur = u[2 * ((size_t)mid * k + j)] * s[j];
+        double ui = u[2 * ((size_t)mid * k + j) + 1] * s[j];
+        double* y = prev + 2 * ((size_t)lp * keep + j);
+        y[0] += x[0] * ur - x[1] * ui;
+        y[1] += x[0] * ui + x[1] * ur;
+      }
+    }
+  }
+  free(mps->sites[c]);
+  free(mps->sites[c - 1]);
+  mps->sites[c] = right;
+  mps->sites[c - 1] = prev;
+  mps->bonds[c] = keep;
+  mps->center = c - 1;
+  free(u);
+  free(s);
+  free(v);
+}
+
+/**move_center
+  *Moves the orthogonality center to a site.
+*/
+static void move_center(q_mps* mps, int site){
+  while(mps->center < site){
+    move_right(mps, mps->center);
+  }
+  while(mps->center > site){
+    move_left(mps, mps->center);
+  }
+}
+
+/**apply_two_site
+  *Applies a 4 x 4 gate (row major, interleaved, with site i as the more significant bit) to the adjacent sites i and i + 1, then splits them with a truncated SVD. The center ends up on site i + 1.
+*/
+static void apply_two_site(q_mps* mps, int i, const double* g){
+  move_center(mps, i);
+  int dl = mps->bonds[i], dm = mps->bonds[i + 1], dr = mps->bonds[i + 2];
+  const double* a = mps->sites[i];
+  const double* b = mps->sites[i + 1];
+  //theta[l][p1][p2][r] = sum_m a[l][p1][m] b[m][p2][r]
+  double* theta = calloc(2 * (size_t)dl * 4 * dr, sizeof(double));
+  for(int l = 0; l < dl; l++){
+    for(int p1 = 0; p1 < 2; p1++){
+      for(int mid = 0; mid < dm; mid++){
+        const double* x = a + 2 * (((size_t)l * 2 + p1) * dm + mid);
+        for(int q = 0; q < 2 * dr; q++){
+          const double* y = b + 2 * ((size_t)mid * 2 * dr + q);
+          double* t = theta + 2 * (((size_t)l * 2 + p1) * 2 * dr + q);
+          t[0] += x[0] * y[0] - x[1] * y[1];
+          t[1] += x[0] * y[1] + x[1] * y[0];
+        }
+      }
+    }
+  }
+  //Apply the gate on (p1, p2) and lay the result out as a (2 dl) x (2 dr) matrix.
+  double* m = calloc(2 * (size_t)dl * 4 * dr, sizeof(double));
+  for(int l = 0; l < dl; l++){
+    for(int r = 0; r < dr; r++){
+      double in[8];
+      for(int p = 0; p < 4; p++){
+        const double* t = theta + 2 * (((size_t)l * 2 + (p >> 1)) * 2 * dr + (size_t)(p & 1) * dr + r);
+        in[2 * p] = t[0];
+        in[2 * p + 1] = t[1];
+      }
+      for(int q = 0; q < 4; q++){
+        double re = 0.0, im = 0.0;
+        for(int p = 0; p < 4; p++){
+          re += g[2 * (q * 4 + p)] * in[2 * p] - g[2 * (q * 4 + p) + 1] * in[2 * p + 1];
+          im += g[2 * (q * 4 + p)] * in[2 * p + 1] + g[2 * (q * 4 + p) + 1] * in[2 * p];
+        }
+        double* out = m + 2 * (((size_t)l * 2 + (q >> 1)) * 2 * dr + (size_t)(q & 1) * dr + r);
+        out[0] = re;
+        out[1] = im;
+      }
+    }
+  }
+  free(theta);
+  int rows = 2 * dl, cols = 2 * dr;
+  int k0 = rows < cols ? rows : cols;
+  double* u = malloc(2 * (size_t)rows * k0 * sizeof(double));
+  double* s = malloc(k0 * sizeof(double));
+  double* v = malloc(2 * (size_t)cols * k0 * sizeof(double));
+  int k = svd(m, rows, cols, u, s, v);
+  free(m);
+  int keep = truncate(s, k, mps->max_bond, &mps->truncation_error);
+  double* left = malloc(2 * (size_t)rows * keep * sizeof(double));
+  for(int r = 0; r < rows; r++){
+    memcpy(left + 2 * (size_t)r * keep, u + 2 * (size_t)r * k, 2 * keep * sizeof(double));
+  }
+  double* right = malloc(2 * (size_t)keep * cols * sizeof(double));
+  for(int j = 0; j < keep; j++){
+    for(int q = 0; q < cols; q++){
+      right[2 * ((size_t)j * cols + q)] = s[j] * v[2 * ((size_t)q * k + j)];
+      right[2 * ((size_t)j * cols + q) + 1] = -s[j] * v[2 * ((size_t)q * k + j) + 1];
+    }
+  }
+  free(mps->sites[i]);
+  free(mps->sites[i + 1]);
+  mps->sites[i] = left;
+  mps->sites[i + 1] = right;
+  mps->bonds[i + 1] = keep;
+  mps->center = i + 1;
+  free(u);
+  free(s);
+  free(v);
+}
+
+/**swap_gate
+  *Fills a 4 x 4 swap gate.
+*/
+static void swap_gate(double* g){
+  memset(g, 0, 32 * sizeof(double));
+  g[2 * 0] = 1.0;
+  g[2 * (1 * 4 + 2)] = 1.0;
+  g[2 * (2 * 4 + 1)] = 1.0;
+  g[2 * (3 * 4 + 3)] = 1.0;
+}
+
+/**q_mps_apply_gate
+  *Applies a 1 or 2 qubit q_op to the given target qubits in place. Single qubit gates are contracted into their site. Two qubit gates contract both sites, apply the gate and split them again with an SVD, keeping at most max_bond singular values above Q_MPS_CUTOFF; the state is renormalised and the discarded weight is added to truncation_error. Gates on non-adjacent qubits are routed through adjacent swaps.
+    *mps. The state to apply the gate to. It is overwritten.
+    *gate. The q_op to apply, e.g. from predefined_q.c. It should be unitary.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits, 1 or 2.
+*/
+void q_mps_apply_gate(q_mps* mps, q_op* gate, const int* targets, int k){
+  if(gate->qubits != k || k < 1 || k > 2){
+    printf("Error: matrix product states support 1 and 2 qubit gates only. Terminating.\n");
+    exit(0);
+  }
+  for(int j = 0; j < k; j++){
+    if(targets[j] < 0 || targets[j] >= mps->qubits || (j == 1 && targets[1] == targets[0])){
+      printf("Error: invalid target qubit %d in gate application. Terminating.\n", targets[j]);
+      exit(0);
+    }
+  }
+  if(k == 1){
+    int i = targets[0];
+    gsl_complex u[2][2];
+    for(int p = 0; p < 2; p++){
+      for(int q = 0; q < 2; q++){
+        u[p][q] = q_op_get(gate, p, q);
+      }
+    }
+    double* a = mps->sites[i];
+    int dl = mps->bonds[i], dr = mps->bonds[i + 1];
+    for(int l = 0; l < dl; l++){
+      for(int r = 0; r < dr; r++){
+        double* x0 = a + 2 * (((size_t)l * 2) * dr + r);
+        double* x1 = a + 2 * (((size_t)l * 2 + 1) * dr + r);
+        double in[4] = {x0[0], x0[1], x1[0], x1[1]};
+        double* out[2] = {x0, x1};
+        for(int p = 0; p < 2; p++){
+          double re = GSL_REAL(u[p][0]) * in[0] - GSL_IMAG(u[p][0]) * in[1] + GSL_REAL(u[p][1]) * in[2] - GSL_IMAG(u[p][1]) * in[3];
+          double im = GSL_REAL(u[p][0]) * in[1] + GSL_IMAG(u[p][0]) * in[0] + GSL_REAL(u[p][1]) * in[3] + GSL_IMAG(u[p][1]) * in[2];
+          out[p][0] = re;
+          out[p][1] = im;
+        }
+      }
+    }
+    return;
+  }
+  int a = targets[0], b = targets[1];
+  //Bring b next to a with adjacent swaps.
+  double sw[32];
+  swap_gate(sw);
+  int moves = 0;
+  while(b > a + 1){
+    apply_two_site(mps, b - 1, sw);
+    b--;
+    moves++;
+  }
+  while(b < a - 1){
+    apply_two_site(mps, b, sw);
+    b++;
+    moves--;
+  }
+  double g[32];
+  for(int q = 0; q < 4; q++){
+    for(int p = 0; p < 4; p++){
+      //With a on the right the bits of the gate's local index are reversed.
+      int qq = a < b ? q : ((q & 1) << 1) | (q >> 1);
+      int pp = a < b ? p : ((p & 1) << 1) | (p >> 1);
+      gsl_complex x = q_op_get(gate, qq, pp);
+      g[2 * (q * 4 + p)] = GSL_REAL(x);
+      g[2 * (q * 4 + p) + 1] = GSL_IMAG(x);
+    }
+  }
+  apply_two_site(mps, a < b ? a : b, g);
+  while(moves > 0){
+    apply_two_site(mps, b, sw);
+    b++;
+    moves--;
+  }
+  while(moves < 0){
+    apply_two_site(mps, b - 1, sw);
+    b--;
+    moves++;
+  }
+}
+
+/**q_mps_run
+  *Executes every recorded gate of a circuit, in order, against a matrix product state in place.
+    *mps. The state to apply the circuit to. It is overwritten.
+    *circuit. The circuit to execute. Every gate must act on 1 or 2 qubits.
+*/
+void q_mps_run(q_mps* mps, q_circuit* circuit){
+  if(circuit->qubits != mps->qubits){
+    printf("Error: size mismatch in circuit execution. Terminating.\n");
+    exit(0);
+  }
+  for(int g = 0; g < circuit->gates; g++){
+    q_gate* gate = &circuit->gate_list[g];
+    q_mps_apply_gate(mps, gate->op, gate->targets, gate->k);
+  }
+}
+
+/**q_mps_amplitude
+  *Computes the amplitude of one computational basis state in O(n * max_bond^2).
+    *mps. The state.
+    *bits. The n outcomes, bits[i] being the value of qubit i.
+  *Returns the amplitude.
+*/
+gsl_complex q_mps_amplitude(q_mps* mps, const unsigned char* bits){
+  int width = 1;
+  for(int i = 0; i <= mps->qubits; i++){
+    if(mps->bonds[i] > width) width = mps->bonds[i];
+  }
+  double* env = calloc(2 * width, sizeof(double));
+  double* next = malloc(2 * width * sizeof(double));
+  env[0] = 1.0;
+  for(int i = 0; i < mps->qubits; i++){
+    int dl = mps->bonds[i], dr = mps->bonds[i + 1];
+    int p = bits[i] != 0;
+    for(int r = 0; r < dr; r++){
+      double re = 0.0, im = 0.0;
+      for(int l = 0; l < dl; l++){
+        const double* x = mps->sites[i] + 2 * (((size_t)l * 2 + p) * dr + r);
+        re += env[2 * l] * x[0] - env[2 * l + 1] * x[1];
+        im += env[2 * l] * x[1] + env[2 * l + 1] * x[0];
+      }
+      next[2 * r] = re;
+      next[2 * r + 1] = im;
+    }
+    double* t = env;
+    env = next;
+    next = t;
+  }
+  gsl_complex z;
+  GSL_SET_COMPLEX(&z, env[0], env[1]);
+  free(env);
+  free(next);
+  return z;
+}
+
+/**q_mps_sample
+  *Draws a number of independent shots, each measuring every qubit. The state is brought into right-canonical form once, after which each shot costs O(n * max_bond^2). Shot i uses its own counters of the generator, so shots are drawn in parallel and the result does not depend on the number of threads.
+    *mps. The state to sample from. Its canonical form may change, but not the state it represents.
+    *shots. The number of shots.
+    *rng. The random number generator. It is advanced past the counters used.
+    *out. Output, shots * n outcomes, with out[i * n + j] the outcome of qubit j in shot i.
+*/
+void q_mps_sample(q_mps* mps, size_t shots, q_rng* rng, unsigned char* out){
+  //With the center on site 0 every later site is right-orthonormal, so the marginal of each qubit given the earlier outcomes is the norm of the left environment.
+  move_center(mps, 0);
+  size_t n = mps->qubits;
+  int width = 1;
+  for(size_t i = 0; i <= n; i++){
+    if(mps->bonds[i] > width) width = mps->bonds[i];
+  }
+  unsigned long long first = rng->counter;
+  #pragma omp parallel if(shots * n * width * width >= Q_PARALLEL_MIN) num_threads(q_get_threads())
+  {
+    double* env = malloc(2 * width * sizeof(double));
+    double* branch = malloc(2 * 2 * width * sizeof(double));
+    #pragma omp for schedule(static)
+    for(size_t shot = 0; shot < shots; shot++){
+      env[0] = 1.0;
+      env[1] = 0.0;
+      for(size_t i = 0; i < n; i++){
+        int dl = mps->bonds[i], dr = mps->bonds[i + 1];
+        double weight[2] = {0.0, 0.0};
+        for(int p = 0; p < 2; p++){
+          double* w = branch + 2 * (size_t)p * width;
+          for(int r = 0; r < dr; r++){
+            double re = 0.0, im = 0.0;
+            for(int l = 0; l < dl; l++){
+              const double* x = mps->sites[i] + 2 * (((size_t)l * 2 + p) * dr + r);
+              re += env[2 * l] * x[0] - env[2 * l + 1] * x[1];
+              im += env[2 * l] * x[1] + env[2 * l + 1] * x[0];
+            }
+            w[2 * r] = re;
+            w[2 * r + 1] = im;
+            weight[p] += re * re + im * im;
+          }
+        }
+        double u[2];
+        q_rng_uniform_at(rng, first + shot * n + i, u);
+        int p = u[0] * (weight[0] + weight[1]) >= weight[0];
+        double scale = 1.0 / sqrt(weight[p]);
+        for(int r = 0; r < dr; r++){
+          env[2 * r] = branch[2 * ((size_t)p * width + r)] * scale;
+          env[2 * r + 1] = branch[2 * ((size_t)p * width + r) + 1] * scale;
+        }
+        out[shot * n + i] = p;
+      }
+    }
+    free(env);
+    free(branch);
+  }
+  rng->counter += shots * n;
+}
+
+/**q_mps_from_state
+  *Converts a state vector to a matrix product state with successive SVDs, truncated as in q_mps_apply_gate.
+    *state. The state to convert. It is not destroyed.
+    *max_bond. The largest bond dimension to keep.
+  Returns the generated state "mps"
+*/
+q_mps* q_mps_from_state(q_state* state, int max_bond){
+  int n = state->qubits;
+  q_mps* mps = q_mps_alloc(n, max_bond);
+  size_t dim = (size_t)1 << n;
+  //rest is the (bond x remaining amplitudes) matrix still to be split.
+  double* rest = malloc(2 * dim * sizeof(double));
+  for(size_t i = 0; i < dim; i++){
+    gsl_complex a = gsl_matrix_complex_get(state->vector, i, 0);
+    rest[2 * i] = GSL_REAL(a);
+    rest[2 * i + 1] = GSL_IMAG(a);
+  }
+  int bond = 1;
+  for(int i = 0; i < n - 1; i++){
+    int rows = 2 * bond;
+    size_t cols = dim >> (i + 1);
+    int k0 = rows < (int)cols ? rows : (int)cols;
+    double* u = malloc(2 * (size_t)rows * k0 * sizeof(double));
+    double* s = malloc(k0 * sizeof(double));
+    double* v = malloc(2 * cols * k0 * sizeof(double));
+    int k = svd(rest, rows, cols, u, s, v);
+    int keep = truncate(s, k, max_bond, &mps->truncation_error);
+    free(mps->sites[i]);
+    mps->sites[i] = malloc(2 * (size_t)rows * keep * sizeof(double));
+    for(int r = 0; r < rows; r++){
+      memcpy(mps->sites[i] + 2 * (size_t)r * keep, u + 2 * (size_t)r * k, 2 * keep * sizeof(double));
+    }
+    mps->bonds[i + 1] = keep;
+    //S V^H, which reshapes to (2 keep) x (cols / 2) for the next site.
+    free(rest);
+    rest = malloc(2 * (size_t)keep * cols * sizeof(double));
+    for(int j = 0; j < keep; j++){
+      for(size_t q = 0; q < cols; q++){
+        rest[2 * (j * cols + q)] = s[j] * v[2 * (q * k + j)];
+        rest[2 * (j * cols + q) + 1] = -s[j] * v[2 * (q * k + j) + 1];
+      }
+    }
+    bond = keep;
+    free(u);
+    free(s);
+    free(v);
+  }
+  free(mps->sites[n - 1]);
+  mps->sites[n - 1] = rest;
+  mps->center = n - 1;
+  return mps;
+}
+
+/**q_mps_to_state
+  *Converts a matrix product state to a state vector, for cross-checking on small registers.
+    *mps. The state to convert.
+  Returns the state vector "state", which allocates 2^n amplitudes.
+*/
+q_state* q_mps_to_state(q_mps* mps){
+  //t holds the (2^i x bond) contraction of the first i sites.
+  size_t prefix = 1;
+  double* t = malloc(2 * sizeof(double));
+  t[0] = 1.0;
+  t[1] = 0.0;
+  for(int i = 0; i < mps->qubits; i++){
+    int dl = mps->bonds[i], dr = mps->bonds[i + 1];
+    double* next = calloc(2 * prefix * 2 * dr, sizeof(double));
+    for(size_t idx = 0; idx < prefix; idx++){
+      for(int l = 0; l < dl; l++){
+        const double* x = t + 2 * (idx * dl + l);
+        for(int q = 0; q < 2 * dr; q++){
+          const double* y = mps->sites[i] + 2 * ((size_t)l * 2 * dr + q);
+          double* z = next + 2 * (idx * 2 * dr + q);
+          z[0] += x[0] * y[0] - x[1] * y[1];
+          z[1] += x[0] * y[1] + x[1] * y[0];
+        }
+      }
+    }
+    free(t);
+    t = next;
+    prefix *= 2;
+  }
+  q_state* state = q_state_alloc(mps->qubits);
+  for(size_t i = 0; i < prefix; i++){
+    gsl_complex a;
+    GSL_SET_COMPLEX(&a, t[2 * i], t[2 * i + 1]);
+    gsl_matrix_complex_set(state->vector, i, 0, a);
+  }
+  free(t);
+  return state;
+}
@@ -0,0 +1,80 @@
+#ifndef Q_MPS_H
+#define Q_MPS_H
+
+#include "q_circuit.h"
+
+//Singular values below this fraction of the largest one are dropped whenever a bond is split.
+#define Q_MPS_CUTOFF 1e-12
+
+//Matrix product state. Site i holds a bonds[i] x 2 x bonds[i + 1] tensor, entry (l, p, r) at index (l * 2 + p) * bonds[i + 1] + r as interleaved complex doubles, with bonds[0] = bonds[qubits] = 1. Qubit i is site i, so qubit 0 is the leftmost qubit as in q_state. The sites left of center are left-orthonormal and the sites right of it right-orthonormal.
+typedef struct q_mps{
+  double** sites;
+  int* bonds;
+  int qubits;
+  int max_bond;
+  int center;
+  double truncation_error;
+} q_mps;
+
+/**q_mps_alloc
+  *Allocates a matrix product state initialised to |0...0>. Memory grows as n * max_bond^2 rather than 2^n.
+    *qubits. The number of qubits.
+    *max_bond. The largest bond dimension kept when gates are applied. Larger values are more accurate for more entangled states.
+  Returns the generated state "mps"
+*/
+q_mps* q_mps_alloc(int qubits, int max_bond);
+
+/**q_mps_free
+  *Frees a given matrix product state.
+    *mps. The state to free.
+*/
+void q_mps_free(q_mps* mps);
+
+/**q_mps_apply_gate
+  *Applies a 1 or 2 qubit q_op to the given target qubits in place. Single qubit gates are contracted into their site. Two qubit gates contract both sites, apply the gate and split them again with an SVD, keeping at most max_bond singular values above Q_MPS_CUTOFF; the state is renormalised and the discarded weight is added to truncation_error. Gates on non-adjacent qubits are routed through adjacent swaps.
+    *mps. The state to apply the gate to. It is overwritten.
+    *gate. The q_op to apply, e.g. from predefined_q.c. It should be unitary.
+    *targets. The k distinct target qubits, with the same meaning as in q_state_apply_gate.
+    *k. The number of target qubits, 1 or 2.
+*/
+void q_mps_apply_gate(q_mps* mps, q_op* gate, const int* targets, int k);
+
+/**q_mps_run
+  *Executes every recorded gate of a circuit, in order, against a matrix product state in place.
+    *mps. The state to apply the circuit to. It is overwritten.
+    *circuit. The circuit to execute. Every gate must act on 1 or 2 qubits.
+*/
+void q_mps_run(q_mps* mps, q_circuit* circuit);
+
+/**q_mps_amplitude
+  *Computes the amplitude of one computational basis state in O(n * max_bond^2).
+    *mps. The state.
+    *bits. The n outcomes, bits[i] being the value of qubit i.
+  *Returns the amplitude.
+*/
+gsl_complex q_mps_amplitude(q_mps* mps, const unsigned char* bits);
+
+/**q_mps_sample
+  *Draws a number of independent shots, each measuring every qubit. The state is brought into right-canonical form once, after which each shot costs O(n * max_bond^2). Shot i uses its own counters of the generator, so shots are drawn in parallel and the result does not depend on the number of threads.
+    *mps. The state to sample from. Its canonical form may change, but not the state it represents.
+    *shots. The number of shots.
+    *rng. The random number generator. It is advanced past the counters used.
+    *out. Output, shots * n outcomes, with out[i * n + j] the outcome of qubit j in shot i.
+*/
+void q_mps_sample(q_mps* mps, size_t shots, q_rng* rng, unsigned char* out);
+
+/**q_mps_from_state
+  *Converts a state vector to a matrix product state with successive SVDs, truncated as in q_mps_apply_gate.
+    *state. The state to convert. It is not destroyed.
+    *max_bond. The largest bond dimension to keep.
+  Returns the generated state "mps"
+*/
+q_mps* q_mps_from_state(q_state* state, int max_bond);
+
+/**q_mps_to_state
+  *Converts a matrix product state to a state vector, for cross-checking on small registers.
+    *mps. The state to convert.
+  Returns the state vector "state", which allocates 2^n amplitudes.
+*/
+q_state* q_mps_to_state(q_mps* mps);
+#endif
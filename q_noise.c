@@ -0,0 +1,555 @@
+#include "q_noise.h"
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**gram_entry
+  *Computes entry (a, b) of K^H K for a dense operator K.
+*/
+static gsl_complex gram_entry(q_op* op, size_t a, size_t b){
+  size_t rows = (size_t)1 << op->qubits;
+  gsl_complex sum = GSL_COMPLEX_ZERO;
+  for(size_t r = 0; r < rows; r++){
+    sum = gsl_complex_add(sum, gsl_complex_mul(gsl_complex_conjugate(gsl_matrix_complex_get(op->matrix, r, a)), gsl_matrix_complex_get(op->matrix, r, b)));
+  }
+  return sum;
+}
+
+/**q_channel_alloc
+  *Builds a channel from its Kraus operators. Terminates if sum_i K_i^H K_i is not the identity, i.e. if the channel does not preserve the trace.
+    *kraus. The count Kraus operators, all on the same number of qubits. The channel takes ownership of them and densifies them.
+    *count. The number of Kraus operators.
+  Returns the generated channel "channel"
+*/
+q_channel* q_channel_alloc(q_op** kraus, int count){
+  if(count < 1){
+    printf("Error: a channel needs at least one Kraus operator. Terminating.\n");
+    exit(0);
+  }
+  q_channel* channel = malloc(sizeof(q_channel));
+  channel->count = count;
+  channel->qubits = kraus[0]->qubits;
+  channel->kraus = malloc(count * sizeof(q_op*));
+  channel->weights = malloc(count * sizeof(double));
+  channel->identity = malloc(count);
+  size_t rows = (size_t)1 << channel->qubits;
+  double deviation = 0.0;
+  gsl_matrix_complex* total = gsl_matrix_complex_calloc(rows, rows);
+  for(int i = 0; i < count; i++){
+    if(kraus[i]->qubits != channel->qubits){
+      printf("Error: size mismatch between Kraus operators. Terminating.\n");
+      exit(0);
+    }
+    q_op_densify(kraus[i]);
+    channel->kraus[i] = kraus[i];
+    //K^H K = w I lets the operator be picked with a fixed probability w; K = c I needs no work at all once renormalised.
+    double weight = GSL_REAL(gram_entry(kraus[i], 0, 0));
+    int proportional = 1;
+    int identity = 1;
+    for(size_t a = 0; a < rows; a++){
+      for(size_t b = 0; b < rows; b++){
+        gsl_complex g = gram_entry(kraus[i], a, b);
+        gsl_matrix_complex_set(total, a, b, gsl_complex_add(gsl_matrix_complex_get(total, a, b), g));
+        if(gsl_complex_abs(gsl_complex_sub(g, gsl_complex_rect(a == b ? weight : 0.0, 0.0))) > 1e-12) proportional = 0;
+        gsl_complex x = gsl_matrix_complex_get(kraus[i]->matrix, a, b);
+        gsl_complex d = gsl_matrix_complex_get(kraus[i]->matrix, 0, 0);
+        if(gsl_complex_abs(gsl_complex_sub(x, a == b ? d : GSL_COMPLEX_ZERO)) > 1e-12) identity = 0;
+      }
+    }
+    channel->weights[i] = proportional ? weight : -1.0;
+    channel->identity[i] = identity;
+  }
+  for(size_t a = 0; a < rows; a++){
+    for(size_t b = 0; b < rows; b++){
+      deviation = fmax(deviation, gsl_complex_abs(gsl_complex_sub(gsl_matrix_complex_get(total, a, b), gsl_complex_rect(a == b, 0.0))));
+    }
+  }
+  gsl_matrix_complex_free(total);
+  if(deviation > 1e-9){
+    printf("Error: the Kraus operators of a channel must satisfy sum_i K_i^H K_i = I. Terminating.\n");
+    exit(0);
+  }
+  return channel;
+}
+
+/**q_channel_free
+  *Frees a given channel and its Kraus operators.
+    *channel. The channel to free.
+*/
+void q_channel_free(q_channel* channel){
+  for(int i = 0; i < channel->count; i++){
+    q_op_free(channel->kraus[i]);
+  }
+  free(channel->kraus);
+  free(channel->weights);
+  free(channel->identity);
+  free(channel);
+}
+
+/**kraus_2x2
+  *Builds a single qubit Kraus operator from its four entries, row by row.
+*/
+static q_op* kraus_2x2(gsl_complex a, gsl_complex b, gsl_complex c, gsl_complex d){
+  q_op* op = q_op_alloc(1);
+  gsl_matrix_complex_set(op->matrix, 0, 0, a);
+  gsl_matrix_complex_set(op->matrix, 0, 1, b);
+  gsl_matrix_complex_set(op->matrix, 1, 0, c);
+  gsl_matrix_complex_set(op->matrix, 1, 1, d);
+  return op;
+}
+
+/**check_probability
+  *Checks that a channel parameter is a probability.
+*/
+static void check_probability(double p){
+  if(p < 0.0 || p > 1.0){
+    printf("Error: channel probability %f out of range. Terminating.\n", p);
+    exit(0);
+  }
+}
+
+/**q_channel_depolarizing
+  *Builds the single qubit depolarising channel rho -> (1 - p) rho + p I / 2, with Kraus operators sqrt(1 - 3p/4) I and sqrt(p/4) X, Y, Z.
+    *p. The depolarising probability, between 0 and 1.
+  Returns the generated channel "channel"
+*/
+q_channel* q_channel_depolarizing(double p){
+  check_probability(p);
+  double a = sqrt(1.0 - 0.75 * p);
+  double b = sqrt(0.25 * p);
+  gsl_complex zero = GSL_COMPLEX_ZERO;
+  q_op* kraus[4] = {
+    kraus_2x2(gsl_complex_rect(a, 0.0), zero, zero, gsl_complex_rect(a, 0.0)),
+    kraus_2x2(zero, gsl_complex_rect(b, 0.0), gsl_complex_rect(b, 0.0), zero),
+    kraus_2x2(zero, gsl_complex_rect(0.0, -b), gsl_complex_rect(0.0, b), zero),
+    kraus_2x2(gsl_complex_rect(b, 0.0), zero, zero, gsl_complex_rect(-b, 0.0))
+  };
+  return q_channel_alloc(kraus, 4);
+}
+
+/**q_channel_amplitude_damping
+  *Builds the single qubit amplitude damping channel, which decays |1> to |0> with probability gamma.
+    *gamma. The decay probability, between 0 and 1.
+  Returns the generated channel "channel"
+*/
+q_channel* q_channel_amplitude_damping(double gamma){
+  check_probability(gamma);
+  gsl_complex zero = GSL_COMPLEX_ZERO;
+  q_op* kraus[2] = {
+    kraus_2x2(GSL_COMPLEX_ONE, zero, zero, gsl_complex_rect(sqrt(1.0 - gamma), 0.0)),
+    kraus_2x2(zero, gsl_complex_rect(sqrt(gamma), 0.0), zero, zero)
+  };
+  return q_channel_alloc(kraus, 2);
+}
+
+/**q_channel_phase_damping
+  *Builds the single qubit phase damping channel, which scales the off-diagonal entries of the density matrix by sqrt(1 - lambda) without changing populations.
+    *lambda. The damping probability, between 0 and 1.
+  Returns the generated channel "channel"
+*/
+q_channel* q_channel_phase_damping(double lambda){
+  check_probability(lambda);
+  gsl_complex zero = GSL_COMPLEX_ZERO;
+  q_op* kraus[2] = {
+    kraus_2x2(GSL_COMPLEX_ONE, zero, zero, gsl_complex_rect(sqrt(1.0 - lambda), 0.0)),
+    kraus_2x2(zero, zero, zero, gsl_complex_rect(sqrt(lambda), 0.0))
+  };
+  return q_channel_alloc(kraus, 2);
+}
+
+/**q_noisy_circuit_alloc
+  *Wraps a recorded circuit for noisy simulation, initially without noise.
+    *circuit. The circuit. It is not copied or freed, and gates must not be added or fused while noise refers to their indices.
+  Returns the generated noisy circuit "noisy"
+*/
+q_noisy_circuit* q_noisy_circuit_alloc(q_circuit* circuit){
+  q_noisy_circuit* noisy = malloc(sizeof(q_noisy_circuit));
+  noisy->circuit = circuit;
+  noisy->count = 0;
+  noisy->capacity = 0;
+  noisy->events = NULL;
+  noisy->readout = calloc(2 * circuit->qubits, sizeof(double));
+  return noisy;
+}
+
+/**q_noisy_circuit_free
+  *Frees a given noisy circuit. The circuit and channels it refers to are not freed.
+    *noisy. The noisy circuit to free.
+*/
+void q_noisy_circuit_free(q_noisy_circuit* noisy){
+  for(int e = 0; e < noisy->count; e++){
+    free(noisy->events[e].targets);
+  }
+  free(noisy->events);
+  free(noisy->readout);
+  free(noisy);
+}
+
+/**q_noisy_circuit_add_channel
+  *Attaches a channel to the given qubits right after a gate. Several channels may follow the same gate; they act in the order they were attached.
+    *noisy. The noisy circuit.
+    *gate. The index of the gate in the circuit, from 0 to gates - 1.
+    *channel. The channel. It is not copied, so one channel can be attached many times, and must outlive the noisy circuit.
+    *targets. The channel's distinct target qubits, with the same meaning as in q_state_apply_gate.
+*/
+void q_noisy_circuit_add_channel(q_noisy_circuit* noisy, int gate, q_channel* channel, const int* targets){
+  if(gate < 0 || gate >= noisy->circuit->gates){
+    printf("Error: gate %d out of range when attaching noise. Terminating.\n", gate);
+    exit(0);
+  }
+  for(int i = 0; i < channel->qubits; i++){
+    if(targets[i] < 0 || targets[i] >= noisy->circuit->qubits){
+      printf("Error: target qubit %d out of range when attaching noise. Terminating.\n", targets[i]);
+      exit(0);
+    }
+    for(int j = 0; j < i; j++){
+      if(targets[j] == targets[i]){
+        printf("Error: repeated target qubit %d when attaching noise. Terminating.\n", targets[i]);
+        exit(0);
+      }
+    }
+  }
+  if(noisy->count == noisy->capacity){
+    noisy->capacity = noisy->capacity > 0 ? 2 * noisy->capacity : 16;
+    noisy->events = realloc(noisy->events, noisy->capacity * sizeof(q_noise_event));
+  }
+  //Insert after every event of the same or an earlier gate, which keeps the events sorted and in attachment order.
+  int pos = noisy->count++;
+  while(pos > 0 && noisy->events[pos - 1].gate > gate){
+    noisy->events[pos] = noisy->events[pos - 1];
+    pos--;
+  }
+  q_noise_event* event = &noisy->events[pos];
+  event->channel = channel;
+  event->gate = gate;
+  event->targets = malloc(channel->qubits * sizeof(int));
+  memcpy(event->targets, targets, channel->qubits * sizeof(int));
+}
+
+/**q_noisy_circuit_add_gate_noise
+  *Attaches a single qubit channel after every gate of the circuit, once on each of the gate's target qubits, as a simple model of gate errors.
+    *noisy. The noisy circuit.
+    *channel. The single qubit channel. It must outlive the noisy circuit.
+*/
+void q_noisy_circuit_add_gate_noise(q_noisy_circuit* noisy, q_channel* channel){
+  if(channel->qubits != 1){
+    printf("Error: gate noise must be a single qubit channel. Terminating.\n");
+    exit(0);
+  }
+  for(int g = 0; g < noisy->circuit->gates; g++){
+    q_gate* gate = &noisy->circuit->gate_list[g];
+    for(int j = 0; j < gate->k; j++){
+      q_noisy_circuit_add_channel(noisy, g, channel, &gate->targets[j]);
+    }
+  }
+}
+
+/**q_noisy_circuit_set_readout
+  *Sets the readout error of a qubit, applied whenever trajectories are measured.
+    *noisy. The noisy circuit.
+    *qubit. The qubit.
+    *p01. The probability of reading 1 when the qubit is 0.
+    *p10. The probability of reading 0 when the qubit is 1.
+*/
+void q_noisy_circuit_set_readout(q_noisy_circuit* noisy, int qubit, double p01, double p10){
+  if(qubit < 0 || qubit >= noisy->circuit->qubits){
+    printf("Error: qubit %d out of range when setting readout error. Terminating.\n", qubit);
+    exit(0);
+  }
+  check_probability(p01);
+  check_probability(p10);
+  noisy->readout[2 * qubit] = p01;
+  noisy->readout[2 * qubit + 1] = p10;
+}
+
+/**kraus_weights
+  *Computes ||K_i psi||^2 for every Kraus operator of a channel whose weight depends on the state, together with the squared norm of the state, in one pass over the blocks of the state, multiplying each 2^k block in registers instead of forming K_i psi. Blocks are summed in fixed chunks of Q_REDUCE_CHUNK, at most Q_REDUCE_PARTS runs of them at a time into a stack buffer as in reduce_norm, so the result does not depend on the number of threads and nothing is allocated.
+  Returns the squared norm of the state.
+*/
+static double kraus_weights(q_channel* channel, q_state* state, const size_t* sorted, const size_t* offsets, double* weights){
+  int k = channel->qubits;
+  int count = channel->count;
+  size_t dim = (size_t)1 << k;
+  size_t blocks = ((size_t)1 << state->qubits) >> k;
+  size_t chunks = (blocks + Q_REDUCE_CHUNK - 1) / Q_REDUCE_CHUNK;
+  size_t per = (chunks + Q_REDUCE_PARTS - 1) / Q_REDUCE_PARTS;
+  size_t parts = (chunks + per - 1) / per;
+  double* amp = state->vector->data;
+  size_t stride = state->vector->tda;
+  //Slot count of each part holds the norm.
+  double partial[Q_REDUCE_PARTS * (count + 1)];
+  #pragma omp parallel for if(blocks * dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t s = 0; s < parts; s++){
+    double* part = partial + s * (count + 1);
+    double v[2 * dim];
+    for(int i = 0; i <= count; i++){
+      part[i] = 0.0;
+    }
+    for(size_t c = s * per; c < (s + 1) * per && c < chunks; c++){
+      size_t end = (c + 1) * Q_REDUCE_CHUNK < blocks ? (c + 1) * Q_REDUCE_CHUNK : blocks;
+      double sum[count + 1];
+      for(int i = 0; i <= count; i++){
+        sum[i] = 0.0;
+      }
+      for(size_t r = c * Q_REDUCE_CHUNK; r < end; r++){
+        size_t base = q_insert_zero_bits(r, sorted, k);
+        for(size_t j = 0; j < dim; j++){
+          v[2 * j] = amp[2 * (base + offsets[j]) * stride];
+          v[2 * j + 1] = amp[2 * (base + offsets[j]) * stride + 1];
+          sum[count] += v[2 * j] * v[2 * j] + v[2 * j + 1] * v[2 * j + 1];
+        }
+        for(int i = 0; i < count; i++){
+          if(channel->weights[i] >= 0.0) continue;
+          gsl_matrix_complex* m = channel->kraus[i]->matrix;
+          for(size_t a = 0; a < dim; a++){
+            const double* row = m->data + 2 * a * m->tda;
+            double re = 0.0, im = 0.0;
+            for(size_t b = 0; b < dim; b++){
+              re += row[2 * b] * v[2 * b] - row[2 * b + 1] * v[2 * b + 1];
+              im += row[2 * b] * v[2 * b + 1] + row[2 * b + 1] * v[2 * b];
+            }
+            sum[i] += re * re + im * im;
+          }
+        }
+      }
+      for(int i = 0; i <= count; i++){
+        part[i] += sum[i];
+      }
+    }
+  }
+  double total = 0.0;
+  for(int i = 0; i < count; i++){
+    weights[i] = 0.0;
+  }
+  for(size_t s = 0; s < parts; s++){
+    for(int i = 0; i < count; i++){
+      weights[i] += partial[s * (count + 1) + i];
+    }
+    total += partial[s * (count + 1) + count];
+  }
+  return total;
+}
+
+/**kraus_apply
+  *Replaces psi by scale * K psi block by block, in place.
+*/
+static void kraus_apply(q_op* kraus, double scale, q_state* state, int k, const size_t* sorted, const size_t* offsets){
+  size_t dim = (size_t)1 << k;
+  size_t blocks = ((size_t)1 << state->qubits) >> k;
+  double* amp = state->vector->data;
+  size_t stride = state->vector->tda;
+  gsl_matrix_complex* m = kraus->matrix;
+  #pragma omp parallel for if(blocks * dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t r = 0; r < blocks; r++){
+    size_t base = q_insert_zero_bits(r, sorted, k);
+    double v[2 * dim];
+    for(size_t j = 0; j < dim; j++){
+      v[2 * j] = amp[2 * (base + offsets[j]) * stride];
+      v[2 * j + 1] = amp[2 * (base + offsets[j]) * stride + 1];
+    }
+    for(size_t a = 0; a < dim; a++){
+      const double* row = m->data + 2 * a * m->tda;
+      double re = 0.0, im = 0.0;
+      for(size_t b = 0; b < dim; b++){
+        re += row[2 * b] * v[2 * b] - row[2 * b + 1] * v[2 * b + 1];
+        im += row[2 * b] * v[2 * b + 1] + row[2 * b + 1] * v[2 * b];
+      }
+      amp[2 * (base + offsets[a]) * stride] = scale * re;
+      amp[2 * (base + offsets[a]) * stride + 1] = scale * im;
+    }
+  }
+}
+
+/**apply_channel
+  *Applies one stochastic step of a channel: picks Kraus operator i with probability ||K_i psi||^2 and replaces psi by K_i psi / ||K_i psi||. Operators with fixed weights need no pass over the state to be picked, and multiples of the identity need none to be applied.
+*/
+static void apply_channel(q_channel* channel, q_state* state, const int* targets, q_rng* rng){
+  int k = channel->qubits;
+  int count = channel->count;
+  size_t masks[k];
+  size_t sorted[k];
+  size_t offsets[(size_t)1 << k];
+  q_gate_masks(state->qubits, targets, k, masks, sorted);
+  q_gate_offsets(masks, k, offsets);
+  double weights[count];
+  int fixed = 1;
+  for(int i = 0; i < count; i++){
+    fixed &= channel->weights[i] >= 0.0;
+  }
+  double total = 1.0;
+  if(fixed){
+    memcpy(weights, channel->weights, count * sizeof(double));
+  }
+  else{
+    //The fixed weights are scaled by the norm of the state, found in the same pass, so that they are comparable with the computed ones.
+    total = kraus_weights(channel, state, sorted, offsets, weights);
+    for(int i = 0; i < count; i++){
+      if(channel->weights[i] >= 0.0) weights[i] = channel->weights[i] * total;
+    }
+  }
+  double sum = 0.0;
+  for(int i = 0; i < count; i++){
+    sum += weights[i];
+  }
+  double u = q_rng_uniform(rng) * sum;
+  int pick = 0;
+  while(pick < count - 1 && (u >= weights[pick] || weights[pick] <= 0.0)){
+    u -= weights[pick];
+    pick++;
+  }
+  //Rounding can carry u past every positive weight; fall back to the last operator that can occur.
+  while(pick > 0 && weights[pick] <= 0.0){
+    pick--;
+  }
+  if(channel->identity[pick]) return;
+  kraus_apply(channel->kraus[pick], sqrt(total / weights[pick]), state, k, sorted, offsets);
+}
+
+/**q_trajectory_run
+  *Runs one stochastic trajectory of a noisy circuit in place. Gates are applied with the kernels of q_circuit_run; at every channel one Kraus operator is picked with probability ||K_i psi||^2, computed block by block without temporaries, and applied with renormalisation. Averaging |psi><psi| over trajectories converges to the density matrix of the noisy circuit.
+    *noisy. The noisy circuit.
+    *state. The initial state, overwritten with the final state of the trajectory.
+    *rng. The generator of the trajectory. It is advanced past the numbers drawn.
+*/
+void q_trajectory_run(q_noisy_circuit* noisy, q_state* state, q_rng* rng){
+  int done = 0;
+  for(int e = 0; e < noisy->count; e++){
+    q_noise_event* event = &noisy->events[e];
+    q_circuit_run_range(noisy->circuit, state, done, event->gate + 1);
+    done = event->gate + 1;
+    apply_channel(event->channel, state, event->targets, rng);
+  }
+  q_circuit_run_range(noisy->circuit, state, done, noisy->circuit->gates);
+}
+
+/**trajectory_rng
+  *Sets up the generator of trajectory t of a run that starts at counter first.
+*/
+static void trajectory_rng(q_rng* local, const q_rng* rng, unsigned long long first, size_t t){
+  *local = *rng;
+  local->counter = first + t * Q_TRAJECTORY_COUNTERS;
+  local->has_spare = 0;
+}
+
+/**q_trajectory_sample
+  *Runs many trajectories from the same initial state and measures every qubit once at the end of each, with readout error. Trajectories run in parallel when states are small, each thread reusing one state buffer, and in sequence with parallel kernels otherwise. Trajectory i draws from its own block of Q_TRAJECTORY_COUNTERS counters, so the result does not depend on the number of threads.
+    *noisy. The noisy circuit.
+    *initial. The initial state. It is not changed.
+    *trajectories. The number of trajectories.
+    *rng. The random number generator. It is advanced past the counters used.
+    *out. Output, trajectories * n outcomes, with out[i * n + j] the outcome of qubit j in trajectory i.
+*/
+void q_trajectory_sample(q_noisy_circuit* noisy, q_state* initial, size_t trajectories, q_rng* rng, unsigned char* out){
+  int n = noisy->circuit->qubits;
+  if(initial->qubits != n){
+    printf("Error: size mismatch in trajectory simulation. Terminating.\n");
+    exit(0);
+  }
+  size_t dim = (size_t)1 << n;
+  unsigned long long first = rng->counter;
+  #pragma omp parallel if(trajectories > 1 && dim < Q_PARALLEL_MIN) num_threads(q_get_threads())
+  {
+    q_state* state = q_state_alloc(n);
+    #pragma omp for schedule(static)
+    for(size_t t = 0; t < trajectories; t++){
+      q_rng local;
+      trajectory_rng(&local, rng, first, t);
+      gsl_matrix_complex_memcpy(state->vector, initial->vector);
+      q_trajectory_run(noisy, state, &local);
+      //Measure the whole register at once by walking the cumulative distribution.
+      const double* amp = state->vector->data;
+      size_t stride = state->vector->tda;
+      double norm = GSL_REAL(q_state_inner(state, state));
+      double u = q_rng_uniform(&local) * norm;
+      size_t outcome = 0;
+      double p = amp[0] * amp[0] + amp[1] * amp[1];
+      while(outcome < dim - 1 && (u >= p || p == 0.0)){
+        u -= p;
+        outcome++;
+        p = amp[2 * outcome * stride] * amp[2 * outcome * stride] + amp[2 * outcome * stride + 1] * amp[2 * outcome * stride + 1];
+      }
+      for(int q = 0; q < n; q++){
+        int bit = (outcome >> (n - 1 - q)) & 1;
+        double flip = noisy->readout[2 * q + bit];
+        if(flip > 0.0 && q_rng_uniform(&local) < flip) bit ^= 1;
+        out[t * n + q] = bit;
+      }
+    }
+    q_state_free(state);
+  }
+  rng->counter = first + trajectories * Q_TRAJECTORY_COUNTERS;
+  rng->has_spare = 0;
+}
+
+/**q_trajectory_probabilities
+  *Runs many trajectories from the same initial state and averages their outcome probabilities |psi_i|^2, then applies the readout error. This estimates the measurement statistics of the noisy circuit with less variance than sampling. Trajectories are drawn as in q_trajectory_sample; the average depends on the number of threads only through rounding.
+    *noisy. The noisy circuit.
+    *initial. The initial state. It is not changed.
+    *trajectories. The number of trajectories.
+    *rng. The random number generator. It is advanced past the counters used.
+  Returns the 2^n outcome probabilities "probabilities", indexed like the amplitudes of a state.
+*/
+gsl_vector* q_trajectory_probabilities(q_noisy_circuit* noisy, q_state* initial, size_t trajectories, q_rng* rng){
+  int n = noisy->circuit->qubits;
+  if(initial->qubits != n){
+    printf("Error: size mismatch in trajectory simulation. Terminating.\n");
+    exit(0);
+  }
+  size_t dim = (size_t)1 << n;
+  unsigned long long first = rng->counter;
+  gsl_vector* probabilities = gsl_vector_calloc(dim);
+  #pragma omp parallel if(trajectories > 1 && dim < Q_PARALLEL_MIN) num_threads(q_get_threads())
+  {
+    q_state* state = q_state_alloc(n);
+    double* sum = calloc(dim, sizeof(double));
+    #pragma omp for schedule(static)
+    for(size_t t = 0; t < trajectories; t++){
+      q_rng local;
+      trajectory_rng(&local, rng, first, t);
+      gsl_matrix_complex_memcpy(state->vector, initial->vector);
+      q_trajectory_run(noisy, state, &local);
+      const double* amp = state->vector->data;
+      size_t stride = state->vector->tda;
+      double scale = 1.0 / GSL_REAL(q_state_inner(state, state));
+      for(size_t i = 0; i < dim; i++){
+        sum[i] += scale * (amp[2 * i * stride] * amp[2 * i * stride] + amp[2 * i * stride + 1] * amp[2 * i * stride + 1]);
+      }
+    }
+    //Add the partial sums in thread order.
+#ifdef _OPENMP
+    int threads = omp_get_num_threads();
+#else
+    int threads = 1;
+#endif
+    #pragma omp for ordered schedule(static, 1)
+    for(int thread = 0; thread < threads; thread++){
+      #pragma omp ordered
+      for(size_t i = 0; i < dim; i++){
+        probabilities->data[i * probabilities->stride] += sum[i];
+      }
+    }
+    free(sum);
+    q_state_free(state);
+  }
+  rng->counter = first + trajectories * Q_TRAJECTORY_COUNTERS;
+  rng->has_spare = 0;
+  double* p = probabilities->data;
+  size_t stride = probabilities->stride;
+  for(size_t i = 0; i < dim; i++){
+    p[i * stride] /= trajectories;
+  }
+  //Readout errors act on each qubit independently, as a 2 x 2 stochastic matrix on every pair of outcomes differing in that qubit.
+  for(int q = 0; q < n; q++){
+    double p01 = noisy->readout[2 * q], p10 = noisy->readout[2 * q + 1];
+    if(p01 == 0.0 && p10 == 0.0) continue;
+    size_t mask = (size_t)1 << (n - 1 - q);
+    for(size_t i = 0; i < dim; i++){
+      if(i & mask) continue;
+      double zero = p[i * stride], one = p[(i | mask) * stride];
+      p[i * stride] = (1.0 - p01) * zero + p10 * one;
+      p[(i | mask) * stride] = p01 * zero + (1.0 - p10) * one;
+    }
+  }
+  return probabilities;
+}
@@ -0,0 +1,134 @@
+#ifndef Q_NOISE_H
+#define Q_NOISE_H
+
+#include "q_circuit.h"
+
+//Counters of the generator reserved for each trajectory. Trajectory t of a run starting at counter c draws from counters c + t * Q_TRAJECTORY_COUNTERS onwards, so every trajectory has its own stream of numbers.
+#define Q_TRAJECTORY_COUNTERS ((unsigned long long)1 << 32)
+
+//A quantum channel rho -> sum_i K_i rho K_i^H on qubits qubits, given by count dense Kraus operators. weights[i] is w_i if K_i^H K_i = w_i I, so that K_i is picked with a fixed probability, or -1 if the probability depends on the state. identity[i] is set if K_i is a multiple of the identity.
+typedef struct q_channel{
+  q_op** kraus;
+  double* weights;
+  unsigned char* identity;
+  int count;
+  int qubits;
+} q_channel;
+
+//A channel applied to the given qubits right after gate number gate of a circuit.
+typedef struct q_noise_event{
+  q_channel* channel;
+  int* targets;
+  int gate;
+} q_noise_event;
+
+//A recorded circuit with noise attached. Events are kept sorted by gate. readout[2q] is the probability of reading 1 when qubit q is 0 and readout[2q + 1] that of reading 0 when it is 1.
+typedef struct q_noisy_circuit{
+  q_circuit* circuit;
+  q_noise_event* events;
+  int count;
+  int capacity;
+  double* readout;
+} q_noisy_circuit;
+
+/**q_channel_alloc
+  *Builds a channel from its Kraus operators. Terminates if sum_i K_i^H K_i is not the identity, i.e. if the channel does not preserve the trace.
+    *kraus. The count Kraus operators, all on the same number of qubits. The channel takes ownership of them and densifies them.
+    *count. The number of Kraus operators.
+  Returns the generated channel "channel"
+*/
+q_channel* q_channel_alloc(q_op** kraus, int count);
+
+/**q_channel_free
+  *Frees a given channel and its Kraus operators.
+    *channel. The channel to free.
+*/
+void q_channel_free(q_channel* channel);
+
+/**q_channel_depolarizing
+  *Builds the single qubit depolarising channel rho -> (1 - p) rho + p I / 2, with Kraus operators sqrt(1 - 3p/4) I and sqrt(p/4) X, Y, Z.
+    *p. The depolarising probability, between 0 and 1.
+  Returns the generated channel "channel"
+*/
+q_channel* q_channel_depolarizing(double p);
+
+/**q_channel_amplitude_damping
+  *Builds the single qubit amplitude damping channel, which decays |1> to |0> with probability gamma.
+    *gamma. The decay probability, between 0 and 1.
+  Returns the generated channel "channel"
+*/
+q_channel* q_channel_amplitude_damping(double gamma);
+
+/**q_channel_phase_damping
+  *Builds the single qubit phase damping channel, which scales the off-diagonal entries of the density matrix by sqrt(1 - lambda) without changing populations.
+    *lambda. The damping probability, between 0 and 1.
+  Returns the generated channel "channel"
+*/
+q_channel* q_channel_phase_damping(double lambda);
+
+/**q_noisy_circuit_alloc
+  *Wraps a recorded circuit for noisy simulation, initially without noise.
+    *circuit. The circuit. It is not copied or freed, and gates must not be added or fused while noise refers to their indices.
+  Returns the generated noisy circuit "noisy"
+*/
+q_noisy_circuit* q_noisy_circuit_alloc(q_circuit* circuit);
+
+/**q_noisy_circuit_free
+  *Frees a given noisy circuit. The circuit and channels it refers to are not freed.
+    *noisy. The noisy circuit to free.
+*/
+void q_noisy_circuit_free(q_noisy_circuit* noisy);
+
+/**q_noisy_circuit_add_channel
+  *Attaches a channel to the given qubits right after a gate. Several channels may follow the same gate; they act in the order they were attached.
+    *noisy. The noisy circuit.
+    *gate. The index of the gate in the circuit, from 0 to gates - 1.
+    *channel. The channel. It is not copied, so one channel can be attached many times, and must outlive the noisy circuit.
+    *targets. The channel's distinct target qubits, with the same meaning as in q_state_apply_gate.
+*/
+void q_noisy_circuit_add_channel(q_noisy_circuit* noisy, int gate, q_channel* channel, const int* targets);
+
+/**q_noisy_circuit_add_gate_noise
+  *Attaches a single qubit channel after every gate of the circuit, once on each of the gate's target qubits, as a simple model of gate errors.
+    *noisy. The noisy circuit.
+    *channel. The single qubit channel. It must outlive the noisy circuit.
+*/
+void q_noisy_circuit_add_gate_noise(q_noisy_circuit* noisy, q_channel* channel);
+
+/**q_noisy_circuit_set_readout
+  *Sets the readout error of a qubit, applied whenever trajectories are measured.
+    *noisy. The noisy circuit.
+    *qubit. The qubit.
+    *p01. The probability of reading 1 when the qubit is 0.
+    *p10. The probability of reading 0 when the qubit is 1.
+*/
+void q_noisy_circuit_set_readout(q_noisy_circuit* noisy, int qubit, double p01, double p10);
+
+/**q_trajectory_run
+  *Runs one stochastic trajectory of a noisy circuit in place. Gates are applied with the kernels of q_circuit_run; at every channel one Kraus operator is picked with probability ||K_i psi||^2, computed block by block without temporaries, and applied with renormalisation. Averaging |psi><psi| over trajectories converges to the density matrix of the noisy circuit.
+    *noisy. The noisy circuit.
+    *state. The initial state, overwritten with the final state of the trajectory.
+    *rng. The generator of the trajectory. It is advanced past the numbers drawn.
+*/
+void q_trajectory_run(q_noisy_circuit* noisy, q_state* state, q_rng* rng);
+
+/**q_trajectory_sample
+  *Runs many trajectories from the same initial state and measures every qubit once at the end of each, with readout error. Trajectories run in parallel when states are small, each thread reusing one state buffer, and in sequence with parallel kernels otherwise. Trajectory i draws from its own block of Q_TRAJECTORY_COUNTERS counters, so the result does not depend on the number of threads.
+    *noisy. The noisy circuit.
+    *initial. The initial state. It is not changed.
+    *trajectories. The number of trajectories.
+    *rng. The random number generator. It is advanced past the counters used.
+    *out. Output, trajectories * n outcomes, with out[i * n + j] the outcome of qubit j in trajectory i.
+*/
+void q_trajectory_sample(q_noisy_circuit* noisy, q_state* initial, size_t trajectories, q_rng* rng, unsigned char* out);
+
+/**q_trajectory_probabilities
+  *Runs many trajectories from the same initial state and averages their outcome probabilities |psi_i|^2, then applies the readout error. This estimates the measurement statistics of the noisy circuit with less variance than sampling. Trajectories are drawn as in q_trajectory_sample; the average depends on the number of threads only through rounding.
+    *noisy. The noisy circuit.
+    *initial. The initial state. It is not changed.
+    *trajectories. The number of trajectories.
+    *rng. The random number generator. It is advanced past the counters used.
+  Returns the 2^n outcome probabilities "probabilities", indexed like the amplitudes of a state.
+*/
+gsl_vector* q_trajectory_probabilities(q_noisy_circuit* noisy, q_state* initial, size_t trajectories, q_rng* rng);
+#endif
@@ -0,0 +1,288 @@
+#include "q_param.h"
+#include "predefined_q.h"
+#include <string.h>
+
+/**param_qubits
+  *Returns the number of qubits a parameterised rotation acts on.
+*/
+static int param_qubits(q_param_type type){
+  return type == Q_PARAM_CROT_Z ? 2 : 1;
+}
+
+/**param_op
+  *Builds the rotation of a given type at a given value with the constructors of predefined_q.c.
+*/
+static q_op* param_op(q_param_type type, double value){
+  switch(type){
+    case Q_PARAM_RX:
+      return r_x(value);
+    case Q_PARAM_RY:
+      return r_y(value);
+    case Q_PARAM_RZ:
+      return r_z(value);
+    case Q_PARAM_ROT_Z:
+      return q_rot_z(value);
+    case Q_PARAM_CROT_Z:
+      return q_crot_z(value);
+  }
+  printf("Error: unknown parameterised gate. Terminating.\n");
+  exit(0);
+}
+
+/**param_generator
+  *Fills the 2^k x 2^k matrix G, as interleaved complex numbers in row major order, such that dU/dtheta = G U for the rotation U of a given type. G commutes with U: -i X / 2, -i Y / 2 and -i Z / 2 for the rotations in radians, and 2 pi i times the projector onto the phased basis state for q_rot_z and q_crot_z.
+*/
+static void param_generator(q_param_type type, double* g){
+  int d = 1 << param_qubits(type);
+  memset(g, 0, 2 * d * d * sizeof(double));
+  switch(type){
+    case Q_PARAM_RX:
+      g[3] = -0.5;
+      g[5] = -0.5;
+      break;
+    case Q_PARAM_RY:
+      g[2] = -0.5;
+      g[4] = 0.5;
+      break;
+    case Q_PARAM_RZ:
+      g[1] = -0.5;
+      g[7] = 0.5;
+      break;
+    case Q_PARAM_ROT_Z:
+      g[7] = 2.0 * M_PI;
+      break;
+    case Q_PARAM_CROT_Z:
+      g[2 * 15 + 1] = 2.0 * M_PI;
+      break;
+  }
+}
+
+/**q_param_circuit_alloc
+  *Wraps a recorded circuit for parameterised execution, initially without parameters. Fixed gates are still added with q_circuit_add on the circuit itself.
+    *circuit. The circuit. It is not copied or freed, and must not be fused while parameters refer to its gates.
+  Returns the generated parameterised circuit "param"
+*/
+q_param_circuit* q_param_circuit_alloc(q_circuit* circuit){
+  q_param_circuit* param = malloc(sizeof(q_param_circuit));
+  param->circuit = circuit;
+  param->count = 0;
+  param->capacity = 16;
+  param->gates = malloc(param->capacity * sizeof(q_param_gate));
+  param->parameters = 0;
+  param->values = NULL;
+  return param;
+}
+
+/**q_param_circuit_free
+  *Frees a given parameterised circuit. The circuit it refers to is not freed.
+    *param. The parameterised circuit to free.
+*/
+void q_param_circuit_free(q_param_circuit* param){
+  free(param->gates);
+  free(param->values);
+  free(param);
+}
+
+/**q_param_circuit_add
+  *Records a parameterised rotation at the end of the circuit, built with the current value of its parameter (0 for a new parameter).
+    *param. The parameterised circuit.
+    *type. The kind of rotation.
+    *parameter. The index of the parameter, 0 or more. Parameters not used by any gate have a zero gradient.
+    *targets. The target qubit, or for Q_PARAM_CROT_Z the two target qubits, with the same meaning as in q_state_apply_gate.
+*/
+void q_param_circuit_add(q_param_circuit* param, q_param_type type, int parameter, const int* targets){
+  if(parameter < 0){
+    printf("Error: negative parameter index. Terminating.\n");
+    exit(0);
+  }
+  if(parameter >= param->parameters){
+    param->values = realloc(param->values, (parameter + 1) * sizeof(double));
+    for(int j = param->parameters; j <= parameter; j++){
+      param->values[j] = 0.0;
+    }
+    param->parameters = parameter + 1;
+  }
+  q_circuit_add(param->circuit, param_op(type, param->values[parameter]), targets, param_qubits(type));
+  if(param->count == param->capacity){
+    param->capacity *= 2;
+    param->gates = realloc(param->gates, param->capacity * sizeof(q_param_gate));
+  }
+  param->gates[param->count].gate = param->circuit->gates - 1;
+  param->gates[param->count].parameter = parameter;
+  param->gates[param->count].type = type;
+  param->count++;
+}
+
+/**q_param_circuit_set
+  *Sets every parameter and rebuilds the gates bound to them in place, so the circuit can be run with q_circuit_run at the new values.
+    *param. The parameterised circuit.
+    *values. The param->parameters new values.
+*/
+void q_param_circuit_set(q_param_circuit* param, const double* values){
+  for(int j = 0; j < param->parameters; j++){
+    param->values[j] = values[j];
+  }
+  for(int i = 0; i < param->count; i++){
+    q_param_gate* p = &param->gates[i];
+    q_circuit_set_gate(param->circuit, p->gate, param_op(p->type, param->values[p->parameter]));
+  }
+}
+
+/**local_inner
+  *Computes <a|G|b> for a 2^k x 2^k matrix G on the target qubits, block by block without forming G|b>. Only the non-zero entries of G are visited, which is one or two per block for the generators of param_generator. Blocks are summed in fixed chunks, with at most Q_REDUCE_PARTS runs of them in a stack buffer as in reduce_inner, so the result does not depend on the number of threads and nothing is allocated.
+*/
+static gsl_complex local_inner(q_state* a, q_state* b, const double* g, const int* targets, int k){
+  size_t dim = (size_t)1 << k;
+  size_t masks[k];
+  size_t sorted[k];
+  size_t offsets[dim];
+  q_gate_masks(a->qubits, targets, k, masks, sorted);
+  q_gate_offsets(masks, k, offsets);
+  size_t from[dim * dim];
+  size_t to[dim * dim];
+  double entries[2 * dim * dim];
+  int nonzeros = 0;
+  for(size_t i = 0; i < dim; i++){
+    for(size_t j = 0; j < dim; j++){
+      if(g[2 * (i * dim + j)] == 0.0 && g[2 * (i * dim + j) + 1] == 0.0) continue;
+      to[nonzeros] = offsets[i];
+      from[nonzeros] = offsets[j];
+      entries[2 * nonzeros] = g[2 * (i * dim + j)];
+      entries[2 * nonzeros + 1] = g[2 * (i * dim + j) + 1];
+      nonzeros++;
+    }
+  }
+  size_t blocks = ((size_t)1 << a->qubits) >> k;
+  size_t chunks = (blocks + Q_REDUCE_CHUNK - 1) / Q_REDUCE_CHUNK;
+  const double* x = a->vector->data;
+  const double* y = b->vector->data;
+  size_t sx = a->vector->tda;
+  size_t sy = b->vector->tda;
+  size_t per = (chunks + Q_REDUCE_PARTS - 1) / Q_REDUCE_PARTS;
+  size_t parts = (chunks + per - 1) / per;
+  double partial[2 * Q_REDUCE_PARTS];
+  #pragma omp parallel for if(blocks * dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t s = 0; s < parts; s++){
+    double part[2] = {0.0, 0.0};
+    for(size_t c = s * per; c < (s + 1) * per && c < chunks; c++){
+      size_t end = (c + 1) * Q_REDUCE_CHUNK < blocks ? (c + 1) * Q_REDUCE_CHUNK : blocks;
+      double re = 0.0, im = 0.0;
+      for(size_t r = c * Q_REDUCE_CHUNK; r < end; r++){
+        size_t base = q_insert_zero_bits(r, sorted, k);
+        for(int e = 0; e < nonzeros; e++){
+          const double* u = x + 2 * (base + to[e]) * sx;
+          const double* v = y + 2 * (base + from[e]) * sy;
+          //conj(u) * g * v
+          double pr = u[0] * v[0] + u[1] * v[1];
+          double pi = u[0] * v[1] - u[1] * v[0];
+          re += entries[2 * e] * pr - entries[2 * e + 1] * pi;
+          im += entries[2 * e] * pi + entries[2 * e + 1] * pr;
+        }
+      }
+      part[0] += re;
+      part[1] += im;
+    }
+    partial[2 * s] = part[0];
+    partial[2 * s + 1] = part[1];
+  }
+  gsl_complex sum = GSL_COMPLEX_ZERO;
+  for(size_t s = 0; s < parts; s++){
+    GSL_SET_COMPLEX(&sum, GSL_REAL(sum) + partial[2 * s], GSL_IMAG(sum) + partial[2 * s + 1]);
+  }
+  return sum;
+}
+
+/**sparse_adjoint
+  *Builds the conjugate transpose of a sparse op in CSR form, placing the non-zeros of each column of op, row by row, into the matching row of the result.
+*/
+static q_op* sparse_adjoint(q_op* op){
+  size_t rows = (size_t)1 << op->qubits;
+  const q_sparse* a = op->sparse;
+  q_op* adjoint = q_op_sparse_alloc(op->qubits, a->nonzeros);
+  q_sparse* t = adjoint->sparse;
+  for(size_t nz = 0; nz < a->nonzeros; nz++){
+    t->row_start[a->columns[nz] + 1]++;
+  }
+  for(size_t r = 0; r < rows; r++){
+    t->row_start[r + 1] += t->row_start[r];
+  }
+  size_t* next = malloc(rows * sizeof(size_t));
+  memcpy(next, t->row_start, rows * sizeof(size_t));
+  for(size_t r = 0; r < rows; r++){
+    for(size_t nz = a->row_start[r]; nz < a->row_start[r + 1]; nz++){
+      size_t p = next[a->columns[nz]]++;
+      t->columns[p] = r;
+      t->values[2 * p] = a->values[2 * nz];
+      t->values[2 * p + 1] = -a->values[2 * nz + 1];
+    }
+  }
+  free(next);
+  return adjoint;
+}
+
+/**adjoint_circuit
+  *Records the inverse of every gate of a circuit, in the same order, so that running gate i of the result undoes gate i of the circuit with the classified kernels of q_circuit_run.
+*/
+static q_circuit* adjoint_circuit(q_circuit* circuit){
+  q_circuit* adjoint = q_circuit_alloc(circuit->qubits);
+  for(int i = 0; i < circuit->gates; i++){
+    q_gate* gate = &circuit->gate_list[i];
+    if(gate->op->sparse != NULL){
+      q_circuit_add(adjoint, sparse_adjoint(gate->op), gate->targets, gate->k);
+      continue;
+    }
+    gsl_matrix_complex* m = gate->op->matrix;
+    q_op* op = q_op_alloc(gate->k);
+    for(size_t r = 0; r < m->size1; r++){
+      for(size_t c = 0; c < m->size2; c++){
+        gsl_matrix_complex_set(op->matrix, c, r, gsl_complex_conjugate(gsl_matrix_complex_get(m, r, c)));
+      }
+    }
+    q_circuit_add(adjoint, op, gate->targets, gate->k);
+  }
+  return adjoint;
+}
+
+/**q_param_gradient
+  *Computes the expectation value E = <psi|obs|psi> of the circuit's output psi and its gradient with respect to every parameter by the adjoint method. The state is run forward once, then lambda = obs|psi> and psi are walked back through the inverse gates; at each parameterised gate U = exp(theta G) the derivative 2 Re <lambda|G|psi> is evaluated block by block on the gate's qubits without temporaries. The cost is three circuit passes plus one read-only pass over the two states per parameterised gate, with two state buffers, instead of two circuit runs per parameter for parameter shift.
+    *param. The parameterised circuit, at the values to differentiate at.
+    *obs. The observable.
+    *initial. The initial state. It is not changed.
+    *gradient. Output, the param->parameters derivatives dE/dvalues[j].
+  *Returns the expectation value.
+*/
+double q_param_gradient(q_param_circuit* param, q_observable* obs, q_state* initial, double* gradient){
+  q_circuit* circuit = param->circuit;
+  if(initial->qubits != circuit->qubits || obs->qubits != circuit->qubits){
+    printf("Error: size mismatch in gradient. Terminating.\n");
+    exit(0);
+  }
+  for(int j = 0; j < param->parameters; j++){
+    gradient[j] = 0.0;
+  }
+  q_state* psi = q_state_alloc(circuit->qubits);
+  q_state* lambda = q_state_alloc(circuit->qubits);
+  gsl_matrix_complex_memcpy(psi->vector, initial->vector);
+  q_circuit_run(circuit, psi);
+  q_observable_apply(obs, psi, lambda);
+  double expectation = GSL_REAL(q_state_inner(psi, lambda));
+  q_circuit* adjoint = adjoint_circuit(circuit);
+  double g[2 * 16];
+  int p = param->count - 1;
+  for(int i = circuit->gates - 1; i >= 0; i--){
+    //psi is the state right after gate i and lambda the observable pulled back to the same point.
+    for(; p >= 0 && param->gates[p].gate == i; p--){
+      q_param_gate* gate = &param->gates[p];
+      param_generator(gate->type, g);
+      gsl_complex d = local_inner(lambda, psi, g, circuit->gate_list[i].targets, circuit->gate_list[i].k);
+      gradient[gate->parameter] += 2.0 * GSL_REAL(d);
+    }
+    if(p < 0) break;
+    q_circuit_run_range(adjoint, psi, i, i + 1);
+    q_circuit_run_range(adjoint, lambda, i, i + 1);
+  }
+  q_circuit_free(adjoint);
+  q_state_free(psi);
+  q_state_free(lambda);
+  return expectation;
+}
@@ -0,0 +1,71 @@
+#ifndef Q_PARAM_H
+#define Q_PARAM_H
+
+#include "q_circuit.h"
+#include "q_pauli.h"
+
+//Rotations that can be recorded with a free parameter, named after their constructors in predefined_q.c. Q_PARAM_RX, Q_PARAM_RY and Q_PARAM_RZ take an angle in radians; Q_PARAM_ROT_Z and Q_PARAM_CROT_Z take the phase p of q_rot_z and q_crot_z, in turns.
+typedef enum q_param_type{
+  Q_PARAM_RX,
+  Q_PARAM_RY,
+  Q_PARAM_RZ,
+  Q_PARAM_ROT_Z,
+  Q_PARAM_CROT_Z
+} q_param_type;
+
+//Gate number gate of the circuit is a rotation of the given type by values[parameter].
+typedef struct q_param_gate{
+  int gate;
+  int parameter;
+  q_param_type type;
+} q_param_gate;
+
+//A recorded circuit with some gates bound to parameters. Gates are kept in circuit order. Several gates may share a parameter, whose gradient is then the sum over them.
+typedef struct q_param_circuit{
+  q_circuit* circuit;
+  q_param_gate* gates;
+  int count;
+  int capacity;
+  double* values;
+  int parameters;
+} q_param_circuit;
+
+/**q_param_circuit_alloc
+  *Wraps a recorded circuit for parameterised execution, initially without parameters. Fixed gates are still added with q_circuit_add on the circuit itself.
+    *circuit. The circuit. It is not copied or freed, and must not be fused while parameters refer to its gates.
+  Returns the generated parameterised circuit "param"
+*/
+q_param_circuit* q_param_circuit_alloc(q_circuit* circuit);
+
+/**q_param_circuit_free
+  *Frees a given parameterised circuit. The circuit it refers to is not freed.
+    *param. The parameterised circuit to free.
+*/
+void q_param_circuit_free(q_param_circuit* param);
+
+/**q_param_circuit_add
+  *Records a parameterised rotation at the end of the circuit, built with the current value of its parameter (0 for a new parameter).
+    *param. The parameterised circuit.
+    *type. The kind of rotation.
+    *parameter. The index of the parameter, 0 or more. Parameters not used by any gate have a zero gradient.
+    *targets. The target qubit, or for Q_PARAM_CROT_Z the two target qubits, with the same meaning as in q_state_apply_gate.
+*/
+void q_param_circuit_add(q_param_circuit* param, q_param_type type, int parameter, const int* targets);
+
+/**q_param_circuit_set
+  *Sets every parameter and rebuilds the gates bound to them in place, so the circuit can be run with q_circuit_run at the new values.
+    *param. The parameterised circuit.
+    *values. The param->parameters new values.
+*/
+void q_param_circuit_set(q_param_circuit* param, const double* values);
+
+/**q_param_gradient
+  *Computes the expectation value E = <psi|obs|psi> of the circuit's output psi and its gradient with respect to every parameter by the adjoint method. The state is run forward once, then lambda = obs|psi> and psi are walked back through the inverse gates; at each parameterised gate U = exp(theta G) the derivative 2 Re <lambda|G|psi> is evaluated block by block on the gate's qubits without temporaries. The cost is three circuit passes plus one read-only pass over the two states per parameterised gate, with two state buffers, instead of two circuit runs per parameter for parameter shift.
+    *param. The parameterised circuit, at the values to differentiate at.
+    *obs. The observable.
+    *initial. The initial state. It is not changed.
+    *gradient. Output, the param->parameters derivatives dE/dvalues[j].
+  *Returns the expectation value.
+*/
+double q_param_gradient(q_param_circuit* param, q_observable* obs, q_state* initial, double* gradient);
+#endif
@@ -0,0 +1,233 @@
+#include "q_pauli.h"
+
+/**q_observable_alloc
+  *Allocates an empty observable.
+    *qubits. The number of qubits the observable acts on.
+  Returns the empty observable "obs".
+*/
+q_observable* q_observable_alloc(int qubits){
+  q_observable* obs = malloc(sizeof(q_observable));
+  obs->qubits = qubits;
+  obs->terms = 0;
+  obs->capacity = 16;
+  obs->x_masks = malloc(obs->capacity * sizeof(size_t));
+  obs->z_masks = malloc(obs->capacity * sizeof(size_t));
+  obs->coefficients = malloc(obs->capacity * sizeof(double));
+  return obs;
+}
+
+/**q_observable_free
+  *Frees a given observable.
+    *obs. The observable to free.
+*/
+void q_observable_free(q_observable* obs){
+  free(obs->x_masks);
+  free(obs->z_masks);
+  free(obs->coefficients);
+  free(obs);
+}
+
+/**q_observable_add_term
+  *Adds a weighted Pauli string given only on the qubits it acts on, which is convenient for wide registers.
+    *obs. The observable to add to.
+    *coefficient. The real weight of the term.
+    *paulis. A string of k characters from "IXYZ".
+    *qubits. The qubit each character acts on.
+    *k. The number of characters.
+*/
+void q_observable_add_term(q_observable* obs, double coefficient, const char* paulis, const int* qubits, int k){
+  size_t x = 0;
+  size_t z = 0;
+  for(int j = 0; j < k; j++){
+    if(qubits[j] < 0 || qubits[j] >= obs->qubits){
+      printf("Error: qubit %d out of range in observable. Terminating.\n", qubits[j]);
+      exit(0);
+    }
+    size_t mask = (size_t)1 << (obs->qubits - 1 - qubits[j]);
+    switch(paulis[j]){
+      case 'I':
+        break;
+      case 'X':
+        x ^= mask;
+        break;
+      case 'Y':
+        x ^= mask;
+        z ^= mask;
+        break;
+      case 'Z':
+        z ^= mask;
+        break;
+      default:
+        printf("Error: unknown Pauli '%c' in observable. Terminating.\n", paulis[j]);
+        exit(0);
+    }
+  }
+  if(obs->terms == obs->capacity){
+    obs->capacity *= 2;
+    obs->x_masks = realloc(obs->x_masks, obs->capacity * sizeof(size_t));
+    obs->z_masks = realloc(obs->z_masks, obs->capacity * sizeof(size_t));
+    obs->coefficients = realloc(obs->coefficients, obs->capacity * sizeof(double));
+  }
+  obs->x_masks[obs->terms] = x;
+  obs->z_masks[obs->terms] = z;
+  obs->coefficients[obs->terms] = coefficient;
+  obs->terms++;
+}
+
+/**q_observable_add
+  *Adds a weighted Pauli string to an observable.
+    *obs. The observable to add to.
+    *coefficient. The real weight of the term.
+    *paulis. A string of obs->qubits characters from "IXYZ", character j acting on qubit j, e.g. "XIZ".
+*/
+void q_observable_add(q_observable* obs, double coefficient, const char* paulis){
+  int qubits[obs->qubits];
+  for(int j = 0; j < obs->qubits; j++){
+    qubits[j] = j;
+  }
+  q_observable_add_term(obs, coefficient, paulis, qubits, obs->qubits);
+}
+
+/**group_expectation
+  *Computes sum_i conj(psi_(i^x)) psi_i f(i), with f(i) = sum_t c_t (-1)^|i & z_t| over the terms of one group, which share the flip mask x. c holds each term's coefficient times i^(number of Y factors) as interleaved complex numbers. The state is summed in fixed chunks, with at most Q_REDUCE_PARTS runs of them in a stack buffer as in reduce_norm, so the result does not depend on the number of threads.
+*/
+static gsl_complex group_expectation(q_state* state, size_t x, const size_t* z, const double* c, int terms){
+  size_t dim = (size_t)1 << state->qubits;
+  size_t stride = state->vector->tda;
+  const double* amp = state->vector->data;
+  size_t chunks = (dim + Q_REDUCE_CHUNK - 1) / Q_REDUCE_CHUNK;
+  size_t per = (chunks + Q_REDUCE_PARTS - 1) / Q_REDUCE_PARTS;
+  size_t parts = (chunks + per - 1) / per;
+  double partial[2 * Q_REDUCE_PARTS];
+  #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t s = 0; s < parts; s++){
+    double part[2] = {0.0, 0.0};
+    for(size_t ch = s * per; ch < (s + 1) * per && ch < chunks; ch++){
+      size_t end = (ch + 1) * Q_REDUCE_CHUNK < dim ? (ch + 1) * Q_REDUCE_CHUNK : dim;
+      double re = 0.0, im = 0.0;
+      for(size_t i = ch * Q_REDUCE_CHUNK; i < end; i++){
+        double fr = 0.0, fi = 0.0;
+        for(int t = 0; t < terms; t++){
+          double sign = __builtin_parityll(i & z[t]) ? -1.0 : 1.0;
+          fr += sign * c[2 * t];
+          fi += sign * c[2 * t + 1];
+        }
+        const double* a = amp + 2 * (i ^ x) * stride;
+        const double* b = amp + 2 * i * stride;
+        //conj(a) * b
+        double pr = a[0] * b[0] + a[1] * b[1];
+        double pi = a[0] * b[1] - a[1] * b[0];
+        re += pr * fr - pi * fi;
+        im += pr * fi + pi * fr;
+      }
+      part[0] += re;
+      part[1] += im;
+    }
+    partial[2 * s] = part[0];
+    partial[2 * s + 1] = part[1];
+  }
+  gsl_complex sum = GSL_COMPLEX_ZERO;
+  for(size_t s = 0; s < parts; s++){
+    GSL_SET_COMPLEX(&sum, GSL_REAL(sum) + partial[2 * s], GSL_IMAG(sum) + partial[2 * s + 1]);
+  }
+  return sum;
+}
+
+/**q_observable_expectation
+  *Computes <state|obs|state> without copying the state. Each Pauli string acts on a basis state by a bit flip and a sign, so a term is evaluated directly on the amplitude index. Terms that flip the same qubits are grouped and evaluated together, so a Hamiltonian costs one pass over the state per distinct X/Y pattern (a single pass for all diagonal terms).
+    *obs. The observable.
+    *state. The state, assumed normalised.
+  *Returns the expectation value.
+*/
+double q_observable_expectation(q_observable* obs, q_state* state){
+  if(obs->qubits != state->qubits){
+    printf("Error: size mismatch in expectation value. Terminating.\n");
+    exit(0);
+  }
+  int done[obs->terms > 0 ? obs->terms : 1];
+  size_t* z = malloc((obs->terms + 1) * sizeof(size_t));
+  double* c = malloc(2 * (obs->terms + 1) * sizeof(double));
+  for(int t = 0; t < obs->terms; t++){
+    done[t] = 0;
+  }
+  double expectation = 0.0;
+  for(int t = 0; t < obs->terms; t++){
+    if(done[t]) continue;
+    size_t x = obs->x_masks[t];
+    int group = 0;
+    for(int u = t; u < obs->terms; u++){
+      if(done[u] || obs->x_masks[u] != x) continue;
+      //Each Y = iXZ contributes a factor of i.
+      int ys = __builtin_popcountll(obs->x_masks[u] & obs->z_masks[u]) % 4;
+      double cr[4] = {1.0, 0.0, -1.0, 0.0};
+      double ci[4] = {0.0, 1.0, 0.0, -1.0};
+      z[group] = obs->z_masks[u];
+      c[2 * group] = obs->coefficients[u] * cr[ys];
+      c[2 * group + 1] = obs->coefficients[u] * ci[ys];
+      group++;
+      done[u] = 1;
+    }
+    expectation += GSL_REAL(group_expectation(state, x, z, c, group));
+  }
+  free(z);
+  free(c);
+  return expectation;
+}
+
+/**q_observable_apply
+  *Computes obs|state> into a preallocated state, e.g. the starting vector of an adjoint gradient. Terms are grouped by flip mask as in q_observable_expectation, so this costs one pass per distinct X/Y pattern.
+    *obs. The observable.
+    *state. The state. It is not changed.
+    *out. Output, a state on the same qubits, distinct from state. It is overwritten and is not normalised.
+*/
+void q_observable_apply(q_observable* obs, q_state* state, q_state* out){
+  if(obs->qubits != state->qubits || out->qubits != state->qubits){
+    printf("Error: size mismatch in observable application. Terminating.\n");
+    exit(0);
+  }
+  size_t dim = (size_t)1 << state->qubits;
+  size_t stride = state->vector->tda;
+  size_t out_stride = out->vector->tda;
+  const double* amp = state->vector->data;
+  double* res = out->vector->data;
+  int done[obs->terms > 0 ? obs->terms : 1];
+  size_t* z = malloc((obs->terms + 1) * sizeof(size_t));
+  double* c = malloc(2 * (obs->terms + 1) * sizeof(double));
+  for(int t = 0; t < obs->terms; t++){
+    done[t] = 0;
+  }
+  gsl_matrix_complex_set_zero(out->vector);
+  for(int t = 0; t < obs->terms; t++){
+    if(done[t]) continue;
+    size_t x = obs->x_masks[t];
+    int group = 0;
+    for(int u = t; u < obs->terms; u++){
+      if(done[u] || obs->x_masks[u] != x) continue;
+      int ys = __builtin_popcountll(obs->x_masks[u] & obs->z_masks[u]) % 4;
+      double cr[4] = {1.0, 0.0, -1.0, 0.0};
+      double ci[4] = {0.0, 1.0, 0.0, -1.0};
+      z[group] = obs->z_masks[u];
+      c[2 * group] = obs->coefficients[u] * cr[ys];
+      c[2 * group + 1] = obs->coefficients[u] * ci[ys];
+      group++;
+      done[u] = 1;
+    }
+    //(X^x Z^z psi)_i = (-1)^|(i ^ x) & z| psi_(i ^ x)
+    #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t i = 0; i < dim; i++){
+      size_t j = i ^ x;
+      double fr = 0.0, fi = 0.0;
+      for(int g = 0; g < group; g++){
+        double sign = __builtin_parityll(j & z[g]) ? -1.0 : 1.0;
+        fr += sign * c[2 * g];
+        fi += sign * c[2 * g + 1];
+      }
+      const double* a = amp + 2 * j * stride;
+      double* r = res + 2 * i * out_stride;
+      r[0] += fr * a[0] - fi * a[1];
+      r[1] += fr * a[1] + fi * a[0];
+    }
+  }
+  free(z);
+  free(c);
+}
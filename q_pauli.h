@@ -0,0 +1,62 @@
+#ifndef Q_PAULI_H
+#define Q_PAULI_H
+
+#include "q_circuit.h"
+
+//A weighted sum of Pauli strings. Term t is coefficients[t] times the string with X (or Y) on the qubits of x_masks[t] and Z (or Y) on the qubits of z_masks[t]; masks are on the amplitude index, as for gates.
+typedef struct q_observable{
+  size_t* x_masks;
+  size_t* z_masks;
+  double* coefficients;
+  int terms;
+  int capacity;
+  int qubits;
+} q_observable;
+
+/**q_observable_alloc
+  *Allocates an empty observable.
+    *qubits. The number of qubits the observable acts on.
+  Returns the empty observable "obs".
+*/
+q_observable* q_observable_alloc(int qubits);
+
+/**q_observable_free
+  *Frees a given observable.
+    *obs. The observable to free.
+*/
+void q_observable_free(q_observable* obs);
+
+/**q_observable_add
+  *Adds a weighted Pauli string to an observable.
+    *obs. The observable to add to.
+    *coefficient. The real weight of the term.
+    *paulis. A string of obs->qubits characters from "IXYZ", character j acting on qubit j, e.g. "XIZ".
+*/
+void q_observable_add(q_observable* obs, double coefficient, const char* paulis);
+
+/**q_observable_add_term
+  *Adds a weighted Pauli string given only on the qubits it acts on, which is convenient for wide registers.
+    *obs. The observable to add to.
+    *coefficient. The real weight of the term.
+    *paulis. A string of k characters from "IXYZ".
+    *qubits. The qubit each character acts on.
+    *k. The number of characters.
+*/
+void q_observable_add_term(q_observable* obs, double coefficient, const char* paulis, const int* qubits, int k);
+
+/**q_observable_expectation
+  *Computes <state|obs|state> without copying the state. Each Pauli string acts on a basis state by a bit flip and a sign, so a term is evaluated directly on the amplitude index. Terms that flip the same qubits are grouped and evaluated together, so a Hamiltonian costs one pass over the state per distinct X/Y pattern (a single pass for all diagonal terms).
+    *obs. The observable.
+    *state. The state, assumed normalised.
+  *Returns the expectation value.
+*/
+double q_observable_expectation(q_observable* obs, q_state* state);
+
+/**q_observable_apply
+  *Computes obs|state> into a preallocated state, e.g. the starting vector of an adjoint gradient. Terms are grouped by flip mask as in q_observable_expectation, so this costs one pass per distinct X/Y pattern.
+    *obs. The observable.
+    *state. The state. It is not changed.
+    *out. Output, a state on the same qubits, distinct from state. It is overwritten and is not normalised.
+*/
+void q_observable_apply(q_observable* obs, q_state* state, q_state* out);
+#endif
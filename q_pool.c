@@ -0,0 +1,103 @@
+#include "q_pool.h"
+
+/**q_pool_alloc
+  *Allocates an empty pool.
+  Returns the generated pool "pool"
+*/
+q_pool* q_pool_alloc(){
+  return calloc(1, sizeof(q_pool));
+}
+
+/**q_pool_free
+  *Frees a pool together with every state and operator it holds. Objects still in use are not affected and must be freed or released by the user.
+    *pool. The pool to free.
+*/
+void q_pool_free(q_pool* pool){
+  for(int c = 0; c < Q_POOL_CLASSES; c++){
+    for(int i = 0; i < pool->states[c].count; i++){
+      q_state_free(pool->states[c].items[i]);
+    }
+    for(int i = 0; i < pool->ops[c].count; i++){
+      q_op_free(pool->ops[c].items[i]);
+    }
+    free(pool->states[c].items);
+    free(pool->ops[c].items);
+  }
+  free(pool);
+}
+
+/**check_class
+  *Checks that a number of qubits has a size class.
+*/
+static void check_class(int qubits){
+  if(qubits < 0 || qubits >= Q_POOL_CLASSES){
+    printf("Error: no pool size class for %d qubits. Terminating.\n", qubits);
+    exit(0);
+  }
+}
+
+/**list_pop
+  *Takes the most recently released object of a free list, or NULL if it is empty.
+*/
+static void* list_pop(q_pool_list* list){
+  return list->count > 0 ? list->items[--list->count] : NULL;
+}
+
+/**list_push
+  *Adds an object to a free list, growing it geometrically so that a warmed up pool does not reallocate.
+*/
+static void list_push(q_pool_list* list, void* item){
+  if(list->count == list->capacity){
+    list->capacity = list->capacity > 0 ? 2 * list->capacity : 4;
+    list->items = realloc(list->items, list->capacity * sizeof(void*));
+  }
+  list->items[list->count++] = item;
+}
+
+/**q_pool_state
+  *Takes a state from the pool, allocating one only if no released state of that size is available. Its amplitudes are not initialised, as with q_state_alloc.
+    *pool. The pool.
+    *qubits. The number of qubits of the state.
+  Returns the state "state", to be given back with q_pool_release_state or freed with q_state_free.
+*/
+q_state* q_pool_state(q_pool* pool, int qubits){
+  check_class(qubits);
+  q_state* state = list_pop(&pool->states[qubits]);
+  return state != NULL ? state : q_state_alloc(qubits);
+}
+
+/**q_pool_release_state
+  *Gives a state back to the pool for reuse. The state must not be used afterwards.
+    *pool. The pool.
+    *state. The state, from q_pool_state or any allocator of q_circuit.c.
+*/
+void q_pool_release_state(q_pool* pool, q_state* state){
+  check_class(state->qubits);
+  list_push(&pool->states[state->qubits], state);
+}
+
+/**q_pool_op
+  *Takes a dense operator from the pool, allocating one only if no released operator of that size is available. Its entries are not initialised, as with q_op_alloc.
+    *pool. The pool.
+    *qubits. The number of qubits the operator acts on.
+  Returns the operator "op", to be given back with q_pool_release_op or freed with q_op_free.
+*/
+q_op* q_pool_op(q_pool* pool, int qubits){
+  check_class(qubits);
+  q_op* op = list_pop(&pool->ops[qubits]);
+  return op != NULL ? op : q_op_alloc(qubits);
+}
+
+/**q_pool_release_op
+  *Gives an operator back to the pool for reuse. Dense operators are kept; sparse and lazy operators are freed, as their buffers have no fixed size. The operator must not be used afterwards.
+    *pool. The pool.
+    *op. The operator.
+*/
+void q_pool_release_op(q_pool* pool, q_op* op){
+  if(op->matrix == NULL){
+    q_op_free(op);
+    return;
+  }
+  check_class(op->qubits);
+  list_push(&pool->ops[op->qubits], op);
+}
@@ -0,0 +1,63 @@
+#ifndef Q_POOL_H
+#define Q_POOL_H
+
+#include "q_circuit.h"
+
+//Number of size classes of a q_pool. Class q holds buffers of 2^q amplitudes (states) or 2^q x 2^q entries (operators).
+#define Q_POOL_CLASSES 64
+
+//Free list of released objects of one size class, used as a stack.
+typedef struct q_pool_list{
+  void** items;
+  int count;
+  int capacity;
+} q_pool_list;
+
+//Recycles the buffers of states and dense operators by number of qubits. Objects taken from the pool are ordinary q_states and q_ops; releasing them keeps them for the next request of the same size instead of freeing them, so once a loop has warmed the pool up it performs no heap allocations. A pool is not thread safe; use one per thread.
+typedef struct q_pool{
+  q_pool_list states[Q_POOL_CLASSES];
+  q_pool_list ops[Q_POOL_CLASSES];
+} q_pool;
+
+/**q_pool_alloc
+  *Allocates an empty pool.
+  Returns the generated pool "pool"
+*/
+q_pool* q_pool_alloc();
+
+/**q_pool_free
+  *Frees a pool together with every state and operator it holds. Objects still in use are not affected and must be freed or released by the user.
+    *pool. The pool to free.
+*/
+void q_pool_free(q_pool* pool);
+
+/**q_pool_state
+  *Takes a state from the pool, allocating one only if no released state of that size is available. Its amplitudes are not initialised, as with q_state_alloc.
+    *pool. The pool.
+    *qubits. The number of qubits of the state.
+  Returns the state "state", to be given back with q_pool_release_state or freed with q_state_free.
+*/
+q_state* q_pool_state(q_pool* pool, int qubits);
+
+/**q_pool_release_state
+  *Gives a state back to the pool for reuse. The state must not be used afterwards.
+    *pool. The pool.
+    *state. The state, from q_pool_state or any allocator of q_circuit.c.
+*/
+void q_pool_release_state(q_pool* pool, q_state* state);
+
+/**q_pool_op
+  *Takes a dense operator from the pool, allocating one only if no released operator of that size is available. Its entries are not initialised, as with q_op_alloc.
+    *pool. The pool.
+    *qubits. The number of qubits the operator acts on.
+  Returns the operator "op", to be given back with q_pool_release_op or freed with q_op_free.
+*/
+q_op* q_pool_op(q_pool* pool, int qubits);
+
+/**q_pool_release_op
+  *Gives an operator back to the pool for reuse. Dense operators are kept; sparse and lazy operators are freed, as their buffers have no fixed size. The operator must not be used afterwards.
+    *pool. The pool.
+    *op. The operator.
+*/
+void q_pool_release_op(q_pool* pool, q_op* op);
+#endif
@@ -0,0 +1,100 @@
+#include "q_rng.h"
+#include <math.h>
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+/**philox4x32_10
+  *The Philox4x32 bijection with 10 rounds, applied to the counter ctr under key k.
+*/
+static void philox4x32_10(unsigned int* ctr, const unsigned int* k){
+  unsigned int k0 = k[0], k1 = k[1];
+  for(int round = 0; round < 10; round++){
+    unsigned long long p0 = (unsigned long long)PHILOX_M0 * ctr[0];
+    unsigned long long p1 = (unsigned long long)PHILOX_M1 * ctr[2];
+    unsigned int c0 = (unsigned int)(p1 >> 32) ^ ctr[1] ^ k0;
+    unsigned int c2 = (unsigned int)(p0 >> 32) ^ ctr[3] ^ k1;
+    ctr[0] = c0;
+    ctr[1] = (unsigned int)p1;
+    ctr[2] = c2;
+    ctr[3] = (unsigned int)p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+}
+
+/**q_rng_init
+  *Initialises a generator at the start of a stream.
+    *rng. The generator to initialise.
+    *seed. The seed shared by all streams of a run.
+    *stream. The stream, e.g. a thread, shot or trajectory index. Different streams never overlap.
+*/
+void q_rng_init(q_rng* rng, unsigned long long seed, unsigned long long stream){
+  rng->key[0] = (unsigned int)seed;
+  rng->key[1] = (unsigned int)(seed >> 32);
+  rng->stream = stream;
+  rng->counter = 0;
+  rng->has_spare = 0;
+}
+
+/**q_rng_block
+  *Computes the 128 random bits at a given counter of a generator's stream, without changing the generator.
+    *rng. The generator.
+    *counter. The counter.
+    *out. Output, four 32 bit words.
+*/
+void q_rng_block(const q_rng* rng, unsigned long long counter, unsigned int* out){
+  out[0] = (unsigned int)counter;
+  out[1] = (unsigned int)(counter >> 32);
+  out[2] = (unsigned int)rng->stream;
+  out[3] = (unsigned int)(rng->stream >> 32);
+  philox4x32_10(out, rng->key);
+}
+
+/**q_rng_uniform_at
+  *Computes the two uniform doubles in [0, 1) at a given counter of a generator's stream, without changing the generator. Lets parallel loops draw the numbers for item i from counter i.
+    *rng. The generator.
+    *counter. The counter.
+    *out. Output, two uniform doubles.
+*/
+void q_rng_uniform_at(const q_rng* rng, unsigned long long counter, double* out){
+  unsigned int bits[4];
+  q_rng_block(rng, counter, bits);
+  for(int i = 0; i < 2; i++){
+    unsigned long long x = ((unsigned long long)bits[2 * i + 1] << 32) | bits[2 * i];
+    out[i] = (x >> 11) * (1.0 / 9007199254740992.0);
+  }
+}
+
+/**q_rng_uniform
+  *Draws the next uniform double in [0, 1) from a generator's stream.
+    *rng. The generator.
+  *Returns the uniform double.
+*/
+double q_rng_uniform(q_rng* rng){
+  if(rng->has_spare){
+    rng->has_spare = 0;
+    return rng->spare;
+  }
+  double u[2];
+  q_rng_uniform_at(rng, rng->counter++, u);
+  rng->spare = u[1];
+  rng->has_spare = 1;
+  return u[0];
+}
+
+/**q_rng_normal_at
+  *Computes two independent standard normal doubles at a given counter of a generator's stream (Box-Muller), without changing the generator.
+    *rng. The generator.
+    *counter. The counter.
+    *out. Output, two normal doubles.
+*/
+void q_rng_normal_at(const q_rng* rng, unsigned long long counter, double* out){
+  double u[2];
+  q_rng_uniform_at(rng, counter, u);
+  double r = sqrt(-2.0 * log(1.0 - u[0]));
+  out[0] = r * cos(2.0 * M_PI * u[1]);
+  out[1] = r * sin(2.0 * M_PI * u[1]);
+}
@@ -0,0 +1,51 @@
+#ifndef Q_RNG_H
+#define Q_RNG_H
+
+//A Philox4x32-10 counter-based generator. Every output is a pure function of (seed, stream, counter), so independent streams can be handed to threads or shots and any run can be reproduced bit for bit regardless of scheduling.
+typedef struct q_rng{
+  unsigned int key[2];
+  unsigned long long stream;
+  unsigned long long counter;
+  double spare;
+  int has_spare;
+} q_rng;
+
+/**q_rng_init
+  *Initialises a generator at the start of a stream.
+    *rng. The generator to initialise.
+    *seed. The seed shared by all streams of a run.
+    *stream. The stream, e.g. a thread, shot or trajectory index. Different streams never overlap.
+*/
+void q_rng_init(q_rng* rng, unsigned long long seed, unsigned long long stream);
+
+/**q_rng_block
+  *Computes the 128 random bits at a given counter of a generator's stream, without changing the generator.
+    *rng. The generator.
+    *counter. The counter.
+    *out. Output, four 32 bit words.
+*/
+void q_rng_block(const q_rng* rng, unsigned long long counter, unsigned int* out);
+
+/**q_rng_uniform_at
+  *Computes the two uniform doubles in [0, 1) at a given counter of a generator's stream, without changing the generator. Lets parallel loops draw the numbers for item i from counter i.
+    *rng. The generator.
+    *counter. The counter.
+    *out. Output, two uniform doubles.
+*/
+void q_rng_uniform_at(const q_rng* rng, unsigned long long counter, double* out);
+
+/**q_rng_uniform
+  *Draws the next uniform double in [0, 1) from a generator's stream.
+    *rng. The generator.
+  *Returns the uniform double.
+*/
+double q_rng_uniform(q_rng* rng);
+
+/**q_rng_normal_at
+  *Computes two independent standard normal doubles at a given counter of a generator's stream (Box-Muller), without changing the generator.
+    *rng. The generator.
+    *counter. The counter.
+    *out. Output, two normal doubles.
+*/
+void q_rng_normal_at(const q_rng* rng, unsigned long long counter, double* out);
+#endif
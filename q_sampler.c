@@ -0,0 +1,142 @@
+#include "q_sampler.h"
+
+/**q_sampler_alloc
+  *Builds a sampler for the computational basis outcomes of a subset of qubits of a state, marginalising over the rest. The outcome distribution is turned into a Walker alias table once, after which every shot costs O(1). The state is not modified and may be freed afterwards.
+    *state. The state to sample from. It does not need to be normalised.
+    *qubits. The k distinct qubits to sample, or NULL to sample every qubit in order.
+    *k. The number of qubits to sample. Ignored if qubits is NULL.
+  Returns the sampler "sampler". Outcomes are bitstrings packed into integers with qubits[0] as the most significant bit.
+*/
+q_sampler* q_sampler_alloc(q_state* state, const int* qubits, int k){
+  int n = state->qubits;
+  if(qubits == NULL){
+    k = n;
+  }
+  size_t shift[k];
+  for(int j = 0; j < k; j++){
+    int qubit = qubits == NULL ? j : qubits[j];
+    if(qubit < 0 || qubit >= n){
+      printf("Error: qubit %d out of range in sampler. Terminating.\n", qubit);
+      exit(0);
+    }
+    shift[j] = n - 1 - qubit;
+  }
+  q_sampler* sampler = malloc(sizeof(q_sampler));
+  sampler->qubits = k;
+  sampler->outcomes = (size_t)1 << k;
+  sampler->threshold = calloc(sampler->outcomes, sizeof(double));
+  sampler->alias = malloc(sampler->outcomes * sizeof(size_t));
+  double* p = sampler->threshold;
+
+  //Marginal distribution of the sampled qubits, in one pass over the state.
+  size_t dim = (size_t)1 << n;
+  size_t stride = state->vector->tda;
+  const double* amp = state->vector->data;
+  double total = 0.0;
+  for(size_t i = 0; i < dim; i++){
+    const double* x = amp + 2 * i * stride;
+    size_t outcome = i;
+    if(qubits != NULL){
+      outcome = 0;
+      for(int j = 0; j < k; j++){
+        outcome = (outcome << 1) | ((i >> shift[j]) & 1);
+      }
+    }
+    double w = x[0] * x[0] + x[1] * x[1];
+    p[outcome] += w;
+    total += w;
+  }
+
+  //Vose's alias method: scale to mean one, then pair each light outcome with a heavy one.
+  size_t m = sampler->outcomes;
+  size_t* small = malloc(m * sizeof(size_t));
+  size_t* large = malloc(m * sizeof(size_t));
+  size_t ns = 0, nl = 0;
+  for(size_t l = 0; l < m; l++){
+    p[l] *= m / total;
+    sampler->alias[l] = l;
+    if(p[l] < 1.0){
+      small[ns++] = l;
+    }
+    else{
+      large[nl++] = l;
+    }
+  }
+  while(ns > 0 && nl > 0){
+    size_t s = small[--ns];
+    size_t g = large[nl - 1];
+    sampler->alias[s] = g;
+    p[g] -= 1.0 - p[s];
+    if(p[g] < 1.0){
+      nl--;
+      small[ns++] = g;
+    }
+  }
+  //Whatever is left is one up to rounding.
+  while(nl > 0){
+    p[large[--nl]] = 1.0;
+  }
+  while(ns > 0){
+    p[small[--ns]] = 1.0;
+  }
+  free(small);
+  free(large);
+  return sampler;
+}
+
+/**q_sampler_free
+  *Frees a given q_sampler.
+    *sampler. The sampler to free.
+*/
+void q_sampler_free(q_sampler* sampler){
+  free(sampler->threshold);
+  free(sampler->alias);
+  free(sampler);
+}
+
+/**sampler_draw
+  *Draws the outcome of shot i from the alias table, using the two uniforms at counter i of the generator.
+*/
+static size_t sampler_draw(q_sampler* sampler, const q_rng* rng, unsigned long long i){
+  double u[2];
+  q_rng_uniform_at(rng, i, u);
+  size_t column = (size_t)(u[0] * sampler->outcomes);
+  return u[1] < sampler->threshold[column] ? column : sampler->alias[column];
+}
+
+/**q_sampler_sample
+  *Draws a number of independent shots from a sampler. Shot i uses its own counter of the generator, so shots are drawn in parallel and the result does not depend on the number of threads.
+    *sampler. The sampler to draw from.
+    *shots. The number of shots.
+    *rng. The random number generator. It is advanced past the counters used.
+    *out. Output, the shots sampled outcomes.
+*/
+void q_sampler_sample(q_sampler* sampler, size_t shots, q_rng* rng, size_t* out){
+  unsigned long long first = rng->counter;
+  #pragma omp parallel for if(shots >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < shots; i++){
+    out[i] = sampler_draw(sampler, rng, first + i);
+  }
+  rng->counter += shots;
+}
+
+/**q_sampler_histogram
+  *Draws a number of independent shots from a sampler and counts how often each outcome occurs. Gives the same counts as q_sampler_sample with the same generator.
+    *sampler. The sampler to draw from.
+    *shots. The number of shots.
+    *rng. The random number generator. It is advanced past the counters used.
+    *counts. Output, an array of sampler->outcomes counts, which is overwritten.
+*/
+void q_sampler_histogram(q_sampler* sampler, size_t shots, q_rng* rng, size_t* counts){
+  unsigned long long first = rng->counter;
+  for(size_t l = 0; l < sampler->outcomes; l++){
+    counts[l] = 0;
+  }
+  #pragma omp parallel for if(shots >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+  for(size_t i = 0; i < shots; i++){
+    size_t outcome = sampler_draw(sampler, rng, first + i);
+    #pragma omp atomic
+    counts[outcome]++;
+  }
+  rng->counter += shots;
+}
@@ -0,0 +1,45 @@
+#ifndef Q_SAMPLER_H
+#define Q_SAMPLER_H
+
+#include "q_circuit.h"
+
+typedef struct q_sampler{
+  int qubits;
+  size_t outcomes;
+  double* threshold;
+  size_t* alias;
+} q_sampler;
+
+/**q_sampler_alloc
+  *Builds a sampler for the computational basis outcomes of a subset of qubits of a state, marginalising over the rest. The outcome distribution is turned into a Walker alias table once, after which every shot costs O(1). The state is not modified and may be freed afterwards.
+    *state. The state to sample from. It does not need to be normalised.
+    *qubits. The k distinct qubits to sample, or NULL to sample every qubit in order.
+    *k. The number of qubits to sample. Ignored if qubits is NULL.
+  Returns the sampler "sampler". Outcomes are bitstrings packed into integers with qubits[0] as the most significant bit.
+*/
+q_sampler* q_sampler_alloc(q_state* state, const int* qubits, int k);
+
+/**q_sampler_free
+  *Frees a given q_sampler.
+    *sampler. The sampler to free.
+*/
+void q_sampler_free(q_sampler* sampler);
+
+/**q_sampler_sample
+  *Draws a number of independent shots from a sampler. Shot i uses its own counter of the generator, so shots are drawn in parallel and the result does not depend on the number of threads.
+    *sampler. The sampler to draw from.
+    *shots. The number of shots.
+    *rng. The random number generator. It is advanced past the counters used.
+    *out. Output, the shots sampled outcomes.
+*/
+void q_sampler_sample(q_sampler* sampler, size_t shots, q_rng* rng, size_t* out);
+
+/**q_sampler_histogram
+  *Draws a number of independent shots from a sampler and counts how often each outcome occurs. Gives the same counts as q_sampler_sample with the same generator.
+    *sampler. The sampler to draw from.
+    *shots. The number of shots.
+    *rng. The random number generator. It is advanced past the counters used.
+    *counts. Output, an array of sampler->outcomes counts, which is overwritten.
+*/
+void q_sampler_histogram(q_sampler* sampler, size_t shots, q_rng* rng, size_t* counts);
+#endif
@@ -0,0 +1,287 @@
+#include "q_simd.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define Q_SIMD_X86
+#include <immintrin.h>
+#endif
+
+static int q_simd_level_set = -1;
+
+/**q_simd_supported
+  *Returns the best instruction set supported by the CPU.
+*/
+static q_simd_level q_simd_supported(){
+#ifdef Q_SIMD_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")){
+    return Q_SIMD_AVX512;
+  }
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+    return Q_SIMD_AVX2;
+  }
+#endif
+  return Q_SIMD_SCALAR;
+}
+
+/**q_simd_get_level
+  *Returns the instruction set used by the vectorised kernels. On first use this is the best one the CPU supports.
+*/
+q_simd_level q_simd_get_level(){
+  if(q_simd_level_set < 0){
+    q_simd_level_set = q_simd_supported();
+  }
+  return q_simd_level_set;
+}
+
+/**q_simd_set_level
+  *Restricts the vectorised kernels to a given instruction set, e.g. Q_SIMD_SCALAR to compare against the scalar fallback. Levels the CPU does not support are lowered to the best supported one.
+    *level. The instruction set to use.
+*/
+void q_simd_set_level(q_simd_level level){
+  q_simd_level supported = q_simd_supported();
+  q_simd_level_set = level < supported ? level : supported;
+}
+
+/**pair_low
+  *Returns the index of the amplitude with the target bit clear in pair r. Consecutive pairs have consecutive indices over runs as long as the smaller of control and mask.
+*/
+static inline size_t pair_low(size_t r, size_t control, size_t mask){
+  if(control == 0){
+    return ((r & ~(mask - 1)) << 1) | (r & (mask - 1));
+  }
+  size_t small = control < mask ? control : mask;
+  size_t large = control < mask ? mask : control;
+  r = ((r & ~(small - 1)) << 1) | (r & (small - 1));
+  r = ((r & ~(large - 1)) << 1) | (r & (large - 1));
+  return r | control;
+}
+
+/**gate_1_scalar
+  *Scalar pair update for pairs begin..end.
+*/
+static void gate_1_scalar(double* amp, const double* u, size_t control, size_t mask, size_t begin, size_t end){
+  for(size_t r = begin; r < end; r++){
+    size_t lo = pair_low(r, control, mask);
+    double* a = amp + 2 * lo;
+    double* b = amp + 2 * (lo + mask);
+    double ar = a[0], ai = a[1], br = b[0], bi = b[1];
+    a[0] = u[0] * ar - u[1] * ai + u[2] * br - u[3] * bi;
+    a[1] = u[0] * ai + u[1] * ar + u[2] * bi + u[3] * br;
+    b[0] = u[4] * ar - u[5] * ai + u[6] * br - u[7] * bi;
+    b[1] = u[4] * ai + u[5] * ar + u[6] * bi + u[7] * br;
+  }
+}
+
+#ifdef Q_SIMD_X86
+/**cmul_256
+  *Multiplies two interleaved complex doubles x by the complex number (re, im), both broadcast.
+*/
+__attribute__((target("avx2,fma")))
+static inline __m256d cmul_256(__m256d re, __m256d im, __m256d x){
+  return _mm256_fmaddsub_pd(re, x, _mm256_mul_pd(im, _mm256_permute_pd(x, 0x5)));
+}
+
+/**gate_1_avx2
+  *AVX2 pair update. Two pairs are updated at once when their indices are consecutive, and a pair whose target is the lowest bit is held in a single register.
+*/
+__attribute__((target("avx2,fma")))
+static void gate_1_avx2(double* amp, const double* u, size_t control, size_t mask, size_t begin, size_t end){
+  size_t step = control == 0 || mask < control ? mask : control;
+  if(mask == 1){
+    //Lane 0 of c0/c1 holds the first row of u and lane 1 the second, so one register holds the whole pair.
+    __m256d c0 = _mm256_setr_pd(u[0], u[1], u[4], u[5]);
+    __m256d c1 = _mm256_setr_pd(u[2], u[3], u[6], u[7]);
+    __m256d c0r = _mm256_movedup_pd(c0), c0i = _mm256_permute_pd(c0, 0xF);
+    __m256d c1r = _mm256_movedup_pd(c1), c1i = _mm256_permute_pd(c1, 0xF);
+    for(size_t r = begin; r < end; r++){
+      double* p = amp + 2 * pair_low(r, control, mask);
+      __m256d x = _mm256_loadu_pd(p);
+      __m256d x0 = _mm256_permute2f128_pd(x, x, 0x00);
+      __m256d x1 = _mm256_permute2f128_pd(x, x, 0x11);
+      __m256d y = _mm256_add_pd(cmul_256(c0r, c0i, x0), cmul_256(c1r, c1i, x1));
+      _mm256_storeu_pd(p, y);
+    }
+    return;
+  }
+  if(step < 2){
+    gate_1_scalar(amp, u, control, mask, begin, end);
+    return;
+  }
+  __m256d u00r = _mm256_set1_pd(u[0]), u00i = _mm256_set1_pd(u[1]);
+  __m256d u01r = _mm256_set1_pd(u[2]), u01i = _mm256_set1_pd(u[3]);
+  __m256d u10r = _mm256_set1_pd(u[4]), u10i = _mm256_set1_pd(u[5]);
+  __m256d u11r = _mm256_set1_pd(u[6]), u11i = _mm256_set1_pd(u[7]);
+  size_t r = begin;
+  if(r & 1){
+    gate_1_scalar(amp, u, control, mask, r, r + 1);
+    r++;
+  }
+  for(; r + 2 <= end; r += 2){
+    size_t lo = pair_low(r, control, mask);
+    double* pa = amp + 2 * lo;
+    double* pb = amp + 2 * (lo + mask);
+    __m256d a = _mm256_loadu_pd(pa);
+    __m256d b = _mm256_loadu_pd(pb);
+    _mm256_storeu_pd(pa, _mm256_add_pd(cmul_256(u00r, u00i, a), cmul_256(u01r, u01i, b)));
+    _mm256_storeu_pd(pb, _mm256_add_pd(cmul_256(u10r, u10i, a), cmul_256(u11r, u11i, b)));
+  }
+  gate_1_scalar(amp, u, control, mask, r, end);
+}
+
+/**cmul_512
+  *Multiplies four interleaved complex doubles x by the complex number (re, im), both broadcast.
+*/
+__attribute__((target("avx512f")))
+static inline __m512d cmul_512(__m512d re, __m512d im, __m512d x){
+  return _mm512_fmaddsub_pd(re, x, _mm512_mul_pd(im, _mm512_permute_pd(x, 0x55)));
+}
+
+/**gate_1_avx512
+  *AVX-512 pair update, four pairs at a time. Falls back to the AVX2 kernel when fewer than four consecutive pairs have consecutive indices.
+*/
+__attribute__((target("avx512f,avx2,fma")))
+static void gate_1_avx512(double* amp, const double* u, size_t control, size_t mask, size_t begin, size_t end){
+  size_t step = control == 0 || mask < control ? mask : control;
+  if(step < 4){
+    gate_1_avx2(amp, u, control, mask, begin, end);
+    return;
+  }
+  __m512d u00r = _mm512_set1_pd(u[0]), u00i = _mm512_set1_pd(u[1]);
+  __m512d u01r = _mm512_set1_pd(u[2]), u01i = _mm512_set1_pd(u[3]);
+  __m512d u10r = _mm512_set1_pd(u[4]), u10i = _mm512_set1_pd(u[5]);
+  __m512d u11r = _mm512_set1_pd(u[6]), u11i = _mm512_set1_pd(u[7]);
+  size_t r = begin;
+  size_t head = (4 - (r & 3)) & 3;
+  if(head > end - r){
+    head = end - r;
+  }
+  gate_1_scalar(amp, u, control, mask, r, r + head);
+  r += head;
+  for(; r + 4 <= end; r += 4){
+    size_t lo = pair_low(r, control, mask);
+    double* pa = amp + 2 * lo;
+    double* pb = amp + 2 * (lo + mask);
+    __m512d a = _mm512_loadu_pd(pa);
+    __m512d b = _mm512_loadu_pd(pb);
+    _mm512_storeu_pd(pa, _mm512_add_pd(cmul_512(u00r, u00i, a), cmul_512(u01r, u01i, b)));
+    _mm512_storeu_pd(pb, _mm512_add_pd(cmul_512(u10r, u10i, a), cmul_512(u11r, u11i, b)));
+  }
+  gate_1_scalar(amp, u, control, mask, r, end);
+}
+
+/**hsum_256
+  *Adds the four doubles of a register.
+*/
+__attribute__((target("avx2,fma")))
+static inline double hsum_256(__m256d x){
+  __m128d s = _mm_add_pd(_mm256_castpd256_pd128(x), _mm256_extractf128_pd(x, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+/**norm_avx2
+  *AVX2 squared norm, two amplitudes at a time.
+*/
+__attribute__((target("avx2,fma")))
+static double norm_avx2(const double* amp, size_t n){
+  __m256d acc = _mm256_setzero_pd();
+  size_t i = 0;
+  for(; i + 2 <= n; i += 2){
+    __m256d x = _mm256_loadu_pd(amp + 2 * i);
+    acc = _mm256_fmadd_pd(x, x, acc);
+  }
+  double sum = hsum_256(acc);
+  for(; i < n; i++){
+    sum += amp[2 * i] * amp[2 * i] + amp[2 * i + 1] * amp[2 * i + 1];
+  }
+  return sum;
+}
+
+/**inner_avx2
+  *AVX2 inner product, two amplitudes at a time. The real part sums a*b elementwise and the imaginary part sums a*swap(b) with the even lanes subtracted.
+*/
+__attribute__((target("avx2,fma")))
+static void inner_avx2(const double* a, const double* b, size_t n, double* out){
+  __m256d re = _mm256_setzero_pd();
+  __m256d im = _mm256_setzero_pd();
+  size_t i = 0;
+  for(; i + 2 <= n; i += 2){
+    __m256d x = _mm256_loadu_pd(a + 2 * i);
+    __m256d y = _mm256_loadu_pd(b + 2 * i);
+    re = _mm256_fmadd_pd(x, y, re);
+    im = _mm256_fmadd_pd(x, _mm256_permute_pd(y, 0x5), im);
+  }
+  __m256d sign = _mm256_setr_pd(-1.0, 1.0, -1.0, 1.0);
+  out[0] = hsum_256(re);
+  out[1] = hsum_256(_mm256_mul_pd(im, sign));
+  for(; i < n; i++){
+    out[0] += a[2 * i] * b[2 * i] + a[2 * i + 1] * b[2 * i + 1];
+    out[1] += a[2 * i + 1] * b[2 * i] - a[2 * i] * b[2 * i + 1];
+  }
+}
+#endif
+
+/**q_simd_gate_1
+  *Applies a (possibly controlled) single qubit gate to a contiguous interleaved amplitude array. Pair r of the range is the r'th pair of amplitudes that differ in the target bit and have the control bit set.
+    *amp. The amplitudes, as interleaved real and imaginary parts.
+    *u. The 2x2 gate, row major, as 8 interleaved doubles.
+    *control. The mask of the control qubit, or 0 for an uncontrolled gate.
+    *mask. The mask of the target qubit.
+    *begin. The first pair to update.
+    *end. One past the last pair to update.
+*/
+void q_simd_gate_1(double* amp, const double* u, size_t control, size_t mask, size_t begin, size_t end){
+#ifdef Q_SIMD_X86
+  switch(q_simd_get_level()){
+    case Q_SIMD_AVX512:
+      gate_1_avx512(amp, u, control, mask, begin, end);
+      return;
+    case Q_SIMD_AVX2:
+      gate_1_avx2(amp, u, control, mask, begin, end);
+      return;
+    default:
+      break;
+  }
+#endif
+  gate_1_scalar(amp, u, control, mask, begin, end);
+}
+
+/**q_simd_norm
+  *Computes the squared norm of a contiguous interleaved amplitude array.
+    *amp. The amplitudes.
+    *n. The number of amplitudes.
+  *Returns the sum of |amp_i|^2.
+*/
+double q_simd_norm(const double* amp, size_t n){
+#ifdef Q_SIMD_X86
+  if(q_simd_get_level() >= Q_SIMD_AVX2){
+    return norm_avx2(amp, n);
+  }
+#endif
+  double sum = 0.0;
+  for(size_t i = 0; i < n; i++){
+    sum += amp[2 * i] * amp[2 * i] + amp[2 * i + 1] * amp[2 * i + 1];
+  }
+  return sum;
+}
+
+/**q_simd_inner
+  *Computes sum_i a_i * conj(b_i) over two contiguous interleaved amplitude arrays.
+    *a. The first amplitudes.
+    *b. The second amplitudes.
+    *n. The number of amplitudes.
+    *out. Output, the real and imaginary parts of the sum.
+*/
+void q_simd_inner(const double* a, const double* b, size_t n, double* out){
+#ifdef Q_SIMD_X86
+  if(q_simd_get_level() >= Q_SIMD_AVX2){
+    inner_avx2(a, b, n, out);
+    return;
+  }
+#endif
+  out[0] = 0.0;
+  out[1] = 0.0;
+  for(size_t i = 0; i < n; i++){
+    out[0] += a[2 * i] * b[2 * i] + a[2 * i + 1] * b[2 * i + 1];
+    out[1] += a[2 * i + 1] * b[2 * i] - a[2 * i] * b[2 * i + 1];
+  }
+}
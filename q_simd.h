@@ -0,0 +1,53 @@
+#ifndef Q_SIMD_H
+#define Q_SIMD_H
+
+#include <stddef.h>
+
+//Alignment in bytes of q_state amplitude buffers, enough for an AVX-512 load.
+#define Q_ALIGNMENT 64
+
+typedef enum q_simd_level{
+  Q_SIMD_SCALAR,
+  Q_SIMD_AVX2,
+  Q_SIMD_AVX512
+} q_simd_level;
+
+/**q_simd_get_level
+  *Returns the instruction set used by the vectorised kernels. On first use this is the best one the CPU supports.
+*/
+q_simd_level q_simd_get_level();
+
+/**q_simd_set_level
+  *Restricts the vectorised kernels to a given instruction set, e.g. Q_SIMD_SCALAR to compare against the scalar fallback. Levels the CPU does not support are lowered to the best supported one.
+    *level. The instruction set to use.
+*/
+void q_simd_set_level(q_simd_level level);
+
+/**q_simd_gate_1
+  *Applies a (possibly controlled) single qubit gate to a contiguous interleaved amplitude array. Pair r of the range is the r'th pair of amplitudes that differ in the target bit and have the control bit set.
+    *amp. The amplitudes, as interleaved real and imaginary parts.
+    *u. The 2x2 gate, row major, as 8 interleaved doubles.
+    *control. The mask of the control qubit, or 0 for an uncontrolled gate.
+    *mask. The mask of the target qubit.
+    *begin. The first pair to update.
+    *end. One past the last pair to update.
+*/
+void q_simd_gate_1(double* amp, const double* u, size_t control, size_t mask, size_t begin, size_t end);
+
+/**q_simd_norm
+  *Computes the squared norm of a contiguous interleaved amplitude array.
+    *amp. The amplitudes.
+    *n. The number of amplitudes.
+  *Returns the sum of |amp_i|^2.
+*/
+double q_simd_norm(const double* amp, size_t n);
+
+/**q_simd_inner
+  *Computes sum_i a_i * conj(b_i) over two contiguous interleaved amplitude arrays.
+    *a. The first amplitudes.
+    *b. The second amplitudes.
+    *n. The number of amplitudes.
+    *out. Output, the real and imaginary parts of the sum.
+*/
+void q_simd_inner(const double* a, const double* b, size_t n, double* out);
+#endif
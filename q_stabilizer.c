@@ -0,0 +1,611 @@
+#include "q_stabilizer.h"
+#include <string.h>
+
+/**q_stabilizer_alloc
+  *Allocates a stabilizer state initialised to |0...0>. Memory and the cost of every gate grow only polynomially with the number of qubits.
+    *qubits. The number of qubits.
+  Returns the generated state "s"
+*/
+q_stabilizer* q_stabilizer_alloc(int qubits){
+  q_stabilizer* s = malloc(sizeof(q_stabilizer));
+  s->qubits = qubits;
+  s->words = (qubits + 63) / 64;
+  size_t rows = 2 * (size_t)qubits + 1;
+  s->x = calloc(rows * s->words, sizeof(unsigned long long));
+  s->z = calloc(rows * s->words, sizeof(unsigned long long));
+  s->r = calloc(rows, sizeof(unsigned char));
+  //Destabilizer i is X_i and stabilizer i is Z_i.
+  for(int i = 0; i < qubits; i++){
+    s->x[(size_t)i * s->words + i / 64] = 1ULL << (i % 64);
+    s->z[(size_t)(qubits + i) * s->words + i / 64] = 1ULL << (i % 64);
+  }
+  return s;
+}
+
+/**q_stabilizer_free
+  *Frees a given stabilizer state.
+    *s. The state to free.
+*/
+void q_stabilizer_free(q_stabilizer* s){
+  free(s->x);
+  free(s->z);
+  free(s->r);
+  free(s);
+}
+
+/**copy_into
+  *Copies the tableau of a stabilizer state into another of the same size.
+*/
+static void copy_into(q_stabilizer* dest, const q_stabilizer* s){
+  size_t rows = 2 * (size_t)s->qubits + 1;
+  memcpy(dest->x, s->x, rows * s->words * sizeof(unsigned long long));
+  memcpy(dest->z, s->z, rows * s->words * sizeof(unsigned long long));
+  memcpy(dest->r, s->r, rows * sizeof(unsigned char));
+}
+
+/**q_stabilizer_copy
+  *Copies a stabilizer state.
+    *s. The state to copy.
+  Returns the copy "copy"
+*/
+q_stabilizer* q_stabilizer_copy(q_stabilizer* s){
+  q_stabilizer* copy = q_stabilizer_alloc(s->qubits);
+  copy_into(copy, s);
+  return copy;
+}
+
+/**check_qubit
+  *Terminates if a qubit is out of range for a stabilizer state.
+*/
+static void check_qubit(q_stabilizer* s, int a){
+  if(a < 0 || a >= s->qubits){
+    printf("Error: qubit %d out of range in stabilizer simulation. Terminating.\n", a);
+    exit(0);
+  }
+}
+
+/**check_pair
+  *Terminates if two qubits are out of range or equal.
+*/
+static void check_pair(q_stabilizer* s, int a, int b){
+  check_qubit(s, a);
+  check_qubit(s, b);
+  if(a == b){
+    printf("Error: repeated qubit %d in stabilizer simulation. Terminating.\n", a);
+    exit(0);
+  }
+}
+
+/**q_stabilizer_hadamard
+  *Applies a Hadamard gate to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_hadamard(q_stabilizer* s, int a){
+  check_qubit(s, a);
+  size_t w = a / 64;
+  unsigned long long bit = 1ULL << (a % 64);
+  for(size_t i = 0; i < 2 * (size_t)s->qubits; i++){
+    unsigned long long* x = s->x + i * s->words + w;
+    unsigned long long* z = s->z + i * s->words + w;
+    unsigned long long xa = *x & bit;
+    unsigned long long za = *z & bit;
+    s->r[i] ^= (xa && za);
+    *x = (*x & ~bit) | za;
+    *z = (*z & ~bit) | xa;
+  }
+}
+
+/**q_stabilizer_s
+  *Applies the phase gate S = diag(1, i) to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_s(q_stabilizer* s, int a){
+  check_qubit(s, a);
+  size_t w = a / 64;
+  unsigned long long bit = 1ULL << (a % 64);
+  for(size_t i = 0; i < 2 * (size_t)s->qubits; i++){
+    unsigned long long xa = s->x[i * s->words + w] & bit;
+    unsigned long long* z = s->z + i * s->words + w;
+    s->r[i] ^= (xa && (*z & bit));
+    *z ^= xa;
+  }
+}
+
+/**q_stabilizer_s_dagger
+  *Applies the inverse phase gate diag(1, -i) to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_s_dagger(q_stabilizer* s, int a){
+  check_qubit(s, a);
+  size_t w = a / 64;
+  unsigned long long bit = 1ULL << (a % 64);
+  for(size_t i = 0; i < 2 * (size_t)s->qubits; i++){
+    unsigned long long xa = s->x[i * s->words + w] & bit;
+    unsigned long long* z = s->z + i * s->words + w;
+    s->r[i] ^= (xa && !(*z & bit));
+    *z ^= xa;
+  }
+}
+
+/**apply_pauli
+  *Applies a Pauli gate, which only flips the signs of the rows that anticommute with it. Pass the x and z bits of the gate: X is (1, 0), Z is (0, 1) and Y is (1, 1).
+*/
+static void apply_pauli(q_stabilizer* s, int a, int px, int pz){
+  check_qubit(s, a);
+  size_t w = a / 64;
+  unsigned long long bit = 1ULL << (a % 64);
+  for(size_t i = 0; i < 2 * (size_t)s->qubits; i++){
+    int xa = (s->x[i * s->words + w] & bit) != 0;
+    int za = (s->z[i * s->words + w] & bit) != 0;
+    s->r[i] ^= (px & za) ^ (pz & xa);
+  }
+}
+
+/**q_stabilizer_pauli_X
+  *Applies a Pauli X gate to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_pauli_X(q_stabilizer* s, int a){
+  apply_pauli(s, a, 1, 0);
+}
+
+/**q_stabilizer_pauli_Y
+  *Applies a Pauli Y gate to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_pauli_Y(q_stabilizer* s, int a){
+  apply_pauli(s, a, 1, 1);
+}
+
+/**q_stabilizer_pauli_Z
+  *Applies a Pauli Z gate to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_pauli_Z(q_stabilizer* s, int a){
+  apply_pauli(s, a, 0, 1);
+}
+
+/**q_stabilizer_cX
+  *Applies a CNOT gate.
+    *s. The state. It is overwritten.
+    *control. The control qubit.
+    *target. The target qubit.
+*/
+void q_stabilizer_cX(q_stabilizer* s, int control, int target){
+  check_pair(s, control, target);
+  size_t wa = control / 64, wb = target / 64;
+  int sa = control % 64, sb = target % 64;
+  for(size_t i = 0; i < 2 * (size_t)s->qubits; i++){
+    unsigned long long* x = s->x + i * s->words;
+    unsigned long long* z = s->z + i * s->words;
+    int xa = (x[wa] >> sa) & 1, za = (z[wa] >> sa) & 1;
+    int xb = (x[wb] >> sb) & 1, zb = (z[wb] >> sb) & 1;
+    s->r[i] ^= xa & zb & (xb ^ za ^ 1);
+    x[wb] ^= (unsigned long long)xa << sb;
+    z[wa] ^= (unsigned long long)zb << sa;
+  }
+}
+
+/**q_stabilizer_cZ
+  *Applies a controlled Z gate.
+    *s. The state. It is overwritten.
+    *a. The first qubit.
+    *b. The second qubit.
+*/
+void q_stabilizer_cZ(q_stabilizer* s, int a, int b){
+  check_pair(s, a, b);
+  size_t wa = a / 64, wb = b / 64;
+  int sa = a % 64, sb = b % 64;
+  for(size_t i = 0; i < 2 * (size_t)s->qubits; i++){
+    unsigned long long* x = s->x + i * s->words;
+    unsigned long long* z = s->z + i * s->words;
+    int xa = (x[wa] >> sa) & 1, za = (z[wa] >> sa) & 1;
+    int xb = (x[wb] >> sb) & 1, zb = (z[wb] >> sb) & 1;
+    s->r[i] ^= xa & xb & (za ^ zb);
+    z[wa] ^= (unsigned long long)xb << sa;
+    z[wb] ^= (unsigned long long)xa << sb;
+  }
+}
+
+/**q_stabilizer_swap
+  *Swaps two qubits.
+    *s. The state. It is overwritten.
+    *a. The first qubit.
+    *b. The second qubit.
+*/
+void q_stabilizer_swap(q_stabilizer* s, int a, int b){
+  check_pair(s, a, b);
+  size_t wa = a / 64, wb = b / 64;
+  int sa = a % 64, sb = b % 64;
+  for(size_t i = 0; i < 2 * (size_t)s->qubits; i++){
+    unsigned long long* rows[2] = {s->x + i * s->words, s->z + i * s->words};
+    for(int p = 0; p < 2; p++){
+      unsigned long long* v = rows[p];
+      unsigned long long da = (v[wa] >> sa) & 1, db = (v[wb] >> sb) & 1;
+      if(da != db){
+        v[wa] ^= 1ULL << sa;
+        v[wb] ^= 1ULL << sb;
+      }
+    }
+  }
+}
+
+/**rowsum
+  *Replaces row h by the product of rows i and h, tracking the sign with the phase exponents of the Pauli products qubit by qubit, a whole word of qubits at a time.
+*/
+static void rowsum(q_stabilizer* s, size_t h, size_t i){
+  const unsigned long long* x1 = s->x + i * s->words;
+  const unsigned long long* z1 = s->z + i * s->words;
+  unsigned long long* x2 = s->x + h * s->words;
+  unsigned long long* z2 = s->z + h * s->words;
+  long long phase = 2 * s->r[h] + 2 * s->r[i];
+  for(int w = 0; w < s->words; w++){
+    unsigned long long y = x1[w] & z1[w];
+    unsigned long long xo = x1[w] & ~z1[w];
+    unsigned long long zo = ~x1[w] & z1[w];
+    unsigned long long plus = (y & z2[w] & ~x2[w]) | (xo & z2[w] & x2[w]) | (zo & x2[w] & ~z2[w]);
+    unsigned long long minus = (y & x2[w] & ~z2[w]) | (xo & z2[w] & ~x2[w]) | (zo & x2[w] & z2[w]);
+    phase += __builtin_popcountll(plus) - __builtin_popcountll(minus);
+    x2[w] ^= x1[w];
+    z2[w] ^= z1[w];
+  }
+  s->r[h] = ((phase % 4) + 4) % 4 == 2;
+}
+
+/**random_row
+  *Finds a stabilizer that anticommutes with Z on a qubit, which makes its measurement random.
+  *Returns the row, or 0 if the outcome is deterministic.
+*/
+static size_t random_row(q_stabilizer* s, int a){
+  size_t w = a / 64;
+  unsigned long long bit = 1ULL << (a % 64);
+  for(size_t p = s->qubits; p < 2 * (size_t)s->qubits; p++){
+    if(s->x[p * s->words + w] & bit) return p;
+  }
+  return 0;
+}
+
+/**deterministic_outcome
+  *Computes the outcome of measuring a qubit whose outcome is deterministic, by multiplying the stabilizers selected by the destabilizers into the scratch row.
+*/
+static int deterministic_outcome(q_stabilizer* s, int a){
+  size_t n = s->qubits;
+  size_t w = a / 64;
+  unsigned long long bit = 1ULL << (a % 64);
+  memset(s->x + 2 * n * s->words, 0, s->words * sizeof(unsigned long long));
+  memset(s->z + 2 * n * s->words, 0, s->words * sizeof(unsigned long long));
+  s->r[2 * n] = 0;
+  for(size_t i = 0; i < n; i++){
+    if(s->x[i * s->words + w] & bit) rowsum(s, 2 * n, i + n);
+  }
+  return s->r[2 * n];
+}
+
+/**measure_with
+  *Measures a qubit, using the uniform u in [0, 1) to pick the outcome if it is random.
+*/
+static int measure_with(q_stabilizer* s, int a, double u){
+  size_t n = s->qubits;
+  size_t p = random_row(s, a);
+  if(p == 0){
+    return deterministic_outcome(s, a);
+  }
+  size_t w = a / 64;
+  unsigned long long bit = 1ULL << (a % 64);
+  for(size_t i = 0; i < 2 * n; i++){
+    if(i != p && (s->x[i * s->words + w] & bit)) rowsum(s, i, p);
+  }
+  memcpy(s->x + (p - n) * s->words, s->x + p * s->words, s->words * sizeof(unsigned long long));
+  memcpy(s->z + (p - n) * s->words, s->z + p * s->words, s->words * sizeof(unsigned long long));
+  s->r[p - n] = s->r[p];
+  memset(s->x + p * s->words, 0, s->words * sizeof(unsigned long long));
+  memset(s->z + p * s->words, 0, s->words * sizeof(unsigned long long));
+  s->z[p * s->words + w] = bit;
+  s->r[p] = u >= 0.5;
+  return s->r[p];
+}
+
+/**q_stabilizer_probability
+  *Computes the probability that measuring a qubit gives a given outcome, which for a stabilizer state is 0, 1/2 or 1. The state is not changed.
+    *s. The state.
+    *a. The qubit.
+    *outcome. The outcome, 0 or 1.
+  *Returns the probability.
+*/
+double q_stabilizer_probability(q_stabilizer* s, int a, int outcome){
+  check_qubit(s, a);
+  if(random_row(s, a) != 0){
+    return 0.5;
+  }
+  return deterministic_outcome(s, a) == (outcome != 0) ? 1.0 : 0.0;
+}
+
+/**q_stabilizer_measure
+  *Measures a qubit in the computational basis and collapses the state onto the outcome.
+    *s. The state to measure. It is overwritten.
+    *a. The qubit.
+    *rng. The random number generator, used only if the outcome is random.
+  *Returns the outcome, 0 or 1.
+*/
+int q_stabilizer_measure(q_stabilizer* s, int a, q_rng* rng){
+  check_qubit(s, a);
+  if(random_row(s, a) == 0){
+    return deterministic_outcome(s, a);
+  }
+  return measure_with(s, a, q_rng_uniform(rng));
+}
+
+/**q_stabilizer_sample
+  *Draws a number of independent shots, each measuring every qubit. The outcomes of a stabilizer state are uniform over an affine space, so its basis is found once by Gaussian elimination and every shot is then a random combination of at most n basis rows. Shot i uses its own counters of the generator, so shots are drawn in parallel and the result does not depend on the number of threads.
+    *s. The state to sample from. It is not changed.
+    *shots. The number of shots.
+    *rng. The random number generator. It is advanced past the counters used.
+    *out. Output, shots * n outcomes, with out[i * n + j] the outcome of qubit j in shot i.
+*/
+void q_stabilizer_sample(q_stabilizer* s, size_t shots, q_rng* rng, unsigned char* out){
+  size_t n = s->qubits;
+  int words = s->words;
+  //The outcomes are uniform over base ^ span(x parts of the stabilizers). Find one outcome in the support by measuring a copy, taking outcome 0 whenever it is random.
+  q_stabilizer* copy = q_stabilizer_copy(s);
+  unsigned long long* base = calloc(words, sizeof(unsigned long long));
+  for(size_t j = 0; j < n; j++){
+    if(measure_with(copy, j, 0.0)) base[j / 64] |= 1ULL << (j % 64);
+  }
+  q_stabilizer_free(copy);
+  //Reduce the x parts of the stabilizers to a basis by Gaussian elimination.
+  unsigned long long* basis = malloc(n * words * sizeof(unsigned long long));
+  memcpy(basis, s->x + n * words, n * words * sizeof(unsigned long long));
+  size_t rank = 0;
+  for(size_t j = 0; j < n && rank < n; j++){
+    unsigned long long bit = 1ULL << (j % 64);
+    size_t pivot = rank;
+    while(pivot < n && !(basis[pivot * words + j / 64] & bit)) pivot++;
+    if(pivot == n) continue;
+    for(int w = 0; w < words; w++){
+      unsigned long long t = basis[pivot * words + w];
+      basis[pivot * words + w] = basis[rank * words + w];
+      basis[rank * words + w] = t;
+    }
+    for(size_t i = rank + 1; i < n; i++){
+      if(basis[i * words + j / 64] & bit){
+        for(int w = 0; w < words; w++){
+          basis[i * words + w] ^= basis[rank * words + w];
+        }
+      }
+    }
+    rank++;
+  }
+  //Each shot picks a random combination of the basis, using 128 bits per counter.
+  size_t blocks = (rank + 127) / 128;
+  unsigned long long first = rng->counter;
+  #pragma omp parallel if(shots * rank * words >= Q_PARALLEL_MIN) num_threads(q_get_threads())
+  {
+    unsigned long long* outcome = malloc(words * sizeof(unsigned long long));
+    #pragma omp for schedule(static)
+    for(size_t i = 0; i < shots; i++){
+      memcpy(outcome, base, words * sizeof(unsigned long long));
+      for(size_t b = 0; b < blocks; b++){
+        unsigned int bits[4];
+        q_rng_block(rng, first + i * blocks + b, bits);
+        for(size_t m = 128 * b; m < rank && m < 128 * (b + 1); m++){
+          if((bits[(m % 128) / 32] >> (m % 32)) & 1){
+            for(int w = 0; w < words; w++){
+              outcome[w] ^= basis[m * words + w];
+            }
+          }
+        }
+      }
+      for(size_t j = 0; j < n; j++){
+        out[i * n + j] = (outcome[j / 64] >> (j % 64)) & 1;
+      }
+    }
+    free(outcome);
+  }
+  rng->counter += shots * blocks;
+  free(base);
+  free(basis);
+}
+
+typedef enum clifford_kind{
+  CLIFFORD_NONE,
+  CLIFFORD_I,
+  CLIFFORD_H,
+  CLIFFORD_S,
+  CLIFFORD_S_DAGGER,
+  CLIFFORD_X,
+  CLIFFORD_Y,
+  CLIFFORD_Z,
+  CLIFFORD_CX,
+  CLIFFORD_XC,
+  CLIFFORD_CZ,
+  CLIFFORD_SWAP
+} clifford_kind;
+
+/**equal_up_to_phase
+  *Checks whether a q_op equals a reference matrix (row major, interleaved complex) times a unit global phase.
+*/
+static int equal_up_to_phase(q_op* op, const double* ref){
+  size_t d = (size_t)1 << op->qubits;
+  size_t m = 0;
+  for(size_t l = 0; l < d * d; l++){
+    if(fabs(ref[2 * l]) + fabs(ref[2 * l + 1]) > fabs(ref[2 * m]) + fabs(ref[2 * m + 1])) m = l;
+  }
+  gsl_complex ref_m;
+  GSL_SET_COMPLEX(&ref_m, ref[2 * m], ref[2 * m + 1]);
+  gsl_complex phase = gsl_complex_div(q_op_get(op, m / d, m % d), ref_m);
+  if(fabs(gsl_complex_abs(phase) - 1.0) > 1e-9) return 0;
+  for(size_t l = 0; l < d * d; l++){
+    gsl_complex r;
+    GSL_SET_COMPLEX(&r, ref[2 * l], ref[2 * l + 1]);
+    if(gsl_complex_abs(gsl_complex_sub(q_op_get(op, l / d, l % d), gsl_complex_mul(phase, r))) > 1e-9) return 0;
+  }
+  return 1;
+}
+
+/**classify
+  *Recognises the Clifford gates the tableau supports from a gate's matrix.
+*/
+static clifford_kind classify(q_op* op){
+  static const double h = 0.70710678118654752440;
+  static const double one[4][8] = {
+    {1, 0, 0, 0, 0, 0, 1, 0},
+    {h, 0, h, 0, h, 0, -h, 0},
+    {1, 0, 0, 0, 0, 0, 0, 1},
+    {1, 0, 0, 0, 0, 0, 0, -1}
+  };
+  static const double paulis[3][8] = {
+    {0, 0, 1, 0, 1, 0, 0, 0},
+    {0, 0, 0, -1, 0, 1, 0, 0},
+    {1, 0, 0, 0, 0, 0, -1, 0}
+  };
+  static const int perms[3][4] = {{0, 1, 3, 2}, {0, 3, 2, 1}, {0, 2, 1, 3}};
+  if(op->qubits == 1){
+    for(int g = 0; g < 4; g++){
+      if(equal_up_to_phase(op, one[g])) return CLIFFORD_I + g;
+    }
+    for(int g = 0; g < 3; g++){
+      if(equal_up_to_phase(op, paulis[g])) return CLIFFORD_X + g;
+    }
+  }
+  else if(op->qubits == 2){
+    double ref[32];
+    for(int g = 0; g < 3; g++){
+      memset(ref, 0, sizeof(ref));
+      for(int j = 0; j < 4; j++){
+        ref[2 * (perms[g][j] * 4 + j)] = 1.0;
+      }
+      if(equal_up_to_phase(op, ref)) return g == 0 ? CLIFFORD_CX : g == 1 ? CLIFFORD_XC : CLIFFORD_SWAP;
+    }
+    memset(ref, 0, sizeof(ref));
+    for(int j = 0; j < 4; j++){
+      ref[2 * (j * 4 + j)] = j == 3 ? -1.0 : 1.0;
+    }
+    if(equal_up_to_phase(op, ref)) return CLIFFORD_CZ;
+  }
+  return CLIFFORD_NONE;
+}
+
+/**q_circuit_is_clifford
+  *Checks whether every recorded gate of a circuit is, up to a global phase, one the stabilizer backend can run: the identity, q_hadamard, q_s, its inverse, the Paulis, q_cX (either way round), q_cZ or a two qubit swap.
+    *circuit. The circuit to check.
+  *Returns 1 if the circuit can be run by q_stabilizer_run and 0 otherwise.
+*/
+int q_circuit_is_clifford(q_circuit* circuit){
+  for(int g = 0; g < circuit->gates; g++){
+    if(classify(circuit->gate_list[g].op) == CLIFFORD_NONE) return 0;
+  }
+  return 1;
+}
+
+/**q_stabilizer_run
+  *Executes every recorded gate of a Clifford circuit, in order, against a stabilizer state in place. Gates are recognised from their matrices, so circuits built for the state vector backend can be reused unchanged; global phases are dropped.
+    *s. The state to apply the circuit to. It is overwritten.
+    *circuit. The circuit to execute. Terminates if it contains a gate rejected by q_circuit_is_clifford.
+*/
+void q_stabilizer_run(q_stabilizer* s, q_circuit* circuit){
+  if(circuit->qubits != s->qubits){
+    printf("Error: size mismatch in circuit execution. Terminating.\n");
+    exit(0);
+  }
+  for(int g = 0; g < circuit->gates; g++){
+    const int* t = circuit->gate_list[g].targets;
+    switch(classify(circuit->gate_list[g].op)){
+      case CLIFFORD_I:
+        break;
+      case CLIFFORD_H:
+        q_stabilizer_hadamard(s, t[0]);
+        break;
+      case CLIFFORD_S:
+        q_stabilizer_s(s, t[0]);
+        break;
+      case CLIFFORD_S_DAGGER:
+        q_stabilizer_s_dagger(s, t[0]);
+        break;
+      case CLIFFORD_X:
+        q_stabilizer_pauli_X(s, t[0]);
+        break;
+      case CLIFFORD_Y:
+        q_stabilizer_pauli_Y(s, t[0]);
+        break;
+      case CLIFFORD_Z:
+        q_stabilizer_pauli_Z(s, t[0]);
+        break;
+      case CLIFFORD_CX:
+        q_stabilizer_cX(s, t[0], t[1]);
+        break;
+      case CLIFFORD_XC:
+        q_stabilizer_cX(s, t[1], t[0]);
+        break;
+      case CLIFFORD_CZ:
+        q_stabilizer_cZ(s, t[0], t[1]);
+        break;
+      case CLIFFORD_SWAP:
+        q_stabilizer_swap(s, t[0], t[1]);
+        break;
+      default:
+        printf("Error: gate %d is not a supported Clifford gate in stabilizer simulation. Terminating.\n", g);
+        exit(0);
+    }
+  }
+}
+
+/**q_stabilizer_to_state
+  *Converts a stabilizer state to a state vector, for cross-checking against the state vector backend on small registers. The vector is the product of the projectors (I + g)/2 over the stabilizers g applied to a basis state in the support, so it agrees with the state vector simulation up to a global phase.
+    *s. The state to convert.
+  Returns the state vector "state", which allocates 2^n amplitudes.
+*/
+q_state* q_stabilizer_to_state(q_stabilizer* s){
+  int n = s->qubits;
+  size_t dim = (size_t)1 << n;
+  //Pick a basis state in the support by measuring a copy, taking outcome 0 whenever it is random.
+  q_stabilizer* copy = q_stabilizer_copy(s);
+  size_t basis = 0;
+  for(int j = 0; j < n; j++){
+    if(measure_with(copy, j, 0.0)) basis |= (size_t)1 << (n - 1 - j);
+  }
+  q_stabilizer_free(copy);
+  double* v = calloc(2 * dim, sizeof(double));
+  double* w = malloc(2 * dim * sizeof(double));
+  v[2 * basis] = 1.0;
+  for(size_t g = n; g < 2 * (size_t)n; g++){
+    size_t x_mask = 0, z_mask = 0;
+    int ys = 0;
+    for(int j = 0; j < n; j++){
+      int xj = (s->x[g * s->words + j / 64] >> (j % 64)) & 1;
+      int zj = (s->z[g * s->words + j / 64] >> (j % 64)) & 1;
+      x_mask |= (size_t)xj << (n - 1 - j);
+      z_mask |= (size_t)zj << (n - 1 - j);
+      ys += xj & zj;
+    }
+    //g|i> = (-1)^r i^ys (-1)^(i.z) |i ^ x>, and the projector is (I + g) / 2.
+    int power = (2 * s->r[g] + ys) % 4;
+    #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t i = 0; i < dim; i++){
+      int k = (power + 2 * __builtin_parityll(i & z_mask)) % 4;
+      double re = v[2 * i], im = v[2 * i + 1];
+      double* out = w + 2 * (i ^ x_mask);
+      out[0] = k == 0 ? re : k == 1 ? -im : k == 2 ? -re : im;
+      out[1] = k == 0 ? im : k == 1 ? re : k == 2 ? -im : -re;
+    }
+    #pragma omp parallel for if(dim >= Q_PARALLEL_MIN) num_threads(q_get_threads()) schedule(static)
+    for(size_t i = 0; i < 2 * dim; i++){
+      v[i] = 0.5 * (v[i] + w[i]);
+    }
+  }
+  q_state* state = q_state_alloc(n);
+  for(size_t i = 0; i < dim; i++){
+    gsl_complex a;
+    GSL_SET_COMPLEX(&a, v[2 * i], v[2 * i + 1]);
+    gsl_matrix_complex_set(state->vector, i, 0, a);
+  }
+  free(v);
+  free(w);
+  q_state_normalize(state);
+  return state;
+}
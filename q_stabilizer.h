@@ -0,0 +1,148 @@
+#ifndef Q_STABILIZER_H
+#define Q_STABILIZER_H
+
+#include "q_circuit.h"
+
+//Aaronson-Gottesman tableau of an n-qubit stabilizer state. Rows 0 to n-1 are the destabilizers, rows n to 2n-1 the stabilizers and row 2n is scratch space. Row i is the Pauli (-1)^r[i] P_0 P_1 ... P_(n-1), where qubit j contributes X if only its x bit is set, Z if only its z bit is set and Y if both are. Bits are packed words per row, qubit j in bit j % 64 of word j / 64.
+typedef struct q_stabilizer{
+  unsigned long long* x;
+  unsigned long long* z;
+  unsigned char* r;
+  int qubits;
+  int words;
+} q_stabilizer;
+
+/**q_stabilizer_alloc
+  *Allocates a stabilizer state initialised to |0...0>. Memory and the cost of every gate grow only polynomially with the number of qubits.
+    *qubits. The number of qubits.
+  Returns the generated state "s"
+*/
+q_stabilizer* q_stabilizer_alloc(int qubits);
+
+/**q_stabilizer_free
+  *Frees a given stabilizer state.
+    *s. The state to free.
+*/
+void q_stabilizer_free(q_stabilizer* s);
+
+/**q_stabilizer_copy
+  *Copies a stabilizer state.
+    *s. The state to copy.
+  Returns the copy "copy"
+*/
+q_stabilizer* q_stabilizer_copy(q_stabilizer* s);
+
+/**q_stabilizer_hadamard
+  *Applies a Hadamard gate to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_hadamard(q_stabilizer* s, int a);
+
+/**q_stabilizer_s
+  *Applies the phase gate S = diag(1, i) to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_s(q_stabilizer* s, int a);
+
+/**q_stabilizer_s_dagger
+  *Applies the inverse phase gate diag(1, -i) to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_s_dagger(q_stabilizer* s, int a);
+
+/**q_stabilizer_pauli_X
+  *Applies a Pauli X gate to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_pauli_X(q_stabilizer* s, int a);
+
+/**q_stabilizer_pauli_Y
+  *Applies a Pauli Y gate to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_pauli_Y(q_stabilizer* s, int a);
+
+/**q_stabilizer_pauli_Z
+  *Applies a Pauli Z gate to a qubit.
+    *s. The state. It is overwritten.
+    *a. The qubit.
+*/
+void q_stabilizer_pauli_Z(q_stabilizer* s, int a);
+
+/**q_stabilizer_cX
+  *Applies a CNOT gate.
+    *s. The state. It is overwritten.
+    *control. The control qubit.
+    *target. The target qubit.
+*/
+void q_stabilizer_cX(q_stabilizer* s, int control, int target);
+
+/**q_stabilizer_cZ
+  *Applies a controlled Z gate.
+    *s. The state. It is overwritten.
+    *a. The first qubit.
+    *b. The second qubit.
+*/
+void q_stabilizer_cZ(q_stabilizer* s, int a, int b);
+
+/**q_stabilizer_swap
+  *Swaps two qubits.
+    *s. The state. It is overwritten.
+    *a. The first qubit.
+    *b. The second qubit.
+*/
+void q_stabilizer_swap(q_stabilizer* s, int a, int b);
+
+/**q_circuit_is_clifford
+  *Checks whether every recorded gate of a circuit is, up to a global phase, one the stabilizer backend can run: the identity, q_hadamard, q_s, its inverse, the Paulis, q_cX (either way round), q_cZ or a two qubit swap.
+    *circuit. The circuit to check.
+  *Returns 1 if the circuit can be run by q_stabilizer_run and 0 otherwise.
+*/
+int q_circuit_is_clifford(q_circuit* circuit);
+
+/**q_stabilizer_run
+  *Executes every recorded gate of a Clifford circuit, in order, against a stabilizer state in place. Gates are recognised from their matrices, so circuits built for the state vector backend can be reused unchanged; global phases are dropped.
+    *s. The state to apply the circuit to. It is overwritten.
+    *circuit. The circuit to execute. Terminates if it contains a gate rejected by q_circuit_is_clifford.
+*/
+void q_stabilizer_run(q_stabilizer* s, q_circuit* circuit);
+
+/**q_stabilizer_probability
+  *Computes the probability that measuring a qubit gives a given outcome, which for a stabilizer state is 0, 1/2 or 1. The state is not changed.
+    *s. The state.
+    *a. The qubit.
+    *outcome. The outcome, 0 or 1.
+  *Returns the probability.
+*/
+double q_stabilizer_probability(q_stabilizer* s, int a, int outcome);
+
+/**q_stabilizer_measure
+  *Measures a qubit in the computational basis and collapses the state onto the outcome.
+    *s. The state to measure. It is overwritten.
+    *a. The qubit.
+    *rng. The random number generator, used only if the outcome is random.
+  *Returns the outcome, 0 or 1.
+*/
+int q_stabilizer_measure(q_stabilizer* s, int a, q_rng* rng);
+
+/**q_stabilizer_sample
+  *Draws a number of independent shots, each measuring every qubit. The outcomes of a stabilizer state are uniform over an affine space, so its basis is found once by Gaussian elimination and every shot is then a random combination of at most n basis rows. Shot i uses its own counters of the generator, so shots are drawn in parallel and the result does not depend on the number of threads.
+    *s. The state to sample from. It is not changed.
+    *shots. The number of shots.
+    *rng. The random number generator. It is advanced past the counters used.
+    *out. Output, shots * n outcomes, with out[i * n + j] the outcome of qubit j in shot i.
+*/
+void q_stabilizer_sample(q_stabilizer* s, size_t shots, q_rng* rng, unsigned char* out);
+
+/**q_stabilizer_to_state
+  *Converts a stabilizer state to a state vector, for cross-checking against the state vector backend on small registers. The vector is the product of the projectors (I + g)/2 over the stabilizers g applied to a basis state in the support, so it agrees with the state vector simulation up to a global phase.
+    *s. The state to convert.
+  Returns the state vector "state", which allocates 2^n amplitudes.
+*/
+q_state* q_stabilizer_to_state(q_stabilizer* s);
+#endif